@@ -0,0 +1,142 @@
+/*
+ AudioBlockStats_F32.h
+
+ Purpose: Measure every audio block (mean-square and peak of each input) and stream the
+          results to loop() without missing any, rather than polling a level meter.
+
+ In the audio interrupt, each block gives one small Block_Stats record: the block index,
+     the mean-square and the peak of each input, and the stimulus that was playing (copied
+     from a Block_Stim_State that the stimulus code updates when it applies its settings,
+     see Param_Mailbox.h).  The records go into a lock-free ring (see SPSC_Ring.h).
+
+ loop() drains the ring in batches (popBatch()) and can add the records to a
+     Block_Stats_Accum to get the level, the peak, and the number of clipped blocks over
+     any span (such as one test step).  Gaps in the block index show any blocks that were
+     lost because loop() fell behind by more than the length of the ring.
+
+ Levels use the same convention as AudioCalcLeq_F32: 10*log10(mean-square), so a
+     full-scale sine is -3 dBFS.  Peaks are 20*log10(peak), so full scale is 0 dBFS.
+
+ MIT License, Use at your own risk.
+*/
+
+#ifndef _AudioBlockStats_F32_h
+#define _AudioBlockStats_F32_h
+
+#include <arm_math.h>
+#include "SPSC_Ring.h"
+
+#define BLOCK_STATS_MAX_CHAN   4
+#define BLOCK_STATS_RING_LEN   256     //must be a power of 2.  256 blocks is about 0.75 sec at 44.1 kHz
+#define BLOCK_STATS_BATCH      32      //records to pop at a time in loop()
+#define BLOCK_STATS_CLIP_LEVEL 0.99f   //a block with a peak at or above this is counted as clipped
+
+//the stimulus at one block (written in the audio interrupt by whatever applies the stimulus settings)
+class Block_Stim_State {
+  public:
+    Block_Stim_State(void) {};
+    uint32_t stim_id = 0;                   //changes whenever the stimulus settings change
+    float freq_Hz[2] = {0.0f, 0.0f};        //frequency of each tone
+    float amp[2] = {0.0f, 0.0f};            //linear amplitude of each tone (0 is off)
+    bool isOn(void) const { return (amp[0] > 0.0f) || (amp[1] > 0.0f); }
+};
+
+//the result for one audio block
+class Block_Stats {
+  public:
+    Block_Stats(void) {};
+    uint32_t block_id = 0;                  //counts up by one for every audio block
+    int n_chan = 0;
+    float mean_sq[BLOCK_STATS_MAX_CHAN];
+    float peak[BLOCK_STATS_MAX_CHAN];       //largest magnitude
+    Block_Stim_State stim;
+};
+
+class AudioBlockStats_F32 : public AudioStream_F32 {
+  public:
+    AudioBlockStats_F32(const AudioSettings_F32 &settings, int _n_chan) : AudioStream_F32(constrain(_n_chan, 1, BLOCK_STATS_MAX_CHAN), inputQueueArray) {
+      n_chan = constrain(_n_chan, 1, BLOCK_STATS_MAX_CHAN);
+      block_sec = (float)settings.audio_block_samples / settings.sample_rate_Hz;
+    }
+
+    //where to copy the stimulus state from, for each block (or NULL)
+    void setStimulusSource(const Block_Stim_State *src) { stim_source = src; }
+
+    //from loop()
+    int popBatch(Block_Stats *stats, int max_stats) { return ring.popBatch(stats, max_stats); }
+    void clear(void) { ring.clear(); }
+    uint32_t getOverflowCount(void) const { return ring.getOverflowCount(); }
+    uint32_t getBlockCount(void) const { return n_blocks; }
+    float getBlockDuration_sec(void) const { return block_sec; }
+
+    virtual void update(void) {
+      uint32_t id = n_blocks++;
+      audio_block_f32_t *in_block[BLOCK_STATS_MAX_CHAN];
+      for (int i=0; i < n_chan; i++) in_block[i] = AudioStream_F32::receiveReadOnly_f32(i);
+
+      if (in_block[0] != NULL) {
+        Block_Stats stats;
+        stats.block_id = id;
+        stats.n_chan = n_chan;
+        for (int i=0; i < n_chan; i++) {
+          stats.mean_sq[i] = 0.0f; stats.peak[i] = 0.0f;
+          if ((in_block[i] == NULL) || (in_block[i]->length < 1)) continue;
+          float32_t sum_sq = 0.0f, max_val = 0.0f, min_val = 0.0f;
+          uint32_t ind;
+          arm_power_f32(in_block[i]->data, in_block[i]->length, &sum_sq);
+          arm_max_f32(in_block[i]->data, in_block[i]->length, &max_val, &ind);
+          arm_min_f32(in_block[i]->data, in_block[i]->length, &min_val, &ind);
+          stats.mean_sq[i] = sum_sq / (float)in_block[i]->length;
+          stats.peak[i] = max(max_val, -min_val);
+        }
+        if (stim_source != NULL) stats.stim = *stim_source;
+        ring.push(stats);
+      }
+      for (int i=0; i < n_chan; i++) if (in_block[i] != NULL) AudioStream_F32::release(in_block[i]);
+    }
+
+  private:
+    audio_block_f32_t *inputQueueArray[BLOCK_STATS_MAX_CHAN];
+    int n_chan = 2;
+    float block_sec = 128.0f/44100.0f;
+    const Block_Stim_State *stim_source = NULL;
+    volatile uint32_t n_blocks = 0;
+    SPSC_Ring<Block_Stats, BLOCK_STATS_RING_LEN> ring;
+};
+
+//sum up the records over a span of blocks (in loop())
+class Block_Stats_Accum {
+  public:
+    Block_Stats_Accum(void) { reset(); }
+
+    void reset(void) {
+      n_blocks = 0; n_missed = 0; has_last = false;
+      for (int i=0; i < BLOCK_STATS_MAX_CHAN; i++) { sum_mean_sq[i] = 0.0; peak[i] = 0.0f; n_clipped[i] = 0; }
+    }
+    void add(const Block_Stats &stats) {
+      if (has_last && ((stats.block_id - last_block_id) > 1)) n_missed += (int)(stats.block_id - last_block_id - 1);
+      last_block_id = stats.block_id; has_last = true;
+      for (int i=0; i < stats.n_chan; i++) {
+        sum_mean_sq[i] += stats.mean_sq[i];
+        peak[i] = max(peak[i], stats.peak[i]);
+        if (stats.peak[i] >= BLOCK_STATS_CLIP_LEVEL) n_clipped[i]++;
+      }
+      n_blocks++;
+    }
+
+    int getBlockCount(void) const { return n_blocks; }
+    int getMissedCount(void) const { return n_missed; }     //blocks missing between the first and last records
+    int getClippedCount(int chan) const { return n_clipped[chan]; }
+    float getLevel_dBFS(int chan) const { return (n_blocks > 0) ? 10.0f*log10f(max((float)(sum_mean_sq[chan] / (double)n_blocks), 1.0e-20f)) : -999.9f; }
+    float getPeak_dBFS(int chan) const { return (n_blocks > 0) ? 20.0f*log10f(max(peak[chan], 1.0e-10f)) : -999.9f; }
+
+  private:
+    int n_blocks = 0, n_missed = 0;
+    bool has_last = false;
+    uint32_t last_block_id = 0;
+    double sum_mean_sq[BLOCK_STATS_MAX_CHAN];
+    float peak[BLOCK_STATS_MAX_CHAN];
+    int n_clipped[BLOCK_STATS_MAX_CHAN];
+};
+
+#endif
@@ -1,14 +1,19 @@
 #ifndef _AudioProcessing_h
 #define _AudioProcessing_h
 
+#include "Sine_Output.h"
+
+AudioParamUpdater_F32      paramUpdater(audio_settings);       //applies the tone changes from loop() at the start of each block (must be created first)
 AudioInputI2S_F32          i2s_in(audio_settings);             //Digital audio input from the ADC
 AudioCalcLeq_F32           calcInputLevel_L(audio_settings);   //use this to measure the input signal level
 AudioCalcLeq_F32           calcInputLevel_R(audio_settings);   //use this to measure the input signal level
 AudioSynthWaveform_F32     sineWave(audio_settings);           //generate a synthetic sine wave
 AudioSwitchMatrix4_F32     outputSwitchMatrix(audio_settings); //use this to route the sine wave to L, R, or Both
 AudioCalcLeq_F32           calcOutputLevel(audio_settings);    //use this to measure the input signal level
-AudioSDWriter_F32          audioSDWriter(audio_settings);      //this is stereo by default
+AudioSDWriter_F32          audioSDWriter(&sd, audio_settings); //this is stereo by default.  Shares the SD card with the calibration curve (see Cal_Curve.h)
+AudioBlockStats_F32        blockStats(audio_settings, 3);      //mean-square and peak of every block (left in, right in, sine out), streamed to loop()
 AudioOutputI2S_F32         i2s_out(audio_settings);  //Digital audio output to the DAC.  Should always be last.
+Sine_Output                sineOutput(&sineWave, &outputSwitchMatrix);  //all changes to the sine wave and its routing go through here
 
 /* ///////////////////////////////////////////////////////////
 *
@@ -17,13 +22,16 @@ AudioOutputI2S_F32         i2s_out(audio_settings);  //Digital audio output to t
 *      AudioInputI2S (Chan 0, which is Left) 
 *          | -----> calcInputLevel_L      [end]
 *          | -----> audioSDWriter (Left)  [end]
+*          | -----> blockStats (Chan 0)   [end]
 *
 *      AudioInputI2S (Chan 1, which is Right)
 *          | ------> calcInputLevel_R      [end]
 *          | ----==> audioSDWriter (Right) [end]
+*          | ------> blockStats (Chan 1)   [end]
 *
 *      sineWave (Mono source)
 *          | ------> calcOutputLevel       [end]
+*          | ------> blockStats (Chan 2)   [end]
 *          | ------> AudioSwitchMatrix
 *                           | (Chan 0) ------> AudioOutputI2S(Left)  [end]
 *                           | (Chan 1) ------> AudioOutputI2S(Right)  [end]
@@ -33,14 +41,17 @@ AudioOutputI2S_F32         i2s_out(audio_settings);  //Digital audio output to t
 //Connect the left input to its destinations
 AudioConnection_F32        patchcord11(i2s_in, 0, calcInputLevel_L, 0);    //Left input to the level monitor
 AudioConnection_F32        patchcord12(i2s_in, 0, audioSDWriter,    0);    //Left input to the SD writer
+AudioConnection_F32        patchcord13(i2s_in, 0, blockStats,       0);    //Left input to the per-block measurements
 
 //Connect the right input to its destinations
 AudioConnection_F32        patchcord21(i2s_in, 1, calcInputLevel_R, 0);    //Right input to the level monitor
 AudioConnection_F32        patchcord22(i2s_in, 1, audioSDWriter,    1);    //Right input to the SD writer
+AudioConnection_F32        patchcord23(i2s_in, 1, blockStats,       1);    //Right input to the per-block measurements
 
 //Connect the sineWave to its destinations
 AudioConnection_F32        patchcord30(sineWave, 0, calcOutputLevel,    0);   //Sine wave to level monitor
 AudioConnection_F32        patchcord31(sineWave, 0, outputSwitchMatrix, 0);   //Sine wave to level monitor
+AudioConnection_F32        patchcord34(sineWave, 0, blockStats,         2);   //Sine wave to the per-block measurements
 AudioConnection_F32        patchcord32(outputSwitchMatrix, State::OUT_LEFT,  i2s_out, 0);   //Sine wave to left output
 AudioConnection_F32        patchcord33(outputSwitchMatrix, State::OUT_RIGHT, i2s_out, 1);   //Sine wave to right toutput
 
@@ -96,32 +107,26 @@ void printInputConfiguration(void) {
 int setOutputChan(int chan) {
   const int inputChanForSineWave = 0;
   const int inputChanForMutedOutput = 3;
-  const int outputChanLeft = State::OUT_LEFT;
-  const int outputChanRight = State::OUT_RIGHT;
 
   switch (chan) {
     case State::OUT_LEFT:
       Serial.println("setOutputChan: Setting to LEFT...");
-      outputSwitchMatrix.setInputToOutput(inputChanForSineWave,outputChanLeft);     //sine to left output
-      outputSwitchMatrix.setInputToOutput(inputChanForMutedOutput,outputChanRight); //mute the right output
+      sineOutput.setRouting(inputChanForSineWave, inputChanForMutedOutput);       //sine to left output, mute the right output
       myState.output_chan = chan;
       break;
     case State::OUT_RIGHT:
       Serial.println("setOutputChan: Setting to RIGHT...");
-      outputSwitchMatrix.setInputToOutput(inputChanForMutedOutput,outputChanLeft);  //mute the left output
-      outputSwitchMatrix.setInputToOutput(inputChanForSineWave,outputChanRight);    //sine to right output
+      sineOutput.setRouting(inputChanForMutedOutput, inputChanForSineWave);       //mute the left output, sine to right output
       myState.output_chan = chan;
       break;
     case State::OUT_BOTH:
       Serial.println("setOutputChan: Setting to BOTH...");
-      outputSwitchMatrix.setInputToOutput(inputChanForSineWave,outputChanLeft);     //sine to left output
-      outputSwitchMatrix.setInputToOutput(inputChanForSineWave,outputChanRight);    //sine to right output
+      sineOutput.setRouting(inputChanForSineWave, inputChanForSineWave);          //sine to both outputs
       myState.output_chan = chan;
       break;
     default:
       Serial.println("setOutputChan: *** WARNING ***: chan = " +  String(chan) + " not recognized.  Setting to BOTH...");
-      outputSwitchMatrix.setInputToOutput(inputChanForSineWave,outputChanLeft);     //sine to left output
-      outputSwitchMatrix.setInputToOutput(inputChanForSineWave,outputChanRight);    //sine to right output  
+      sineOutput.setRouting(inputChanForSineWave, inputChanForSineWave);          //sine to both outputs
       myState.output_chan = chan;
       break;
   }
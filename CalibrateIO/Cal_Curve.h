@@ -0,0 +1,161 @@
+/*
+ Cal_Curve.h
+
+ Purpose: Save the result of CalibrateIO's stepped-tone sweep to the SD card as a
+          compact calibration curve, so that the DPOAE sketch can load it and set
+          its tone levels at any frequency, rather than from hand-entered values.
+
+ The curve is one binary file (CALn.BIN, where n is the output channel that played the
+     sweep...so CAL1.BIN is the left speaker and CAL2.BIN is the right speaker):
+
+     header (64 bytes): magic "TCCV", version, number of points, number of inputs,
+                        the settings during the sweep (sample rate, output level,
+                        output and input gains), the mic's level for a 94 dB SPL
+                        calibrator, CRC32 of the points, and CRC32 of the header
+     points: freq_Hz[n_points] (float), then gain_cdB[n_chan][n_points] (int16)
+
+ The gain is the input level minus the output level (both in dB RMS re: full scale, as
+     measured by AudioCalcLeq_F32), in hundredths of a dB.  The frequencies must go up.
+
+ getGain_dB() interpolates (linearly in dB, against log frequency) at any frequency.
+     It finds the points by bisection, so it takes O(log n_points).
+
+ This file is the same in CalibrateIO and DPOAE_Tones_Record.  Change both together.
+
+ MIT License, Use at your own risk.
+*/
+
+#ifndef _Cal_Curve_h
+#define _Cal_Curve_h
+
+#include "Crc32.h"
+#include "Fixed_Format.h"
+
+#define CAL_CURVE_MAGIC       0x56434354UL   //"TCCV" as little-endian bytes
+#define CAL_CURVE_VERSION     1
+#define CAL_CURVE_MAX_POINTS  512            //CalibrateIO's sweep has 501
+#define CAL_CURVE_N_CHAN      2              //the left and right inputs
+#define CAL_CURVE_NO_MIC_REF  (-999.0f)      //the mic's level for 94 dB SPL is not known
+#define CAL_CURVE_MIC_CHAN    0              //the input with the calibrated mic (mic_dBFS_at_94dBSPL is for this one)
+
+struct Cal_Curve_Header {
+  uint32_t magic = CAL_CURVE_MAGIC;
+  uint32_t version = CAL_CURVE_VERSION;
+  uint32_t n_points = 0;
+  uint32_t n_chan = CAL_CURVE_N_CHAN;
+  float sample_rate_Hz = 0.0f;
+  float out_level_dBFS = 0.0f;                     //level of the sine during the sweep (dB RMS re: full scale)
+  float out_gain_dB = 0.0f;                        //analog output (headphone amp) gain during the sweep
+  float in_gain_dB = 0.0f;                         //analog input gain during the sweep
+  float mic_dBFS_at_94dBSPL = CAL_CURVE_NO_MIC_REF; //left input's level (dB RMS re: full scale) in a 94 dB SPL calibrator, at the same input gain
+  uint32_t out_chan = 0;                           //which outputs played the sweep: bit 0 = left, bit 1 = right
+  uint32_t created_sec = 0;                        //real-time clock seconds (zero if not known)
+  uint32_t reserved[3] = {0, 0, 0};
+  uint32_t data_crc = 0;                           //CRC32 of the points
+  uint32_t crc = 0;                                //CRC32 of everything above
+};
+
+class Cal_Curve {
+  public:
+    Cal_Curve(void) {};
+
+    //build it (in CalibrateIO).  Points with a frequency of zero (steps not yet measured) are skipped.  Returns the number of points.
+    int setPoints(int n, const float *freqs_Hz, const float *gain_dB[CAL_CURVE_N_CHAN]) {
+      header.n_points = 0;
+      for (int i=0; (i < n) && (header.n_points < CAL_CURVE_MAX_POINTS); i++) {
+        if (freqs_Hz[i] <= 0.0f) continue;
+        if ((header.n_points > 0) && (freqs_Hz[i] <= freq_Hz[header.n_points-1])) {
+          Serial.println("Cal_Curve: setPoints: *** ERROR ***: the frequencies must go up");
+          return header.n_points = 0;
+        }
+        freq_Hz[header.n_points] = freqs_Hz[i];
+        for (int c=0; c < CAL_CURVE_N_CHAN; c++) gain_cdB[c][header.n_points] = (int16_t)constrain(lroundf(100.0f * gain_dB[c][i]), -32767L, 32767L);
+        header.n_points++;
+      }
+      return header.n_points;
+    }
+
+    bool save(SdFs *sd, const char *fname);
+    bool load(SdFs *sd, const char *fname);
+    static void makeFilename(int out_chan, Fixed_String<16> *fname) { fname->clear(); fname->printf("CAL%d.BIN", out_chan); }
+
+    bool isLoaded(void) const { return header.n_points > 0; }
+    bool hasMicRef(void) const { return header.mic_dBFS_at_94dBSPL > (CAL_CURVE_NO_MIC_REF + 1.0f); }
+    int getNumPoints(void) const { return header.n_points; }
+    float getMinFreq_Hz(void) const { return isLoaded() ? freq_Hz[0] : 0.0f; }
+    float getMaxFreq_Hz(void) const { return isLoaded() ? freq_Hz[header.n_points-1] : 0.0f; }
+
+    //input level minus output level (dB) at any frequency.  Outside of the sweep, the end point is used.
+    float getGain_dB(int chan, float f_Hz) const {
+      int n = header.n_points;
+      if ((n < 1) || (chan < 0) || (chan >= CAL_CURVE_N_CHAN)) return 0.0f;
+      if (f_Hz <= freq_Hz[0]) return 0.01f * gain_cdB[chan][0];
+      if (f_Hz >= freq_Hz[n-1]) return 0.01f * gain_cdB[chan][n-1];
+      int lo = 0, hi = n-1;   //bisect so that freq_Hz[lo] <= f_Hz < freq_Hz[hi]
+      while ((hi - lo) > 1) { int mid = (lo + hi) / 2; if (freq_Hz[mid] <= f_Hz) lo = mid; else hi = mid; }
+      float frac = logf(f_Hz / freq_Hz[lo]) / logf(freq_Hz[hi] / freq_Hz[lo]);
+      return 0.01f * ((float)gain_cdB[chan][lo] + frac * (float)(gain_cdB[chan][hi] - gain_cdB[chan][lo]));
+    }
+
+    void printSummary(Print *s, const char *fname) const {
+      if (!isLoaded()) { s->print("Cal_Curve: "); s->print(fname); s->println(": not loaded"); return; }
+      char line[160];
+      snprintf(line, sizeof(line), "Cal_Curve: %s: %d points, %.1f to %.1f Hz, out chan %lu, out %.1f dBFS, mic %.2f dBFS at 94 dB SPL, gains (out, in) %.1f, %.1f dB",
+               fname, header.n_points, getMinFreq_Hz(), getMaxFreq_Hz(), (unsigned long)header.out_chan, header.out_level_dBFS,
+               header.mic_dBFS_at_94dBSPL, header.out_gain_dB, header.in_gain_dB);
+      s->println(line);
+    }
+
+    Cal_Curve_Header header;
+
+  private:
+    float freq_Hz[CAL_CURVE_MAX_POINTS];
+    int16_t gain_cdB[CAL_CURVE_N_CHAN][CAL_CURVE_MAX_POINTS];
+
+    uint32_t calcDataCRC(void) const {
+      uint32_t crc = crc32_update(0, freq_Hz, header.n_points * sizeof(float));
+      for (int c=0; c < CAL_CURVE_N_CHAN; c++) crc = crc32_update(crc, gain_cdB[c], header.n_points * sizeof(int16_t));
+      return crc;
+    }
+};
+
+bool Cal_Curve::save(SdFs *sd, const char *fname) {
+  if (!isLoaded()) { Serial.println("Cal_Curve: save: *** ERROR ***: there are no points to save"); return false; }
+  header.magic = CAL_CURVE_MAGIC; header.version = CAL_CURVE_VERSION; header.n_chan = CAL_CURVE_N_CHAN;
+  header.created_sec = (uint32_t)Teensy3Clock.get();
+  header.data_crc = calcDataCRC();
+  header.crc = crc32(&header, sizeof(header) - sizeof(header.crc));
+
+  FsFile file = sd->open(fname, O_WRONLY | O_CREAT | O_TRUNC);
+  if (!file) { Serial.print("Cal_Curve: save: *** ERROR ***: could not open "); Serial.println(fname); return false; }
+  size_t n_expected = sizeof(header) + header.n_points * (sizeof(float) + CAL_CURVE_N_CHAN * sizeof(int16_t));
+  size_t n_written = file.write(&header, sizeof(header));
+  n_written += file.write(freq_Hz, header.n_points * sizeof(float));
+  for (int c=0; c < CAL_CURVE_N_CHAN; c++) n_written += file.write(gain_cdB[c], header.n_points * sizeof(int16_t));
+  file.close();
+  if (n_written != n_expected) { Serial.print("Cal_Curve: save: *** ERROR ***: could not write all of "); Serial.println(fname); return false; }
+  return true;
+}
+
+bool Cal_Curve::load(SdFs *sd, const char *fname) {
+  header.n_points = 0;  //not loaded, unless everything checks out
+  FsFile file = sd->open(fname, O_RDONLY);
+  if (!file) return false;  //no curve is fine (the caller decides what to do)
+
+  Cal_Curve_Header h;
+  bool ok = (file.read(&h, sizeof(h)) == (int)sizeof(h));
+  ok = ok && (h.magic == CAL_CURVE_MAGIC) && (h.crc == crc32(&h, sizeof(h) - sizeof(h.crc)));
+  if (ok && (h.version != CAL_CURVE_VERSION)) { Serial.print("Cal_Curve: load: *** ERROR ***: unknown version in "); Serial.println(fname); file.close(); return false; }
+  ok = ok && (h.n_chan == CAL_CURVE_N_CHAN) && (h.n_points >= 1) && (h.n_points <= CAL_CURVE_MAX_POINTS);
+  if (ok) {
+    ok = (file.read(freq_Hz, h.n_points * sizeof(float)) == (int)(h.n_points * sizeof(float)));
+    for (int c=0; c < CAL_CURVE_N_CHAN; c++) ok = ok && (file.read(gain_cdB[c], h.n_points * sizeof(int16_t)) == (int)(h.n_points * sizeof(int16_t)));
+  }
+  file.close();
+  if (ok) { header = h; ok = (calcDataCRC() == h.data_crc); }
+  for (uint32_t i=1; ok && (i < h.n_points); i++) ok = (freq_Hz[i] > freq_Hz[i-1]);
+  if (!ok) { header.n_points = 0; Serial.print("Cal_Curve: load: *** ERROR ***: bad or incomplete curve in "); Serial.println(fname); }
+  return ok;
+}
+
+#endif
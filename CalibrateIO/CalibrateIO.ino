@@ -32,6 +32,8 @@
 #include <Tympan_Library.h>
 #include "SerialManager.h"
 #include "State.h"        
+#include "Fixed_Format.h"
+#include "Task_Scheduler.h"
 
 //set the sample rate and block size
 const float       sample_rate_Hz = 44100.0f ;   //24000 or 44117 or 96000 (or other frequencies in the table in AudioOutputI2S_F32)
@@ -40,6 +42,7 @@ AudioSettings_F32 audio_settings(sample_rate_Hz, audio_block_samples);
 
 // Create the audio objects and then connect them
 Tympan            myTympan(TympanRev::E,audio_settings);   //do TympanRev::D or TympanRev::E or TympanRev::F
+SdFs              sd;                                      //the SD card, shared by the SD writer and the calibration curve
 #include "AudioProcessing.h"  //see here for audio objects, connections, and configuration functions
 
 // Create classes for controlling the system, espcially via USB Serial and via the App        
@@ -48,11 +51,21 @@ State             myState(&audio_settings, &myTympan, &serialManager); //keeping
 
 // Define variables related to the measurements
 #include "Measurement.h"
-Measurement inputMeasurement(&calcInputLevel_L, &calcInputLevel_R);   //calcInputLevel_L and calcInputLevel_R are in AudioProcessing.h
+Measurement inputMeasurement(&calcInputLevel_L, &calcInputLevel_R, &blockStats);   //calcInputLevel_L, calcInputLevel_R, and blockStats are in AudioProcessing.h
 
 // Be aware that this calibration program can output steady tones or it can automatically step the tones across frequencies
 #include "TestController.h"   //see here for the relevant functions for managing the changing test tones
-TestController testController(&sineWave, &inputMeasurement);    // sineWave is in AudioProcessing.h
+TestController testController(&sineOutput, &inputMeasurement);    // sineOutput is in AudioProcessing.h
+
+// Binary telemetry frames over USB, when enabled via "$telemetry 1" (see Telemetry.h)
+#include "Telemetry.h"
+Telemetry telemetry(&Serial);
+
+// The stepped-tone results, saved as a calibration curve for the DPOAE sketch via "$cal_save" (see Cal_Curve.h)
+Cal_Curve calCurve;
+
+// Runs the work of loop(), with the time-critical tasks first (see Task_Scheduler.h and setupTasks())
+Task_Scheduler scheduler;
 
 // ///////////////// Main setup() and loop() as required for all Arduino programs
 
@@ -65,12 +78,16 @@ void setup() {
   Serial.println("Sample Rate (Hz): " + String(audio_settings.sample_rate_Hz));
   Serial.println("Audio Block Size (samples): " + String(audio_settings.audio_block_samples));
 
+  //all changes to the sine wave reach it through its mailbox (see Param_Mailbox.h)
+  paramUpdater.addClient(&sineOutput);
+  blockStats.setStimulusSource(sineOutput.getStimState());  //each block's measurement says what the sine was doing
+
   //allocate the dynamically re-allocatable audio memory
   AudioMemory_F32(100, audio_settings); 
 
   //activate the Tympan audio hardware
   myTympan.enable();        // activate the flow of audio
-  myTympan.volume_dB(0.0);  // headphone amplifier
+  myTympan.volume_dB(myState.output_gain_dB);  // headphone amplifier
   myTympan.setHPFonADC(true, myState.adc_hp_cutoff_Hz, sample_rate_Hz); //set DC-blocking filter on AIC
 
   //Select the input that we will use 
@@ -90,70 +107,151 @@ void setup() {
   setOutputChan(myState.output_chan);
   testController.switchTestToneMode(testController.current_test_mode);
 
+  //register the work to be done in loop()
+  setupTasks();
+
   //End of setup
   Serial.println("Setup: complete."); 
   serialManager.printHelp();
 } //end setup()
 
 
+// register the work to be done in loop().  The SD writer and the stepping of the test tones are CRITICAL,
+// so they run every pass of loop(), no matter how slow the printing gets (see Task_Scheduler.h).
+void setupTasks(void) {
+  //name, function, period (msec), priority, deadline (msec)
+  scheduler.addTask("serial",     serviceSerialInput,       0, Task_Scheduler::CRITICAL,  0);
+  scheduler.addTask("sd",         serviceSDWriter,          0, Task_Scheduler::CRITICAL, 10);  //flag any gap of more than 10 msec
+  scheduler.addTask("blockstats", serviceBlockStats,        0, Task_Scheduler::CRITICAL,  0);
+  scheduler.addTask("test",       serviceSteppedToneTest,   0, Task_Scheduler::CRITICAL, 10);
+  scheduler.addTask("telemetry",  serviceTelemetry,        10, Task_Scheduler::HIGH,      0);  //the telemetry object knows its own rate
+  scheduler.addTask("in_levels",  printInputSignalLevels, 1000, Task_Scheduler::NORMAL,   0);
+  scheduler.addTask("out_levels", printOutputSignalLevels, 1000, Task_Scheduler::NORMAL,  0);
+  scheduler.addTask("leds",       serviceLEDs,              0, Task_Scheduler::LOW,       0);
+  scheduler.addTask("cpu",        serviceCPUandMemory,   3000, Task_Scheduler::LOW,       0);
+}
+
 // define the loop() function, the function that is repeated over and over for the life of the device
 void loop() {
+  scheduler.run(millis());  //see setupTasks()
+} //end loop()
+
+// //////////////////////////////////////// Servicing routines (run by the scheduler...see setupTasks())
 
-  //respond to Serial commands
+//respond to Serial commands
+void serviceSerialInput(unsigned long cur_millis) {
   if (Serial.available()) serialManager.respondToByte((char)Serial.read());   //USB Serial
+}
 
-  //service the SD recording
+//service the SD recording
+void serviceSDWriter(unsigned long cur_millis) {
   audioSDWriter.serviceSD_withWarnings(i2s_in); //For the warnings, it asks the i2s_in class for some info
+}
 
-  //service the LEDs...blink slow normally, blink fast if recording
-  myTympan.serviceLEDs(millis(),audioSDWriter.getState() == AudioSDWriter::STATE::RECORDING); 
+//service the LEDs...blink slow normally, blink fast if recording
+void serviceLEDs(unsigned long cur_millis) {
+  myTympan.serviceLEDs(cur_millis, audioSDWriter.getState() == AudioSDWriter::STATE::RECORDING); 
+}
 
-  //periodically print the CPU and Memory Usage
-  if (myState.enable_printCpuToUSB) myState.printCPUandMemory(millis(), 3000); //print every 3000msec  (method is built into TympanStateBase.h, which myState inherits from)
+//print the CPU and Memory Usage
+void serviceCPUandMemory(unsigned long cur_millis) {
+  if (myState.enable_printCpuToUSB) myState.printCPUandMemory(cur_millis, 0); //the scheduler sets the rate  (method is built into TympanStateBase.h, which myState inherits from)
+}
 
-  //check to see what test mode we're in
-  if (testController.current_test_mode == TestController::TEST_MODE_STEPPED_FREQUENCY) {  //are we doing stepped tones?
+//read every audio block's measurements
+void serviceBlockStats(unsigned long cur_millis) {
+  inputMeasurement.serviceBlockStats();
+}
 
-    //update the stepped dones
-    testController.serviceSteppedToneTest(millis());  //update the tones
+//update the stepped tones (if we are doing stepped tones)
+void serviceSteppedToneTest(unsigned long cur_millis) {
+  if (testController.current_test_mode == TestController::TEST_MODE_STEPPED_FREQUENCY) testController.serviceSteppedToneTest(cur_millis);
+}
 
-  } else {                                                                     //we are not doing stepped tones
-    //periodically print the signal levels
-    if (myState.flag_printInputLevelToUSB) printInputSignalLevels(millis(),1000);  //print every 1000 msec
+void printTaskStats(void) { scheduler.printStats(&Serial); }
+void resetTaskStats(void) { scheduler.resetStats(); }
 
-    //periodically print the output levels
-    if (myState.flag_printOutputLevelToUSB) printOutputSignalLevels(millis(),1000);  //print every 1000 msec
-  }
+// //////////////////////////////////////// Other functions
 
-} //end loop()
+//set the left input's level for a 94 dB SPL calibrator (dB re: input FS).  Put the mic in the calibrator, then
+//use the current level (use_current = true) or give the level that was measured some other way.
+float setMicRef_dBFS(bool use_current, float mic_dBFS) {
+  if (use_current) mic_dBFS = calcInputLevel_L.getCurrentLevel_dB();
+  myState.mic_dBFS_at_94dBSPL = mic_dBFS;
+  printlnf(Serial, "setMicRef_dBFS: left input = %.2f dB re: input FS at 94 dB SPL (input gain = %.1f dB)", mic_dBFS, myState.input_gain_dB);
+  return mic_dBFS;
+}
 
-// //////////////////////////////////////// Other functions
-void printInputSignalLevels(unsigned long cur_millis, unsigned long updatePeriod_millis) {
-  static unsigned long lastUpdate_millis = 0UL;
-  if ( (cur_millis < lastUpdate_millis) || (cur_millis >= lastUpdate_millis + updatePeriod_millis) ) {
-    Serial.print("Input gain = " + String(myState.input_gain_dB,1) + " dB");
-    Serial.print(", Measured Input (L,R) = ");
-    Serial.print(calcInputLevel_L.getCurrentLevel_dB(),2);
-    Serial.print(", ");
-    Serial.print(calcInputLevel_R.getCurrentLevel_dB(),2);
-    Serial.print(" dB re: input FS");
-    Serial.println();
-
-    lastUpdate_millis = cur_millis;    
+//save the stepped-tone results as the calibration curve for one output channel of the DPOAE sketch (CALn.BIN, see Cal_Curve.h)
+bool saveCalCurve(int dpoae_out_chan) {
+  if (audioSDWriter.getState() == AudioSDWriter::STATE::RECORDING) {
+    Serial.println("saveCalCurve: *** ERROR ***: cannot write to the SD card while recording.  Stop the recording first.");
+    return false;
+  }
+  if (myState.mic_dBFS_at_94dBSPL <= (CAL_CURVE_NO_MIC_REF + 1.0f)) {
+    Serial.println("saveCalCurve: *** ERROR ***: the mic's level at 94 dB SPL is not known.  Set it first (\"$mic_ref\").");
+    return false;
   }
+  int n = inputMeasurement.all_freq_Hz.size();  //the measurements are cleared when each stepped-tone test starts
+  if ((n < testController.number_steps) || (inputMeasurement.all_freq_Hz[testController.number_steps-1] <= 0.0f) ||
+      (testController.current_test_mode == TestController::TEST_MODE_STEPPED_FREQUENCY)) {   //the last step is only filled in when a whole test finishes
+    Serial.println("saveCalCurve: *** ERROR ***: finish a stepped-tone test first");
+    return false;
+  }
+
+  //gain = input level minus output level, for each step and each input
+  std::vector<float> left_gain_dB(n), right_gain_dB(n);
+  for (int i=0; i < n; i++) {
+    left_gain_dB[i] = inputMeasurement.all_left_dB[i] - inputMeasurement.all_out_dB[i];
+    right_gain_dB[i] = inputMeasurement.all_right_dB[i] - inputMeasurement.all_out_dB[i];
+  }
+  const float *gains_dB[CAL_CURVE_N_CHAN] = { left_gain_dB.data(), right_gain_dB.data() };
+  if (calCurve.setPoints(n, inputMeasurement.all_freq_Hz.data(), gains_dB) < 1) return false;
+
+  calCurve.header.sample_rate_Hz = audio_settings.sample_rate_Hz;
+  calCurve.header.out_level_dBFS = inputMeasurement.all_out_dB[0];
+  calCurve.header.out_gain_dB = myState.output_gain_dB;
+  calCurve.header.in_gain_dB = myState.input_gain_dB;
+  calCurve.header.mic_dBFS_at_94dBSPL = myState.mic_dBFS_at_94dBSPL;
+  calCurve.header.out_chan = (myState.output_chan == State::OUT_LEFT) ? 0x01 : ((myState.output_chan == State::OUT_RIGHT) ? 0x02 : 0x03);
+
+  Fixed_String<16> fname;
+  Cal_Curve::makeFilename(dpoae_out_chan, &fname);
+  if (audioSDWriter.getState() == AudioSDWriter::STATE::UNPREPARED) audioSDWriter.prepareSDforRecording();  //starts the SD card
+  if (!calCurve.save(&sd, fname)) return false;
+  calCurve.printSummary(&Serial, fname);
+  return true;
+}
+//periodically print the signal levels (when we are not doing stepped tones)
+void printInputSignalLevels(unsigned long cur_millis) {
+  if (!myState.flag_printInputLevelToUSB || (testController.current_test_mode == TestController::TEST_MODE_STEPPED_FREQUENCY)) return;
+  printlnf(Serial, "Input gain = %.1f dB, Measured Input (L,R) = %.2f, %.2f dB re: input FS", 
+            myState.input_gain_dB, calcInputLevel_L.getCurrentLevel_dB(), calcInputLevel_R.getCurrentLevel_dB());
 }
 
-void printOutputSignalLevels(unsigned long cur_millis, unsigned long updatePeriod_millis) {
-  static unsigned long lastUpdate_millis = 0UL;
-  if ( (cur_millis < lastUpdate_millis) || (cur_millis >= lastUpdate_millis + updatePeriod_millis) ) {
-    Serial.print("SineWave, commanded amplitude = " + String(sineWave.getAmplitude(),4));
-    Serial.print(", Measured Ouptut = ");
-    Serial.print(calcOutputLevel.getCurrentLevel_dB(),2);
-    Serial.print(" dB re: output FS");
-    Serial.println();
+void serviceTelemetry(unsigned long cur_millis) {
+  if (!telemetry.isTimeToSend(cur_millis)) return;  //the telemetry object knows if it is enabled and what rate to use
+
+  Telemetry_Status status;
+  status.n_chan = 3;  //input left, input right, and the sine wave output
+  status.level_dB[0] = calcInputLevel_L.getCurrentLevel_dB();
+  status.level_dB[1] = calcInputLevel_R.getCurrentLevel_dB();
+  status.level_dB[2] = calcOutputLevel.getCurrentLevel_dB();
+  status.is_stim_on = (testController.current_test_mode != TestController::TEST_MODE_MUTE);
+  status.is_recording = (audioSDWriter.getState() == AudioSDWriter::STATE::RECORDING);
+  status.test_state = testController.current_test_mode;
+  status.step_ind = testController.getCurrentStep();
+  status.cpu_percent = audio_settings.processorUsage();
+  status.audio_mem_used = AudioMemoryUsage_F32();
+  status.audio_mem_max = AudioMemoryUsageMax_F32();
+  telemetry.sendStatus(status, cur_millis);
+}
 
-    lastUpdate_millis = cur_millis;    
-  }
+//periodically print the output levels (when we are not doing stepped tones)
+void printOutputSignalLevels(unsigned long cur_millis) {
+  if (!myState.flag_printOutputLevelToUSB || (testController.current_test_mode == TestController::TEST_MODE_STEPPED_FREQUENCY)) return;
+  printlnf(Serial, "SineWave, commanded amplitude = %.4f, Measured Ouptut = %.2f dB re: output FS", 
+            sineWave.getAmplitude(), calcOutputLevel.getCurrentLevel_dB());
 }
 
 
@@ -0,0 +1,31 @@
+/*
+ Crc32.h
+
+ Purpose: The standard CRC-32 (the same one as zlib, PNG, and Python's zlib.crc32)
+          for checking the files and records that are written to the SD card.
+
+ Use crc32(data, n) for a whole buffer.  For data that arrives in pieces, start
+ with crc = 0 and call crc = crc32_update(crc, data, n) for each piece.
+
+ MIT License, Use at your own risk.
+*/
+
+#ifndef _Crc32_h
+#define _Crc32_h
+
+//table-driven, four bits at a time (small table, still quick enough for the SD card)
+static inline uint32_t crc32_update(uint32_t crc, const void *data, size_t n_bytes) {
+  static const uint32_t table[16] = {
+    0x00000000UL, 0x1DB71064UL, 0x3B6E20C8UL, 0x26D930ACUL, 0x76DC4190UL, 0x6B6B51F4UL, 0x4DB26158UL, 0x5005713CUL,
+    0xEDB88320UL, 0xF00F9344UL, 0xD6D6A3E8UL, 0xCB61B38CUL, 0x9B64C2B0UL, 0x86D3D2D4UL, 0xA00AE278UL, 0xBDBDF21CUL };
+  const uint8_t *p = (const uint8_t *)data;
+  crc = ~crc;
+  for (size_t i=0; i < n_bytes; i++) {
+    crc = table[(crc ^ p[i]) & 0x0F] ^ (crc >> 4);
+    crc = table[(crc ^ (p[i] >> 4)) & 0x0F] ^ (crc >> 4);
+  }
+  return ~crc;
+}
+static inline uint32_t crc32(const void *data, size_t n_bytes) { return crc32_update(0, data, n_bytes); }
+
+#endif
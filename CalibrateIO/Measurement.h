@@ -4,12 +4,37 @@
 
 #include <AudioCalcLeq_F32.h>  //from Tympan_Library.h
 #include <vector>
+#include "Fixed_Format.h"
+#include "AudioBlockStats_F32.h"
 
 class Measurement { 
   public: 
-    Measurement(AudioCalcLeq_F32 *left, AudioCalcLeq_F32 *right) : measureLevel_L(left), measureLevel_R(right) {};
+    Measurement(AudioCalcLeq_F32 *left, AudioCalcLeq_F32 *right, AudioBlockStats_F32 *stats) : measureLevel_L(left), measureLevel_R(right), blockStats(stats) {};
+
+    //read every audio block's measurements (see AudioBlockStats_F32.h).  Call from loop().
+    void serviceBlockStats(void) {
+      if (blockStats == nullptr) return;
+      Block_Stats batch[BLOCK_STATS_BATCH];
+      int n;
+      while ((n = blockStats->popBatch(batch, BLOCK_STATS_BATCH)) > 0) {
+        for (int i=0; i < n; i++) {
+          const Block_Stats &s = batch[i];
+          if ((step_freq_Hz <= 0.0f) || (fabsf(s.stim.freq_Hz[0] - step_freq_Hz) < 0.01f)) step_stats.add(s);  //skip blocks still playing the previous step
+          if (print_block_stats) printlnf(Serial, "blk, %lu, %.2f, %.2f, %.2f, %.2f, %.2f, %.2f, %lu, %.2f", (unsigned long)s.block_id,
+              10.0f*log10f(max(s.mean_sq[0], 1.0e-20f)), 20.0f*log10f(max(s.peak[0], 1.0e-10f)),
+              10.0f*log10f(max(s.mean_sq[1], 1.0e-20f)), 20.0f*log10f(max(s.peak[1], 1.0e-10f)),
+              10.0f*log10f(max(s.mean_sq[2], 1.0e-20f)), 20.0f*log10f(max(s.peak[2], 1.0e-10f)),
+              (unsigned long)s.stim.stim_id, s.stim.freq_Hz[0]);
+        }
+      }
+    }
+    bool enableBlockStatsLog(bool enable) {
+      if (enable) Serial.println("blk, block, left (dBFS), left peak (dBFS), right (dBFS), right peak (dBFS), sine (dBFS), sine peak (dBFS), stim_id, freq (Hz)");
+      return print_block_stats = enable;
+    }
         
-    void takeMeasurement(const int test_step, const float freq_Hz) {
+    //out_amplitude is the sine's amplitude during the step (so that the output level is kept with the input levels)
+    void takeMeasurement(const int test_step, const float freq_Hz, const float out_amplitude) {
       //Serial.println("Measurement: takeMeasurement: test_step " + String(test_step) + ", freq = " + String(freq_Hz));
       if ((measureLevel_L != nullptr) && (measureLevel_R != nullptr)) {
         //confirm that there is space
@@ -19,22 +44,28 @@ class Measurement {
         all_freq_Hz[test_step] = freq_Hz;
         all_left_dB[test_step] = measureLevel_L->getCurrentLevel_dB();
         all_right_dB[test_step] = measureLevel_R->getCurrentLevel_dB();
+        all_out_dB[test_step] = 20.0f*log10f(max(out_amplitude, 1.0e-10f)) - 3.0103f;  //dB RMS, the same as AudioCalcLeq_F32
         printMeasurement(test_step);
+
+        //check every block of this step, not just the end
+        serviceBlockStats();
+        if ((step_stats.getClippedCount(0) > 0) || (step_stats.getClippedCount(1) > 0)) {
+          printlnf(Serial, "Measurement: step %d: *** WARNING ***: the input clipped in %d (left) and %d (right) of %d blocks",
+                    test_step, step_stats.getClippedCount(0), step_stats.getClippedCount(1), step_stats.getBlockCount());
+        }
+        if (step_stats.getMissedCount() > 0) printlnf(Serial, "Measurement: step %d: %d blocks were not measured (loop() fell behind)", test_step, step_stats.getMissedCount());
       } else {
         Serial.println("Measurement: takeMeasurement: *** ERROR ***: no pointers to level measuring blocks have been provided!");
       }
     }
 
     void printMeasurement(const int test_step) {
-      Serial.print("Measurement: (step, Tone Hz, Left dBFS, Right dBFS): " + String(test_step));
-      Serial.print(", " + String(all_freq_Hz[test_step],2));
-      Serial.print(", " + String(all_left_dB[test_step],2));
-      Serial.print(", " + String(all_right_dB[test_step],2));
-      Serial.println();
+      printlnf(Serial, "Measurement: (step, Tone Hz, Left dBFS, Right dBFS): %d, %.2f, %.2f, %.2f", 
+                test_step, all_freq_Hz[test_step], all_left_dB[test_step], all_right_dB[test_step]);
     }
 
     void printAllMeasurements(void) {
-      Serial.println("Measurement: printing all measurements: " + String(all_freq_Hz.size()));
+      printlnf(Serial, "Measurement: printing all measurements: %d", (int)all_freq_Hz.size());
       for (int i=0; i < all_freq_Hz.size(); i++) {
         printMeasurement(i);
       }
@@ -44,11 +75,15 @@ class Measurement {
       int n = getMinimumNumberOfMeasurments();
       if (all_freq_Hz.size() < n) setSizeOfVectors(n);
       for (int i=0; i < getMinimumNumberOfMeasurments(); i++) {
-        all_freq_Hz.at(i) = 0.0; all_left_dB.at(i) = 0.0; all_right_dB.at(i);
+        all_freq_Hz.at(i) = 0.0; all_left_dB.at(i) = 0.0; all_right_dB.at(i); all_out_dB.at(i) = 0.0;
       }
     }
     
-    void resetLevelCalculators(void) { measureLevel_L->clearStates();  measureLevel_R->clearStates(); }
+    //start fresh for a new step (at the given tone frequency, or 0 for any)
+    void resetLevelCalculators(float freq_Hz = 0.0f) {
+      measureLevel_L->clearStates();  measureLevel_R->clearStates();
+      serviceBlockStats(); step_stats.reset(); step_freq_Hz = freq_Hz;
+    }
     
 
     int setSizeOfVectors(const int n) { 
@@ -56,6 +91,7 @@ class Measurement {
       all_freq_Hz.resize(n); 
       all_left_dB.resize(n); 
       all_right_dB.resize(n); 
+      all_out_dB.resize(n);
       return n; 
     }
     int setMinimumNumberOfMeasurements(const int n) {
@@ -71,8 +107,13 @@ class Measurement {
     std::vector<float> all_freq_Hz;
     std::vector<float> all_left_dB;
     std::vector<float> all_right_dB;  //use these to hold data
+    std::vector<float> all_out_dB;    //level of the sine during each step (dB re: output FS)
+    AudioBlockStats_F32 *blockStats = nullptr;
+    Block_Stats_Accum step_stats;     //every block of the current step
 
   private:
+    float step_freq_Hz = 0.0f;
+    bool print_block_stats = false;
     int minimumNumberOfMeasurements = 501;
 };
 
@@ -0,0 +1,99 @@
+/*
+ Param_Mailbox.h
+
+ Purpose: Hand a complete set of audio parameters (frequencies, amplitudes, gains, fades...)
+          from loop() to the audio interrupt, so that they all change together at the
+          start of an audio block, rather than one at a time partway through the block.
+
+ Param_Mailbox<T> is a double buffer.  loop() fills the back copy and then publishes it
+     with one store (post()).  The audio interrupt copies out the newest published set
+     (take()).  If loop() posts twice before the next block, the newer set wins, so
+     always post the whole state (start from latest()), never just the change.  Nothing
+     is locked and loop() never has to turn off the interrupts.
+
+     This relies on the interrupt never being interrupted by loop(), which is true on our
+     single-core Teensy.  There must be only one writer (loop()) and one reader (the interrupt).
+
+ AudioParamUpdater_F32 is an audio object with no inputs or outputs.  Each audio block, it
+     calls applyParams() on each of its Block_Param_Clients, which take() their mailbox and
+     set the library's audio objects (sines, faders, mixers...).  Create it before the audio
+     objects that its clients control, so that it runs before them in each block (the
+     objects are updated in the order that they were created).  Our own audio objects
+     (like AudioSynthChirp_F32) just take() their own mailbox at the top of their update().
+
+ MIT License, Use at your own risk.
+*/
+
+#ifndef _Param_Mailbox_h
+#define _Param_Mailbox_h
+
+#include <atomic>
+
+#define PARAM_UPDATER_MAX_CLIENTS 8
+
+template <class T>
+class Param_Mailbox {
+  public:
+    Param_Mailbox(void) {};
+
+    //from loop(): publish a complete set of parameters.  Returns the number of sets posted so far.
+    uint32_t post(const T &params) {
+      int back = 1 - front;
+      slot[back] = params;
+      std::atomic_signal_fence(std::memory_order_release);  //the copy must be finished before it is published
+      front = back;
+      return ++n_posted;
+    }
+
+    //from the audio interrupt: get the newest set, if there is a new one since the last take()
+    bool take(T *params) {
+      uint32_t n = n_posted;
+      if (n == n_taken) return false;
+      std::atomic_signal_fence(std::memory_order_acquire);
+      *params = slot[front];
+      n_taken = n;
+      return true;
+    }
+
+    //from loop(): the last set that was posted (which might not be applied yet)
+    const T &latest(void) const { return slot[front]; }
+    bool isPending(void) const { return n_posted != n_taken; }
+
+  private:
+    T slot[2];
+    volatile int front = 0;
+    volatile uint32_t n_posted = 0, n_taken = 0;
+};
+
+class Block_Param_Client {
+  public:
+    virtual void applyParams(void) = 0;   //called from the audio interrupt, at the start of each block
+};
+
+class AudioParamUpdater_F32 : public AudioStream_F32 {
+  public:
+    AudioParamUpdater_F32(const AudioSettings_F32 &settings) : AudioStream_F32(0, NULL) {
+      active = true;  //nothing is connected to it, but it still needs to be updated every block
+    }
+
+    //register a client (do this in setup())
+    bool addClient(Block_Param_Client *client) {
+      if (n_clients >= PARAM_UPDATER_MAX_CLIENTS) {
+        Serial.println("AudioParamUpdater_F32: addClient: *** ERROR ***: too many clients");
+        return false;
+      }
+      clients[n_clients] = client;
+      n_clients++;  //only now will the interrupt see it
+      return true;
+    }
+
+    virtual void update(void) {
+      for (int i=0; i < n_clients; i++) clients[i]->applyParams();
+    }
+
+  private:
+    Block_Param_Client *clients[PARAM_UPDATER_MAX_CLIENTS];
+    volatile int n_clients = 0;
+};
+
+#endif
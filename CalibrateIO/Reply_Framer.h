@@ -0,0 +1,86 @@
+/*
+ Reply_Framer.h
+
+ Purpose: Mark where the reply to each command begins and ends on the Serial link, so
+          that a script on the PC can go on as soon as the reply is complete, rather
+          than waiting for the link to go quiet for a while after every command.
+
+ Framing is off by default (so the Serial Monitor looks as it always has).  Turn it on
+     with "$frame 1".  Then, the reply to each command is wrapped in two extra lines:
+
+        @@begin <seq>
+        ...the reply, exactly as without framing...
+        @@end <seq> <status> <status name>
+
+     where seq counts up by one for each reply, and status is one of:
+
+        0 ok            the command was run
+        1 bad_command   a '$' line was not understood, or failed its checks, so nothing was run
+        2 unknown       a single-character command that isn't known
+
+ The reply to "$frame 1" gets the end line (and a begin line ahead of whatever the
+     command printed after framing came on).  The reply to "$frame 0" is still closed.
+
+ Only the reply to the command itself is framed.  Anything printed later (the progress
+     of a test, levels, telemetry) is outside of any frame, so it can be told apart.  The
+     file transfers ('x', 'X', 'k') are not framed, as they have their own protocols.
+
+ This file is the same in CalibrateIO and DPOAE_Tones_Record.  Change both together.
+
+ MIT License, Use at your own risk.
+*/
+
+#ifndef _Reply_Framer_h
+#define _Reply_Framer_h
+
+#include "Fixed_Format.h"
+
+#define REPLY_FRAME_BEGIN   "@@begin"
+#define REPLY_FRAME_END     "@@end"
+
+class Reply_Framer {
+  public:
+    enum STATUS { REPLY_OK=0, REPLY_BAD_COMMAND, REPLY_UNKNOWN };
+
+    Reply_Framer(Print *_out) : out(_out) {};
+
+    bool enable(bool _enable) {
+      is_enabled = _enable;
+      if (is_enabled && in_command) begin();  //so that the reply that turned framing on is framed, too
+      return is_enabled;
+    }
+    bool isEnabled(void) const { return is_enabled; }
+    uint32_t getSeq(void) const { return seq; }
+
+    //call around the work of each command (even if framing is off, so that enable() knows that a command is underway)
+    void startCommand(void) { in_command = true; begin(); }
+    void endCommand(int status) {
+      in_command = false;
+      if (!in_reply) return;   //only close what was opened
+      in_reply = false;
+      printlnf(*out, REPLY_FRAME_END " %lu %d %s", (unsigned long)seq, status, getStatusName(status));
+    }
+
+    static const char *getStatusName(int status) {
+      switch (status) {
+        case REPLY_OK: return "ok";
+        case REPLY_BAD_COMMAND: return "bad_command";
+        case REPLY_UNKNOWN: return "unknown";
+      }
+      return "other";
+    }
+
+  private:
+    Print *out;
+    bool is_enabled = false, in_command = false, in_reply = false;
+    uint32_t seq = 0;
+
+    void begin(void) {
+      if (!is_enabled || in_reply) return;
+      in_reply = true;
+      seq++;
+      printlnf(*out, REPLY_FRAME_BEGIN " %lu", (unsigned long)seq);
+    }
+};
+
+#endif
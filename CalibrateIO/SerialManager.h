@@ -6,6 +6,9 @@
 #include "State.h"
 #include "Measurement.h"
 #include "TestController.h"
+#include "Command_Line.h"
+#include "Telemetry.h"
+#include "Reply_Framer.h"
 
 
 //Extern variables from the main *.ino file
@@ -14,6 +17,7 @@ extern AudioSDWriter_F32 audioSDWriter;
 extern State myState;
 extern TestController testController;
 extern Measurement inputMeasurement;
+extern Telemetry telemetry;
 
 //Extern Functions (that live in a file other than this file here)
 extern void setConfiguration(int);
@@ -23,18 +27,52 @@ extern bool enablePrintMemoryAndCPU(bool _enable);
 extern void printInputConfiguration(void);
 extern void printOutputChannel(void);
 extern float setCalcLevelTimeWindow(float time_window_sec);
+extern void printTaskStats(void);
+extern void resetTaskStats(void);
+extern float setMicRef_dBFS(bool use_current, float mic_dBFS);
+extern bool saveCalCurve(int dpoae_out_chan);
+
+//define the named commands that can be sent as a line starting with '$' (see Command_Line.h)
+enum CALIBRATE_CMD { CMD_HELP=0, CMD_FREQ, CMD_AMP_DB, CMD_OUT_CHAN, CMD_MODE, CMD_STEP_DUR, CMD_TIME_WINDOW, 
+                     CMD_INPUT_GAIN, CMD_RESET, CMD_RESULTS, CMD_TELEMETRY, CMD_BLOCKSTATS, CMD_TASKS,
+                     CMD_MIC_REF, CMD_CAL_SAVE, CMD_FRAME, N_CALIBRATE_CMDS };
+const Command_Def calibrate_commands[N_CALIBRATE_CMDS] = {   //must be in the same order as the enum above
+  { "help",        0, 0, ": Print this list of commands" },
+  { "freq",        1, 1, "<Hz>: Set the steady-tone frequency" },
+  { "amp_db",      1, 1, "<dB>: Set the sine amplitude (dB re: output FS)" },
+  { "out_chan",    1, 1, "<1|2|3>: Output the sine to left (1), right (2), or both (3)" },
+  { "mode",        1, 1, "<0|1|2>: Switch to muted (0), steady tone (1), or stepped-tone (2) mode" },
+  { "step_dur",    1, 1, "<sec>: Set the duration of each step of the stepped-tone test" },
+  { "time_window", 1, 1, "<sec>: Set the averaging time of the level measurements" },
+  { "input_gain",  1, 1, "<dB>: Set the analog input gain" },
+  { "reset",       0, 0, ": Reset all test parameters to the defaults" },
+  { "results",     0, 0, ": Print all results from the stepped-tone test" },
+  { "telemetry",   1, 2, "<0|1> [rate_Hz]: Stop (0) or start (1) the binary telemetry frames on USB (see Telemetry.h)" },
+  { "blockstats",  1, 1, "<0|1>: Stop (0) or start (1) printing every audio block's levels and peaks (see AudioBlockStats_F32.h)" },
+  { "tasks",       0, 1, "[reset]: Print each loop() task's run time and deadline misses (1 also resets them)" },
+  { "mic_ref",     0, 1, "[dBFS]: With the left mic in a 94 dB SPL calibrator, save its level (now, or as given)" },
+  { "cal_save",    1, 1, "<1-4>: Save the stepped-tone results as CALn.BIN, the curve for DPOAE output channel n (see Cal_Curve.h)" },
+  { "frame",       1, 1, "<0|1>: Stop (0) or start (1) marking the begin and end of each command's reply, for scripts (see Reply_Framer.h)" }
+};
 
 class SerialManager : public SerialManagerBase  {  // see Tympan_Library for SerialManagerBase for more functions!
   public:
-    SerialManager(void) : SerialManagerBase() {};
+    SerialManager(void) : SerialManagerBase(), cmdLine(calibrate_commands, N_CALIBRATE_CMDS), replyFramer(&Serial) {};
 
     void printHelp(void);
     bool processCharacter(char c);  //this is called automatically by SerialManagerBase.respondToByte(char c)
 
+    //methods for the named, line-based commands (see Command_Line.h)
+    int processCommandLine(void);  //returns a Reply_Framer::STATUS
+    const char *checkCommand(const Parsed_Command &cmd);  //returns NULL if the command can be executed
+    void executeCommand(const Parsed_Command &cmd);
+
     float inputGainIncrement_dB = 5.0;  //changes the input gain of the AIC
     float frequencyIncrement_factor = pow(2.0,1.0/3.0);  //third octave steps
     float amplitudeIcrement_dB = 1.0;  //changes the amplitude of the synthetic sine wave
   private:
+    Command_Line cmdLine;              //collects and parses the '$' commands
+    Reply_Framer replyFramer;          //marks the begin and end of each reply, when enabled
 };
 
 void SerialManager::printHelp(void) {  
@@ -53,6 +91,8 @@ void SerialManager::printHelp(void) {
   Serial.print(  "  p/P:   Printing: start/Stop printing the current input signal levels"); if (myState.flag_printInputLevelToUSB)   {Serial.println(" (active)");} else { Serial.println(" (off)"); }
   Serial.print(  "  o/O:   Printing: start/Stop printing the current output signal levels"); if (myState.flag_printOutputLevelToUSB)   {Serial.println(" (active)");} else { Serial.println(" (off)"); }
   Serial.println("  r/s:   SD: Start recording (r) or stop (s) audio to SD card");
+  Serial.println("  $  :   Named commands, one line, several allowed if separated by ';' (ex: \"$step_dur 0.2; mode 2\")");
+  cmdLine.printHelp(&Serial);
   Serial.println();
 }
 
@@ -60,10 +100,25 @@ void SerialManager::printHelp(void) {
 //switch yard to determine the desired action
 bool SerialManager::processCharacter(char c) { //this is called by SerialManagerBase.respondToByte(char c)
   bool ret_val = true; //assume at first that we will find a match
+
+  //are we in the middle of receiving a named command line?
+  if (cmdLine.isCapturing()) {
+    if (cmdLine.addChar(c)) { replyFramer.startCommand(); replyFramer.endCommand(processCommandLine()); }  //execute once the whole line has arrived
+    return ret_val;
+  }
+
+  //frame the reply (see Reply_Framer.h), except for the '$' that only starts a command line and
+  //the EOL after a single-character command
+  bool is_framed = (c != CMDLINE_START_CHAR) && (c != '\r') && (c != '\n');
+  if (is_framed) replyFramer.startCommand();
+
   switch (c) {
     case 'h': 
       printHelp(); 
       break;
+    case CMDLINE_START_CHAR:
+      cmdLine.begin();  //the rest of the line holds one or more named commands
+      break;
     case 'c':
       Serial.println("SerialManager: enabling printing of memory and CPU usage.");
       myState.enable_printCpuToUSB = true;
@@ -191,10 +246,137 @@ bool SerialManager::processCharacter(char c) { //this is called by SerialManager
       break;
     default:
       Serial.println("SerialManager: command " + String(c) + " not recognized");
+      ret_val = false;
       break;
   }
+  if (is_framed) replyFramer.endCommand(ret_val ? Reply_Framer::REPLY_OK : Reply_Framer::REPLY_UNKNOWN);
   return ret_val;
 }
 
+// //////////////////////////////////  Methods for the named, line-based commands
+
+//parse the whole line, check every command, and only then execute them (so that a batch is all-or-nothing)
+int SerialManager::processCommandLine(void) {
+  static Parsed_Command cmds[CMDLINE_MAX_BATCH];
+  int n_cmds = cmdLine.parse(cmds, CMDLINE_MAX_BATCH);
+  if (n_cmds < 0) {
+    Serial.print("SerialManager: *** ERROR ***: $: "); Serial.print(cmdLine.getErrorMessage()); Serial.println(". Nothing executed.");
+    return Reply_Framer::REPLY_BAD_COMMAND;
+  }
+  for (int i=0; i < n_cmds; i++) {
+    const char *err = checkCommand(cmds[i]);
+    if (err != NULL) {
+      Serial.print("SerialManager: *** ERROR ***: $"); Serial.print(cmdLine.getDef(cmds[i]).name); 
+      Serial.print(": "); Serial.print(err); Serial.println(". Nothing executed.");
+      return Reply_Framer::REPLY_BAD_COMMAND;
+    }
+  }
+
+  //everything is OK, so execute them all
+  for (int i=0; i < n_cmds; i++) executeCommand(cmds[i]);
+  Serial.print("SerialManager: $: executed "); Serial.print(n_cmds); Serial.println(" command(s)");
+  return Reply_Framer::REPLY_OK;
+}
+
+const char* SerialManager::checkCommand(const Parsed_Command &cmd) {
+  switch (cmd.def_ind) {
+    case CMD_FREQ:
+      if ((cmd.args[0] < 125.0/8) || (cmd.args[0] > 20000.0)) return "frequency must be 15.625 to 20000 Hz";
+      break;
+    case CMD_AMP_DB:
+      if (cmd.args[0] > -3.0) return "amplitude must be -3 dB or less";
+      break;
+    case CMD_OUT_CHAN:
+      if ((cmd.args[0] != 1) && (cmd.args[0] != 2) && (cmd.args[0] != 3)) return "chan must be 1, 2, or 3";
+      break;
+    case CMD_MODE:
+      if ((cmd.args[0] != 0) && (cmd.args[0] != 1) && (cmd.args[0] != 2)) return "mode must be 0, 1, or 2";
+      break;
+    case CMD_STEP_DUR:
+      if (cmd.args[0] < 0.05) return "duration must be at least 0.05 sec";
+      break;
+    case CMD_TIME_WINDOW:
+      if (cmd.args[0] <= 0.0) return "time window must be greater than zero";
+      break;
+    case CMD_INPUT_GAIN:
+      if ((cmd.args[0] < 0.0f) || (cmd.args[0] > 47.5f)) return "gain must be 0 to 47.5 dB";
+      break;
+    case CMD_TELEMETRY:
+      if ((cmd.n_args > 1) && ((cmd.args[1] <= 0.0f) || (cmd.args[1] > TELEMETRY_MAX_RATE_HZ))) return "rate must be greater than 0 and no more than 50 Hz";
+      break;
+    case CMD_MIC_REF:
+      if ((cmd.n_args > 0) && ((cmd.args[0] > 0.0f) || (cmd.args[0] < -150.0f))) return "level must be -150 to 0 dBFS";
+      break;
+    case CMD_CAL_SAVE:
+      if ((cmd.args[0] < 1) || (cmd.args[0] > 4) || (cmd.args[0] != (int)cmd.args[0])) return "channel must be 1, 2, 3, or 4";
+      if (audioSDWriter.getState() == AudioSDWriter::STATE::RECORDING) return "cannot save the cal curve while recording";
+      break;
+  }
+  return NULL;
+}
+
+void SerialManager::executeCommand(const Parsed_Command &cmd) {
+  const int out_chans[3] = {State::OUT_LEFT, State::OUT_RIGHT, State::OUT_BOTH};
+  const int test_modes[3] = {TestController::TEST_MODE_MUTE, TestController::TEST_MODE_STEADY, TestController::TEST_MODE_STEPPED_FREQUENCY};
+  switch (cmd.def_ind) {
+    case CMD_HELP:
+      cmdLine.printHelp(&Serial);
+      break;
+    case CMD_FREQ:
+      testController.setFrequency_Hz(cmd.args[0]);
+      break;
+    case CMD_AMP_DB:
+      testController.setAmplitude(sqrt(2.0)*pow(10.0,cmd.args[0]/20.0));  //convert from dB (RMS) to linear amplitude
+      break;
+    case CMD_OUT_CHAN:
+      setOutputChan(out_chans[(int)cmd.args[0] - 1]);
+      break;
+    case CMD_MODE:
+      if (test_modes[(int)cmd.args[0]] == TestController::TEST_MODE_STEPPED_FREQUENCY) inputMeasurement.clearAllMeasurements();
+      testController.switchTestToneMode(test_modes[(int)cmd.args[0]]);
+      break;
+    case CMD_STEP_DUR:
+      testController.stepped_test_step_dur_sec = cmd.args[0];
+      {
+        //keep the averaging window no longer than half of a step (and no shorter than needed)
+        float maxAllowedTimeWindow_sec = max(0.05, 0.5*testController.stepped_test_step_dur_sec);
+        setCalcLevelTimeWindow(min(myState.target_calcLevel_timeWindow_sec, maxAllowedTimeWindow_sec));
+      }
+      break;
+    case CMD_TIME_WINDOW:
+      setCalcLevelTimeWindow(cmd.args[0]);
+      break;
+    case CMD_INPUT_GAIN:
+      setInputGain_dB(cmd.args[0]);
+      break;
+    case CMD_RESET:
+      testController.resetToDefaults();
+      inputMeasurement.clearAllMeasurements();
+      break;
+    case CMD_RESULTS:
+      inputMeasurement.printAllMeasurements();
+      break;
+    case CMD_TELEMETRY:
+      if (cmd.n_args > 1) telemetry.setRate_Hz(cmd.args[1]);
+      telemetry.enable(cmd.args[0] != 0);
+      break;
+    case CMD_BLOCKSTATS:
+      inputMeasurement.enableBlockStatsLog(cmd.args[0] != 0);
+      break;
+    case CMD_TASKS:
+      printTaskStats();
+      if ((cmd.n_args > 0) && (cmd.args[0] != 0)) resetTaskStats();
+      break;
+    case CMD_MIC_REF:
+      setMicRef_dBFS(cmd.n_args < 1, (cmd.n_args > 0) ? cmd.args[0] : 0.0f);
+      break;
+    case CMD_CAL_SAVE:
+      saveCalCurve((int)cmd.args[0]);
+      break;
+    case CMD_FRAME:
+      replyFramer.enable(cmd.args[0] != 0);
+      break;
+  }
+}
 
 #endif
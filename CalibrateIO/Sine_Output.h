@@ -0,0 +1,58 @@
+
+#ifndef _Sine_Output_h
+#define _Sine_Output_h
+
+// Sine_Output: the one place that changes the test tone (its frequency, its amplitude,
+// and which outputs it goes to).  The setters post the new settings to a mailbox and the
+// audio interrupt applies them all together at the start of the next block (see
+// Param_Mailbox.h), so a step to a new frequency never lands partway through a block.
+// Register it with the AudioParamUpdater_F32 in setup().
+
+#include "State.h"
+#include "Param_Mailbox.h"
+#include "AudioBlockStats_F32.h"
+
+class Sine_Params {
+  public:
+    Sine_Params(void) {};
+    float freq_Hz = 1000.0f;
+    float amplitude = 0.0f;
+    int input_for_left = 0, input_for_right = 0;   //input of the switch matrix for each output
+};
+
+class Sine_Output : public Block_Param_Client {
+  public:
+    Sine_Output(AudioSynthWaveform_F32 *sine, AudioSwitchMatrix4_F32 *switchMatrix) : sineWave(sine), outputSwitchMatrix(switchMatrix) {};
+
+    float setFrequency_Hz(const float freq_Hz) { Sine_Params p = mailbox.latest(); p.freq_Hz = constrain(freq_Hz, 125.0/8, 20000.0); mailbox.post(p); return p.freq_Hz; }  //constrain the frequency
+    float getFrequency_Hz(void) const { return mailbox.latest().freq_Hz; }
+    float setAmplitude(const float amplitude) { Sine_Params p = mailbox.latest(); p.amplitude = constrain(amplitude, 0.0, 1.0); mailbox.post(p); return p.amplitude; } //constrain the amplitude
+    float getAmplitude(void) const { return mailbox.latest().amplitude; }
+    const Block_Stim_State *getStimState(void) const { return &stim_state; }  //what the audio interrupt last applied (see AudioBlockStats_F32.h)
+    void setRouting(int input_for_left, int input_for_right) {
+      Sine_Params p = mailbox.latest();
+      p.input_for_left = input_for_left; p.input_for_right = input_for_right;
+      mailbox.post(p);
+    }
+
+    //called from the audio interrupt (via AudioParamUpdater_F32) at the start of each block
+    virtual void applyParams(void) {
+      Sine_Params p;
+      if (!mailbox.take(&p)) return;
+      sineWave->setFrequency_Hz(p.freq_Hz);
+      sineWave->setAmplitude(p.amplitude);
+      outputSwitchMatrix->setInputToOutput(p.input_for_left, State::OUT_LEFT);
+      outputSwitchMatrix->setInputToOutput(p.input_for_right, State::OUT_RIGHT);
+      stim_state.stim_id++;
+      stim_state.freq_Hz[0] = p.freq_Hz;
+      stim_state.amp[0] = p.amplitude;
+    }
+
+  private:
+    AudioSynthWaveform_F32 *sineWave;
+    AudioSwitchMatrix4_F32 *outputSwitchMatrix;
+    Param_Mailbox<Sine_Params> mailbox;
+    Block_Stim_State stim_state;  //only written by the audio interrupt
+};
+
+#endif
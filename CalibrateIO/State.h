@@ -5,6 +5,8 @@
 
 extern const int N_CHAN;
 
+#include "Cal_Curve.h"
+
 // The purpose of this class is to be a central place to hold important information
 // about the algorithm parameters or the operation of the system.  This is mainly to
 // help *you* (the programmer) know and track what is important.  
@@ -43,7 +45,10 @@ class State : public TympanStateBase_UI { // look in TympanStateBase or TympanSt
     
     //Put different gain settings (except those in the compressors) here to ease the updating of the GUI
     float input_gain_dB  = 0.0;   //gain of the hardware PGA in the AIC
-    //float output_gain_dB = 0.0;  //gain of the hardware headphone amplifier in the AIC
+    float output_gain_dB = 0.0;   //gain of the hardware headphone amplifier in the AIC
+
+    //the left input's level (dB re: input FS) when its mic is in a 94 dB SPL calibrator (saved with the calibration curve, see Cal_Curve.h)
+    float mic_dBFS_at_94dBSPL = CAL_CURVE_NO_MIC_REF;
 
     //variables related ot printing of output
     bool enable_printCpuToUSB = false;
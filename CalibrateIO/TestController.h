@@ -4,6 +4,7 @@
 
 //header files
 #include "Measurement.h"
+#include "Sine_Output.h"
 #include <vector>
 
 #define TEST_CONTROLLER_DEFAULT_current_test_mode         TEST_MODE_MUTE
@@ -13,7 +14,7 @@
 
 class TestController {
   public:
-    TestController(AudioSynthWaveform_F32 *sine, Measurement *measurement) : sineWave(sine), inputMeasurement(measurement) { resetToDefaults(); };
+    TestController(Sine_Output *sine, Measurement *measurement) : sineOutput(sine), inputMeasurement(measurement) { resetToDefaults(); };
 
     void resetToDefaults(void) {
       Serial.println("TestController: reseting to default settings for stepped tone test");
@@ -70,7 +71,7 @@ class TestController {
 
       //test not yet complete.  change the frequency
       setSteppedTone(getToneFrequencyForCurrentStep());
-      if (inputMeasurement != nullptr) inputMeasurement->resetLevelCalculators();  //clear the averaging so that we're starting fresh for this new frequency
+      if (inputMeasurement != nullptr) inputMeasurement->resetLevelCalculators(getFrequency_Hz());  //clear the averaging so that we're starting fresh for this new frequency
       return false; //this is the normal return path
     }
 
@@ -107,7 +108,7 @@ class TestController {
       if (current_millis >= stepped_test_next_change_millis) {
       
         //we're about to make a change, so print the current levels
-        if (inputMeasurement != nullptr) inputMeasurement->takeMeasurement(current_step, getFrequency_Hz());
+        if (inputMeasurement != nullptr) inputMeasurement->takeMeasurement(current_step, getFrequency_Hz(), getAmplitude());
         
         //go to the next test tone frequency
         bool is_done = incrementToNextStep();
@@ -131,10 +132,11 @@ class TestController {
       }
     }
 
-    float setFrequency_Hz(const float freq_Hz) { return sineWave->setFrequency_Hz(constrain(freq_Hz, 125.0/8, 20000.0)); }  //constrain the frequency
-    float getFrequency_Hz(void) { return sineWave->getFrequency_Hz(); }
-    float setAmplitude(const float amplitude) { return sineWave->setAmplitude(constrain(amplitude, 0.0, 1.0)); } //constrain the amplitude
-    float getAmplitude(void) { return sineWave->getAmplitude(); }
+    float setFrequency_Hz(const float freq_Hz) { return sineOutput->setFrequency_Hz(freq_Hz); }  //takes effect at the next audio block (see Sine_Output.h)
+    float getFrequency_Hz(void) { return sineOutput->getFrequency_Hz(); }
+    float setAmplitude(const float amplitude) { return sineOutput->setAmplitude(amplitude); }    //takes effect at the next audio block (see Sine_Output.h)
+    float getAmplitude(void) { return sineOutput->getAmplitude(); }
+    int getCurrentStep(void) { return current_step; }
 
     //data members
     enum Test_Mode { TEST_MODE_MUTE, TEST_MODE_STEADY, TEST_MODE_STEPPED_FREQUENCY};  //different test modes allowed here
@@ -150,7 +152,7 @@ class TestController {
 
 
   private:
-    AudioSynthWaveform_F32 *sineWave = nullptr;
+    Sine_Output *sineOutput = nullptr;
     Measurement *inputMeasurement = nullptr;
     int current_step = -1;                                    //which step are we in the stepped test?
     unsigned long stepped_test_next_change_millis = 0UL;      //when to switch to the next step
@@ -17,6 +17,10 @@ import matplotlib.pyplot as plt
 import codecs
 import numpy as np
 
+# lines that wrap each reply, once the Tympan has been told "$frame 1" (see Reply_Framer.h)
+REPLY_FRAME_BEGIN = '@@begin'
+REPLY_FRAME_END = '@@end'
+
 # ##################### Define functions
 def clearSerialBuffer():
     foo = getReply(False,1.0)
@@ -28,21 +32,43 @@ def printReceivedLine(all_lines):
     #    all_lines = all_lines[:-1] #strip off trailing \r
     print(all_lines,end='')
 
+# read until the end of a framed reply or, if the reply isn't framed, until the link
+# has been quiet for wait_period_sec.  The framing lines themselves are not returned.
 def getReply(print_as_received=True,wait_period_sec=0.5):
     all_lines = ''
-    new_readline = codecs.decode(serial_with_tympan.readline(),encoding='utf-8')
-    all_lines += new_readline
+    is_framed = False
     last_reply_time  = time.time()
-    #while (len(new_readline) > 0):
     while (time.time() < (last_reply_time + wait_period_sec)):
         new_readline = codecs.decode(serial_with_tympan.readline(),encoding='utf-8')
         if len(new_readline) > 0:
             last_reply_time = time.time()
+        if new_readline.startswith(REPLY_FRAME_BEGIN):
+            is_framed = True
+            continue
+        if new_readline.startswith(REPLY_FRAME_END):
+            if is_framed:
+                break   #the reply is complete, so there is no need to wait
+            continue    #the end of an earlier reply
         all_lines += new_readline
         if print_as_received:
             printReceivedLine(new_readline)
     return all_lines
 
+# read (and print) lines until one of them contains the given text, or until timeout_sec
+def waitForLine(text, print_as_received=True, timeout_sec=600.0):
+    all_lines = ''
+    end_time = time.time() + timeout_sec
+    while (time.time() < end_time):
+        new_readline = codecs.decode(serial_with_tympan.readline(),encoding='utf-8')
+        if new_readline.startswith(REPLY_FRAME_BEGIN) or new_readline.startswith(REPLY_FRAME_END):
+            continue
+        all_lines += new_readline
+        if print_as_received:
+            printReceivedLine(new_readline)
+        if text in new_readline:
+            break
+    return all_lines
+
 def sendCharacterAndGetResponse(send_character, print_as_received = True, wait_period_sec = 0.5):
     serial_with_tympan.write(bytes(send_character + '\n', 'utf-8'))  #send an 'h' to the Tympan
     time.sleep(0.05)                             #wait a bit to enable a response 
@@ -80,22 +106,26 @@ serial_with_tympan = serial.Serial(port=my_com_port, baudrate=115200, timeout=.5
 # mute the system to stop any curren test
 all_lines = sendCharacterAndGetResponse('m',print_as_received=False, wait_period_sec=0.5)
 
+# frame the replies, so that each command goes on as soon as its reply is complete
+all_lines = sendCharacterAndGetResponse('$frame 1', print_as_received=False)
+
 # reset the test parameters
 all_lines = sendCharacterAndGetResponse('q')
 
 # ask the Tympan for the help menu and read the response
 all_lines = sendCharacterAndGetResponse('h')
 
-wait_period_sec = 1.1  # default value for slow (1 second)
 if 1:
     # speed up the test by shorting from the default 0.5sec/step to 0.2 sec/step the test parameters
-    all_lines = sendCharacterAndGetResponse('DDD')
-    wait_period_sec = 0.25  #faster value for faster (0.2 sec) test tones
+    # (a '$' line sets the value directly, in one round trip, rather than sending 'DDD')
+    all_lines = sendCharacterAndGetResponse('$step_dur 0.2')
 
 
 if 1:
-    # command the test to start
-    all_lines = sendCharacterAndGetResponse('T',wait_period_sec=wait_period_sec)
+    # command the test to start, and wait for it to finish (its progress is printed outside of the reply)
+    all_lines = sendCharacterAndGetResponse('T')
+    if 'stepped-tone test completed!' not in all_lines:   #(without framing, the reply runs until the test is done)
+        all_lines += waitForLine('stepped-tone test completed!')
 
     # get all of the results
     all_lines = sendCharacterAndGetResponse('v')
@@ -112,6 +142,7 @@ if 1:
 
 
 # close the serial port
+all_lines = sendCharacterAndGetResponse('$frame 0', print_as_received=False)
 print("Closing serial port...")
 serial_with_tympan.close()
 
@@ -0,0 +1,142 @@
+#
+# tympanTelemetry.py
+#
+# Purpose: Decode the binary telemetry frames sent by the Tympan over the USB
+#     Serial link (see Telemetry.h in the Tympan sketch for the frame format).
+#
+# The frames are mixed in with the normal text printed by the Tympan.  The
+# decoder looks for the sync bytes, checks the CRC, and returns the decoded
+# frames.  Everything else (ie, the text) is returned separately so that it
+# can still be printed, if you want.
+#
+# To use it as a live monitor, run this file directly:
+#     python tympanTelemetry.py COM26 20      #(port name, telemetry rate in Hz)
+#
+# MIT License
+#
+
+import struct
+import sys
+
+SYNC = b'\xa5\x5a'
+HEADER_LEN = 11       # sync(2) + version(1) + type(1) + length(1) + seq(2) + timestamp(4)
+CRC_LEN = 2
+TELEMETRY_VERSION = 1
+TELEMETRY_STATUS = 1
+TELEMETRY_SPECTRUM = 2
+
+# CRC-16/CCITT-FALSE, which matches Telemetry::crc16() on the Tympan
+def crc16(data, crc=0xFFFF):
+    for byte in data:
+        crc ^= byte << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) if (crc & 0x8000) else (crc << 1)
+            crc &= 0xFFFF
+    return crc
+
+# turn the payload of a status frame into a dictionary
+def decodeStatusPayload(payload):
+    n_chan, stim, test_state, step_ind, cpu, mem_used, mem_max = struct.unpack_from('<BBBhHHH', payload, 0)
+    levels = struct.unpack_from('<' + 'h'*n_chan, payload, 11)
+    return {'stim_on': bool(stim & 0x01),
+            'recording': bool(stim & 0x02),
+            'test_state': test_state,
+            'step_ind': step_ind,
+            'cpu_percent': cpu / 100.0,
+            'audio_mem_used': mem_used,
+            'audio_mem_max': mem_max,
+            'level_dB': [val / 100.0 for val in levels]}
+
+# turn the payload of a spectrum frame into a dictionary
+def decodeSpectrumPayload(payload):
+    n_bands, f_min_Hz, f_max_Hz = struct.unpack_from('<BHH', payload, 0)
+    levels = struct.unpack_from('<' + 'h'*n_bands, payload, 5)
+    # the bands are log-spaced between f_min_Hz and f_max_Hz.  Compute their center frequencies.
+    ratio = (f_max_Hz / f_min_Hz) ** (1.0 / n_bands) if (n_bands > 0 and f_min_Hz > 0) else 1.0
+    centers_Hz = [f_min_Hz * (ratio ** (i + 0.5)) for i in range(n_bands)]
+    return {'f_min_Hz': f_min_Hz,
+            'f_max_Hz': f_max_Hz,
+            'band_center_Hz': centers_Hz,
+            'band_dB': [val / 100.0 for val in levels]}
+
+# decoders for each frame type.  Other frame types are returned with just their raw payload.
+payload_decoders = {TELEMETRY_STATUS: decodeStatusPayload, TELEMETRY_SPECTRUM: decodeSpectrumPayload}
+
+class TelemetryDecoder:
+    def __init__(self):
+        self.buffer = bytearray()
+        self.n_frames = 0
+        self.n_crc_errors = 0
+        self.last_seq = None
+        self.n_dropped = 0    # frames that were missed, based on gaps in the sequence number
+
+    # give the decoder more bytes.  Returns (list of decoded frames, bytes that were not part of a frame)
+    def feed(self, new_bytes):
+        self.buffer += new_bytes
+        frames = []
+        other_bytes = bytearray()
+        while True:
+            ind = self.buffer.find(SYNC)
+            if ind < 0:
+                # no sync found.  Keep the last byte (it might be the first sync byte) and return the rest as text
+                keep = 1 if self.buffer.endswith(SYNC[:1]) else 0
+                other_bytes += self.buffer[:len(self.buffer)-keep]
+                del self.buffer[:len(self.buffer)-keep]
+                break
+            other_bytes += self.buffer[:ind]
+            del self.buffer[:ind]
+            if len(self.buffer) < HEADER_LEN:
+                break  # wait for more bytes
+            version, frame_type, payload_len, seq, timestamp_millis = struct.unpack_from('<BBBHI', self.buffer, 2)
+            frame_len = HEADER_LEN + payload_len + CRC_LEN
+            if len(self.buffer) < frame_len:
+                break  # wait for more bytes
+            (crc,) = struct.unpack_from('<H', self.buffer, HEADER_LEN + payload_len)
+            if (version != TELEMETRY_VERSION) or (crc != crc16(self.buffer[2:HEADER_LEN + payload_len])):
+                # not a good frame.  Skip the sync bytes and keep looking.
+                self.n_crc_errors += 1
+                del self.buffer[:1]
+                continue
+            payload = bytes(self.buffer[HEADER_LEN:HEADER_LEN + payload_len])
+            del self.buffer[:frame_len]
+
+            # track any missed frames
+            if self.last_seq is not None:
+                self.n_dropped += (seq - self.last_seq - 1) & 0xFFFF
+            self.last_seq = seq
+            self.n_frames += 1
+
+            frame = {'type': frame_type, 'seq': seq, 'timestamp_millis': timestamp_millis}
+            if frame_type in payload_decoders:
+                frame.update(payload_decoders[frame_type](payload))
+            else:
+                frame['payload'] = payload
+            frames.append(frame)
+        return frames, bytes(other_bytes)
+
+
+# ############ Example: print the telemetry live
+if __name__ == '__main__':
+    import serial  #pip install pyserial
+    port = sys.argv[1] if len(sys.argv) > 1 else 'COM26'
+    rate_Hz = float(sys.argv[2]) if len(sys.argv) > 2 else 20.0
+    serial_to_tympan = serial.Serial(port=port, baudrate=115200, timeout=0.1) #baudrate doesn't matter for Tympan
+    serial_to_tympan.write(bytes('$telemetry 1 ' + str(rate_Hz) + '\n', 'utf-8'))  #turn on the telemetry
+    decoder = TelemetryDecoder()
+    try:
+        while True:
+            frames, text = decoder.feed(serial_to_tympan.read(1024))
+            for frame in frames:
+                if frame['type'] == TELEMETRY_STATUS:
+                    levels = ', '.join(['%6.1f' % val for val in frame['level_dB']])
+                    print('%9.3f s: step %2d, stim %d, rec %d, CPU %5.1f%%, mem %3d, levels (dB) = %s' %
+                          (frame['timestamp_millis']/1000.0, frame['step_ind'], frame['stim_on'], frame['recording'],
+                           frame['cpu_percent'], frame['audio_mem_used'], levels))
+                elif frame['type'] == TELEMETRY_SPECTRUM:
+                    print('%9.3f s: spectrum (dB) = %s' % (frame['timestamp_millis']/1000.0,
+                          ' '.join(['%.0f' % val for val in frame['band_dB']])))
+    except KeyboardInterrupt:
+        pass
+    finally:
+        serial_to_tympan.write(bytes('$telemetry 0\n', 'utf-8'))  #turn off the telemetry
+        serial_to_tympan.close()
@@ -0,0 +1,157 @@
+/*
+ Artifact_Log.h
+
+ Purpose: Keep track of the blocks that AudioArtifactMonitor_F32 flagged during an
+          SD recording and save them next to the WAV file, so that the off-line
+          analysis can skip the same audio that the Tympan skipped.
+
+ While recording, runs of consecutive flagged blocks are collected in RAM (nothing
+     is written to the SD card while the WAV file is being written).  After the
+     recording stops, writeSidecar() writes a small CSV file with the same name as
+     the WAV file plus "_flags.csv".  For example, AUDIO001.WAV -> AUDIO001_flags.csv.
+     For binaural tests, each ear has its own log and its own suffix (such as
+     "_ear1_flags.csv").
+
+ The sidecar file looks like this ('#' lines are comments):
+
+     # Artifact flags for AUDIO001.WAV
+     # sample_rate_Hz = 22058.5, block_samples = 64, threshold_dB = 10.0
+     # stimulus_rate_Hz = 44117.0, decimation = 2
+     # sdstart_ms = 2000, tone_ms = 3000, silence_ms = 1000
+     # start_sample, n_samples, max_level_dBFS
+     12800, 384, -31.2
+     # step 1: rejected 35 msec, tone extended by 35 msec
+
+ The sample numbers are counted from the first block after the recording started.
+     They should be good to within a block or so, because the recording is started
+     from loop() and not from the audio interrupt.
+
+ The sample rate is the WAV file's (after any decimation of the recording), while the
+     stimulus rate is the one that the tones were planned for (see DPOAE_Protocol.h).
+     The PC tools plan the tones at the stimulus rate, and only then find their bins at
+     the WAV file's rate.
+
+ The durations are the test's timing when it was recorded ("$sdstart_ms", "$tone_ms",
+     and "$silence_ms"), so that the PC tools can find each step without being told.
+
+ MIT License, Use at your own risk.
+*/
+
+#ifndef _Artifact_Log_h
+#define _Artifact_Log_h
+
+#include "AudioArtifactMonitor_F32.h"
+#include "Fixed_Format.h"
+
+#define ARTIFACT_LOG_MAX_RUNS   256   //most runs of flagged blocks to remember for one recording
+#define ARTIFACT_LOG_MAX_STEPS  16    //most test steps to remember for one recording
+#define ARTIFACT_LOG_FNAME_LEN  64
+
+class Artifact_Log {
+  public:
+    Artifact_Log(void) {};
+
+    //start and stop collecting (call right after starting and stopping the SD recording)
+    void startRecording(const char *wav_fname, uint32_t first_block_id);
+    void stopRecording(void) { is_recording = false; }
+    bool isRecording(void) { return is_recording; }
+
+    //give it the result for each block (from AudioArtifactMonitor_F32::popBlockInfo())
+    void addBlock(const Artifact_Block_Info &info);
+
+    //remember how each step of the test went, and the test's timing (negative if not known)
+    void addStep(int step_ind, int rejected_millis, int extended_millis);
+    void setTiming_msec(int _sdstart_ms, int _tone_ms, int _silence_ms) { sdstart_ms = _sdstart_ms; tone_ms = _tone_ms; silence_ms = _silence_ms; }
+
+    //write the sidecar file.  Returns the number of runs written, or -1 on error
+    int writeSidecar(SdFs *sd, float sample_rate_Hz, int block_samples, float threshold_dB, float stimulus_rate_Hz) { return writeSidecar(sd, sample_rate_Hz, block_samples, threshold_dB, stimulus_rate_Hz, "_flags.csv"); }
+    int writeSidecar(SdFs *sd, float sample_rate_Hz, int block_samples, float threshold_dB, float stimulus_rate_Hz, const char *suffix);
+
+    const char *getSidecarFilename(void) { return sidecar_fname.c_str(); }  //name and size of the last sidecar file written
+    uint32_t getSidecarBytes(void) { return sidecar_bytes; }
+
+    int getNumRuns(void) { return n_runs; }
+    int getNumDroppedRuns(void) { return n_dropped_runs; }
+
+  private:
+    struct Run { uint32_t start_block; uint32_t n_blocks; float max_level_dBFS; };
+    struct Step { int step_ind; int rejected_millis; int extended_millis; };
+    Run runs[ARTIFACT_LOG_MAX_RUNS];
+    Step steps[ARTIFACT_LOG_MAX_STEPS];
+    int n_runs = 0, n_dropped_runs = 0, n_steps = 0;
+    bool is_recording = false, in_run = false;
+    uint32_t first_block = 0;
+    int sdstart_ms = -1, tone_ms = -1, silence_ms = -1;
+    char wav_fname[ARTIFACT_LOG_FNAME_LEN] = "";
+    Fixed_String<ARTIFACT_LOG_FNAME_LEN> sidecar_fname;
+    uint32_t sidecar_bytes = 0;
+};
+
+void Artifact_Log::startRecording(const char *_wav_fname, uint32_t first_block_id) {
+  strncpy(wav_fname, _wav_fname, ARTIFACT_LOG_FNAME_LEN-1); wav_fname[ARTIFACT_LOG_FNAME_LEN-1] = '\0';
+  first_block = first_block_id;
+  n_runs = 0; n_dropped_runs = 0; n_steps = 0; in_run = false;
+  is_recording = true;
+}
+
+void Artifact_Log::addBlock(const Artifact_Block_Info &info) {
+  if (!is_recording || (info.block_id < first_block)) return;
+  if (!info.is_flagged) { in_run = false; return; }
+
+  //extend the current run or start a new one
+  if (in_run && (n_runs > 0) && (runs[n_runs-1].start_block + runs[n_runs-1].n_blocks == info.block_id - first_block)) {
+    Run &run = runs[n_runs-1];
+    run.n_blocks++;
+    run.max_level_dBFS = max(run.max_level_dBFS, info.level_dBFS);
+    return;
+  }
+  if (n_runs >= ARTIFACT_LOG_MAX_RUNS) { n_dropped_runs++; in_run = false; return; }
+  runs[n_runs].start_block = info.block_id - first_block;
+  runs[n_runs].n_blocks = 1;
+  runs[n_runs].max_level_dBFS = info.level_dBFS;
+  n_runs++;
+  in_run = true;
+}
+
+void Artifact_Log::addStep(int step_ind, int rejected_millis, int extended_millis) {
+  if (!is_recording || (n_steps >= ARTIFACT_LOG_MAX_STEPS)) return;
+  steps[n_steps].step_ind = step_ind;
+  steps[n_steps].rejected_millis = rejected_millis;
+  steps[n_steps].extended_millis = extended_millis;
+  n_steps++;
+}
+
+int Artifact_Log::writeSidecar(SdFs *sd, float sample_rate_Hz, int block_samples, float threshold_dB, float stimulus_rate_Hz, const char *suffix) {
+  if (wav_fname[0] == '\0') return -1;
+
+  //make the file name by swapping the WAV file's extension for the suffix (such as "_flags.csv")
+  Fixed_String<ARTIFACT_LOG_FNAME_LEN> fname("%s", wav_fname);
+  const char *dot = strrchr(wav_fname, '.');
+  if (dot != NULL) fname.printf("%.*s", (int)(dot - wav_fname), wav_fname);
+  fname.appendf("%s", suffix);
+
+  FsFile file = sd->open(fname.c_str(), O_WRITE | O_CREAT | O_TRUNC);
+  if (!file) {
+    printlnf(Serial, "Artifact_Log: writeSidecar: *** ERROR ***: could not open %s", fname.c_str());
+    return -1;
+  }
+  printlnf(file, "# Artifact flags for %s", wav_fname);
+  printlnf(file, "# sample_rate_Hz = %.1f, block_samples = %d, threshold_dB = %.1f", sample_rate_Hz, block_samples, threshold_dB);
+  printlnf(file, "# stimulus_rate_Hz = %.1f, decimation = %d", stimulus_rate_Hz, (int)(stimulus_rate_Hz / sample_rate_Hz + 0.5f));
+  if ((sdstart_ms >= 0) && (tone_ms >= 0) && (silence_ms >= 0)) printlnf(file, "# sdstart_ms = %d, tone_ms = %d, silence_ms = %d", sdstart_ms, tone_ms, silence_ms);
+  if (n_dropped_runs > 0) printlnf(file, "# WARNING: %d more runs were not saved (too many)", n_dropped_runs);
+  printlnf(file, "# start_sample, n_samples, max_level_dBFS");
+  for (int i=0; i < n_runs; i++) {
+    printlnf(file, "%lu, %lu, %.1f", (unsigned long)(runs[i].start_block * block_samples), (unsigned long)(runs[i].n_blocks * block_samples), runs[i].max_level_dBFS);
+  }
+  for (int i=0; i < n_steps; i++) {
+    printlnf(file, "# step %d: rejected %d msec, tone extended by %d msec", steps[i].step_ind+1, steps[i].rejected_millis, steps[i].extended_millis);
+  }
+  sidecar_fname.printf("%s", fname.c_str());
+  sidecar_bytes = (uint32_t)file.fileSize();
+  file.close();
+  printlnf(Serial, "Artifact_Log: wrote %d runs of flagged blocks to %s", n_runs, fname.c_str());
+  return n_runs;
+}
+
+#endif
@@ -0,0 +1,183 @@
+/*
+ AudioArtifactMonitor_F32.h
+
+ Purpose: Find the audio blocks that are spoiled by subject movement, swallowing,
+          or room noise, and keep them out of the on-device averaging.
+
+ Detection (in the audio interrupt, once per block):
+     The probe mic (input 0) is filtered to remove everything that we expect to hear:
+     a highpass removes the very low frequencies and notch filters remove the two
+     stimulus tones (f1, f2) and the distortion product (2*f1-f2).  The energy that
+     is left is the noise.  It is compared against an adaptive threshold, which is
+     threshold_dB above a slowly-updated estimate of the noise floor.  A block that
+     is over the threshold is flagged, as are the next hangover_blocks blocks (noise
+     bursts have tails).
+
+ Rejection:
+     Every input is passed to the matching output (input 0 -> output 0, etc).  For a
+     flagged block, nothing is transmitted.  Downstream nodes that average (such as
+     AudioCalcLeq_F32 and AudioSpectrumMonitor_F32) simply see no block, so the
+     flagged audio never gets into their averages.  For this to work in the same
+     audio cycle, this node must be created after the nodes that feed it and before
+     the nodes that it feeds.
+
+ Reporting:
+     Each block's result is pushed into a small ring buffer for loop() to read (see
+     popBlockInfo() and SPSC_Ring.h).  The counters give the total number of blocks and flagged blocks.
+
+ MIT License, Use at your own risk.
+*/
+
+#ifndef _AudioArtifactMonitor_F32_h
+#define _AudioArtifactMonitor_F32_h
+
+#include <arm_math.h>
+#include "SPSC_Ring.h"
+
+#define ARTIFACT_N_CHAN          3     //input 0 is the probe mic (used for detection).  All inputs are gated.
+#define ARTIFACT_N_STAGES        4     //highpass + notches at f1, f2, and 2*f1-f2
+#define ARTIFACT_RING_LEN        64    //must be a power of 2
+#define ARTIFACT_WARMUP_BLOCKS   50    //blocks used to get the first estimate of the noise floor (no flagging yet)
+#define ARTIFACT_MAX_BLOCK_SAMPLES 128
+
+//the result for one audio block
+struct Artifact_Block_Info {
+  uint32_t block_id = 0;      //counts up by one for every block
+  float level_dBFS = -200.0f; //noise level (everything other than the stimulus) in this block
+  float thresh_dBFS = 0.0f;   //the threshold that it was compared against
+  bool is_flagged = false;
+};
+
+class AudioArtifactMonitor_F32 : public AudioStream_F32 {
+  public:
+    AudioArtifactMonitor_F32(const AudioSettings_F32 &settings) : AudioStream_F32(ARTIFACT_N_CHAN, inputQueueArray) {
+      sample_rate_Hz = settings.sample_rate_Hz;
+      block_sec = (float)settings.audio_block_samples / sample_rate_Hz;
+      computeCoeffs(coeffs);  //the audio isn't running yet, so no need to protect this
+      arm_biquad_cascade_df1_init_f32(&iir, ARTIFACT_N_STAGES, coeffs, iir_state);
+      setFloorTime_sec(2.0f);
+    }
+
+    virtual void update(void);
+
+    //settings
+    bool enable(bool _enable) { return is_enabled = _enable; }  //when disabled, everything is passed and nothing is flagged
+    bool isEnabled(void) { return is_enabled; }
+    float setThreshold_dB(float val_dB) { return threshold_dB = val_dB; }
+    float getThreshold_dB(void) { return threshold_dB; }
+    int setHangoverBlocks(int n) { return hangover_blocks = max(0, n); }
+    float setFloorTime_sec(float tau_sec) { floor_alpha = 1.0f - expf(-block_sec / max(tau_sec, block_sec)); return tau_sec; }
+    void setHighpass_Hz(float freq_Hz) { hp_Hz = freq_Hz; updateCoeffs(); }
+    void setStimulusFreqs(float f1_Hz, float f2_Hz) { f1 = f1_Hz; f2 = f2_Hz; updateCoeffs(); }  //call whenever the tones change
+    void resetFloor(void) { n_warmup = 0; }
+
+    //results
+    float getBlockDuration_sec(void) { return block_sec; }
+    float getNoiseFloor_dBFS(void) { return floor_dBFS; }
+    uint32_t getBlockCount(void) { return n_blocks; }
+    uint32_t getFlaggedBlockCount(void) { return n_flagged; }
+    uint32_t getRingOverflowCount(void) { return ring.getOverflowCount(); }
+
+    //get the next block result from the ring buffer (call from loop()).  Returns false if there is nothing new.
+    bool popBlockInfo(Artifact_Block_Info *info) { return ring.pop(info); }
+
+  private:
+    audio_block_f32_t *inputQueueArray[ARTIFACT_N_CHAN];
+    float sample_rate_Hz = 44100.0f, block_sec = 128.0f/44100.0f;
+    bool is_enabled = true;
+
+    //detection filters
+    arm_biquad_casd_df1_inst_f32 iir;
+    float coeffs[5*ARTIFACT_N_STAGES];
+    float iir_state[4*ARTIFACT_N_STAGES];
+    float work[ARTIFACT_MAX_BLOCK_SAMPLES];
+    float hp_Hz = 100.0f, f1 = 1000.0f, f2 = 1200.0f, notch_Q = 3.0f;
+    void computeCoeffs(float *c);
+    void updateCoeffs(void);
+    static void calcNotch(float freq_Hz, float Q, float fs_Hz, float *c);
+    static void calcHighpass(float freq_Hz, float fs_Hz, float *c);
+
+    //adaptive threshold
+    float threshold_dB = 10.0f;   //flag blocks that are this far above the noise floor
+    int hangover_blocks = 2;
+    float floor_dBFS = -200.0f, floor_alpha = 0.001f;
+    int n_warmup = 0, hangover_left = 0;
+
+    //counters and the ring buffer to loop()
+    volatile uint32_t n_blocks = 0, n_flagged = 0;
+    SPSC_Ring<Artifact_Block_Info, ARTIFACT_RING_LEN> ring;
+};
+
+void AudioArtifactMonitor_F32::update(void) {
+  audio_block_f32_t *in_block[ARTIFACT_N_CHAN];
+  for (int i=0; i < ARTIFACT_N_CHAN; i++) in_block[i] = AudioStream_F32::receiveReadOnly_f32(i);
+
+  bool reject = false;
+  if ((in_block[0] != NULL) && is_enabled) {
+    //measure the level of everything other than the stimulus
+    int n = min(in_block[0]->length, ARTIFACT_MAX_BLOCK_SAMPLES);
+    arm_biquad_cascade_df1_f32(&iir, in_block[0]->data, work, n);
+    float sum_sq = 0.0f;
+    arm_power_f32(work, n, &sum_sq);
+    float level_dBFS = 10.0f*log10f(max(sum_sq / (float)n, 1.0e-20f));
+
+    //compare to the adaptive threshold
+    Artifact_Block_Info info;
+    info.block_id = n_blocks;
+    info.level_dBFS = level_dBFS;
+    info.thresh_dBFS = floor_dBFS + threshold_dB;
+    float alpha = floor_alpha;
+    if (n_warmup < ARTIFACT_WARMUP_BLOCKS) {
+      if (n_warmup == 0) floor_dBFS = level_dBFS;  //start from the first block
+      alpha = 0.1f; n_warmup++;                    //adapt quickly at first
+    } else if (level_dBFS > info.thresh_dBFS) {
+      hangover_left = hangover_blocks + 1;         //this block plus the hangover
+    }
+    if (hangover_left > 0) { info.is_flagged = true; hangover_left--; alpha *= 0.1f; }  //flagged blocks only nudge the floor (so that it can follow a real change)
+    floor_dBFS += alpha * (level_dBFS - floor_dBFS);
+    reject = info.is_flagged;
+    if (reject) n_flagged++;
+
+    //tell loop()
+    ring.push(info);
+  }
+  if (in_block[0] != NULL) n_blocks++;
+
+  //pass along (or drop) the audio
+  for (int i=0; i < ARTIFACT_N_CHAN; i++) {
+    if (in_block[i] == NULL) continue;
+    if (!reject) AudioStream_F32::transmit(in_block[i], i);
+    AudioStream_F32::release(in_block[i]);
+  }
+}
+
+void AudioArtifactMonitor_F32::computeCoeffs(float *c) {
+  calcHighpass(hp_Hz, sample_rate_Hz, c);
+  calcNotch(f1, notch_Q, sample_rate_Hz, c+5);
+  calcNotch(f2, notch_Q, sample_rate_Hz, c+10);
+  calcNotch(max(2.0f*f1 - f2, 10.0f), notch_Q, sample_rate_Hz, c+15);  //distortion product
+}
+
+void AudioArtifactMonitor_F32::updateCoeffs(void) {
+  float new_coeffs[5*ARTIFACT_N_STAGES];
+  computeCoeffs(new_coeffs);
+  AudioNoInterrupts();  //don't let the audio interrupt see half-updated coefficients
+  for (int i=0; i < 5*ARTIFACT_N_STAGES; i++) coeffs[i] = new_coeffs[i];
+  AudioInterrupts();
+}
+
+//biquad coefficients (from the RBJ Audio EQ Cookbook) in the CMSIS order: b0, b1, b2, -a1, -a2 (all divided by a0)
+void AudioArtifactMonitor_F32::calcNotch(float freq_Hz, float Q, float fs_Hz, float *c) {
+  float w0 = 2.0f * (float)M_PI * min(freq_Hz, 0.49f*fs_Hz) / fs_Hz;
+  float alpha = sinf(w0) / (2.0f * Q), cos_w0 = cosf(w0), a0 = 1.0f + alpha;
+  c[0] = 1.0f / a0; c[1] = -2.0f * cos_w0 / a0; c[2] = 1.0f / a0;
+  c[3] = 2.0f * cos_w0 / a0; c[4] = -(1.0f - alpha) / a0;
+}
+void AudioArtifactMonitor_F32::calcHighpass(float freq_Hz, float fs_Hz, float *c) {
+  float w0 = 2.0f * (float)M_PI * freq_Hz / fs_Hz;
+  float alpha = sinf(w0) / (2.0f * 0.7071f), cos_w0 = cosf(w0), a0 = 1.0f + alpha;
+  c[0] = 0.5f * (1.0f + cos_w0) / a0; c[1] = -(1.0f + cos_w0) / a0; c[2] = 0.5f * (1.0f + cos_w0) / a0;
+  c[3] = 2.0f * cos_w0 / a0; c[4] = -(1.0f - alpha) / a0;
+}
+
+#endif
@@ -0,0 +1,150 @@
+/*
+ AudioDecimator_F32.h
+
+ Purpose: Lower the sample rate of one or more channels (by a whole number) with an
+          anti-alias lowpass, so that the analysis (or the recording) after it only
+          has to handle the band that we actually care about.
+
+ Each channel uses the CMSIS FIR decimator (arm_fir_decimate_f32), which only computes
+     the output samples that are kept, so it is as cheap as a polyphase filter bank: each
+     output sample costs n_taps multiply-adds.  The lowpass is a Kaiser-windowed sinc,
+     designed here when the decimation is set.
+
+ Each output block has 1/factor as many samples as the input block (its length says so),
+     at 1/factor of the sample rate, so the audio objects after it should be created with
+     the matching AudioSettings_F32 (see getOutputRate_Hz() and getOutputBlockSamples()).
+     With a factor of 1, the blocks are passed straight through.
+
+ The time taken by each update() is measured (with the CPU's cycle counter), so that we
+     can see what the decimation costs against what it saves.
+
+ MIT License, Use at your own risk.
+*/
+
+#ifndef _AudioDecimator_F32_h
+#define _AudioDecimator_F32_h
+
+#include <arm_math.h>
+
+#define DECIMATOR_MAX_CHAN          4
+#define DECIMATOR_MAX_TAPS          128
+#define DECIMATOR_MAX_BLOCK_SAMPLES 128
+#define DECIMATOR_DEFAULT_TAPS      48
+#define DECIMATOR_KAISER_BETA       7.0f   //about 70 dB of stopband rejection
+
+#if defined(F_CPU_ACTUAL)
+  #define DECIMATOR_CPU_HZ ((float)F_CPU_ACTUAL)
+#else
+  #define DECIMATOR_CPU_HZ ((float)F_CPU)
+#endif
+
+class AudioDecimator_F32 : public AudioStream_F32 {
+  public:
+    AudioDecimator_F32(const AudioSettings_F32 &settings, int _n_chan) : AudioStream_F32(constrain(_n_chan, 1, DECIMATOR_MAX_CHAN), inputQueueArray) {
+      n_chan = constrain(_n_chan, 1, DECIMATOR_MAX_CHAN);
+      in_rate_Hz = settings.sample_rate_Hz;
+      in_block_samples = min(settings.audio_block_samples, DECIMATOR_MAX_BLOCK_SAMPLES);
+    }
+
+    //choose the decimation factor and the anti-alias filter.  The factor must divide the block size.
+    //A cutoff of 0 puts it at the new Nyquist frequency.  Returns false (and changes nothing) if it can't be done.
+    bool setDecimation(int new_factor, int new_n_taps, float new_cutoff_Hz) {
+      if ((new_factor < 1) || ((in_block_samples % new_factor) != 0)) {
+        printlnf(Serial, "AudioDecimator_F32: setDecimation: *** ERROR ***: factor %d does not divide the block size (%d)", new_factor, in_block_samples);
+        return false;
+      }
+      new_n_taps = constrain(new_n_taps, new_factor, DECIMATOR_MAX_TAPS);
+      if (new_cutoff_Hz <= 0.0f) new_cutoff_Hz = 0.5f * in_rate_Hz / (float)new_factor;
+      float new_coeffs[DECIMATOR_MAX_TAPS];
+      designLowpass(min(new_cutoff_Hz / in_rate_Hz, 0.5f), new_n_taps, DECIMATOR_KAISER_BETA, new_coeffs);
+
+      AudioNoInterrupts();  //don't let the audio interrupt see a half-changed filter
+      factor = new_factor; n_taps = new_n_taps; cutoff_Hz = new_cutoff_Hz;
+      for (int i=0; i < n_taps; i++) coeffs[i] = new_coeffs[i];
+      for (int i=0; i < n_chan; i++) arm_fir_decimate_init_f32(&fir[i], n_taps, factor, coeffs, state[i], in_block_samples);  //also clears the state
+      resetCost();
+      AudioInterrupts();
+      return true;
+    }
+    int getFactor(void) const { return factor; }
+    int getNumTaps(void) const { return n_taps; }
+    float getCutoff_Hz(void) const { return cutoff_Hz; }
+    float getOutputRate_Hz(void) const { return in_rate_Hz / (float)factor; }
+    int getOutputBlockSamples(void) const { return in_block_samples / factor; }
+
+    //what each update() costs (the average is smoothed over about 100 blocks)
+    float getCost_usec(void) const { return 1.0e6f * ave_cycles / DECIMATOR_CPU_HZ; }
+    float getMaxCost_usec(void) const { return 1.0e6f * (float)max_cycles / DECIMATOR_CPU_HZ; }
+    float getCost_percent(void) const { return 100.0f * getCost_usec() / (1.0e6f * (float)in_block_samples / in_rate_Hz); }  //of the time between blocks
+    void resetCost(void) { ave_cycles = 0.0f; max_cycles = 0; }
+
+    virtual void update(void) {
+      uint32_t start_cycles = ARM_DWT_CYCCNT;
+      for (int i=0; i < n_chan; i++) {
+        audio_block_f32_t *in_block = AudioStream_F32::receiveReadOnly_f32(i);
+        if (in_block == NULL) continue;
+        if (factor == 1) { AudioStream_F32::transmit(in_block, i); AudioStream_F32::release(in_block); continue; }
+
+        audio_block_f32_t *out_block = AudioStream_F32::allocate_f32();
+        if (out_block != NULL) {
+          int n_in = min(in_block->length, in_block_samples);
+          n_in -= (n_in % factor);
+          arm_fir_decimate_f32(&fir[i], in_block->data, out_block->data, n_in);
+          out_block->length = n_in / factor;
+          out_block->fs_Hz = in_block->fs_Hz / factor;
+          out_block->id = in_block->id;
+          AudioStream_F32::transmit(out_block, i);
+          AudioStream_F32::release(out_block);
+        }
+        AudioStream_F32::release(in_block);
+      }
+      uint32_t cycles = ARM_DWT_CYCCNT - start_cycles;
+      ave_cycles += 0.01f * ((float)cycles - ave_cycles);
+      if (cycles > max_cycles) max_cycles = cycles;
+    }
+
+  private:
+    audio_block_f32_t *inputQueueArray[DECIMATOR_MAX_CHAN];
+    int n_chan = 2;
+    float in_rate_Hz = 44100.0f;
+    int in_block_samples = 128;
+
+    int factor = 1, n_taps = DECIMATOR_DEFAULT_TAPS;
+    float cutoff_Hz = 0.0f;
+    float coeffs[DECIMATOR_MAX_TAPS];
+    float state[DECIMATOR_MAX_CHAN][DECIMATOR_MAX_TAPS + DECIMATOR_MAX_BLOCK_SAMPLES - 1];
+    arm_fir_decimate_instance_f32 fir[DECIMATOR_MAX_CHAN];
+
+    volatile float ave_cycles = 0.0f;
+    volatile uint32_t max_cycles = 0;
+
+    static void designLowpass(float cutoff_norm, int N, float beta, float *h);
+    static float besselI0(float x);
+};
+
+//Kaiser-windowed sinc lowpass.  cutoff_norm is in cycles per sample (0.5 is Nyquist).  Unity gain at DC.
+void AudioDecimator_F32::designLowpass(float cutoff_norm, int N, float beta, float *h) {
+  const float center = 0.5f * (float)(N - 1), I0_beta = besselI0(beta);
+  float sum = 0.0f;
+  for (int k=0; k < N; k++) {
+    float x = (float)k - center;
+    float sinc = (fabsf(x) < 1.0e-6f) ? (2.0f * cutoff_norm) : (sinf(2.0f * (float)M_PI * cutoff_norm * x) / ((float)M_PI * x));
+    float r = (N > 1) ? (x / center) : 0.0f;
+    h[k] = sinc * besselI0(beta * sqrtf(max(0.0f, 1.0f - r*r))) / I0_beta;
+    sum += h[k];
+  }
+  for (int k=0; k < N; k++) h[k] /= sum;
+}
+
+//modified Bessel function of the first kind (order 0), for the Kaiser window
+float AudioDecimator_F32::besselI0(float x) {
+  float sum = 1.0f, term = 1.0f, half_x = 0.5f * x;
+  for (int k=1; k < 25; k++) {
+    term *= (half_x / (float)k) * (half_x / (float)k);
+    sum += term;
+    if (term < 1.0e-8f * sum) break;
+  }
+  return sum;
+}
+
+#endif
@@ -1,57 +1,184 @@
 
 
+#include "AudioSpectrumMonitor_F32.h"
+#include "AudioSynthChirp_F32.h"
+#include "AudioArtifactMonitor_F32.h"
+#include "AudioStimulusPlayer_F32.h"
+#include "Param_Mailbox.h"
+#include "AudioBlockStats_F32.h"
+#include "AudioDecimator_F32.h"
+
+#include "AudioSDWriter_Indexed_UI.h"
 
 // Create the audio library objects that we'll use
+AudioParamUpdater_F32     paramUpdater(audio_settings);                     //applies the tone and fade changes from loop() at the start of each block (must be created first)
+#if (N_EARS > 1)
+AudioInputI2SQuad_F32     audio_in(audio_settings);                         //4 inputs: Tympan (ear 1) and earpiece shield (ear 2)
+#else
 AudioInputI2S_F32         audio_in(audio_settings);                         //from the Tympan_Library
-AudioSDWriter_F32_UI      audioSDWriter(&sd, audio_settings);               //record audio to SD card.  This is stereo by default
+#endif
+AudioDecimator_F32        recordDecim(audio_settings, 2*N_EARS);            //anti-alias and decimate the mics before recording them (see RECORD_DECIMATION)
+AudioSDWriter_Indexed_UI  audioSDWriter(&sd, record_settings);              //record audio to SD card (at the decimated rate).  This is stereo by default
 AudioSynthWaveform_F32    sine1(audio_settings),sine2(audio_settings);      //from the Tympan_Library...for generating tones
+AudioStimulusPlayer_F32   stimPlayer1(audio_settings);                      //plays the tones (or any stimulus) precomputed in the stimulus cache
+AudioMixer4_F32           stimMix1(audio_settings), stimMix2(audio_settings);   //choose the live sines or the precomputed stimulus (before the fades)
 AudioEffectFade_F32       fade1(audio_settings), fade2(audio_settings);     //For smoohting start/stop of the tones
-AudioFilterBiquad_F32     highpass1(audio_settings), highpass2(audio_settings);     //for limiting bandwidth prior to measuring loudness
-AudioFilterBiquad_F32     lowpass1(audio_settings), lowpass2(audio_settings);       //for limiting bandwidth prior to measuring loudness
-AudioCalcLeq_F32          measureLEQ1(audio_settings), measureLEQ2(audio_settings); //for measuring loudness
+AudioSynthChirp_F32       chirp(audio_settings);                            //broadband sweep for the probe-fit check
+AudioMixer4_F32           mixer1(audio_settings), mixer2(audio_settings);   //combine the tones and the chirp
+AudioDecimator_F32        analysisDecim1(audio_settings, 2);                //both mics, down to the analysis rate (just passes them through if ANALYSIS_DECIMATION is 1)
+AudioFilterBiquad_F32     highpass1(analysis_settings), highpass2(analysis_settings);     //for limiting bandwidth prior to measuring loudness
+AudioFilterBiquad_F32     lowpass1(analysis_settings), lowpass2(analysis_settings);       //for limiting bandwidth prior to measuring loudness
+AudioArtifactMonitor_F32  artifactMonitor(analysis_settings);               //flags noisy blocks and keeps them out of the averaging below (must be created before them)
+AudioCalcLeq_F32          measureLEQ1(analysis_settings), measureLEQ2(analysis_settings); //for measuring loudness
+AudioSpectrumMonitor_F32  spectrumMonitor(analysis_settings);               //live spectrum of the probe mic (FFT is done in loop(), not here)
+AudioBlockStats_F32       blockStats1(audio_settings, 2);                   //mean-square and peak of every block of both inputs, streamed to loop()
+#if (N_EARS > 1)
+//the same again for the second ear (on the earpiece shield)
+AudioSynthWaveform_F32    sine3(audio_settings),sine4(audio_settings);
+AudioStimulusPlayer_F32   stimPlayer2(audio_settings);
+AudioMixer4_F32           stimMix3(audio_settings), stimMix4(audio_settings);
+AudioEffectFade_F32       fade3(audio_settings), fade4(audio_settings);
+AudioSynthChirp_F32       chirp2(audio_settings);                           //each ear has its own chirp, so that each probe check is on its own
+AudioMixer4_F32           mixer3(audio_settings), mixer4(audio_settings);
+AudioDecimator_F32        analysisDecim2(audio_settings, 2);
+AudioFilterBiquad_F32     highpass3(analysis_settings), highpass4(analysis_settings);
+AudioFilterBiquad_F32     lowpass3(analysis_settings), lowpass4(analysis_settings);
+AudioArtifactMonitor_F32  artifactMonitor2(analysis_settings);
+AudioCalcLeq_F32          measureLEQ3(analysis_settings), measureLEQ4(analysis_settings);
+AudioSpectrumMonitor_F32  spectrumMonitor2(analysis_settings);
+AudioBlockStats_F32       blockStats2(audio_settings, 2);
+AudioOutputI2SQuad_F32    audio_out(audio_settings);   //4 outputs: Tympan (ear 1) and earpiece shield (ear 2)
+#else
 AudioOutputI2S_F32        audio_out(audio_settings);   //from the Tympan_Library
+#endif
 
 // Create the audio connections from the sine1 object to the audio output object
-AudioConnection_F32     patchCord10(sine1, 0, fade1, 0);  //connect to left output
-AudioConnection_F32     patchCord11(sine2, 0, fade2, 0);  //connect to right output
-AudioConnection_F32     patchCord12(fade1, 0, audio_out, 0);  //connect to left output
-AudioConnection_F32     patchCord13(fade2, 0, audio_out, 1);  //connect to right output
-AudioConnection_F32     patchcord20(audio_in, 0, audioSDWriter, 0);   //connect Raw audio to left channel of SD writer
-AudioConnection_F32     patchcord21(audio_in, 1, audioSDWriter, 1);   //connect Raw audio to right channel of SD writer
-AudioConnection_F32     patchcord30(audio_in, 0, highpass1, 0);   //connect Raw audio to a highpass filter
-AudioConnection_F32     patchcord31(audio_in, 1, highpass2, 0);   //connect Raw audio to a highpass filter
+AudioConnection_F32     patchCord10(sine1, 0, stimMix1, 0);  //live tone to the left stimulus mixer
+AudioConnection_F32     patchCord11(sine2, 0, stimMix2, 0);  //live tone to the right stimulus mixer
+AudioConnection_F32     patchCord18(stimPlayer1, 0, stimMix1, 1);  //precomputed stimulus to the left stimulus mixer
+AudioConnection_F32     patchCord19(stimPlayer1, 1, stimMix2, 1);  //precomputed stimulus to the right stimulus mixer
+AudioConnection_F32     patchCord90(stimMix1, 0, fade1, 0);  //whichever is playing, to the left fader
+AudioConnection_F32     patchCord91(stimMix2, 0, fade2, 0);  //whichever is playing, to the right fader
+AudioConnection_F32     patchCord12(fade1, 0, mixer1, 0);  //tone to the left mixer
+AudioConnection_F32     patchCord13(fade2, 0, mixer2, 0);  //tone to the right mixer
+AudioConnection_F32     patchCord14(chirp, 0, mixer1, 1);  //chirp to the left mixer
+AudioConnection_F32     patchCord15(chirp, 0, mixer2, 1);  //chirp to the right mixer
+AudioConnection_F32     patchCord16(mixer1, 0, audio_out, 0);  //connect to left output
+AudioConnection_F32     patchCord17(mixer2, 0, audio_out, 1);  //connect to right output
+AudioConnection_F32     patchcord22(audio_in, 0, recordDecim, 0);    //Raw audio down to the recording rate
+AudioConnection_F32     patchcord23(audio_in, 1, recordDecim, 1);    //Raw audio down to the recording rate
+AudioConnection_F32     patchcord20(recordDecim, 0, audioSDWriter, 0);   //connect decimated audio to left channel of SD writer
+AudioConnection_F32     patchcord21(recordDecim, 1, audioSDWriter, 1);   //connect decimated audio to right channel of SD writer
+AudioConnection_F32     patchcord28(audio_in, 0, analysisDecim1, 0);   //Raw audio down to the analysis rate
+AudioConnection_F32     patchcord29(audio_in, 1, analysisDecim1, 1);   //Raw audio down to the analysis rate
+AudioConnection_F32     patchcord30(analysisDecim1, 0, highpass1, 0);   //connect decimated audio to a highpass filter
+AudioConnection_F32     patchcord31(analysisDecim1, 1, highpass2, 0);   //connect decimated audio to a highpass filter
 AudioConnection_F32     patchcord32(highpass1, 0, lowpass1, 0);   //more filtering
 AudioConnection_F32     patchcord33(highpass2, 0, lowpass2, 0);   //more filtering
-AudioConnection_F32     patchcord34(lowpass1, 0, measureLEQ1, 0);   //filtered audio to level measurement
-AudioConnection_F32     patchcord35(lowpass2, 0, measureLEQ2, 0);   //filtered audio to level measurement
+AudioConnection_F32     patchcord34(lowpass1, 0, artifactMonitor, 1);   //filtered audio to be gated by the artifact monitor
+AudioConnection_F32     patchcord35(lowpass2, 0, artifactMonitor, 2);   //filtered audio to be gated by the artifact monitor
+AudioConnection_F32     patchcord36(artifactMonitor, 1, measureLEQ1, 0);   //gated audio to level measurement
+AudioConnection_F32     patchcord37(artifactMonitor, 2, measureLEQ2, 0);   //gated audio to level measurement
+AudioConnection_F32     patchcord40(analysisDecim1, 0, artifactMonitor, 0);   //decimated audio to the artifact detection
+AudioConnection_F32     patchcord41(artifactMonitor, 0, spectrumMonitor, 0);   //gated raw audio to the live spectrum
+AudioConnection_F32     patchcord42(audio_in, 0, blockStats1, 0);   //Raw audio to the per-block measurements
+AudioConnection_F32     patchcord43(audio_in, 1, blockStats1, 1);   //Raw audio to the per-block measurements
+
+#if (N_EARS > 1)
+// Connections for the second ear: the same as above, but using outputs 2-3 and inputs 2-3
+AudioConnection_F32     patchCord50(sine3, 0, stimMix3, 0);
+AudioConnection_F32     patchCord51(sine4, 0, stimMix4, 0);
+AudioConnection_F32     patchCord58(stimPlayer2, 0, stimMix3, 1);
+AudioConnection_F32     patchCord59(stimPlayer2, 1, stimMix4, 1);
+AudioConnection_F32     patchCord92(stimMix3, 0, fade3, 0);
+AudioConnection_F32     patchCord93(stimMix4, 0, fade4, 0);
+AudioConnection_F32     patchCord52(fade3, 0, mixer3, 0);
+AudioConnection_F32     patchCord53(fade4, 0, mixer4, 0);
+AudioConnection_F32     patchCord54(chirp2, 0, mixer3, 1);
+AudioConnection_F32     patchCord55(chirp2, 0, mixer4, 1);
+AudioConnection_F32     patchCord56(mixer3, 0, audio_out, 2);
+AudioConnection_F32     patchCord57(mixer4, 0, audio_out, 3);
+AudioConnection_F32     patchcord62(audio_in, 2, recordDecim, 2);
+AudioConnection_F32     patchcord63(audio_in, 3, recordDecim, 3);
+AudioConnection_F32     patchcord60(recordDecim, 2, audioSDWriter, 2);
+AudioConnection_F32     patchcord61(recordDecim, 3, audioSDWriter, 3);
+AudioConnection_F32     patchcord68(audio_in, 2, analysisDecim2, 0);
+AudioConnection_F32     patchcord69(audio_in, 3, analysisDecim2, 1);
+AudioConnection_F32     patchcord70(analysisDecim2, 0, highpass3, 0);
+AudioConnection_F32     patchcord71(analysisDecim2, 1, highpass4, 0);
+AudioConnection_F32     patchcord72(highpass3, 0, lowpass3, 0);
+AudioConnection_F32     patchcord73(highpass4, 0, lowpass4, 0);
+AudioConnection_F32     patchcord74(lowpass3, 0, artifactMonitor2, 1);
+AudioConnection_F32     patchcord75(lowpass4, 0, artifactMonitor2, 2);
+AudioConnection_F32     patchcord76(artifactMonitor2, 1, measureLEQ3, 0);
+AudioConnection_F32     patchcord77(artifactMonitor2, 2, measureLEQ4, 0);
+AudioConnection_F32     patchcord80(analysisDecim2, 0, artifactMonitor2, 0);
+AudioConnection_F32     patchcord81(artifactMonitor2, 0, spectrumMonitor2, 0);
+AudioConnection_F32     patchcord82(audio_in, 2, blockStats2, 0);
+AudioConnection_F32     patchcord83(audio_in, 3, blockStats2, 1);
+#endif
+
+//bring the mics down to the analysis rate (call before the audio starts, so that the analysis never sees the full rate)
+void setupAnalysisDecimation(void) {
+  analysisDecim1.setDecimation(ANALYSIS_DECIMATION, DECIMATOR_DEFAULT_TAPS, 0.0f);  //anti-alias at the new Nyquist
+  #if (N_EARS > 1)
+    analysisDecim2.setDecimation(ANALYSIS_DECIMATION, DECIMATOR_DEFAULT_TAPS, 0.0f);
+  #endif
+}
+
+//bring the mics down to the recording rate
+bool setupRecordDecimation(int n_taps, float cutoff_Hz) {
+  return recordDecim.setDecimation(RECORD_DECIMATION, n_taps, cutoff_Hz);
+}
 
 //settings for level measurement
 float hp_Hz = 100.0;     //cutoff for highpass filter
+#if (DPOAE_HIGH_RATE)
+float lp_Hz = 20000.0;   //cutoff for lowpass filter (above the highest F2)
+#else
 float lp_Hz = 10000.0;   //cutoff for lowpass filter
+#endif
 float LEQ_ave_sec = 0.5; //averaging time
 void setupLevelMeasurements(void) {
   highpass1.setHighpass(0,hp_Hz);  highpass2.setHighpass(0,hp_Hz);
   lowpass1.setLowpass(0,lp_Hz);  lowpass2.setLowpass(0,lp_Hz);
   measureLEQ1.setTimeWindow_sec(LEQ_ave_sec);measureLEQ2.setTimeWindow_sec(LEQ_ave_sec);
+  spectrumMonitor.setAveragingTime_sec(LEQ_ave_sec);
+  #if (N_EARS > 1)
+    highpass3.setHighpass(0,hp_Hz);  highpass4.setHighpass(0,hp_Hz);
+    lowpass3.setLowpass(0,lp_Hz);  lowpass4.setLowpass(0,lp_Hz);
+    measureLEQ3.setTimeWindow_sec(LEQ_ave_sec);measureLEQ4.setTimeWindow_sec(LEQ_ave_sec);
+    spectrumMonitor2.setAveragingTime_sec(LEQ_ave_sec);
+  #endif
 }
 
 
-//code to switch between the different analog inputs
+//code to switch between the different analog inputs (for binaural, the earpiece shield is switched the same way)
 void setConfiguration(int config) {
  
   switch (config) {
     case State::INPUT_PCBMICS:
       myTympan.inputSelect(TYMPAN_INPUT_ON_BOARD_MIC); // use the on-board microphones
+      #if (N_EARS > 1)
+        earpieceShield.inputSelect(TYMPAN_INPUT_ON_BOARD_MIC);
+      #endif
       break;
 
     case State::INPUT_JACK_MIC:
       myTympan.inputSelect(TYMPAN_INPUT_JACK_AS_MIC); // use the mic jack
       myTympan.setEnableStereoExtMicBias(true);  //put the mic bias on both channels
+      #if (N_EARS > 1)
+        earpieceShield.inputSelect(TYMPAN_INPUT_JACK_AS_MIC);
+        earpieceShield.setEnableStereoExtMicBias(true);
+      #endif
       break;
    
     case State::INPUT_JACK_LINE:
       Serial.println("setConfiguration: changing to INPUT JACK as LINE-IN...");
       myTympan.inputSelect(TYMPAN_INPUT_JACK_AS_LINEIN); // use the line-input through holes
+      #if (N_EARS > 1)
+        earpieceShield.inputSelect(TYMPAN_INPUT_JACK_AS_LINEIN);
+      #endif
       break;
       
     default:
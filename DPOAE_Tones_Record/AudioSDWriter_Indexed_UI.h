@@ -0,0 +1,37 @@
+/*
+ AudioSDWriter_Indexed_UI.h
+
+ Purpose: The SD writer, but with the App's record buttons going through the same
+          path as the test's recordings (startTestRecording() and stopTestRecording()
+          in DPOAE_test_logic.h).  So, the App's recordings are named by the SD index
+          and are added to it, just like the test's, and they get artifact sidecars, too.
+
+ Only the start and stop buttons are taken over.  Everything else (the card, the
+     status of the buttons, the help) is left to AudioSDWriter_F32_UI.
+
+ MIT License, Use at your own risk.
+*/
+
+#ifndef _AudioSDWriter_Indexed_UI_h
+#define _AudioSDWriter_Indexed_UI_h
+
+#include <Tympan_Library.h>
+
+//in DPOAE_test_logic.h
+extern bool startManualRecording(void);
+extern bool stopManualRecording(void);
+
+class AudioSDWriter_Indexed_UI : public AudioSDWriter_F32_UI {
+  public:
+    using AudioSDWriter_F32_UI::AudioSDWriter_F32_UI;
+
+    virtual bool processCharacterTriple(char mode_char, char chan_char, char data_char) {
+      if (mode_char == ID_char) {   //it's for us (the same codes as AudioSDWriter_F32_UI's own start and stop buttons)
+        if (data_char == 'r') { startManualRecording(); return true; }
+        if (data_char == 's') { stopManualRecording(); return true; }
+      }
+      return AudioSDWriter_F32_UI::processCharacterTriple(mode_char, chan_char, data_char);
+    }
+};
+
+#endif
@@ -0,0 +1,159 @@
+/*
+ AudioSpectrumMonitor_F32.h
+
+ Purpose: Compute a live, averaged spectrum of one audio channel (ie, the probe mic)
+          so that problems like probe leaks, hum, and noisy rooms can be seen
+          right away.
+
+ The work is split between the audio interrupt and loop():
+   * update() (audio interrupt): only copies each incoming block into a frame
+       buffer.  When a frame of SPECTRUM_NFFT samples is full, it switches to
+       the other buffer and increments a frame counter.  No math is done here.
+   * processNewFrame() (from loop()): copies out the most recent frame, applies a
+       Hann window, does the FFT, and updates the exponentially-averaged power
+       spectrum.  The frame counter is checked before and after the copy, so a
+       frame that was overwritten during the copy is thrown away (no locks needed).
+
+ The power spectrum is scaled so that a full-scale sine wave is -3.0 dB, which
+     is the same dBFS convention used by AudioCalcLeq_F32.  For display, the
+     spectrum can be summed into log-spaced bands (getBandLevels_dB()).
+
+ MIT License, Use at your own risk.
+*/
+
+#ifndef _AudioSpectrumMonitor_F32_h
+#define _AudioSpectrumMonitor_F32_h
+
+#include <arm_math.h>
+
+#define SPECTRUM_NFFT   1024                  //matches DPOAE_ASSUMED_NFFT (see DPOAE_Protocol.h)
+#define SPECTRUM_NBINS  (SPECTRUM_NFFT/2+1)   //number of bins from DC through Nyquist
+
+class AudioSpectrumMonitor_F32 : public AudioStream_F32 {
+  public:
+    AudioSpectrumMonitor_F32(const AudioSettings_F32 &settings) : AudioStream_F32(1, inputQueueArray) {
+      sample_rate_Hz = settings.sample_rate_Hz;
+      arm_rfft_fast_init_f32(&fft_inst, SPECTRUM_NFFT);
+      float sum_win = 0.0f, sum_win_sq = 0.0f;
+      for (int i=0; i < SPECTRUM_NFFT; i++) {
+        window[i] = 0.5f * (1.0f - cosf(2.0f * (float)M_PI * (float)i / (float)SPECTRUM_NFFT));  //Hann window
+        sum_win += window[i]; sum_win_sq += window[i]*window[i];
+      }
+      bin_scale = 2.0f / (sum_win * sum_win);  //so that a sine's peak bin equals its mean-square value
+      enbw_bins = SPECTRUM_NFFT * sum_win_sq / (sum_win * sum_win); //equivalent noise bandwidth (1.5 bins for Hann)
+      setAveragingTime_sec(0.5f);
+      clearAverage();
+    }
+
+    //called by the audio interrupt.  Just saves the samples.
+    virtual void update(void) {
+      audio_block_f32_t *block = AudioStream_F32::receiveReadOnly_f32();
+      if (block == NULL) { fill_count = 0; return; }  //a missing block (such as one rejected upstream) would leave a gap, so start the frame over
+      if (is_enabled) {
+        int n = min(block->length, SPECTRUM_NFFT - fill_count);
+        memcpy(frame_buff[fill_ind] + fill_count, block->data, n * sizeof(float));
+        fill_count += n;
+        if (fill_count >= SPECTRUM_NFFT) {
+          ready_ind = fill_ind;   //this frame is now the newest complete frame
+          fill_ind = 1 - fill_ind;
+          fill_count = 0;
+          frame_counter++;        //tells loop() that there is a new frame
+        }
+      }
+      AudioStream_F32::release(block);
+    }
+
+    //called from loop().  Returns true if a new frame was processed.
+    bool processNewFrame(void);
+
+    //settings
+    bool enable(bool _enable) { fill_count = 0; return is_enabled = _enable; }
+    bool isEnabled(void) { return is_enabled; }
+    float setAveragingTime_sec(float tau_sec) {
+      averaging_tau_sec = max(tau_sec, 0.001f);
+      float frame_sec = (float)SPECTRUM_NFFT / sample_rate_Hz;
+      avg_alpha = 1.0f - expf(-frame_sec / averaging_tau_sec);
+      return averaging_tau_sec;
+    }
+    bool setRunningMean(bool _use) { return use_running_mean = _use; }  //true = equal weight to every frame since clearAverage()
+    void clearAverage(void) { for (int i=0; i < SPECTRUM_NBINS; i++) avg_power[i] = 0.0f; n_averaged = 0; }
+
+    //results
+    float getBinWidth_Hz(void) { return sample_rate_Hz / (float)SPECTRUM_NFFT; }
+    int freqToBin(float freq_Hz) { return constrain((int)(freq_Hz / getBinWidth_Hz() + 0.5f), 0, SPECTRUM_NBINS-1); }
+    const float *getFramePower(void) { return frame_power; }    //power spectrum (mean-square per bin) of the latest frame
+    const float *getAveragePower(void) { return avg_power; }    //exponentially-averaged power spectrum
+    float getENBW_bins(void) { return enbw_bins; }
+    unsigned long getFrameCount(void) { return n_frames_processed; }
+    unsigned long getDroppedFrameCount(void) { return n_frames_dropped; }
+    unsigned long getAveragedFrameCount(void) { return n_averaged; }         //frames in the average since clearAverage()
+
+    //sum the averaged spectrum into n_bands log-spaced bands from f_min_Hz up to f_max_Hz.  Returns dBFS for each band.
+    int getBandLevels_dB(const int n_bands, const float f_min_Hz, const float f_max_Hz, float *band_dB);
+
+  private:
+    audio_block_f32_t *inputQueueArray[1];
+    float sample_rate_Hz = 44100.0f;
+    bool is_enabled = false;
+
+    //written by the audio interrupt
+    float frame_buff[2][SPECTRUM_NFFT];
+    volatile int fill_ind = 0, fill_count = 0, ready_ind = 0;
+    volatile unsigned long frame_counter = 0;
+
+    //only used by loop()
+    arm_rfft_fast_instance_f32 fft_inst;
+    float window[SPECTRUM_NFFT];
+    float work_buff[SPECTRUM_NFFT], fft_buff[SPECTRUM_NFFT];
+    float frame_power[SPECTRUM_NBINS], avg_power[SPECTRUM_NBINS];
+    float bin_scale = 1.0f, enbw_bins = 1.5f;
+    float averaging_tau_sec = 0.5f, avg_alpha = 0.05f;
+    bool use_running_mean = false;
+    unsigned long last_frame_counter = 0, n_frames_processed = 0, n_frames_dropped = 0, n_averaged = 0;
+};
+
+bool AudioSpectrumMonitor_F32::processNewFrame(void) {
+  unsigned long counter_before = frame_counter;
+  if (counter_before == last_frame_counter) return false;  //nothing new
+
+  //copy out the newest frame.  If the interrupt finished another frame while we were copying, the
+  //buffer that we were copying might have been overwritten, so throw it away and try again next time.
+  int ind = ready_ind;
+  memcpy(work_buff, frame_buff[ind], SPECTRUM_NFFT * sizeof(float));
+  if (frame_counter - counter_before > 0) { n_frames_dropped++; return false; }
+  n_frames_dropped += (counter_before - last_frame_counter - 1);  //any frames that we never got to
+  last_frame_counter = counter_before;
+
+  //window and FFT
+  arm_mult_f32(work_buff, window, work_buff, SPECTRUM_NFFT);
+  arm_rfft_fast_f32(&fft_inst, work_buff, fft_buff, 0);  //output is [DC, Nyquist, re1, im1, re2, im2, ...]
+
+  //compute the power in each bin
+  frame_power[0] = fft_buff[0]*fft_buff[0] * 0.5f * bin_scale;
+  frame_power[SPECTRUM_NBINS-1] = fft_buff[1]*fft_buff[1] * 0.5f * bin_scale;
+  arm_cmplx_mag_squared_f32(fft_buff+2, frame_power+1, SPECTRUM_NBINS-2);
+  for (int i=1; i < SPECTRUM_NBINS-1; i++) frame_power[i] *= bin_scale;
+
+  //update the average (start with the first frame rather than ramping up from zero)
+  float alpha = (n_averaged == 0) ? 1.0f : avg_alpha;
+  if (use_running_mean) alpha = 1.0f / (float)(n_averaged + 1);
+  for (int i=0; i < SPECTRUM_NBINS; i++) avg_power[i] += alpha * (frame_power[i] - avg_power[i]);
+  n_averaged++;
+  n_frames_processed++;
+  return true;
+}
+
+int AudioSpectrumMonitor_F32::getBandLevels_dB(const int n_bands, const float f_min_Hz, const float f_max_Hz, float *band_dB) {
+  if (n_bands < 1) return 0;
+  float log_step = logf(f_max_Hz / f_min_Hz) / (float)n_bands;
+  for (int Iband=0; Iband < n_bands; Iband++) {
+    int start_bin = freqToBin(f_min_Hz * expf(log_step * Iband));
+    int end_bin = max(start_bin+1, freqToBin(f_min_Hz * expf(log_step * (Iband+1))));  //at least one bin per band
+    float sum = 0.0f;
+    for (int i=start_bin; (i < end_bin) && (i < SPECTRUM_NBINS); i++) sum += avg_power[i];
+    band_dB[Iband] = 10.0f*log10f(max(sum / enbw_bins, 1.0e-12f));  //correct for the window's noise bandwidth
+  }
+  return n_bands;
+}
+
+#endif
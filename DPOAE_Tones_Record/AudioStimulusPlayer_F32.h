@@ -0,0 +1,292 @@
+/*
+ AudioStimulusPlayer_F32.h
+
+ Purpose: Play precomputed stimuli (one buffer per test step) from RAM, or from the
+          PSRAM of a Teensy 4.1, instead of computing them sample by sample.
+
+ There are two parts:
+   * Stimulus_Cache holds the buffers.  A buffer is either synthesized when the
+       protocol is loaded (synthTones(): one tone per channel, as an integer
+       number of cycles so that it loops without a seam) or loaded from a WAV
+       file on the SD card (loadWav(): any stimulus, such as multitones, chirps,
+       or calibrated clicks).  All of the math (ie, the sinf()) is done here, in loop().
+   * AudioStimulusPlayer_F32 is the audio object.  Its update() only copies samples
+       out of the buffer and scales them by each channel's gain.  A new buffer (from
+       play()) always starts at its first sample at the start of the next audio block,
+       so switching steps is instant and the start is known to the sample (see
+       getStartBlock()).  Gain changes are ramped across one block so that they don't click.
+
+ With the tones on FFT bins (see dpoae_planFrequencies() in DPOAE_Protocol.h), each tone
+     is a whole number of cycles in DPOAE_ASSUMED_NFFT samples, so that is the loop length.
+
+ When it is not playing, no audio blocks are transmitted (so it costs nothing).
+
+ Do not free (or reload) a buffer while a player is playing it.  Stop the player first.
+ In the DPOAE test, the player is only driven from the audio interrupt, by Tone_Manager::applyParams().
+
+ MIT License, Use at your own risk.
+*/
+
+#ifndef _AudioStimulusPlayer_F32_h
+#define _AudioStimulusPlayer_F32_h
+
+#include "Fixed_Format.h"
+
+#define STIM_MAX_CHAN     2    //outputs of the player (one per speaker of a probe)
+#define STIM_CACHE_SLOTS  16   //most buffers in the cache
+
+#if defined(ARDUINO_TEENSY41)
+extern "C" uint8_t external_psram_size;  //size of the PSRAM (in MB), from the Teensy core
+#endif
+
+class Stimulus_Buffer {
+  public:
+    float *data = NULL;                     //planar: channel c starts at data + c*n_samples
+    int n_chan = 0, n_samples = 0;
+    float freq_Hz[STIM_MAX_CHAN] = {0};     //frequency of each synthesized tone (0 if loaded from a file)
+    bool in_psram = false;
+    const float *chan(int c) const { return data + min(c, n_chan-1) * n_samples; }  //a mono buffer plays on every channel
+};
+
+class Stimulus_Cache {
+  public:
+    Stimulus_Cache(void) {};
+
+    bool prefer_psram = true;   //put the buffers in PSRAM, if there is any (Teensy 4.1)
+
+    //synthesize one integer-period tone per channel (unit amplitude).  Returns the slot, or -1 on error.
+    int synthTones(int slot, float fs_Hz, int n_samples, int n_chan, const float *freq_Hz);
+
+    //load a WAV file (16-bit PCM or 32-bit float, up to STIM_MAX_CHAN channels).  Returns the slot, or -1 on error.
+    int loadWav(int slot, SdFs *sd, const char *fname, int max_samples);
+
+    int findTones(float f1_Hz, float f2_Hz) const;   //the slot with these two tones, or -1
+    const Stimulus_Buffer *getSlot(int slot) const { return isValidSlot(slot) && (slots[slot].data != NULL) ? &slots[slot] : NULL; }
+    void freeSlot(int slot);
+    void freeAll(void) { for (int i=0; i < STIM_CACHE_SLOTS; i++) freeSlot(i); }
+    uint32_t getBytesUsed(bool psram) const;
+    void printSlots(Print *s) const;
+
+  private:
+    Stimulus_Buffer slots[STIM_CACHE_SLOTS];
+    static bool isValidSlot(int slot) { return (slot >= 0) && (slot < STIM_CACHE_SLOTS); }
+    bool allocSlot(int slot, int n_chan, int n_samples);
+};
+
+class AudioStimulusPlayer_F32 : public AudioStream_F32 {
+  public:
+    AudioStimulusPlayer_F32(const AudioSettings_F32 &settings) : AudioStream_F32(0, NULL) {
+      block_size = settings.audio_block_samples;
+      for (int c=0; c < STIM_MAX_CHAN; c++) { gain[c] = 0.0f; cur_gain[c] = 0.0f; }
+    }
+
+    //start the buffer at its first sample at the start of the next audio block.  It loops until stopped, if looping.
+    void play(const Stimulus_Buffer *buf, bool looping = true) {
+      if ((buf == NULL) || (buf->data == NULL) || (buf->n_samples < 1)) { stop(); return; }
+      next_looping = looping;
+      next_buf = buf;
+      next_pending = true;   //set last, so update() sees a complete request
+    }
+    void stop(void) { next_pending = false; stop_pending = true; }
+    bool isPlaying(void) const { return (cur_buf != NULL) || next_pending; }
+    const Stimulus_Buffer *getBuffer(void) const { return next_pending ? next_buf : cur_buf; }
+
+    //the gain of each output (linear).  The change is ramped across the next block.
+    float setGain(int chan, float _gain) { if ((chan >= 0) && (chan < STIM_MAX_CHAN)) gain[chan] = _gain; return _gain; }
+
+    uint32_t getBlockCount(void) const { return block_count; }   //blocks since startup
+    uint32_t getStartBlock(void) const { return start_block; }   //block at which the current buffer started (at its first sample)
+
+    virtual void update(void);
+
+  private:
+    int block_size = 128;
+    const Stimulus_Buffer * volatile next_buf = NULL;
+    volatile bool next_pending = false, next_looping = true, stop_pending = false;
+    const Stimulus_Buffer *cur_buf = NULL;
+    bool looping = true;
+    int pos = 0;
+    float gain[STIM_MAX_CHAN], cur_gain[STIM_MAX_CHAN];
+    volatile uint32_t block_count = 0, start_block = 0;
+};
+
+// //////////////////////////////////////////////////// Stimulus_Cache
+
+bool Stimulus_Cache::allocSlot(int slot, int n_chan, int n_samples) {
+  freeSlot(slot);
+  size_t n_bytes = (size_t)n_chan * (size_t)n_samples * sizeof(float);
+  Stimulus_Buffer &buf = slots[slot];
+  #if defined(ARDUINO_TEENSY41)
+    if (prefer_psram && (external_psram_size > 0)) {
+      buf.data = (float *)extmem_malloc(n_bytes);
+      buf.in_psram = (buf.data != NULL);
+    }
+  #endif
+  if (buf.data == NULL) { buf.data = (float *)malloc(n_bytes); buf.in_psram = false; }
+  if (buf.data == NULL) {
+    printlnf(Serial, "Stimulus_Cache: allocSlot: *** ERROR ***: could not allocate %d bytes for slot %d", (int)n_bytes, slot);
+    return false;
+  }
+  buf.n_chan = n_chan; buf.n_samples = n_samples;
+  for (int c=0; c < STIM_MAX_CHAN; c++) buf.freq_Hz[c] = 0.0f;
+  return true;
+}
+
+void Stimulus_Cache::freeSlot(int slot) {
+  if (!isValidSlot(slot)) return;
+  Stimulus_Buffer &buf = slots[slot];
+  if (buf.data != NULL) {
+    #if defined(ARDUINO_TEENSY41)
+      if (buf.in_psram) { extmem_free(buf.data); } else { free(buf.data); }
+    #else
+      free(buf.data);
+    #endif
+  }
+  buf.data = NULL; buf.n_chan = 0; buf.n_samples = 0; buf.in_psram = false;
+}
+
+int Stimulus_Cache::synthTones(int slot, float fs_Hz, int n_samples, int n_chan, const float *freq_Hz) {
+  if (!isValidSlot(slot) || (n_samples < 1) || (n_chan < 1) || (n_chan > STIM_MAX_CHAN)) {
+    printlnf(Serial, "Stimulus_Cache: synthTones: *** ERROR ***: bad slot (%d), length (%d), or channels (%d)", slot, n_samples, n_chan);
+    return -1;
+  }
+  if (!allocSlot(slot, n_chan, n_samples)) return -1;
+  Stimulus_Buffer &buf = slots[slot];
+  for (int c=0; c < n_chan; c++) {
+    //use a whole number of cycles, so that the buffer loops without a seam
+    float cycles = freq_Hz[c] * (float)n_samples / fs_Hz;
+    int n_cycles = (int)(cycles + 0.5f);
+    if (fabsf(cycles - (float)n_cycles) > 0.001f) {
+      printlnf(Serial, "Stimulus_Cache: synthTones: slot %d: %.2f Hz is not on a bin, so it will play at %.2f Hz", slot, freq_Hz[c], (float)n_cycles * fs_Hz / (float)n_samples);
+    }
+    buf.freq_Hz[c] = freq_Hz[c];  //remember what was asked for, so that findTones() matches the protocol
+    float *data = buf.data + c*n_samples;
+    for (int i=0; i < n_samples; i++) data[i] = sinf(2.0f * (float)M_PI * (float)(((long)n_cycles * i) % n_samples) / (float)n_samples);
+  }
+  return slot;
+}
+
+int Stimulus_Cache::loadWav(int slot, SdFs *sd, const char *fname, int max_samples) {
+  if (!isValidSlot(slot)) {
+    printlnf(Serial, "Stimulus_Cache: loadWav: *** ERROR ***: slot %d is out of range", slot);
+    return -1;
+  }
+  FsFile file = sd->open(fname, O_RDONLY);
+  if (!file) {
+    printlnf(Serial, "Stimulus_Cache: loadWav: *** ERROR ***: could not open %s", fname);
+    return -1;
+  }
+
+  //find the format and the data (walk through the chunks of the RIFF file)
+  uint8_t hdr[16];
+  int format = 0, n_chan = 0, bits = 0;
+  uint32_t data_bytes = 0;
+  bool found_data = false;
+  if ((file.read(hdr, 12) != 12) || (memcmp(hdr, "RIFF", 4) != 0) || (memcmp(hdr+8, "WAVE", 4) != 0)) {
+    printlnf(Serial, "Stimulus_Cache: loadWav: *** ERROR ***: %s is not a WAV file", fname);
+    file.close(); return -1;
+  }
+  while (file.read(hdr, 8) == 8) {
+    uint32_t chunk_bytes = hdr[4] | (hdr[5] << 8) | ((uint32_t)hdr[6] << 16) | ((uint32_t)hdr[7] << 24);
+    if (memcmp(hdr, "fmt ", 4) == 0) {
+      uint8_t fmt[16];
+      if (file.read(fmt, 16) != 16) break;
+      format = fmt[0] | (fmt[1] << 8); n_chan = fmt[2] | (fmt[3] << 8); bits = fmt[14] | (fmt[15] << 8);
+      file.seekSet(file.curPosition() + chunk_bytes - 16 + (chunk_bytes & 1));
+    } else if (memcmp(hdr, "data", 4) == 0) {
+      data_bytes = chunk_bytes; found_data = true;
+      break;
+    } else {
+      file.seekSet(file.curPosition() + chunk_bytes + (chunk_bytes & 1));
+    }
+  }
+  bool is_pcm16 = (format == 1) && (bits == 16), is_float = (format == 3) && (bits == 32);
+  if (!found_data || !(is_pcm16 || is_float) || (n_chan < 1) || (n_chan > STIM_MAX_CHAN)) {
+    printlnf(Serial, "Stimulus_Cache: loadWav: *** ERROR ***: %s must be 16-bit PCM or 32-bit float with 1 to %d channels", fname, STIM_MAX_CHAN);
+    file.close(); return -1;
+  }
+  if (data_bytes == 0) data_bytes = (uint32_t)(file.fileSize() - file.curPosition());  //the header was never finished
+  int n_samples = min((int)(data_bytes / (uint32_t)(n_chan * bits / 8)), max_samples);
+  if ((n_samples < 1) || !allocSlot(slot, n_chan, n_samples)) { file.close(); return -1; }
+
+  //read the samples (interleaved in the file, planar in the buffer)
+  Stimulus_Buffer &buf = slots[slot];
+  uint8_t in[4*STIM_MAX_CHAN];
+  const int frame_bytes = n_chan * bits / 8;
+  for (int i=0; i < n_samples; i++) {
+    if (file.read(in, frame_bytes) != frame_bytes) { buf.n_samples = i; break; }
+    for (int c=0; c < n_chan; c++) {
+      if (is_float) { memcpy(buf.data + c*n_samples + i, in + 4*c, 4); }
+      else { buf.data[c*n_samples + i] = (float)(int16_t)(in[2*c] | (in[2*c+1] << 8)) * (1.0f/32768.0f); }
+    }
+  }
+  file.close();
+  printlnf(Serial, "Stimulus_Cache: loaded %s into slot %d (%d channels, %d samples, %s)", fname, slot, buf.n_chan, buf.n_samples, buf.in_psram ? "PSRAM" : "RAM");
+  return slot;
+}
+
+int Stimulus_Cache::findTones(float f1_Hz, float f2_Hz) const {
+  for (int i=0; i < STIM_CACHE_SLOTS; i++) {
+    const Stimulus_Buffer &buf = slots[i];
+    if ((buf.data == NULL) || (buf.n_chan < 2)) continue;
+    if ((fabsf(buf.freq_Hz[0] - f1_Hz) < 0.01f) && (fabsf(buf.freq_Hz[1] - f2_Hz) < 0.01f)) return i;
+  }
+  return -1;
+}
+
+uint32_t Stimulus_Cache::getBytesUsed(bool psram) const {
+  uint32_t n_bytes = 0;
+  for (int i=0; i < STIM_CACHE_SLOTS; i++) {
+    if ((slots[i].data != NULL) && (slots[i].in_psram == psram)) n_bytes += (uint32_t)slots[i].n_chan * (uint32_t)slots[i].n_samples * sizeof(float);
+  }
+  return n_bytes;
+}
+
+void Stimulus_Cache::printSlots(Print *s) const {
+  printlnf(*s, "Stimulus_Cache: %lu bytes in RAM, %lu bytes in PSRAM", (unsigned long)getBytesUsed(false), (unsigned long)getBytesUsed(true));
+  for (int i=0; i < STIM_CACHE_SLOTS; i++) {
+    const Stimulus_Buffer &buf = slots[i];
+    if (buf.data == NULL) continue;
+    printlnf(*s, "    slot %d: %d channels, %d samples, %s, tones = %.1f Hz, %.1f Hz", i, buf.n_chan, buf.n_samples,
+             buf.in_psram ? "PSRAM" : "RAM", buf.freq_Hz[0], (buf.n_chan > 1) ? buf.freq_Hz[1] : 0.0f);
+  }
+}
+
+// //////////////////////////////////////////////////// AudioStimulusPlayer_F32
+
+void AudioStimulusPlayer_F32::update(void) {
+  block_count++;
+
+  //take any new request from loop() (only here, at the block boundary)
+  if (stop_pending) { cur_buf = NULL; stop_pending = false; }
+  if (next_pending) {
+    cur_buf = next_buf; looping = next_looping; pos = 0;
+    start_block = block_count;
+    next_pending = false;
+  }
+  if (cur_buf == NULL) return;
+
+  const int n = cur_buf->n_samples;
+  int end_pos = pos;
+  for (int c=0; c < STIM_MAX_CHAN; c++) {
+    audio_block_f32_t *block = AudioStream_F32::allocate_f32();
+    if (block == NULL) return;
+    const float *src = cur_buf->chan(c);
+    const float g0 = cur_gain[c], dg = (gain[c] - cur_gain[c]) / (float)block_size;
+    int p = pos;
+    for (int i=0; i < block_size; i++) {
+      float x = 0.0f;
+      if (p < n) { x = src[p]; if ((++p >= n) && looping) p = 0; }
+      block->data[i] = (g0 + dg * (float)(i+1)) * x;
+    }
+    cur_gain[c] = gain[c];
+    end_pos = p;
+    block->length = block_size;
+    AudioStream_F32::transmit(block, c);
+    AudioStream_F32::release(block);
+  }
+  pos = end_pos;
+  if (pos >= n) cur_buf = NULL;  //it wasn't looping, and it has finished
+}
+
+#endif
@@ -0,0 +1,101 @@
+/*
+ AudioSynthChirp_F32.h
+
+ Purpose: Generate a repeating, logarithmic sine sweep (a "chirp").  Used as the
+          broadband stimulus for the probe-fit check (see Probe_Check.h).
+
+ Each sweep goes from f_start_Hz to f_end_Hz over sweep_samples.  A log sweep puts
+     equal energy into each octave, so its averaged spectrum is smooth and is easy
+     to compare against a reference.  The start and end of each sweep are tapered
+     so that the repeats do not click.
+
+ When it is not playing, no audio blocks are transmitted (so it costs nothing).
+
+ The settings from loop() (setSweep(), amplitude(), play()) are posted to a mailbox
+     (see Param_Mailbox.h) and all take effect together at the start of the next block.
+
+ MIT License, Use at your own risk.
+*/
+
+#ifndef _AudioSynthChirp_F32_h
+#define _AudioSynthChirp_F32_h
+
+#include "Param_Mailbox.h"
+
+#define CHIRP_TAPER_SAMPLES 64   //length of the raised-cosine taper at each end of the sweep
+
+class Chirp_Params {
+  public:
+    Chirp_Params(void) {};
+    float amp = 0.1f;
+    int sweep_samples = 4096;
+    float dphase_start = 0.0f, dphase_mult = 1.0f;
+    bool is_playing = false;
+    uint32_t start_count = 0;   //incremented each time that it starts playing
+};
+
+class AudioSynthChirp_F32 : public AudioStream_F32 {
+  public:
+    AudioSynthChirp_F32(const AudioSettings_F32 &settings) : AudioStream_F32(0, NULL) {
+      sample_rate_Hz = settings.sample_rate_Hz;
+      block_size = settings.audio_block_samples;
+      setSweep(150.0f, 12000.0f, 4096);
+    }
+
+    //set the sweep (only takes effect if not currently playing)
+    void setSweep(float f_start_Hz, float f_end_Hz, int _sweep_samples) {
+      Chirp_Params p = mailbox.latest();
+      if (p.is_playing) return;
+      p.sweep_samples = max(_sweep_samples, 4*CHIRP_TAPER_SAMPLES);
+      p.dphase_start = 2.0f * (float)M_PI * f_start_Hz / sample_rate_Hz;  //phase increment at the start of the sweep
+      p.dphase_mult = powf(f_end_Hz / f_start_Hz, 1.0f / (float)p.sweep_samples); //how much the frequency grows each sample
+      mailbox.post(p);
+    }
+    float amplitude(float _amp) { Chirp_Params p = mailbox.latest(); p.amp = _amp; mailbox.post(p); return _amp; }
+    void play(bool _play) {
+      Chirp_Params p = mailbox.latest();
+      if (_play && !p.is_playing) p.start_count++;  //always start at the start of a sweep
+      p.is_playing = _play;
+      mailbox.post(p);
+    }
+    bool isPlaying(void) { return mailbox.latest().is_playing; }
+
+    virtual void update(void) {
+      Chirp_Params p;
+      if (mailbox.take(&p)) {
+        if (p.start_count != cur.start_count) { sample_ind = 0; phase = 0.0f; dphase = p.dphase_start; }
+        cur = p;
+      }
+      if (!cur.is_playing) return;
+      const float amp = cur.amp, dphase_start = cur.dphase_start, dphase_mult = cur.dphase_mult;
+      const int sweep_samples = cur.sweep_samples;
+      audio_block_f32_t *block = AudioStream_F32::allocate_f32();
+      if (block == NULL) return;
+      for (int i=0; i < block_size; i++) {
+        //taper the start and end of the sweep
+        float gain = amp;
+        int dist_to_end = min(sample_ind, sweep_samples - 1 - sample_ind);
+        if (dist_to_end < CHIRP_TAPER_SAMPLES) gain *= 0.5f * (1.0f - cosf((float)M_PI * (float)dist_to_end / (float)CHIRP_TAPER_SAMPLES));
+
+        block->data[i] = gain * sinf(phase);
+
+        //step forward
+        phase += dphase; if (phase > 2.0f*(float)M_PI) phase -= 2.0f*(float)M_PI;
+        dphase *= dphase_mult;
+        if (++sample_ind >= sweep_samples) { sample_ind = 0; phase = 0.0f; dphase = dphase_start; }  //start the next sweep
+      }
+      block->length = block_size;
+      AudioStream_F32::transmit(block);
+      AudioStream_F32::release(block);
+    }
+
+  private:
+    float sample_rate_Hz = 44100.0f;
+    int block_size = 128;
+    Param_Mailbox<Chirp_Params> mailbox;
+    Chirp_Params cur;   //only used by the audio interrupt
+    int sample_ind = 0;
+    float phase = 0.0f, dphase = 0.0f;
+};
+
+#endif
@@ -0,0 +1,149 @@
+/*
+ Command_Line.h
+
+ Purpose: Parse named, line-based commands (with numeric arguments) as an
+          alternative to the single-character commands.
+
+ A command line starts with '$' and ends with a newline.  It can hold one
+     command or a batch of commands separated by ';'.  Each command is a name
+     followed by zero or more numbers, separated by spaces (or commas).  Examples:
+
+        $step 3
+        $spl 65 55; cal 1 0.5; cal 2 -1.2; step 1
+
+ The whole line is parsed (and checked against the table of known commands)
+     before anything is executed.  If any command in the batch is bad, none of
+     them are executed, so a batch is applied all-or-nothing.  (The sketch's
+     SerialManager also holds the tone changes until the whole batch has run, and
+     wants any command that starts a test to be the last one in the batch.)
+
+ The characters are fed in one at a time (via addChar()), so it works the same
+     whether the bytes arrive over USB Serial or over BLE.  All storage is
+     fixed-size.  No heap is used.
+
+ MIT License, Use at your own risk.
+*/
+
+#ifndef _Command_Line_h
+#define _Command_Line_h
+
+#include <stdlib.h>
+#include <string.h>
+
+#define CMDLINE_START_CHAR    '$'
+#define CMDLINE_MAX_LEN       256  //longest command line (including all commands in a batch)
+#define CMDLINE_MAX_NAME_LEN  16   //longest command name (including the null terminator)
+#define CMDLINE_MAX_ARGS      4    //most numeric arguments for one command
+#define CMDLINE_MAX_BATCH     16   //most commands in one line
+
+//describes one of the commands that a sketch will accept
+struct Command_Def {
+  const char *name;
+  int min_args;
+  int max_args;
+  const char *help;
+};
+
+//one command that has been parsed from the line
+struct Parsed_Command {
+  int def_ind = -1;                //which entry in the table of Command_Defs
+  int n_args = 0;
+  float args[CMDLINE_MAX_ARGS];
+};
+
+class Command_Line {
+  public:
+    Command_Line(const Command_Def *_defs, const int _n_defs) : defs(_defs), n_defs(_n_defs) {};
+
+    //start capturing a new line (call this upon receiving CMDLINE_START_CHAR)
+    void begin(void) { len = 0; line[0] = '\0'; is_capturing = true; }
+    bool isCapturing(void) { return is_capturing; }
+
+    //add a character to the line.  Returns true when the line is complete and ready to parse.
+    bool addChar(const char c) {
+      if (!is_capturing) return false;
+      if ((c == '\n') || (c == '\r')) { is_capturing = false; return (len > 0); }
+      if (len < (CMDLINE_MAX_LEN-1)) { line[len++] = c; line[len] = '\0'; } else { overflowed = true; }
+      return false;
+    }
+
+    //parse the captured line into cmds[].  Returns the number of commands, or -1 if there was an error
+    //(in which case getErrorMessage() says what was wrong)
+    int parse(Parsed_Command *cmds, const int max_cmds);
+    const char *getLine(void) { return line; }
+    const char *getErrorMessage(void) { return err_msg; }
+    const Command_Def &getDef(const Parsed_Command &cmd) { return defs[cmd.def_ind]; }
+
+    //print the table of commands
+    void printHelp(Print *out) {
+      for (int i=0; i < n_defs; i++) { out->print("  $"); out->print(defs[i].name); out->print(" "); out->println(defs[i].help); }
+    }
+
+  private:
+    const Command_Def *defs;
+    const int n_defs;
+    char line[CMDLINE_MAX_LEN];
+    int len = 0;
+    bool is_capturing = false;
+    bool overflowed = false;
+    char err_msg[64] = "";
+
+    int findDef(const char *name) {
+      for (int i=0; i < n_defs; i++) if (strcmp(defs[i].name, name) == 0) return i;
+      return -1;
+    }
+    static bool isSeparator(const char c) { return (c == ' ') || (c == ',') || (c == '\t'); }
+};
+
+int Command_Line::parse(Parsed_Command *cmds, const int max_cmds) {
+  if (overflowed) { overflowed = false; snprintf(err_msg, sizeof(err_msg), "line longer than %d characters", CMDLINE_MAX_LEN-1); return -1; }
+
+  int n_cmds = 0;
+  char *p = line;
+  while (*p != '\0') {
+    //find the end of this command (a ';' or the end of the line)
+    char *end = strchr(p, ';');
+    if (end != NULL) *end = '\0';
+
+    //skip leading whitespace and get the command name
+    while (isSeparator(*p)) p++;
+    if (*p != '\0') {
+      if (n_cmds >= max_cmds) { snprintf(err_msg, sizeof(err_msg), "more than %d commands in one line", max_cmds); return -1; }
+      char name[CMDLINE_MAX_NAME_LEN]; int name_len = 0;
+      while ((*p != '\0') && !isSeparator(*p)) {
+        if (name_len < (CMDLINE_MAX_NAME_LEN-1)) name[name_len++] = *p;
+        p++;
+      }
+      name[name_len] = '\0';
+      Parsed_Command &cmd = cmds[n_cmds];
+      cmd.def_ind = findDef(name);
+      if (cmd.def_ind < 0) { snprintf(err_msg, sizeof(err_msg), "unknown command '%s'", name); return -1; }
+
+      //get the numeric arguments
+      cmd.n_args = 0;
+      while (true) {
+        while (isSeparator(*p)) p++;
+        if (*p == '\0') break;
+        char *num_end;
+        float val = strtof(p, &num_end);
+        if (num_end == p) { snprintf(err_msg, sizeof(err_msg), "'%s': bad number '%.8s'", name, p); return -1; }
+        if (cmd.n_args >= CMDLINE_MAX_ARGS) { snprintf(err_msg, sizeof(err_msg), "'%s': too many arguments", name); return -1; }
+        cmd.args[cmd.n_args++] = val;
+        p = num_end;
+      }
+      const Command_Def &def = defs[cmd.def_ind];
+      if ((cmd.n_args < def.min_args) || (cmd.n_args > def.max_args)) {
+        snprintf(err_msg, sizeof(err_msg), "'%s' needs %d to %d arguments", name, def.min_args, def.max_args);
+        return -1;
+      }
+      n_cmds++;
+    }
+
+    //move on to the next command
+    if (end == NULL) break;
+    p = end + 1;
+  }
+  return n_cmds;
+}
+
+#endif
@@ -0,0 +1,213 @@
+/*
+ Compressed_Transfer.h
+
+ Purpose: Send a file from the SD card to the PC with lossless compression, so that
+          the recordings move over the USB Serial link several times faster than the
+          raw transfer of SdFileTransfer::sendFile_interactive() (the 'x' command).
+
+ Codec "d16" (for 16-bit PCM, such as our WAV files):
+     The file is read as 16-bit samples.  Each sample is predicted by the previous
+     sample of the same channel (the stride is the number of channels, read from the
+     WAV header).  The prediction errors are zigzag encoded (so small negative numbers
+     become small positive numbers) and packed with just enough bits for the largest
+     one in the chunk.  Quiet ear-canal recordings need only a few bits per sample.
+
+     Each chunk of up to 512 bytes of the file is sent as:
+         byte 0:     mode (0 = raw bytes follow, 1 = packed prediction errors follow)
+         byte 1:     bits per sample (mode 1 only; 0 means that every error was zero)
+         bytes 2-3:  number of bytes of the original file in this chunk (uint16, little-endian)
+         payload:    mode 0: the original bytes.  Mode 1: the packed errors, LSB first.
+     A chunk is sent raw whenever packing wouldn't make it smaller.  The predictor
+     carries over from one chunk to the next (raw chunks included).
+
+ Codec "raw": the bytes of the file, exactly as sent by 'x'.
+
+ Protocol (the codec is chosen for each transfer; see tympanSdFileTransferFunctions.py):
+     PC sends 'k'.                        Tympan replies with one line listing the codecs.
+     PC sends "<filename>,<codec>[,<offset>]".  Tympan replies with one line (or an error).
+                                          Tympan sends "<n_bytes>,<codec>,<stride>" as one line.
+                                          Tympan sends a one-line start prompt.
+                                          Tympan sends the chunks (or the raw bytes).
+                                          Tympan sends one final line.
+ If the PC asks for a codec that the Tympan doesn't know, "raw" is used (and reported
+ on the "<n_bytes>,<codec>,<stride>" line), so older PC scripts still work.
+
+ To resume an interrupted transfer, the PC gives the byte offset to start from (it
+ must be even).  Then n_bytes is the number of bytes from the offset to the end of
+ the file, and the predictor starts fresh at the offset.
+
+ MIT License, Use at your own risk.
+*/
+
+#ifndef _Compressed_Transfer_h
+#define _Compressed_Transfer_h
+
+#include "Fixed_Format.h"
+
+#define COMP_XFER_CHUNK_BYTES   512     //bytes of the original file per chunk (must be even)
+#define COMP_XFER_MAX_STRIDE    8       //most channels for the predictor
+#define COMP_XFER_FNAME_LEN     64
+#define COMP_XFER_MAX_BITS      17      //the difference of two int16 values needs 17 bits after zigzag
+
+class SdFileTransfer_Compressed {
+  public:
+    SdFileTransfer_Compressed(SdFs *_sd, Stream *_serial) : sd(_sd), serial(_serial) {};
+
+    enum CODEC { CODEC_RAW=0, CODEC_D16 };
+
+    //run the whole transfer (blocks until done, like SdFileTransfer::sendFile_interactive)
+    bool sendFile_interactive(void);
+
+    unsigned long timeout_millis = 5000;  //how long to wait for the file name from the PC
+
+    //compress one chunk (exposed for testing).  Returns the number of bytes written to out.
+    int encodeChunk(const uint8_t *in, int n_bytes, uint8_t *out);
+    void resetPredictor(int _stride) { stride = constrain(_stride, 1, COMP_XFER_MAX_STRIDE); for (int i=0; i < COMP_XFER_MAX_STRIDE; i++) history[i] = 0; phase = 0; }
+
+  private:
+    SdFs *sd;
+    Stream *serial;
+    int stride = 1, phase = 0;
+    int16_t history[COMP_XFER_MAX_STRIDE];
+    uint8_t in_buff[COMP_XFER_CHUNK_BYTES];
+    uint8_t out_buff[4 + (COMP_XFER_CHUNK_BYTES/2*COMP_XFER_MAX_BITS + 7)/8];
+    uint32_t zz_buff[COMP_XFER_CHUNK_BYTES/2];
+
+    int readLine(char *buff, int len);
+    static int getWavChannels(FsFile &file);
+    void updateHistory(const uint8_t *in, int n_samples);
+};
+
+bool SdFileTransfer_Compressed::sendFile_interactive(void) {
+  serial->println("SdFileTransfer_Compressed: send <filename>,<codec>[,<offset>] (codecs: raw, d16)");
+
+  //get the file name and the requested codec
+  char line[COMP_XFER_FNAME_LEN];
+  if (readLine(line, COMP_XFER_FNAME_LEN) <= 0) {
+    serial->println("SdFileTransfer_Compressed: *** ERROR ***: no file name received");
+    return false;
+  }
+  int codec = CODEC_RAW;
+  uint32_t offset = 0;
+  char *comma = strchr(line, ',');
+  if (comma != NULL) {
+    *comma = '\0';
+    char *codec_name = comma+1, *comma2 = strchr(codec_name, ',');
+    if (comma2 != NULL) { *comma2 = '\0'; offset = strtoul(comma2+1, NULL, 10) & ~1UL; }  //keep it even, so that the samples stay aligned
+    if (strcmp(codec_name, "d16") == 0) codec = CODEC_D16;
+  }
+
+  FsFile file = sd->open(line, O_RDONLY);
+  if (!file) {
+    printlnf(*serial, "SdFileTransfer_Compressed: *** ERROR ***: could not open %s", line);
+    return false;
+  }
+  uint32_t file_bytes = (uint32_t)file.fileSize();
+  offset = min(offset, file_bytes);
+  uint32_t n_bytes = file_bytes - offset;
+  resetPredictor((codec == CODEC_D16) ? getWavChannels(file) : 1);
+  file.seekSet(offset);
+  printlnf(*serial, "SdFileTransfer_Compressed: sending %s", line);
+  printlnf(*serial, "%lu,%s,%d", (unsigned long)n_bytes, (codec == CODEC_D16) ? "d16" : "raw", stride);
+  serial->println("SdFileTransfer_Compressed: starting transfer...");
+
+  //send the file, one chunk at a time
+  uint32_t bytes_sent = 0, bytes_left = n_bytes;
+  while (bytes_left > 0) {
+    int n = file.read(in_buff, min(bytes_left, (uint32_t)COMP_XFER_CHUNK_BYTES));
+    if (n <= 0) break;  //the file was shorter than it claimed?  The PC will time out.
+    bytes_left -= n;
+    if (codec == CODEC_D16) {
+      int n_out = encodeChunk(in_buff, n, out_buff);
+      serial->write(out_buff, n_out); bytes_sent += n_out;
+    } else {
+      serial->write(in_buff, n); bytes_sent += n;
+    }
+  }
+  file.close();
+  serial->println();
+  printlnf(*serial, "SdFileTransfer_Compressed: transfer complete: sent %lu bytes for %lu bytes of file", (unsigned long)bytes_sent, (unsigned long)n_bytes);
+  return (bytes_left == 0);
+}
+
+int SdFileTransfer_Compressed::encodeChunk(const uint8_t *in, int n_bytes, uint8_t *out) {
+  out[2] = (uint8_t)(n_bytes & 0xFF); out[3] = (uint8_t)(n_bytes >> 8);
+
+  //an odd number of bytes only happens at the end of the file, so just send it
+  if ((n_bytes % 2) != 0) {
+    out[0] = 0; out[1] = 0;
+    memcpy(out+4, in, n_bytes);
+    return 4 + n_bytes;
+  }
+
+  //prediction errors (zigzag encoded) and the number of bits needed
+  int n_samples = n_bytes / 2, p = phase;
+  uint32_t all_bits = 0;
+  int16_t hist[COMP_XFER_MAX_STRIDE];
+  for (int i=0; i < stride; i++) hist[i] = history[i];
+  for (int i=0; i < n_samples; i++) {
+    int16_t x = (int16_t)(in[2*i] | (in[2*i+1] << 8));
+    int32_t err = (int32_t)x - (int32_t)hist[p];
+    hist[p] = x; p = (p + 1) % stride;
+    zz_buff[i] = (err >= 0) ? ((uint32_t)err << 1) : (((uint32_t)(-err) << 1) - 1);
+    all_bits |= zz_buff[i];
+  }
+  int bits = 0;
+  while (all_bits != 0) { bits++; all_bits >>= 1; }
+  int n_packed = (n_samples * bits + 7) / 8;
+
+  if (n_packed >= n_bytes) {
+    //packing doesn't help, so send it raw
+    out[0] = 0; out[1] = 0;
+    memcpy(out+4, in, n_bytes);
+  } else {
+    out[0] = 1; out[1] = (uint8_t)bits;
+    uint8_t *dest = out + 4;
+    memset(dest, 0, n_packed);
+    uint32_t bit_pos = 0;
+    for (int i=0; i < n_samples; i++) {
+      uint32_t val = zz_buff[i];
+      for (int b=0; b < bits; b++, bit_pos++) {
+        if (val & (1UL << b)) dest[bit_pos >> 3] |= (uint8_t)(1 << (bit_pos & 7));
+      }
+    }
+  }
+  updateHistory(in, n_samples);  //the PC updates its predictor the same way, raw or packed
+  return 4 + ((out[0] == 1) ? n_packed : n_bytes);
+}
+
+void SdFileTransfer_Compressed::updateHistory(const uint8_t *in, int n_samples) {
+  for (int i=0; i < n_samples; i++) {
+    history[phase] = (int16_t)(in[2*i] | (in[2*i+1] << 8));
+    phase = (phase + 1) % stride;
+  }
+}
+
+//read one line from the serial link (without the end-of-line).  Returns the length, or 0 on timeout.
+int SdFileTransfer_Compressed::readLine(char *buff, int len) {
+  int n = 0;
+  unsigned long start_millis = millis();
+  while ((millis() - start_millis) < timeout_millis) {
+    if (serial->available() == 0) continue;
+    char c = (char)serial->read();
+    if ((c == '\n') || (c == '\r')) {
+      if (n == 0) continue;  //skip any leftover end-of-line from the 'k'
+      break;
+    }
+    if (n < len-1) buff[n++] = c;
+  }
+  buff[n] = '\0';
+  return n;
+}
+
+//number of channels from the WAV header (1 if it isn't a WAV file)
+int SdFileTransfer_Compressed::getWavChannels(FsFile &file) {
+  uint8_t header[24];
+  file.seekSet(0);
+  if (file.read(header, sizeof(header)) != (int)sizeof(header)) return 1;
+  if ((memcmp(header, "RIFF", 4) != 0) || (memcmp(header+8, "WAVEfmt ", 8) != 0)) return 1;
+  int n_chan = header[22] | (header[23] << 8);
+  return constrain(n_chan, 1, COMP_XFER_MAX_STRIDE);
+}
+
+#endif
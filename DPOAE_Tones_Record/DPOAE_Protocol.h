@@ -0,0 +1,86 @@
+/*
+ DPOAE_Protocol.h
+
+ Purpose: The frequencies and timing of the stepped DPOAE test, in one place that
+          is shared by the Tympan firmware (see DPOAE_Settings_Manager.h and
+          DPOAE_test_logic.h) and by the PC analysis tool (see host_analysis/).
+
+ This file is plain C++ (no Arduino or Tympan headers), so that it compiles
+ anywhere.  If you change the protocol here, rebuild both the firmware and the
+ analysis tool so that they agree.
+
+ MIT License, Use at your own risk.
+*/
+
+#ifndef _DPOAE_Protocol_h
+#define _DPOAE_Protocol_h
+
+//define DPOAE frequencies to be tested
+/**********************************************************************************
+The tone frequencies used to be computed offline (in MATLAB) for FS=41667 and BlockSize=1024:
+    F1_actual_Hz = floor(F1_desired_Hz * BlockSize / FS + 0.5) * FS / BlockSize;
+    F2_actual_Hz = floor(F2_desired_Hz * BlockSize / FS + 0.5) * FS / BlockSize;
+Now they are planned at compile time for the actual sample rate (see dpoae_planFrequencies() below).
+**********************************************************************************/
+
+#define N_F2 7                      //number of F2 frequencies to choose from
+#define DPOAE_ASSUMED_NFFT 1024     //FFT length assumed by the post-processing
+#define DPOAE_F2_F1_RATIO 1.22f     //F2 / F1
+
+/**Target F2 Frequency (before adjusting to the FFT bins)**/
+static constexpr float dpoae_targ_freq2_Hz[N_F2] = {1000.f, 1500.f, 2000.f, 3000.f, 4000.f, 6000.f, 8000.f};
+
+/**Target F2 Frequency for the extended high-frequency protocol, used when the sample rate is at least DPOAE_EHF_MIN_FS_HZ**/
+#define DPOAE_EHF_MIN_FS_HZ 64000
+static constexpr float dpoae_targ_freq2_ehf_Hz[N_F2] = {2000.f, 4000.f, 6000.f, 8000.f, 10000.f, 12500.f, 16000.f};
+
+//the F2 frequencies to use at a given sample rate
+constexpr const float (&dpoae_targFreq2_Hz(float fs_Hz))[N_F2] {
+  return (fs_Hz >= (float)DPOAE_EHF_MIN_FS_HZ) ? dpoae_targ_freq2_ehf_Hz : dpoae_targ_freq2_Hz;
+}
+
+//The tone frequencies for each step, adjusted so that F1, F2, and 2*F1-F2 all sit exactly
+//on the center of an FFT bin (for the given sample rate and FFT length).  With F1 and F2 on
+//bins, 2*F1-F2 is on a bin, too.  Then the tones don't leak into the other bins, even with a
+//rectangular window, so that short averaging times still give clean levels.
+template <int N>
+struct DPOAE_Freq_Plan {
+  int bin1[N] = {}, bin2[N] = {}, bin_dp[N] = {};              //FFT bin of F1, F2, and 2*F1-F2
+  float freq1_Hz[N] = {}, freq2_Hz[N] = {}, freq_dp_Hz[N] = {};
+  float targ_freq1_Hz[N] = {}, targ_freq2_Hz[N] = {};           //before adjusting to the bins
+  bool is_valid = false;                                        //false if a tone (or 2*F1-F2) doesn't fit in the FFT
+};
+
+constexpr int dpoae_nearestBin(float f_Hz, float fs_Hz, int Nfft) { return (int)(f_Hz * (float)Nfft / fs_Hz + 0.5f); }
+
+//plan the frequencies.  F2 goes to the nearest bin, then F1 goes to the bin that gives the ratio closest to f2_f1_ratio.
+//This is constexpr, so the firmware can plan (and check) at compile time, while the PC tools can call it at run time.
+template <int N>
+constexpr DPOAE_Freq_Plan<N> dpoae_planFrequencies(float fs_Hz, int Nfft, const float (&targ_f2_Hz)[N], float f2_f1_ratio) {
+  DPOAE_Freq_Plan<N> plan;
+  plan.is_valid = (fs_Hz > 0.0f) && (Nfft > 0) && (f2_f1_ratio > 1.0f);
+  if (!plan.is_valid) return plan;
+  const float Hz_per_bin = fs_Hz / (float)Nfft;
+  for (int i=0; i < N; i++) {
+    int k2 = dpoae_nearestBin(targ_f2_Hz[i], fs_Hz, Nfft);
+    int k1 = (int)((float)k2 / f2_f1_ratio + 0.5f);
+    if (k1 >= k2) k1 = k2 - 1;         //keep F1 below F2
+    int kdp = 2*k1 - k2;
+    if ((kdp < 1) || (k2 >= Nfft/2)) plan.is_valid = false;
+    plan.bin1[i] = k1; plan.bin2[i] = k2; plan.bin_dp[i] = kdp;
+    plan.freq1_Hz[i] = (float)k1 * Hz_per_bin;
+    plan.freq2_Hz[i] = (float)k2 * Hz_per_bin;
+    plan.freq_dp_Hz[i] = (float)kdp * Hz_per_bin;
+    plan.targ_freq2_Hz[i] = targ_f2_Hz[i];
+    plan.targ_freq1_Hz[i] = targ_f2_Hz[i] / f2_f1_ratio;
+  }
+  return plan;
+}
+
+//default timing of the stepped test (the firmware can change these via "$sdstart_ms", "$tone_ms", and "$silence_ms")
+#define DPOAE_DEFAULT_SDSTART_MSEC  2000   //dead period after starting SD recording prior to tones starting
+#define DPOAE_DEFAULT_TONE_MSEC     3000   //duration of each tone (plus any extension for rejected audio)
+#define DPOAE_DEFAULT_SILENCE_MSEC  1000   //duration of silence between tones
+#define DPOAE_FADE_MSEC             50     //length of fade in and fade out of tones
+
+#endif
@@ -16,38 +16,29 @@
 #define _DPOAE_Settings_Manager_h
 
 #include "Tone_Manager.h"
+#include "DPOAE_Protocol.h"   //the frequencies to be tested (shared with the analysis tool in host_analysis/)
+#include "Cal_Curve.h"        //speaker calibration curves measured by CalibrateIO
 
-
-//define DPOAE frequencies to be tested
-/**********************************************************************************
-F2_desired_Hz=[1000;1500;2000;3000;4000;6000;8000];
-F1_desired_Hz= F2_desired_Hz/1.22;
-FS=41667;   %Hz
-BlockSize=1024;
-F1_actual_Hz = floor(F1_desired_Hz * BlockSize / FS + 0.5) * FS / BlockSize;
-F2_actual_Hz = floor(F2_desired_Hz * BlockSize / FS + 0.5) * FS / BlockSize;
-**********************************************************************************/
-
-#define N_F2 7   //number of F2 frequencies to choose from
 class Test_Parameters {
   public:
-    Test_Parameters(void) {};
+    Test_Parameters(void) {
+      //start with the un-adjusted targets.  The frequencies planned for the sample rate are set via DPOAE_Settings_Manager::setFrequencyPlan()
+      for (int i=0; i < N_F2; i++) { targ_freq2_Hz[i] = dpoae_targ_freq2_Hz[i]; targ_freq1_Hz[i] = dpoae_targ_freq2_Hz[i] / DPOAE_F2_F1_RATIO; }
+    };
     int n_freqs = N_F2;
 
-    /**F1 Frequency**/
-    float targ_freq1_Hz[N_F2] = {813.80859375, 1220.712890625, 1627.6171875, 2441.42578125, 3295.9248046875, 4923.5419921875, 6551.1591796875};
-    //float targ_freq1_Hz[N_F2] = {820.3125f, 1242.1875f, 1604.625f, 2450.9375f, 3281.25f, 4921.875f, 6562.5f};  //ooops! two frequency were typed in wrong
-    //float targ_freq1_Hz[N_F2] = {820.3125f, 1242.1875f, 1640.625f, 2460.9375f, 3281.25f, 4921.875f, 6562.5f};  //fixed two frequency values, Feb 24, 2023
-
-    /**F2 Frequency**/
-    float targ_freq2_Hz[N_F2] = {1017.2607421875, 1505.5458984375, 1993.8310546875, 3011.091796875, 3987.662109375, 5981.4931640625, 8016.0146484375};
-    //float targ_freq2_Hz[N_F2] = {1000.f, 1500.f, 2000.f, 3000.f, 4000.f, 6000.f, 8000.f}; //define the target F2 frequencies
-    //float targ_freq2_Hz[N_F2] = {1007.8125f, 1500.0f, 1992.1875f, 3000.0f, 4007.8125f, 6000.0f, 7992.1875f}; //define the target F2 frequencies
+    /**F1 and F2 Frequency**/
+    float targ_freq1_Hz[N_F2];
+    float targ_freq2_Hz[N_F2];
     
     float targ_f1_dBSPL = 65.0;
     float targ_f2_dBSPL = 55.0;
+    //per-step speaker cal, measured for the standard steps (dpoae_targ_freq2_Hz).  For the extended high-frequency steps, load the curves
+    //measured by CalibrateIO ("$cal_load"), which fill these in for whatever frequencies are planned.  An extended high-frequency test
+    //won't start until they have (see isCalReadyForTest() in DPOAE_test_logic.h).
     float cal_f1_dBFS_at_94dBSPL[N_F2] = {0.6, 0.5, 1.8, 1.8, -2.2, -2.5, -4.2};
     float cal_f2_dBFS_at_94dBSPL[N_F2] = {1.2, 2.1, 2.8, -1.4, -4.2, -2.4, -14.7};
+    bool is_cal_from_curve[2] = {false, false};  //did the F1 (and F2) cal come from a CalibrateIO curve?  (Set by hand, otherwise.)
 };
 
 class DPOAE_Settings_Manager {
@@ -55,10 +46,16 @@ class DPOAE_Settings_Manager {
     DPOAE_Settings_Manager(Test_Parameters *params) : test_params(params) {};
     
     //define parameters relating to assumptions about the post-processing that will be performed
-    int assumed_Nfft = 1024;
-    bool flag__adjustToCenterOfFFTBin = true;  //if true, this adjusts f2 so that the DPOAE frequency ends up in the center of an FFT bin?
+    int assumed_Nfft = DPOAE_ASSUMED_NFFT;
+    bool flag__adjustToCenterOfFFTBin = true;  //if true, F1, F2, and the DPOAE frequency all end up in the center of an FFT bin
     
     //methods
+    void setFrequencyPlan(const DPOAE_Freq_Plan<N_F2> &plan) {  //see dpoae_planFrequencies() in DPOAE_Protocol.h
+      for (int i=0; i < N_F2; i++) {
+        test_params->targ_freq1_Hz[i] = flag__adjustToCenterOfFFTBin ? plan.freq1_Hz[i] : plan.targ_freq1_Hz[i];
+        test_params->targ_freq2_Hz[i] = flag__adjustToCenterOfFFTBin ? plan.freq2_Hz[i] : plan.targ_freq2_Hz[i];
+      }
+    }
     int nextTestStep(Tone_State *tone_state) {  testStep(cur_step_ind++, tone_state);  return cur_step_ind; }
     int testStep(int step_ind, Tone_State *tone_state);
     //void chooseToneFreqs_Hz(float targ_f2_Hz, float *out_f1_Hz, float *out_f2_Hz);
@@ -66,6 +63,7 @@ class DPOAE_Settings_Manager {
       if ( (step_ind < 0) || (step_ind >= test_params->n_freqs) ) return 0.0;
       if (chan == 0) test_params->cal_f1_dBFS_at_94dBSPL[step_ind] = cal_dBFS_at_94dBSPL;
       if (chan == 1) test_params->cal_f2_dBFS_at_94dBSPL[step_ind] = cal_dBFS_at_94dBSPL;  
+      if ((chan == 0) || (chan == 1)) test_params->is_cal_from_curve[chan] = false;
       set_tone_state_amplitudes(step_ind,tone_state); //this sets some outputs via tone_state
       return cal_dBFS_at_94dBSPL;
     }
@@ -80,9 +78,23 @@ class DPOAE_Settings_Manager {
       float new_val = 0;
       if (chan == 0) new_val = (test_params->cal_f1_dBFS_at_94dBSPL[step_ind] += incr_dB);
       if (chan == 1) new_val = (test_params->cal_f2_dBFS_at_94dBSPL[step_ind] += incr_dB);       
+      if ((chan == 0) || (chan == 1)) test_params->is_cal_from_curve[chan] = false;
       set_tone_state_amplitudes(step_ind,tone_state); //this sets some outputs via tone_state
       return new_val; 
     }
+    //fill in every step's speaker cal from the calibration curves of the F1 and F2 speakers (see Cal_Curve.h).  A curve
+    //that is NULL, not loaded, or without the mic's level at 94 dB SPL leaves its cal as it was.  Returns the number of curves used.
+    int setCalFromCurves(const Cal_Curve *curve_f1, const Cal_Curve *curve_f2, float out_gain_dB, Tone_State *tone_state) {
+      int n_used = 0;
+      for (int i=0; i < test_params->n_freqs; i++) {
+        if (isUsable(curve_f1)) test_params->cal_f1_dBFS_at_94dBSPL[i] = calFromCurve(*curve_f1, test_params->targ_freq1_Hz[i], out_gain_dB);
+        if (isUsable(curve_f2)) test_params->cal_f2_dBFS_at_94dBSPL[i] = calFromCurve(*curve_f2, test_params->targ_freq2_Hz[i], out_gain_dB);
+      }
+      if (isUsable(curve_f1)) { n_used++; test_params->is_cal_from_curve[0] = true; }
+      if (isUsable(curve_f2)) { n_used++; test_params->is_cal_from_curve[1] = true; }
+      set_tone_state_amplitudes(cur_step_ind, tone_state); //this sets some outputs via tone_state
+      return n_used;
+    }
     void set_tone_state_amplitudes(int step_ind, Tone_State *tone_state) { //output is via tone_state
       if ( (step_ind < 0) || (step_ind >= test_params->n_freqs) ) return;
       tone_state->amp1_dBFS = test_params->targ_f1_dBSPL -94.0 + test_params->cal_f1_dBFS_at_94dBSPL[step_ind];
@@ -96,6 +108,15 @@ class DPOAE_Settings_Manager {
   private:
     int cur_step_ind = 0;
     float sample_rate_Hz = 48000;
+
+    static bool isUsable(const Cal_Curve *curve) { return (curve != NULL) && curve->isLoaded() && curve->hasMicRef(); }
+
+    //the tone level (dBFS) that gives 94 dB SPL at the mic.  The curve's levels are RMS (a full-scale sine is -3 dBFS) but
+    //our tone levels are amplitudes (see Tone_Manager::dB_to_amp()), hence the +3 dB.  Any change of the headphone amp's gain
+    //since the curve was measured is taken back out.  The input gain doesn't matter, as the curve's gain and mic level share it.
+    static float calFromCurve(const Cal_Curve &curve, float freq_Hz, float out_gain_dB) {
+      return curve.header.mic_dBFS_at_94dBSPL - curve.getGain_dB(CAL_CURVE_MIC_CHAN, freq_Hz) + 3.0103f - (out_gain_dB - curve.header.out_gain_dB);
+    }
 };
 
 
@@ -28,22 +28,76 @@
   MTP Support is VERY EXPERIMENTAL!!  There are weird behaviors that come with the underlying
   MTP support provided by Teensy and its libraries.  
 
+  Binaural: set N_EARS to 2 (below) to test both ears at once.  This needs the
+  Earpiece Shield for the second pair of inputs and outputs (ie, 4-in/4-out).  Each
+  ear steps through the protocol on its own, with its own calibration, probe check,
+  and artifact rejection.  The manual controls act on the selected ear (see "$ear").
+
+  High frequencies: set DPOAE_HIGH_RATE to 1 (below) to run the audio at 96 kHz and use the
+  extended high-frequency protocol (F2 up to 16 kHz, see DPOAE_Protocol.h).  The level
+  measurements and the live spectrum then run on a copy of the mics that is decimated
+  down to 48 kHz (see AudioDecimator_F32.h), which covers the band that we analyze for
+  about half the CPU.  Use "$dsp_cost" to see what the decimation costs.  The built-in cal
+  is only for the standard frequencies, so the test won't start until every speaker's cal
+  has been loaded from CalibrateIO's curves (see "$cal_load").
+
+  Recording: the mics are decimated by RECORD_DECIMATION (below) before the SD writer, so
+  the WAV files (and their downloads) are half the size, but still cover everything that
+  we analyze.  The WAV header has the decimated rate, while the tones were planned at the
+  full rate, so the artifact sidecar (see Artifact_Log.h) saves the full rate, too.  The PC
+  tools need it to find the tones (or give it to them with "--stim_rate" or stim_rate_Hz).  Set
+  RECORD_DECIMATION to 1 to record at the full rate.
+
+  Results: after each test, every step's results (levels, DP and noise, cal, flags) are added
+  to RESULTS.LOG on the SD card (see Results_Log.h).  Use "$results_since" to fetch just the
+  new ones (or getResultsSince() in tympanSdFileTransferFunctions.py) without the WAV files.
+
   MIT License, Use at your own risk.
 */
 
+#define N_EARS 1   //number of probes tested at once: 1 (one ear) or 2 (binaural, needs the Earpiece Shield)
+#define DPOAE_HIGH_RATE 0   //0 = 44.1 kHz (F2 up to 8 kHz) or 1 = 96 kHz (extended high frequencies, F2 up to 16 kHz)
+
 #include <Tympan_Library.h>   //requires V3.1.1 or later
 #include "DPOAE_Settings_Manager.h"
 #include "Tone_Manager.h"
 #include "SerialManager.h"
 #include "State.h"
+#include "Artifact_Log.h"
+#include "Ear_Manager.h"
+#include "SD_Index.h"
+#include "Compressed_Transfer.h"
+#include "Task_Scheduler.h"
+#include "Session_Queue.h"
+#include "Results_Log.h"
 
 //set the sample rate and block size
-const float sample_rate_Hz = 44117.0f ;  //choose your sample rate (up to 96000)
+#if (DPOAE_HIGH_RATE)
+constexpr float sample_rate_Hz = 96000.0f ;  //for the extended high frequencies
+#define ANALYSIS_DECIMATION 2                //analyze the mics at 48 kHz
+#else
+constexpr float sample_rate_Hz = 44117.0f ;  //choose your sample rate (up to 96000)
+#define ANALYSIS_DECIMATION 1                //analyze the mics at the full rate
+#endif
 const int audio_block_samples = 128;     //do not make bigger than 128
 AudioSettings_F32 audio_settings(sample_rate_Hz, audio_block_samples);
+AudioSettings_F32 analysis_settings(sample_rate_Hz / ANALYSIS_DECIMATION, audio_block_samples / ANALYSIS_DECIMATION);  //for the level measurements and the live spectrum
+
+//the recording's rate and anti-alias filter (the filter can be changed with "$rec_filter")
+#define RECORD_DECIMATION 2   //1 (full rate) or 2 (half rate, still above our analysis band).  Must divide audio_block_samples.
+#define RECORD_DECIM_TAPS 64
+#define RECORD_DECIM_CUTOFF_HZ (0.95f * 0.5f * sample_rate_Hz / RECORD_DECIMATION)  //flat to about 9 kHz (or 19 kHz at 96 kHz)
+AudioSettings_F32 record_settings(sample_rate_Hz / RECORD_DECIMATION, audio_block_samples / RECORD_DECIMATION);  //for the SD writer (and so for the WAV header)
+
+//plan the tone frequencies for this sample rate, so that F1, F2, and 2*F1-F2 land on FFT bin centers (see DPOAE_Protocol.h)
+constexpr DPOAE_Freq_Plan<N_F2> dpoae_freq_plan = dpoae_planFrequencies(sample_rate_Hz, DPOAE_ASSUMED_NFFT, dpoae_targFreq2_Hz(sample_rate_Hz), DPOAE_F2_F1_RATIO);
+static_assert(dpoae_freq_plan.is_valid, "DPOAE frequency plan does not fit this sample rate (see DPOAE_Protocol.h)");
 
 // Create the audio library objects that we'll use
 Tympan    myTympan(TympanRev::E, audio_settings);           //use TympanRev::D or E or F
+#if (N_EARS > 1)
+EarpieceShield  earpieceShield(TympanRev::E, AICShieldRev::A);  //the second ear's inputs and outputs
+#endif
 SdFs      sd;                 //here is the sd card object, to be shared about AudioSDWriter and SDtoSerial
 #include "AudioProcessing.h"  //here is where most of the audio stuff is created
 
@@ -55,6 +109,16 @@ BLE_UI& ble = myTympan.getBLE_UI();      //myTympan owns the ble object, but we
 SerialManager   serialManager(&ble);     //create the serial manager for real-time control (via USB or App)
 State           myState(&audio_settings, &myTympan, &serialManager); //keeping one's state is useful for the App's GUI
 SdFileTransfer  sdFileTransfer(&sd, &Serial);  //transfers raw bytes of files on the sd over to Serial (part of Tympan Library)
+SdFileTransfer_Compressed sdFileTransfer_comp(&sd, &Serial);  //same, but compressed (see Compressed_Transfer.h)
+Telemetry       telemetry(&Serial);            //sends binary status frames over USB, when enabled (see Telemetry.h)
+SD_Index        sdIndex(&sd);                  //index of the files on the SD card, for fast listing and naming (see SD_Index.h)
+Stimulus_Cache  stimCache;                     //precomputed stimuli, in PSRAM if there is any (see AudioStimulusPlayer_F32.h)
+Cal_Curve       calCurves[2*N_EARS];           //speaker calibration curves from CalibrateIO, one per output channel (see Cal_Curve.h)
+Session_Queue   sessionQueue;                  //runs a plan of several tests from the SD card, unattended (see Session_Queue.h)
+Results_Log     resultsLog(&sd);               //every step's results, appended to a binary log on the SD card (see Results_Log.h)
+Task_Scheduler  scheduler;                     //runs the work of loop(), time-critical tasks first (see Task_Scheduler.h)
+Task_Scheduler  mtpScheduler;                  //the smaller set of tasks to run once MTP mode is active
+int spectrumSendTask = -1;                     //so that we can change its rate
 
 //set up the serial manager
 void setupSerialManager(void) {
@@ -68,9 +132,14 @@ void setupSerialManager(void) {
 /* If you want this, be sure to set the USB mode via the Arduino IDE,  Tools Menu -> USB Type -> Serial + MTP (experimental) */
 #include "setup_MTP.h"  //put this line sometime after the audioSDWriter has been instantiated
 
-//create manager for the DPOAE protocol and for the test tones
-DPOAE_Settings_Manager DPOAE_manager(&myState.test_params);
-Tone_Manager tone_manager(&sine1, &sine2, sample_rate_Hz);
+//create the managers for each ear (DPOAE protocol, test tones, probe check, and artifact log...see Ear_Manager.h)
+Ear_Manager earManager[N_EARS] = {
+  Ear_Manager(&myState.ears[0], &sine1, &sine2, &fade1, &fade2, &measureLEQ1, &artifactMonitor, &spectrumMonitor, &chirp, &stimPlayer1, &blockStats1, sample_rate_Hz)
+#if (N_EARS > 1)
+ ,Ear_Manager(&myState.ears[1], &sine3, &sine4, &fade3, &fade4, &measureLEQ3, &artifactMonitor2, &spectrumMonitor2, &chirp2, &stimPlayer2, &blockStats2, sample_rate_Hz)
+#endif
+};
+Ear_Manager &selEarManager(void) { return earManager[myState.sel_ear]; }
 #include "DPOAE_test_logic.h"
 
 
@@ -85,11 +154,21 @@ void setup(void)
   //allocate the audio memory
   AudioMemory_F32(100,audio_settings); //I can only seem to allocate 400 blocks
   
+  //all tone and fade changes reach the audio objects through their mailboxes (see Param_Mailbox.h)
+  for (int i=0; i < N_EARS; i++) paramUpdater.addClient(&earManager[i].tone_manager);
+
   //mute the sine waves
   muteOutput(true);  //true means to mute (false would tell it to unmute)
+
+  //decimate the mics for the level measurements and the live spectrum, and for the SD recording
+  setupAnalysisDecimation();  //see AudioProcessing.h
+  setupRecordDecimation(RECORD_DECIM_TAPS, RECORD_DECIM_CUTOFF_HZ);
   
   //start the audio hardware
   myTympan.enable();
+  #if (N_EARS > 1)
+    earpieceShield.enable();
+  #endif
 
   //Choose the desired input
   setConfiguration(myState.input_source);  //see AudioProcessing.h
@@ -97,6 +176,10 @@ void setup(void)
   //Set the desired volume levels
   myTympan.volume_dB(myState.output_gain_dB);          // headphone amplifier.  -63.6 to +24 dB in 0.5dB steps.
   myTympan.setInputGain_dB(myState.input_gain_dB);     // set input volume, 0-47.5dB in 0.5dB setps
+  #if (N_EARS > 1)
+    earpieceShield.volume_dB(myState.output_gain_dB);
+    earpieceShield.setInputGain_dB(myState.input_gain_dB);
+  #endif
 
   //setup BLE
   while (Serial1.available()) Serial1.read(); //clear the incoming Serial1 (BT) buffer
@@ -104,28 +187,77 @@ void setup(void)
 
   //setup the serial manager
   setupSerialManager();
+  serialManager.prepareTympanRemoteLayout();  //render the App's GUI layout now so that connecting is fast
 
   //prepare the SD writer for the format that we want and any error statements
   audioSDWriter.setSerial(&myTympan);         //the library will print any error info to this serial stream (note that myTympan is also a serial stream)
-  audioSDWriter.setNumWriteChannels(2);       //this is also the built-in defaullt, but you could change it to 4 (maybe?), if you wanted 4 channels.
-  Serial.println("Setup: SD configured for " + String(audioSDWriter.getNumWriteChannels()) + " channels.");
+  audioSDWriter.setNumWriteChannels(2*N_EARS);  //two channels per ear
+  Serial.println("Setup: SD configured for " + String(audioSDWriter.getNumWriteChannels()) + " channels at " + String(record_settings.sample_rate_Hz,0) + " Hz.");
 
   //Prime the tone generation system
-  myState.max_step_ind = myState.test_params.n_freqs; 
+  for (int i=0; i < N_EARS; i++) earManager[i].dpoae_manager.setFrequencyPlan(dpoae_freq_plan);  //planned for our sample rate (see above)
+  #if !(defined(USE_MTPDISK) || defined(USB_MTPDISK_SERIAL))
+  loadCalCurves();  //speaker cal from CalibrateIO, if it is on the SD card.  (Not with MTP, which needs the SD card untouched until it starts...use "$cal_load")
+  loadProbeReferences();  //the probe-fit reference of each ear, if it was saved by "$probe_ref"
+  #endif
+  myState.max_step_ind = myState.ears[0].test_params.n_freqs; 
+  buildStimulusCache();  //precompute each step's tones (if there is room), so that loop() and the audio interrupt don't compute them
   jumpToFreqStepAndPlayTones(0);  //start at step 0 (ie, start at the first step in the protocol)
 
   //setup level measurements
   setupLevelMeasurements();   //see AudioProcessing.h
+
+  //register the work to be done in loop()
+  setupTasks();
   
   Serial.println("Setup complete.");
   serialManager.printHelp();
 } //end setup()
 
 
+//register the work to be done in loop().  The SD writer and the test timing are CRITICAL, so they
+//run every pass of loop(), no matter how slow the GUI updates get (see Task_Scheduler.h).
+void setupTasks(void) {
+  //name, function, period (msec), priority, deadline (msec)
+  scheduler.addTask("serial",     serviceSerialInput,      0, Task_Scheduler::CRITICAL,  0);
+  scheduler.addTask("sd",         serviceSDWriter,         0, Task_Scheduler::CRITICAL, 10);  //flag any gap of more than 10 msec
+  scheduler.addTask("artifact",   serviceArtifactMonitor,  0, Task_Scheduler::CRITICAL,  0);
+  scheduler.addTask("blockstats", serviceBlockStats,       0, Task_Scheduler::CRITICAL,  0);
+  scheduler.addTask("test",       serviceSteppedTest_task, 0, Task_Scheduler::CRITICAL, 10);
+  scheduler.addTask("telemetry",  serviceTelemetry,       10, Task_Scheduler::HIGH,      0);  //the telemetry object knows its own rate
+  scheduler.addTask("spect_fft",  serviceSpectrumFrames,  10, Task_Scheduler::NORMAL,    0);
+  spectrumSendTask =
+  scheduler.addTask("spect_send", serviceSpectrumSend, (unsigned long)(1000.0f / myState.spectrum_rate_Hz), Task_Scheduler::NORMAL, 0);
+  scheduler.addTask("levels",     serviceLevelMeasurements, 1000, Task_Scheduler::NORMAL,  0);
+  scheduler.addTask("session",    serviceSession,        100, Task_Scheduler::NORMAL,    0);  //see DPOAE_test_logic.h
+  scheduler.addTask("leds",       serviceLEDs,             0, Task_Scheduler::LOW,       0);
+  scheduler.addTask("gui",        serviceGUI,              0, Task_Scheduler::LOW,       0);  //the serial manager limits its own rate
+  scheduler.addTask("cpu",        serviceUpdateCPUtoGUI, 3000, Task_Scheduler::LOW,      0);
+  scheduler.addTask("ble_adv",    serviceBLEAdvertising, 5000, Task_Scheduler::LOW,      0);
+
+  //once MTP is active (ie, the SD card appearing as a drive on your PC/Mac), we service it and little else
+  mtpScheduler.addTask("serial",  serviceSerialInput,      0, Task_Scheduler::CRITICAL,  0);
+  mtpScheduler.addTask("sd",      serviceSDWriter,         0, Task_Scheduler::CRITICAL,  0);
+  mtpScheduler.addTask("mtp",     serviceMTP_task,         0, Task_Scheduler::CRITICAL,  0);
+  mtpScheduler.addTask("leds",    serviceLEDs,             0, Task_Scheduler::LOW,       0);
+}
+
 // define loop()...this is run over-and-over while the device is powered
 void loop(void)
 {
-  //look for in-coming serial messages (via USB or via Bluetooth)
+  // Did the user activate MTP mode?  If so, service the MTP and nothing else
+  if (use_MTP) {
+    mtpScheduler.run(millis());
+  } else {
+    scheduler.run(millis());  //do everything else!  (see setupTasks())
+  }
+}  //end loop()
+
+
+// ///////////////// Servicing routines (run by the scheduler...see setupTasks())
+
+//look for in-coming serial messages (via USB or via Bluetooth)
+void serviceSerialInput(unsigned long curTime_millis) {
   if (Serial.available()) serialManager.respondToByte((char)Serial.read());   //USB Serial
 
   //respond to BLE
@@ -133,72 +265,153 @@ void loop(void)
     String msgFromBle; int msgLen = ble.recvBLE(&msgFromBle);
     for (int i=0; i < msgLen; i++) serialManager.respondToByte(msgFromBle[i]);
   }
+}
 
-  //service the SD recording
+//service the SD recording
+void serviceSDWriter(unsigned long curTime_millis) {
   audioSDWriter.serviceSD_withWarnings(audio_in); //For the warnings, it asks the i2s_in class for some info
+}
 
-  //service the LEDs...blink slow normally, blink fast if recording
-  myTympan.serviceLEDs(millis(),audioSDWriter.getState() == AudioSDWriter::STATE::RECORDING); 
+//service the LEDs...blink slow normally, blink fast if recording
+void serviceLEDs(unsigned long curTime_millis) {
+  myTympan.serviceLEDs(curTime_millis, audioSDWriter.getState() == AudioSDWriter::STATE::RECORDING); 
+}
 
-  // Did the user activate MTP mode?  If so, service the MTP and nothing else
-  if (use_MTP) {   //service MTP (ie, the SD card appearing as a drive on your PC/Mac
-     
-     service_MTP();  //Find in Setup_MTP.h 
-  
-  } else { //do everything else!
+void serviceMTP_task(unsigned long curTime_millis) { service_MTP(); }  //Find in Setup_MTP.h 
 
-    //service the BLE advertising state...if not recording to SD
-    if (audioSDWriter.getState() != AudioSDWriter::STATE::RECORDING) {
-      ble.updateAdvertising(millis(),5000); //check every 5000 msec to ensure it is advertising (if not connected)
-    }
+//service the BLE advertising state...if not recording to SD
+void serviceBLEAdvertising(unsigned long curTime_millis) {
+  if (audioSDWriter.getState() == AudioSDWriter::STATE::RECORDING) return;
+  ble.updateAdvertising(curTime_millis, 0); //ensure it is advertising (if not connected).  The scheduler sets the rate.
+}
+
+//send any GUI changes that have been queued up (combined into one BLE message, at most every 100 msec)
+void serviceGUI(unsigned long curTime_millis) {
+  serialManager.serviceGUI(curTime_millis);
+}
 
-    //periodically print the CPU and Memory Usage
-    if (myState.printCPUtoGUI) { myTympan.printCPUandMemory(millis(),3000); serviceUpdateCPUtoGUI(millis(),3000);}      //print every 3000 msec
+//print the CPU and Memory Usage and send the CPU value up to the App
+void serviceUpdateCPUtoGUI(unsigned long curTime_millis) {
+  if (!myState.printCPUtoGUI) return;
+  myTympan.printCPUandMemory(curTime_millis, 0);  //the scheduler sets the rate
+  serialManager.updateCpuDisplayUsage();
+}
 
-    //service the state of the test
-    serviceSteppedTest(millis());  //see DPOAE_test_logic.h
+//service the state of the test
+void serviceSteppedTest_task(unsigned long curTime_millis) {
+  serviceSteppedTest(curTime_millis);  //see DPOAE_test_logic.h
+}
 
-    //service the level measurements
-    if (myState.printLevelsToGUI) serviceLevelMeasurements(millis(),1000);   //update every 1000msec
+//send the latest levels to the GUI
+void serviceLevelMeasurements(unsigned long curTime_millis) {
+  if (!myState.printLevelsToGUI) return;
+  getLevels_dB(myState.measuredLEQ_dB);
+  for (int i=0; i < N_EARS; i++) {  //flag any input that clipped since the last update
+    for (int j=0; j < 2; j++) myState.inputClipped[2*i+j] = (earManager[i].display_stats.getClippedCount(j) > 0);
+    earManager[i].display_stats.reset();
   }
+  serialManager.updateLevelDisplays();
+} 
 
-}  //end loop()
+//print what the analysis decimation costs, next to the total for the audio
+void printDSPCost(void) {
+  printlnf(Serial, "DSP cost: audio at %.0f Hz, analysis at %.0f Hz (decimated by %d, %d taps)",
+            audio_settings.sample_rate_Hz, analysis_settings.sample_rate_Hz, analysisDecim1.getFactor(), analysisDecim1.getNumTaps());
+  printlnf(Serial, "    ear 1 decimator: %.1f usec per block (max %.1f), %.2f%% of the block period", analysisDecim1.getCost_usec(), analysisDecim1.getMaxCost_usec(), analysisDecim1.getCost_percent());
+  #if (N_EARS > 1)
+    printlnf(Serial, "    ear 2 decimator: %.1f usec per block (max %.1f), %.2f%% of the block period", analysisDecim2.getCost_usec(), analysisDecim2.getMaxCost_usec(), analysisDecim2.getCost_percent());
+  #endif
+  printlnf(Serial, "    recording decimator: %.1f usec per block (max %.1f), %.2f%% of the block period (to %.0f Hz, %d taps, cutoff %.0f Hz)",
+            recordDecim.getCost_usec(), recordDecim.getMaxCost_usec(), recordDecim.getCost_percent(),
+            recordDecim.getOutputRate_Hz(), recordDecim.getNumTaps(), recordDecim.getCutoff_Hz());
+  printlnf(Serial, "    all audio: %.1f%% CPU (max %.1f%%)", audio_settings.processorUsage(), audio_settings.processorUsageMax());
+}
 
+//change the recording's anti-alias filter (not while recording, since it would click).  A cutoff of 0 keeps the current one.
+bool setRecordFilter(int n_taps, float cutoff_Hz) {
+  if (audioSDWriter.getState() == AudioSDWriter::STATE::RECORDING) {
+    Serial.println("setRecordFilter: *** ERROR ***: stop the recording first");
+    return false;
+  }
+  if (cutoff_Hz <= 0.0f) cutoff_Hz = recordDecim.getCutoff_Hz();
+  return setupRecordDecimation(n_taps, min(cutoff_Hz, 0.5f * record_settings.sample_rate_Hz));
+}
 
-// ///////////////// Servicing routines
+void printTaskStats(void) { scheduler.printStats(&Serial); }
+void resetTaskStats(void) { scheduler.resetStats(); }
+
+//get the current level of every input (two per ear)
+void getLevels_dB(float *level_dB) {
+  level_dB[0] = measureLEQ1.getCurrentLevel_dB();
+  level_dB[1] = measureLEQ2.getCurrentLevel_dB();
+  #if (N_EARS > 1)
+    level_dB[2] = measureLEQ3.getCurrentLevel_dB();
+    level_dB[3] = measureLEQ4.getCurrentLevel_dB();
+  #endif
+}
 
-//Test to see if enough time has passed to send up updated CPU value to the App
-void serviceUpdateCPUtoGUI(unsigned long curTime_millis, unsigned long updatePeriod_millis) {
-  static unsigned long lastUpdate_millis = 0;
+//Read the per-block results from the artifact monitors (in the audio interrupt) and log the flagged blocks
+void serviceArtifactMonitor(unsigned long curTime_millis) {
+  for (int i=0; i < N_EARS; i++) earManager[i].serviceArtifactMonitor();
+}
 
-  //has enough time passed to update everything?
-  if (curTime_millis < lastUpdate_millis) lastUpdate_millis = 0; //handle wrap-around of the clock
-  if ((curTime_millis - lastUpdate_millis) > updatePeriod_millis) { //is it time to update the user interface?
-    //send the latest value to the GUI!
-    serialManager.updateCpuDisplayUsage();
-    
-    lastUpdate_millis = curTime_millis;
-  } // end if
-} //end serviceUpdateCPUtoGUI();
+//Read every audio block's measurements (see AudioBlockStats_F32.h)
+void serviceBlockStats(unsigned long curTime_millis) {
+  for (int i=0; i < N_EARS; i++) earManager[i].serviceBlockStats();
+}
 
+//print every audio block's measurements to USB Serial (or stop)
+bool enableBlockStatsLog(bool enable) {
+  if (enable) Serial.println("blk, ear, block, in1 (dBFS), in1 peak (dBFS), in2 (dBFS), in2 peak (dBFS), stim_id, f1 (Hz), f2 (Hz), tones on");
+  for (int i=0; i < N_EARS; i++) earManager[i].logBlockStats(enable ? &Serial : NULL, i);
+  return enable;
+}
 
-//void serviceSteppedTest(millis());  //see DPOAE_test_logic.h
+//Test to see if it is time to send the next telemetry frame (the telemetry object knows the rate)
+void serviceTelemetry(unsigned long curTime_millis) {
+  if (!telemetry.isTimeToSend(curTime_millis)) return;
+
+  Telemetry_Status status;
+  status.n_chan = 2*N_EARS;
+  getLevels_dB(status.level_dB);
+  status.is_stim_on = (!myState.selEar().tone_state.is_muted) && (myState.cur_test_state != State::TEST_SILENCE);
+  status.is_recording = (audioSDWriter.getState() == AudioSDWriter::STATE::RECORDING);
+  status.test_state = myState.cur_test_state;
+  status.step_ind = myState.selEar().cur_step_ind;
+  status.cpu_percent = audio_settings.processorUsage();
+  status.audio_mem_used = AudioMemoryUsage_F32();
+  status.audio_mem_max = AudioMemoryUsageMax_F32();
+  telemetry.sendStatus(status, curTime_millis);
+}
 
-void serviceLevelMeasurements(unsigned long curTime_millis, unsigned long updatePeriod_millis) {
-  static unsigned long lastUpdate_millis = 0;
+//Do the FFT for any new frame of mic audio (for the live spectrum, or for measuring the DP during each tone)
+void serviceSpectrumFrames(unsigned long curTime_millis) {
+  for (int i=0; i < N_EARS; i++) {
+    if (earManager[i].spectrumMonitor->isEnabled()) earManager[i].spectrumMonitor->processNewFrame();  //cheap if there is no new frame
+  }
+}
 
-  //has enough time passed to update everything?
-  if (curTime_millis < lastUpdate_millis) lastUpdate_millis = 0; //handle wrap-around of the clock
-  if ((curTime_millis - lastUpdate_millis) > updatePeriod_millis) { //is it time to update the user interface?
-    
-    //send the latest value to the GUI!
-    myState.measuredLEQ_dB[0] = measureLEQ1.getCurrentLevel_dB();
-    myState.measuredLEQ_dB[1] = measureLEQ2.getCurrentLevel_dB();
-    serialManager.updateLevelDisplays();
-    
-    lastUpdate_millis = curTime_millis;
-  } 
-} 
+//Send the averaged spectrum (the scheduler runs this at myState.spectrum_rate_Hz...see enableSpectrum()).
+//The App gets 8 octave bands (as text); the USB link gets finer bands as binary telemetry frames, but
+//only if telemetry is on ("$telemetry"), so that binary frames never land on a text-only link.
+#define N_SPECTRUM_USB_BANDS 48
+void serviceSpectrumSend(unsigned long curTime_millis) {
+  if (!myState.showSpectrum) return;
+  AudioSpectrumMonitor_F32 *spectrum = selEarManager().spectrumMonitor;  //show the selected ear
+
+  //fine, log-spaced bands to the USB link
+  if (telemetry.isEnabled()) {
+    float band_dB[N_SPECTRUM_USB_BANDS];
+    const float f_min_Hz = 100.0f, f_max_Hz = 0.5f*analysis_settings.sample_rate_Hz;
+    spectrum->getBandLevels_dB(N_SPECTRUM_USB_BANDS, f_min_Hz, f_max_Hz, band_dB);
+    telemetry.sendSpectrum(N_SPECTRUM_USB_BANDS, f_min_Hz, f_max_Hz, band_dB, curTime_millis);
+  }
+
+  //octave bands (125 Hz to 16 kHz) to the App
+  float octave_dB[8];
+  spectrum->getBandLevels_dB(8, 125.0f/sqrtf(2.0f), 16000.0f*sqrtf(2.0f), octave_dB);
+  serialManager.updateSpectrumDisplay(octave_dB, 8);
+}
 
 // ///////////////// functions used to respond to the commands
 
@@ -210,50 +423,244 @@ void stop_DPOAE_test(void) {
   myState.cur_test_state = State::TEST_STOPPING;     
 }
 
-//change the gain from the App
+//run just the probe-fit check (without going on to the test)
+void start_probe_check(void) {
+  if (myState.cur_test_state != State::TEST_OFF) return;
+  myState.probe_check_only = true;
+  myState.cur_test_state = State::TEST_STARTING;
+}
+
+//change the gain from the App (for the selected ear)
 float changeCal(int chan, float change_in_cal_dB) {
-  float new_val = DPOAE_manager.incrementCal_dBFS(chan, myState.cur_step_ind, change_in_cal_dB, &myState.tone_state);
-  jumpToFreqStepAndPlayTones(myState.cur_step_ind);  //play the tones at the new settings
+  Ear_Manager &ear = selEarManager();
+  float new_val = ear.dpoae_manager.incrementCal_dBFS(chan, ear.state->cur_step_ind, change_in_cal_dB, &(ear.state->tone_state));
+  ear.jumpToStep(ear.state->cur_step_ind);  //play the tones at the new settings
   return new_val;
 }
 
+//set the cal directly from the App or SerialMonitor (rather than incrementing it)
+float setCal(int ear_ind, int chan, int step_ind, float cal_dBFS_at_94dBSPL) {
+  if ((ear_ind < 0) || (ear_ind >= N_EARS)) ear_ind = myState.sel_ear;
+  Ear_Manager &ear = earManager[ear_ind];
+  float new_val = ear.dpoae_manager.setCal_dB(chan, step_ind, cal_dBFS_at_94dBSPL, &(ear.state->tone_state));
+  ear.jumpToStep(ear.state->cur_step_ind);  //play the tones at the new settings
+  return new_val;
+}
+
+//load the speaker calibration curves from CalibrateIO (CAL1.BIN to CAL4.BIN, see Cal_Curve.h) and use them for every
+//step's cal.  Output channel 2*ear+1 is that ear's F1 speaker and 2*ear+2 is its F2 speaker.  Returns the number used.
+int loadCalCurves(void) {
+  audioSDWriter.prepareSDforRecording();  //starts the SD card, if not already started
+  for (int i=0; i < 2*N_EARS; i++) {
+    Fixed_String<16> fname;
+    Cal_Curve::makeFilename(i+1, &fname);
+    if (!calCurves[i].load(&sd, fname)) continue;
+    calCurves[i].printSummary(&Serial, fname);
+    if (!calCurves[i].hasMicRef()) printlnf(Serial, "loadCalCurves: *** ERROR ***: %s has no mic level at 94 dB SPL (use \"$mic_ref\" in CalibrateIO).  Not using it.", fname.c_str());
+  }
+
+  int n_used = 0;
+  for (int i=0; i < N_EARS; i++) {
+    n_used += earManager[i].dpoae_manager.setCalFromCurves(&calCurves[2*i], &calCurves[2*i+1], myState.output_gain_dB, &(earManager[i].state->tone_state));
+    earManager[i].jumpToStep(earManager[i].state->cur_step_ind);  //play the tones at the new settings
+  }
+  printlnf(Serial, "loadCalCurves: %d of %d speakers calibrated from curves", n_used, 2*N_EARS);
+  return n_used;
+}
+
+//load each ear's probe-fit reference (PROBE1.REF, ...) from the SD card.  If every ear has one, the
+//probe check runs before each test (see Probe_Check.h).  Returns the number of ears with a reference.
+int loadProbeReferences(void) {
+  audioSDWriter.prepareSDforRecording();  //starts the SD card, if not already started
+  int n_loaded = 0;
+  for (int i=0; i < N_EARS; i++) {
+    Fixed_String<16> fname;
+    Probe_Check_Settings::makeRefFilename(i, &fname);
+    if (myState.ears[i].probe_check.loadReference(&sd, fname)) n_loaded++;
+  }
+  myState.probe_check_before_test = (n_loaded == N_EARS);
+  printlnf(Serial, "loadProbeReferences: %d of %d ears have a probe-fit reference.  The probe check %s before each test.", n_loaded, N_EARS,
+           myState.probe_check_before_test ? "runs" : "does not run");
+  return n_loaded;
+}
+
+//use each ear's last probe measurement as its reference and save it to the SD card, so that it is kept through
+//a reboot.  Once every ear has a reference, the probe check runs before each test.  Returns the number of ears saved.
+int captureProbeReferences(void) {
+  audioSDWriter.prepareSDforRecording();  //starts the SD card, if not already started
+  int n_saved = 0;
+  for (int i=0; i < N_EARS; i++) {  //each ear has its own reference
+    if (!earManager[i].probeChecker.captureReference()) { printlnf(Serial, "captureProbeReferences: *** ERROR ***: ear %d: no probe measurement yet.  Run $probe first.", i+1); continue; }
+    Fixed_String<16> fname;
+    Probe_Check_Settings::makeRefFilename(i, &fname);
+    if (!myState.ears[i].probe_check.saveReference(&sd, fname)) continue;
+    printlnf(Serial, "captureProbeReferences: ear %d: the last probe measurement is now the reference (saved to %s).", i+1, fname.c_str());
+    n_saved++;
+  }
+  bool all_have_ref = true;
+  for (int i=0; i < N_EARS; i++) all_have_ref = all_have_ref && myState.ears[i].probe_check.has_ref;
+  if (all_have_ref && !myState.probe_check_before_test) {
+    myState.probe_check_before_test = true;
+    Serial.println("captureProbeReferences: the probe check now runs before each test (\"$probe_auto 0\" to skip it).");
+  }
+  return n_saved;
+}
+
+//set the target loudness of the two tones (for all ears)
+void setTargetLevels_dBSPL(float f1_dBSPL, float f2_dBSPL) {
+  for (int i=0; i < N_EARS; i++) {
+    earManager[i].state->test_params.targ_f1_dBSPL = f1_dBSPL;
+    earManager[i].state->test_params.targ_f2_dBSPL = f2_dBSPL;
+    earManager[i].jumpToStep(earManager[i].state->cur_step_ind);  //play the tones at the new settings
+  }
+}
+
 //Print gain levels 
 void printGainLevels(void) {
-  Serial.print("Analog Input Gain (dB) = "); 
-  Serial.println(myState.input_gain_dB); //print text to Serial port for debugging
-  Serial.println("Overall Output (dB SPL): F1 = " + String(myState.test_params.targ_f1_dBSPL) + " dBFS" 
-                +", F2 = " + String(myState.test_params.targ_f2_dBSPL) + "dBFS");
-  Serial.println("Per-Frequency Cal (dBFS at 94dB SPL) = "); 
-  int n = myState.test_params.n_freqs;
-  float *f2_Hz = myState.test_params.targ_freq2_Hz;
-  float *amp1_dB = myState.test_params.cal_f1_dBFS_at_94dBSPL;
-  float *amp2_dB = myState.test_params.cal_f2_dBFS_at_94dBSPL;
-  for (int i=0; i<n; i++) {
-    Serial.println("    F2 = " + String(f2_Hz[i],0) + " Hz, " 
-                     + "F1 gain = " + String(amp1_dB[i],1) + " dB, "
-                     + "F2 gain = " + String(amp2_dB[i],1) + " dB");
+  printlnf(Serial, "Analog Input Gain (dB) = %.2f", myState.input_gain_dB);
+  for (int i_ear=0; i_ear < N_EARS; i_ear++) {
+    Test_Parameters &params = myState.ears[i_ear].test_params;
+    if (N_EARS > 1) printlnf(Serial, "Ear %d:", i_ear+1);
+    printlnf(Serial, "Overall Output (dB SPL): F1 = %.2f dBFS, F2 = %.2fdBFS", params.targ_f1_dBSPL, params.targ_f2_dBSPL);
+    Serial.println("Per-Frequency Cal (dBFS at 94dB SPL) = "); 
+    int n = params.n_freqs;
+    float *f2_Hz = params.targ_freq2_Hz;
+    float *amp1_dB = params.cal_f1_dBFS_at_94dBSPL;
+    float *amp2_dB = params.cal_f2_dBFS_at_94dBSPL;
+    for (int i=0; i<n; i++) {
+      printlnf(Serial, "    F2 = %.0f Hz, F1 gain = %.1f dB, F2 gain = %.1f dB", f2_Hz[i], amp1_dB[i], amp2_dB[i]);
+    }
   }
   //Serial.println(myState.digital_gain_dB); //print text to Serial port for debugging
 }
 
+//step all ears together (for manual stepping)
 int incrementFreqStep(int ind) {
-  return jumpToFreqStepAndPlayTones(myState.cur_step_ind + ind);
+  return jumpToFreqStepAndPlayTones(myState.selEar().cur_step_ind + ind);
 }
 
 int jumpToFreqStepAndPlayTones(int ind) {
-  myState.cur_step_ind = DPOAE_manager.testStep(ind,&(myState.tone_state));  //start test at step zero. output is through tone_state
-  tone_manager.setTones(myState.tone_state);      //play the tones selected by the DPOAE manager
-  tone_manager.printFrequencyValues();
-  return myState.cur_step_ind;
+  for (int i=0; i < N_EARS; i++) earManager[i].jumpToStep(ind);  //output is through each ear's tone_state
+  selEarManager().tone_manager.printFrequencyValues();
+  return myState.selEar().cur_step_ind;
 }
 
 bool muteOutput(bool please_mute) {
-  myState.tone_state.is_muted = please_mute;      //tell myState.tone_state whether we want to be muted (or not)
-  tone_manager.setTones(myState.tone_state);      //here's where we actually set the frequency and amplitudes to the values in myState.tone_state
-  return myState.tone_state.is_muted;             //return the value of whether we are muted or not
+  for (int i=0; i < N_EARS; i++) earManager[i].mute(please_mute);  //sets each ear's tone_state and then its tones
+  return please_mute;
+}
+
+//precompute one loop of each step's tones (one slot per step).  The tones are on FFT bins (see
+//dpoae_planFrequencies()), so they loop seamlessly every DPOAE_ASSUMED_NFFT samples.  If the memory
+//runs out, the steps without a slot just use the sine generators.
+int buildStimulusCache(void) {
+  Test_Parameters &params = myState.ears[0].test_params;  //every ear plays the same frequencies
+  int n_built = 0;
+  for (int i=0; i < min(params.n_freqs, STIM_CACHE_SLOTS); i++) {
+    float freq_Hz[2] = {params.targ_freq1_Hz[i], params.targ_freq2_Hz[i]};
+    if (stimCache.synthTones(i, sample_rate_Hz, DPOAE_ASSUMED_NFFT, 2, freq_Hz) >= 0) n_built++;
+  }
+  for (int i=0; i < N_EARS; i++) earManager[i].setStimulusCache(&stimCache);
+  printlnf(Serial, "buildStimulusCache: %d of %d steps precomputed", n_built, params.n_freqs);
+  return n_built;
+}
+
+//play the tones from the cache (or not), for all ears
+bool enableStimulusCache(bool enable) {
+  for (int i=0; i < N_EARS; i++) {
+    earManager[i].tone_manager.enableStimulusCache(enable);
+    earManager[i].jumpToStep(earManager[i].state->cur_step_ind);  //switch over now
+  }
+  return enable;
+}
+
+//load a stimulus (WAV file) from the SD card into a slot of the cache, by its SD index entry
+int loadStimulusFromSD(int slot, int entry_ind) {
+  SD_Index_Entry entry;
+  if (!beginSDIndex()) return -1;
+  if (!sdIndex.statFile(entry_ind, &entry)) { printlnf(Serial, "loadStimulusFromSD: *** ERROR ***: could not stat entry %d", entry_ind); return -1; }
+  for (int i=0; i < N_EARS; i++) { if (earManager[i].tone_manager.getBuffer() == stimCache.getSlot(slot)) earManager[i].tone_manager.playBuffer(NULL); }  //don't change it while it plays
+
+  //wait for the audio interrupt to take the stop before overwriting the buffer (even within a line of '$' commands,
+  //which otherwise holds the changes until the end of the line...see SerialManager::executeBatch())
+  bool was_held = paramUpdater.isHeld();
+  paramUpdater.hold(false);
+  const unsigned long timeout_millis = 200;
+  unsigned long start_millis = millis();
+  bool is_stopped = true;
+  for (int i=0; (i < N_EARS) && is_stopped; i++) {
+    while (earManager[i].tone_manager.isUpdatePending()) {
+      if ((millis() - start_millis) > timeout_millis) { is_stopped = false; break; }
+      delay(1);
+    }
+  }
+  paramUpdater.hold(was_held);
+  if (!is_stopped) { Serial.println("loadStimulusFromSD: *** ERROR ***: the audio did not stop playing the slot.  Is the audio running?"); return -1; }
+  return stimCache.loadWav(slot, &sd, entry.name, (int)(10.0f*sample_rate_Hz));  //at most 10 seconds
+}
+
+//play one slot of the cache directly (on all ears) at unity gain, or go back to the tones (slot < 0)
+int playStimulusSlot(int slot) {
+  const Stimulus_Buffer *buf = stimCache.getSlot(slot);
+  if ((slot >= 0) && (buf == NULL)) { printlnf(Serial, "playStimulusSlot: *** ERROR ***: slot %d is empty", slot); return -1; }
+  for (int i=0; i < N_EARS; i++) {
+    if (buf == NULL) { earManager[i].jumpToStep(earManager[i].state->cur_step_ind); continue; }
+    earManager[i].tone_manager.playBuffer(buf);
+  }
+  return slot;
+}
+
+void printStimulusCache(void) { stimCache.printSlots(&Serial); }
+
+//list the files on the SD card from the index (rather than walking the directory)
+bool beginSDIndex(void) {
+  audioSDWriter.prepareSDforRecording();  //starts the SD card, if not already started
+  return sdIndex.begin();
+}
+void listFilesFromIndex(void) {
+  if (!beginSDIndex()) return;
+  sdIndex.printNames(&Serial, ',');  //same format as SdFileTransfer::sendFilenames()
+}
+int listIndexEntries(int first_entry, int max_entries) {
+  if (!beginSDIndex()) return 0;
+  return sdIndex.printEntries(&Serial, first_entry, max_entries);
+}
+void statIndexEntry(int entry_ind) {
+  SD_Index_Entry entry;
+  if (!beginSDIndex()) return;
+  if ((entry_ind == rec_index_entry) && (audioSDWriter.getState() == AudioSDWriter::STATE::RECORDING)) {  //don't read it while it is being written (it would hold up the SD writer)
+    if (!sdIndex.getEntry(entry_ind, &entry)) { printlnf(Serial, "SD_Index: stat: *** ERROR ***: could not read entry %d", entry_ind); return; }
+    printlnf(Serial, "SD_Index: stat: %d, %s, %lu, %08lX, %d", entry_ind, entry.name, 0UL, 0UL, 1);  //no size or CRC yet
+    return;
+  }
+  if (!sdIndex.statFile(entry_ind, &entry)) { printlnf(Serial, "SD_Index: stat: *** ERROR ***: could not stat entry %d", entry_ind); return; }
+  printlnf(Serial, "SD_Index: stat: %d, %s, %lu, %08lX, %d", entry_ind, entry.name, (unsigned long)entry.size_bytes, (unsigned long)entry.content_crc, 0);
+}
+int rebuildSDIndex(void) {
+  if (!beginSDIndex()) return -1;
+  return sdIndex.rebuild();
+}
+
+//print the results log (see Results_Log.h)
+int printResultsSince(int first_record, int max_records) {
+  if (!beginSDIndex() || !resultsLog.begin()) return 0;
+  return resultsLog.printRecordsSince(&Serial, (uint32_t)max(first_record, 0), max_records);
+}
+int printSessionResults(int session_id) {
+  if (!beginSDIndex() || !resultsLog.begin()) return 0;
+  return resultsLog.printSession(&Serial, (uint32_t)max(session_id, 0));
 }
 
 bool enablePrintLevelsToGUI(bool please_print) { 
   return myState.printLevelsToGUI = please_print; 
 }
+
+bool enableSpectrum(bool please_show) {
+  for (int i=0; i < N_EARS; i++) {
+    earManager[i].spectrumMonitor->clearAverage();          //start fresh each time
+    earManager[i].spectrumMonitor->enable(please_show);     //the audio interrupt only collects frames when enabled
+  }
+  scheduler.setPeriod_millis(spectrumSendTask, (unsigned long)(1000.0f / myState.spectrum_rate_Hz));  //in case the rate changed
+  return myState.showSpectrum = please_show;
+}
  
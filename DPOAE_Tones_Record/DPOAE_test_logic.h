@@ -1,8 +1,195 @@
 
-const int sd_start_millis = 2000; //dead period after starting SD recording prior to tones starting
-const int tone_dur_millis = 3000; //duration of tone
-const int silence_dur_millis = 1000; //duration of silence between tones
-const float fade_msec = 50.0; //length of fade in and fade out of tones
+int sd_start_millis = DPOAE_DEFAULT_SDSTART_MSEC; //dead period after starting SD recording prior to tones starting (can be changed via "$sdstart_ms")
+int tone_dur_millis = DPOAE_DEFAULT_TONE_MSEC; //duration of tone (can be changed via "$tone_ms")
+int silence_dur_millis = DPOAE_DEFAULT_SILENCE_MSEC; //duration of silence between tones (can be changed via "$silence_ms")
+const float fade_msec = DPOAE_FADE_MSEC; //length of fade in and fade out of tones
+int max_tone_extend_millis = 2000; //most that a tone can be extended to make up for noisy audio that was rejected (can be changed via "$extend_ms")
+
+int rec_index_entry = -1;  //the SD index's entry for the current recording (see SD_Index.h)
+uint32_t test_start_sec = 0;           //when the current test's recording started (real-time clock)...
+unsigned long test_start_millis = 0;   //...and by millis(), for the times of each step (see Results_Log.h)
+uint32_t test_session_id = 0;          //the session that the current test is a run of (zero if none), kept in case the session is stopped first
+
+//start and stop the SD recording, along with each ear's log of the rejected audio blocks (see Artifact_Log.h).
+//The file name comes from the SD index, so that the writer doesn't have to search the card for a free name.  The
+//writer would replace a file of the same name, so that one name is checked first, in case the index is out of date.
+void startTestRecording(void) {
+  rec_index_entry = -1;
+  test_start_sec = (uint32_t)Teensy3Clock.get();
+  test_start_millis = millis();
+  test_session_id = (uint32_t)sessionQueue.getSessionNum();
+  if (beginSDIndex()) {
+    char fname[SD_INDEX_NAME_LEN];
+    strncpy(fname, sdIndex.getNextRecordingName(), SD_INDEX_NAME_LEN-1); fname[SD_INDEX_NAME_LEN-1] = '\0';
+    if (sd.exists(fname)) {  //the index is out of date (the card was changed elsewhere)
+      printlnf(Serial, "startTestRecording: %s is already on the SD card.  Rebuilding the SD index...", fname);
+      sdIndex.rebuild();
+      strncpy(fname, sdIndex.getNextRecordingName(), SD_INDEX_NAME_LEN-1); fname[SD_INDEX_NAME_LEN-1] = '\0';
+    }
+    if (sd.exists(fname)) {
+      printlnf(Serial, "startTestRecording: *** ERROR ***: %s is still on the SD card.  Not recording.", fname);
+    } else {
+      audioSDWriter.startRecording(fname);
+      if (audioSDWriter.getState() == AudioSDWriter::STATE::RECORDING) rec_index_entry = sdIndex.addRecording(fname);
+    }
+  } else {
+    audioSDWriter.startRecording();  //fall back to letting the writer choose the name
+  }
+  audioSDWriter.setSDRecordingButtons();
+  for (int i=0; i < N_EARS; i++) {
+    earManager[i].artifactLog.startRecording(audioSDWriter.getCurrentFilename().c_str(), earManager[i].artifactMonitor->getBlockCount());
+    earManager[i].artifactLog.setTiming_msec(sd_start_millis, tone_dur_millis, silence_dur_millis);  //(they can't change while the test runs)
+  }
+}
+void stopTestRecording(void) {
+  if (audioSDWriter.getState() != AudioSDWriter::STATE::RECORDING) return;
+  audioSDWriter.stopRecording();audioSDWriter.setSDRecordingButtons();   //stop SD recording
+  if (rec_index_entry >= 0) {  //record the final size in the SD index
+    FsFile file = sd.open(audioSDWriter.getCurrentFilename().c_str(), O_RDONLY);
+    if (file) { sdIndex.closeFile(rec_index_entry, (uint32_t)file.fileSize()); file.close(); }
+  }
+  for (int i=0; i < N_EARS; i++) {
+    Fixed_String<24> suffix("_flags.csv");
+    if (N_EARS > 1) suffix.printf("_ear%d_flags.csv", i+1);
+    Artifact_Log &log = earManager[i].artifactLog;
+    log.stopRecording();
+    if (log.writeSidecar(&sd, record_settings.sample_rate_Hz, record_settings.audio_block_samples, earManager[i].artifactMonitor->getThreshold_dB(), sample_rate_Hz, suffix.c_str()) >= 0) {  //save the flags next to the WAV file (in the WAV file's samples), with the rate that the tones were planned for
+      int ind = sdIndex.addFile(log.getSidecarFilename(), log.getSidecarBytes());
+      if (ind >= 0) sdIndex.closeFile(ind, log.getSidecarBytes());
+    }
+  }
+}
+
+//start and stop a recording from the App's SD buttons (see AudioSDWriter_Indexed_UI in AudioProcessing.h).  The test
+//owns the recording while it runs, so these do nothing then.
+bool startManualRecording(void) {
+  if (myState.cur_test_state != State::TEST_OFF) { Serial.println("startManualRecording: *** ERROR ***: the test is running, and it records on its own"); return false; }
+  if (audioSDWriter.getState() == AudioSDWriter::STATE::RECORDING) return true;
+  startTestRecording();
+  return (audioSDWriter.getState() == AudioSDWriter::STATE::RECORDING);
+}
+bool stopManualRecording(void) {
+  if (myState.cur_test_state != State::TEST_OFF) { Serial.println("stopManualRecording: *** ERROR ***: the test is running.  Stop the test instead."); return false; }
+  stopTestRecording();
+  return true;
+}
+
+//print each ear's results from the most recent test
+void printTestResults(void) {
+  for (int i_ear=0; i_ear < N_EARS; i_ear++) {
+    Ear_State &ear = myState.ears[i_ear];
+    printlnf(Serial, "Test results (ear %d): F2 (Hz), mic level at end of tone (dBFS), rejected (msec), mic peak (dBFS), clipped blocks, DP (dBFS), SNR (dB)", i_ear+1);
+    for (int i=0; i < ear.test_params.n_freqs; i++) {
+      printlnf(Serial, "    %.0f, %.1f, %d, %.1f, %d, %.1f, %.1f", ear.test_params.targ_freq2_Hz[i], ear.step_level_dB[i], ear.step_rejected_millis[i],
+               ear.step_peak_dBFS[i], ear.step_clipped_blocks[i], ear.step_dp_dBFS[i], ear.step_dp_dBFS[i] - ear.step_noise_dBFS[i]);
+    }
+  }
+}
+
+//add each ear's results from the most recent test to the results log (see Results_Log.h).  Steps that
+//were never reached (because the test was stopped) are left out.  Call this after the recording has stopped.
+int logTestResults(void) {
+  if (!beginSDIndex() || !resultsLog.begin()) { Serial.println("logTestResults: *** ERROR ***: could not open the results log"); return 0; }
+  Results_Record records[N_EARS*N_F2];
+  int n = 0;
+  for (int i_ear=0; i_ear < N_EARS; i_ear++) {
+    const Ear_State &ear = myState.ears[i_ear];
+    const Test_Parameters &p = ear.test_params;
+    for (int i=0; i < p.n_freqs; i++) {
+      if (ear.step_level_dB[i] < -999.0f) continue;  //never reached
+      Results_Record &r = records[n++];
+      r.session_id = test_session_id;
+      r.start_sec = test_start_sec;
+      r.step_millis = (uint32_t)(ear.step_end_millis[i] - test_start_millis);
+      r.wav_entry = (rec_index_entry >= 0) ? (uint32_t)rec_index_entry : RESULTS_NO_ENTRY;
+      r.ear = i_ear; r.step = i;
+      r.protocol = (sample_rate_Hz >= (float)DPOAE_EHF_MIN_FS_HZ) ? RESULTS_PROTOCOL_EHF : RESULTS_PROTOCOL_STANDARD;
+      if (ear.step_clipped_blocks[i] > 0) r.flags |= RESULTS_FLAG_CLIPPED;
+      if (ear.step_rejected_millis[i] > max_tone_extend_millis) r.flags |= RESULTS_FLAG_NOISY;
+      if (p.is_cal_from_curve[0]) r.flags |= RESULTS_FLAG_CAL_CURVE_F1;
+      if (p.is_cal_from_curve[1]) r.flags |= RESULTS_FLAG_CAL_CURVE_F2;
+      r.f1_Hz = p.targ_freq1_Hz[i]; r.f2_Hz = p.targ_freq2_Hz[i];
+      r.f1_cdBSPL = Results_Log::to_cdB(p.targ_f1_dBSPL); r.f2_cdBSPL = Results_Log::to_cdB(p.targ_f2_dBSPL);
+      r.cal1_cdB = Results_Log::to_cdB(p.cal_f1_dBFS_at_94dBSPL[i]); r.cal2_cdB = Results_Log::to_cdB(p.cal_f2_dBFS_at_94dBSPL[i]);
+      r.mic_cdBFS = Results_Log::to_cdB(ear.step_level_dB[i]); r.peak_cdBFS = Results_Log::to_cdB(ear.step_peak_dBFS[i]);
+      r.dp_cdBFS = Results_Log::to_cdB(ear.step_dp_dBFS[i]); r.noise_cdBFS = Results_Log::to_cdB(ear.step_noise_dBFS[i]);
+      r.rejected_millis = (uint16_t)constrain(ear.step_rejected_millis[i], 0, 65535);
+      r.clipped_blocks = (uint16_t)constrain(ear.step_clipped_blocks[i], 0, 65535);
+    }
+  }
+  uint32_t first_record = resultsLog.getNumRecords();
+  int n_added = resultsLog.appendTest(records, n);
+  if (n_added > 0) printlnf(Serial, "logTestResults: added records %lu to %lu to %s", (unsigned long)first_record, (unsigned long)(first_record + n_added - 1), RESULTS_LOG_FNAME);
+  return n_added;
+}
+
+//the default cal tables (see DPOAE_Settings_Manager.h) were measured at the standard frequencies, so an extended
+//high-frequency test needs every speaker's cal to come from CalibrateIO's curves ("$cal_load").  Returns false if not.
+bool isCalReadyForTest(void) {
+  if (sample_rate_Hz < (float)DPOAE_EHF_MIN_FS_HZ) return true;  //the standard protocol
+  bool is_ready = true;
+  for (int i_ear=0; i_ear < N_EARS; i_ear++) {
+    for (int chan=0; chan < 2; chan++) {
+      if (myState.ears[i_ear].test_params.is_cal_from_curve[chan]) continue;
+      printlnf(Serial, "isCalReadyForTest: *** ERROR ***: ear %d, F%d: the cal is not from a CalibrateIO curve, so it is wrong for the extended high frequencies.  Use \"$cal_load\".", i_ear+1, chan+1);
+      is_ready = false;
+    }
+  }
+  return is_ready;
+}
+
+//step one ear through its tones and silences.  Each ear keeps its own timing, so that
+//extending one ear's tone (to make up for rejected audio) doesn't hold up the other ear.
+//Returns true if this ear started a new tone.
+bool serviceEarStep(Ear_Manager &ear, unsigned long curTime_millis) {
+  Ear_State &st = *(ear.state);
+  if (curTime_millis < st.lastTransition_millis) st.lastTransition_millis = curTime_millis; //prevent wrap-around problems
+  unsigned long delta_millis = curTime_millis - st.lastTransition_millis;
+
+  switch (st.step_state) {
+    case (Ear_State::STEP_TONE): {
+      //extend the tone by however much audio was rejected as noisy (up to a limit)
+      int rejected_millis = ear.getRejectedMillis();
+      int extended_millis = min(rejected_millis, max_tone_extend_millis);
+      if (delta_millis >= (unsigned long)(tone_dur_millis + extended_millis)) {
+        st.step_level_dB[st.cur_step_ind] = ear.leq->getCurrentLevel_dB();
+        st.step_rejected_millis[st.cur_step_ind] = rejected_millis;
+        st.step_end_millis[st.cur_step_ind] = curTime_millis;
+        ear.finishDPMeasurement(st.tone_state.freq1_Hz, st.tone_state.freq2_Hz, &st.step_dp_dBFS[st.cur_step_ind], &st.step_noise_dBFS[st.cur_step_ind]);
+        ear.serviceBlockStats();  //every block of the tone, up to now
+        st.step_peak_dBFS[st.cur_step_ind] = ear.tone_stats.getPeak_dBFS(0);
+        st.step_clipped_blocks[st.cur_step_ind] = ear.tone_stats.getClippedCount(0);
+        if (ear.tone_stats.getClippedCount(0) > 0) printlnf(Serial, "serviceSteppedTest: ear %d, step %d: *** WARNING ***: the mic clipped in %d of %d blocks.  Lower the input gain or the tones.",
+                                          (int)(&st - myState.ears)+1, st.cur_step_ind+1, ear.tone_stats.getClippedCount(0), ear.tone_stats.getBlockCount());
+        if (ear.tone_stats.getMissedCount() > 0) printlnf(Serial, "serviceSteppedTest: ear %d, step %d: %d blocks were not measured (loop() fell behind)",
+                                          (int)(&st - myState.ears)+1, st.cur_step_ind+1, ear.tone_stats.getMissedCount());
+        ear.artifactLog.addStep(st.cur_step_ind, rejected_millis, extended_millis);
+        if (rejected_millis > 0) printlnf(Serial, "serviceSteppedTest: ear %d, step %d: rejected %d msec of noisy audio, extended the tone by %d msec", 
+                                          (int)(&st - myState.ears)+1, st.cur_step_ind+1, rejected_millis, extended_millis);
+        ear.fadeOut(fade_msec);
+        st.step_state = Ear_State::STEP_SILENCE;
+        st.lastTransition_millis = curTime_millis;
+      }
+      break;
+    }
+    case (Ear_State::STEP_SILENCE):
+      if (delta_millis >= silence_dur_millis) {
+        if (st.cur_step_ind >= (st.test_params.n_freqs - 1)) {
+          st.step_state = Ear_State::STEP_DONE;  //this ear is finished
+        } else {
+          //increment to the next tone
+          ear.jumpToStep(st.cur_step_ind + 1);
+          ear.tone_manager.printFrequencyValues();
+          ear.fadeIn(fade_msec);
+          ear.startTone(curTime_millis);
+          return true;
+        }
+        st.lastTransition_millis = curTime_millis;
+      }
+      break;
+  }
+  return false;
+}
 
 //update the state of the stepped DPOAE test
 int serviceSteppedTest(unsigned long curTime_millis) {
@@ -17,60 +204,108 @@ int serviceSteppedTest(unsigned long curTime_millis) {
       break;
     case (State::TEST_STARTING):
       muteOutput(true); //this mutes any tones
-      audioSDWriter.startRecording();audioSDWriter.setSDRecordingButtons(); //start SD recording
-      audioSDWriter.setSDRecordingButtons();
-      myState.cur_test_state = State::TEST_SDSTART;
+      if (!myState.probe_check_only) {  //a new test, so forget the last one's results (even if the probe check stops this one)
+        for (int i=0; i < N_EARS; i++) earManager[i].state->clearResults();
+        if (!isCalReadyForTest()) {
+          Serial.println("serviceSteppedTest: test not started.");
+          myState.cur_test_state = State::TEST_OFF;  //nothing was started, so there is nothing to stop
+          update_gui = true;
+          break;
+        }
+      }
+      if (myState.probe_check_before_test || myState.probe_check_only) {
+        //check the probe fit (of every ear) before recording anything
+        for (int i=0; i < N_EARS; i++) {
+          earManager[i].artifactMonitor->enable(false);  //the chirp is broadband, so it would all look like noise
+          earManager[i].probeChecker.start(curTime_millis);
+        }
+        myState.cur_test_state = State::TEST_PROBECHECK;
+      } else {
+        startTestRecording();
+        myState.cur_test_state = State::TEST_SDSTART;
+      }
       lastTransition_millis = curTime_millis;
       update_gui = true;
       break;
+    case (State::TEST_PROBECHECK): {
+      bool is_running = false, all_passed = true;
+      for (int i=0; i < N_EARS; i++) {
+        if (earManager[i].probeChecker.service(curTime_millis) == Probe_Checker::RESULT_RUNNING) is_running = true;
+        if (earManager[i].probeChecker.getResult() != Probe_Checker::RESULT_PASS) all_passed = false;
+      }
+      if (!is_running) {
+        for (int i=0; i < N_EARS; i++) {
+          if (N_EARS > 1) printlnf(Serial, "serviceSteppedTest: ear %d:", i+1);
+          earManager[i].probeChecker.printResult(&Serial);
+          earManager[i].artifactMonitor->enable(myState.reject_noisy_blocks);  //back to the user's setting
+        }
+        if (all_passed && (!myState.probe_check_only)) {
+          startTestRecording();  //good fit, so start SD recording
+          myState.cur_test_state = State::TEST_SDSTART;
+        } else {
+          if (!myState.probe_check_only) Serial.println("serviceSteppedTest: probe check failed.  Refit the probe and start the test again.");
+          myState.probe_check_only = false;
+          myState.cur_test_state = State::TEST_OFF;  //nothing was recorded, so there is nothing to stop
+        }
+        lastTransition_millis = curTime_millis;
+        update_gui = true;
+      }
+      break;
+    }
    case (State::TEST_SDSTART):
       if (delta_millis >= sd_start_millis) {
-        //transition to silence
+        //start every ear at the first tone
         muteOutput(false); //this unmutes the tones
         jumpToFreqStepAndPlayTones(0);  //start the test
-        fade1.fadeIn_msec(fade_msec); fade2.fadeIn_msec(fade_msec);
+        for (int i=0; i < N_EARS; i++) { earManager[i].fadeIn(fade_msec); earManager[i].startTone(curTime_millis); }
         myState.cur_test_state = State::TEST_TONE;
         lastTransition_millis = curTime_millis;
         update_gui = true;
       }
       break;
     case (State::TEST_SILENCE):
-      if (delta_millis >= silence_dur_millis) {
-        //increment to the next tone
-        if (myState.cur_step_ind >= (myState.test_params.n_freqs - 1)) {
-          stop_DPOAE_test();
-        } else {
-          incrementFreqStep(+1);
-          fade1.fadeIn_msec(fade_msec); fade2.fadeIn_msec(fade_msec);
-          //muteOutput(false); //this unmutes the tones
-          myState.cur_test_state = State::TEST_TONE;
-          update_gui = true;
-        }
-        lastTransition_millis = curTime_millis;
+    case (State::TEST_TONE): {
+      //step each ear on its own
+      bool any_tone = false, all_done = true;
+      for (int i=0; i < N_EARS; i++) {
+        if (serviceEarStep(earManager[i], curTime_millis)) update_gui = true;
+        if (myState.ears[i].step_state == Ear_State::STEP_TONE) any_tone = true;
+        if (myState.ears[i].step_state != Ear_State::STEP_DONE) all_done = false;
       }
-      break;
-    case (State::TEST_TONE):
-      if (delta_millis >= tone_dur_millis) {
-        //muteOutput(true); //this mutes the tones (ie, goes to silence)
-        fade1.fadeOut_msec(fade_msec); fade2.fadeOut_msec(fade_msec);
-        //update_gui = true;
-        myState.cur_test_state = State::TEST_SILENCE;
-        lastTransition_millis = curTime_millis;
+      if (all_done) {
+        stop_DPOAE_test();
+      } else {
+        int new_state = any_tone ? State::TEST_TONE : State::TEST_SILENCE;
+        if (new_state != myState.cur_test_state) { myState.cur_test_state = new_state; lastTransition_millis = curTime_millis; }
       }
       break;
-    case (State::TEST_STOPPING):
+    }
+    case (State::TEST_STOPPING): {
+      bool was_stepping = false;
+      for (int i=0; i < N_EARS; i++) {
+        Ear_Manager &ear = earManager[i];
+        ear.probeChecker.abort();  //in case we were stopped during the probe check
+        ear.abortDPMeasurement();  //in case we were stopped during a tone
+        ear.artifactMonitor->enable(myState.reject_noisy_blocks);  //in case we were stopped during the probe check
+        ear.fadeIn(0.0);  //snap the faders back open
+        if (ear.state->step_state != Ear_State::STEP_IDLE) was_stepping = true;
+        ear.state->step_state = Ear_State::STEP_IDLE;
+      }
+      myState.probe_check_only = false;
       muteOutput(true);
-      fade1.fadeIn_msec(0.0); fade2.fadeIn_msec(0.0);  //snap the faders back open
-      audioSDWriter.stopRecording();audioSDWriter.setSDRecordingButtons();   //stop SD recording
+      stopTestRecording();
+      if (was_stepping) { printTestResults(); logTestResults(); }
       myState.cur_test_state = State::TEST_OFF;
       lastTransition_millis = curTime_millis;
       update_gui = true;
       break;
+    }
   }
 
   //do we need to update the GUI for the new state?
   if (update_gui) {
     serialManager.updateDPOAEStatus();
+    serialManager.updateProbeCheckDisplay();
     //serialManager.updateCalDisplay();
     //serialManager.updateDPOAEDisplay();
     //serialManager.updateMuteDisplay();
@@ -78,3 +313,140 @@ int serviceSteppedTest(unsigned long curTime_millis) {
 
   return myState.cur_test_state;
 }
+
+
+// ///////////////// Session queue: several tests back to back, from a plan on the SD card (see Session_Queue.h)
+
+bool session_probe_checked = false;                //was the probe checked before the current run?
+Fixed_String<SESSION_NAME_LEN> session_wav_name;   //the current run's recording (empty if nothing was recorded)
+
+//load a plan (PLAN.TXT, or PLANn.TXT for n > 0) and start running it.  Every item is checked before any of them runs.
+bool startSession(int plan_num) {
+  if (sessionQueue.isActive() || (myState.cur_test_state != State::TEST_OFF)) { Serial.println("startSession: *** ERROR ***: a test or session is already running"); return false; }
+  if (!beginSDIndex()) { Serial.println("startSession: *** ERROR ***: could not start the SD card"); return false; }
+  Fixed_String<16> fname("PLAN.TXT");
+  if (plan_num > 0) fname.printf("PLAN%d.TXT", plan_num);
+  if (sessionQueue.load(&sd, fname) < 1) return false;
+  for (int i=0; i < sessionQueue.getNumItems(); i++) {
+    const Session_Item &item = sessionQueue.getItem(i);
+    if (!serialManager.runCommandLine(item.cmds, false)) {  //check it, but don't run it yet
+      printlnf(Serial, "startSession: *** ERROR ***: %s, line %d: bad command.  Nothing started.", fname.c_str(), item.line_num);
+      return false;
+    }
+  }
+  if (!sessionQueue.begin(&sd)) return false;
+  printlnf(Serial, "startSession: running %d items from %s (summary will be %s)", sessionQueue.getNumItems(), fname.c_str(), sessionQueue.getSummaryFilename());
+  return true;
+}
+
+void printSessionStatus(void) { sessionQueue.printStatus(&Serial); }
+
+//did the test that just finished pass?  If not, reason says why.
+bool evaluateSessionRun(bool probe_checked, const char **reason) {
+  for (int i_ear=0; i_ear < N_EARS; i_ear++) {
+    if (probe_checked && (earManager[i_ear].probeChecker.getResult() != Probe_Checker::RESULT_PASS)) { *reason = "probe fit"; return false; }
+  }
+  for (int i_ear=0; i_ear < N_EARS; i_ear++) {
+    const Ear_State &ear = myState.ears[i_ear];
+    for (int i=0; i < ear.test_params.n_freqs; i++) {
+      if (ear.step_level_dB[i] < -999.0f) { *reason = "stopped early"; return false; }
+      if (ear.step_clipped_blocks[i] > 0) { *reason = "clipped"; return false; }
+      if (ear.step_rejected_millis[i] > max_tone_extend_millis) { *reason = "too noisy"; return false; }  //more was rejected than the tone could be extended by
+    }
+  }
+  *reason = "";
+  return true;
+}
+
+//write one run's results (next to its WAV file) and add it to the SD index
+void writeSessionRunResults(int run_ind, const char *wav_name, bool passed, const char *reason) {
+  Fixed_String<SESSION_NAME_LEN> fname;
+  sessionQueue.getRunFilename(run_ind, &fname);
+  FsFile file = sd.open(fname.c_str(), O_WRONLY | O_CREAT | O_TRUNC);
+  if (!file) { printlnf(Serial, "writeSessionRunResults: *** ERROR ***: could not open %s", fname.c_str()); return; }
+  const Session_Item &item = sessionQueue.getCurrentItem();
+  printlnf(file, "# item %d (line %d): %s", sessionQueue.getCurrentItemIndex()+1, item.line_num, item.cmds);
+  printlnf(file, "# recording, %s", wav_name);
+  printlnf(file, "# result, %s%s%s", passed ? "pass" : "fail", passed ? "" : ", ", reason);
+  file.println("ear, step, F1 (Hz), F2 (Hz), F1 (dB SPL), F2 (dB SPL), F1 cal (dBFS at 94dB SPL), F2 cal (dBFS at 94dB SPL), mic level (dBFS), rejected (msec), mic peak (dBFS), clipped blocks");
+  for (int i_ear=0; i_ear < N_EARS; i_ear++) {
+    const Ear_State &ear = myState.ears[i_ear];
+    const Test_Parameters &p = ear.test_params;
+    for (int i=0; i < p.n_freqs; i++) {
+      printlnf(file, "%d, %d, %.2f, %.2f, %.1f, %.1f, %.2f, %.2f, %.2f, %d, %.2f, %d", i_ear+1, i+1, p.targ_freq1_Hz[i], p.targ_freq2_Hz[i],
+               p.targ_f1_dBSPL, p.targ_f2_dBSPL, p.cal_f1_dBFS_at_94dBSPL[i], p.cal_f2_dBFS_at_94dBSPL[i],
+               ear.step_level_dB[i], ear.step_rejected_millis[i], ear.step_peak_dBFS[i], ear.step_clipped_blocks[i]);
+    }
+  }
+  uint32_t n_bytes = (uint32_t)file.fileSize();
+  file.close();
+  int ind = sdIndex.addFile(fname.c_str(), n_bytes);
+  if (ind >= 0) sdIndex.closeFile(ind, n_bytes);
+}
+
+//write the summary of every run and add it to the SD index
+void writeSessionSummary(void) {
+  if (!sessionQueue.writeSummary(&sd, &Serial)) return;
+  FsFile file = sd.open(sessionQueue.getSummaryFilename(), O_RDONLY);
+  uint32_t n_bytes = file ? (uint32_t)file.fileSize() : 0;
+  if (file) file.close();
+  int ind = sdIndex.addFile(sessionQueue.getSummaryFilename(), n_bytes);
+  if (ind >= 0) sdIndex.closeFile(ind, n_bytes);
+}
+
+//end the current run: save its results, then go on to the next run (or finish the session)
+void finishSessionRun(bool passed, const char *reason, unsigned long curTime_millis) {
+  int run_ind = sessionQueue.getNumRuns();
+  writeSessionRunResults(run_ind, session_wav_name.c_str(), passed, reason);
+  printlnf(Serial, "serviceSession: run %d (item %d): %s%s%s", run_ind+1, sessionQueue.getCurrentItemIndex()+1, passed ? "pass" : "fail", passed ? "" : ", ", reason);
+  sessionQueue.finishRun(passed, reason, session_wav_name.c_str(), curTime_millis);
+  if (!sessionQueue.isActive()) writeSessionSummary();
+}
+
+//stop the session.  The test that is running is stopped, too, and counted as a failed run.  Its results and the
+//summary are only written once the test is back to TEST_OFF (see serviceSession()), so that they don't go to the
+//SD card while it is still recording.
+void stopSession(void) {
+  if (!sessionQueue.isActive()) return;
+  if (sessionQueue.getState() == Session_Queue::RUNNING) {
+    sessionQueue.requestStop();
+    stop_DPOAE_test();
+    return;
+  }
+  sessionQueue.stop();
+  writeSessionSummary();
+}
+
+//start each run once the previous test is finished, and judge each run once its test is finished
+void serviceSession(unsigned long curTime_millis) {
+  switch (sessionQueue.getState()) {
+    case (Session_Queue::READY):
+      if (myState.cur_test_state != State::TEST_OFF) return;  //wait for the last test to wind down
+      sessionQueue.startRun(curTime_millis);
+      sessionQueue.printStatus(&Serial);
+      session_wav_name.clear();
+      if (!serialManager.runCommandLine(sessionQueue.getCurrentItem().cmds, true)) { finishSessionRun(false, "bad command", curTime_millis); return; }
+      session_probe_checked = myState.probe_check_before_test;
+      start_DPOAE_test();
+      break;
+    case (Session_Queue::RUNNING):
+      if (myState.cur_test_state != State::TEST_OFF) {  //still going
+        if (audioSDWriter.getState() == AudioSDWriter::STATE::RECORDING) session_wav_name.printf("%s", audioSDWriter.getCurrentFilename().c_str());
+        return;
+      }
+      if (sessionQueue.isStopRequested()) {  //see stopSession()
+        finishSessionRun(false, "stopped", curTime_millis);
+        if (sessionQueue.isActive()) {  //(it would have gone on to another run)
+          sessionQueue.stop();
+          writeSessionSummary();
+        }
+        return;
+      }
+      {
+        const char *reason = "";
+        bool passed = evaluateSessionRun(session_probe_checked, &reason);
+        finishSessionRun(passed, reason, curTime_millis);
+      }
+      break;
+  }
+}
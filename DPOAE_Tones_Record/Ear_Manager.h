@@ -0,0 +1,156 @@
+/*
+ Ear_Manager.h
+
+ Purpose: Hold all of the pieces that belong to one ear (ie, one DPOAE probe) so
+          that the same code can run one ear or both ears at once (binaural).
+
+ Each ear has its own pair of tones (and its own player for precomputed stimuli), its own faders,
+     its own per-block measurements of its two inputs (see AudioBlockStats_F32.h), its own calibration tables
+     (in its Ear_State), its own artifact monitor and spectrum monitor (on its own
+     probe mic), and its own probe-fit check and artifact log.
+
+ During each tone of the test, the ear borrows its spectrum monitor (as the probe-fit
+     check does) to average every unrejected frame of the tone, so that the level of
+     the distortion product (at 2*F1-F2) and the noise floor around it can be saved
+     with the results (see Results_Log.h).  The noise is the mean power of the bins
+     near the DP's bin, skipping the DP's bin and any bin next to F1.  The main sketch
+     creates one Ear_Manager per ear (see N_EARS in DPOAE_Tones_Record.ino).
+
+ MIT License, Use at your own risk.
+*/
+
+#ifndef _Ear_Manager_h
+#define _Ear_Manager_h
+
+#include "State.h"
+#include "Tone_Manager.h"
+#include "DPOAE_Settings_Manager.h"
+#include "Probe_Check.h"
+#include "Artifact_Log.h"
+
+#define EAR_DP_NOT_MEASURED     (-999.9f)
+#define EAR_DP_NOISE_MIN_BINS   2    //the noise is measured from this many bins away from the DP...
+#define EAR_DP_NOISE_MAX_BINS   6    //...out to this many bins (on both sides)
+
+class Ear_Manager {
+  public:
+    Ear_Manager(Ear_State *_state, AudioSynthWaveform_F32 *sine_f1, AudioSynthWaveform_F32 *sine_f2,
+                AudioEffectFade_F32 *_fade_f1, AudioEffectFade_F32 *_fade_f2, AudioCalcLeq_F32 *_leq,
+                AudioArtifactMonitor_F32 *_artifactMonitor, AudioSpectrumMonitor_F32 *_spectrumMonitor,
+                AudioSynthChirp_F32 *chirp, AudioStimulusPlayer_F32 *_stimPlayer, AudioBlockStats_F32 *_blockStats, float fs_Hz) :
+        state(_state), dpoae_manager(&(_state->test_params)), tone_manager(sine_f1, sine_f2, _fade_f1, _fade_f2, fs_Hz),
+        probeChecker(chirp, _spectrumMonitor, &(_state->probe_check)),
+        leq(_leq), artifactMonitor(_artifactMonitor), spectrumMonitor(_spectrumMonitor),
+        stimPlayer(_stimPlayer), blockStats(_blockStats) {
+      blockStats->setStimulusSource(tone_manager.getStimState());  //each block's record says what this ear was playing
+    };
+
+    Ear_State *state;
+    DPOAE_Settings_Manager dpoae_manager;
+    Tone_Manager tone_manager;
+    Probe_Checker probeChecker;
+    Artifact_Log artifactLog;
+
+    //go to the given test step and play its tones.  Returns the step that was actually chosen.
+    int jumpToStep(int step_ind) {
+      state->cur_step_ind = dpoae_manager.testStep(step_ind, &(state->tone_state));  //output is through tone_state
+      tone_manager.setTones(state->tone_state);
+      artifactMonitor->setStimulusFreqs(state->tone_state.freq1_Hz, state->tone_state.freq2_Hz); //so that the tones don't look like noise
+      return state->cur_step_ind;
+    }
+    //play the tones from this cache whenever it has them (see Tone_Manager.h)
+    void setStimulusCache(const Stimulus_Cache *cache) { tone_manager.setStimulusCache(stimPlayer, cache); }
+
+    bool mute(bool please_mute) { state->tone_state.is_muted = please_mute; tone_manager.setTones(state->tone_state); return please_mute; }
+    void fadeIn(float msec) { tone_manager.fadeIn(msec); }    //with any tone change, at the next block (see Tone_Manager.h)
+    void fadeOut(float msec) { tone_manager.fadeOut(msec); }
+
+    //how much of the current tone has been rejected as noisy
+    int getRejectedMillis(void) {
+      return (int)(1000.0f * artifactMonitor->getBlockDuration_sec() * (float)(artifactMonitor->getFlaggedBlockCount() - state->toneStart_flagged));
+    }
+    void startTone(unsigned long curTime_millis) {
+      serviceBlockStats();  //finish with the blocks from before this tone
+      tone_stats.reset();
+      startDPMeasurement();
+      state->step_state = Ear_State::STEP_TONE;
+      state->toneStart_flagged = artifactMonitor->getFlaggedBlockCount();
+      state->lastTransition_millis = curTime_millis;
+    }
+
+    //measure the DP and the noise around it over the whole tone.  finishDPMeasurement() returns false (and
+    //EAR_DP_NOT_MEASURED) if no frame was averaged (such as when every block of the tone was rejected).
+    void startDPMeasurement(void) {
+      if (!is_measuring_dp) was_spectrum_enabled = spectrumMonitor->isEnabled();
+      spectrumMonitor->enable(true);
+      spectrumMonitor->setRunningMean(true);
+      spectrumMonitor->clearAverage();
+      is_measuring_dp = true;
+    }
+    bool finishDPMeasurement(float f1_Hz, float f2_Hz, float *dp_dBFS, float *noise_dBFS) {
+      *dp_dBFS = EAR_DP_NOT_MEASURED; *noise_dBFS = EAR_DP_NOT_MEASURED;
+      if (!is_measuring_dp) return false;
+      spectrumMonitor->processNewFrame();  //the last frame of the tone
+      bool ok = (spectrumMonitor->getAveragedFrameCount() > 0);
+      int dp_bin = spectrumMonitor->freqToBin(2.0f*f1_Hz - f2_Hz), f1_bin = spectrumMonitor->freqToBin(f1_Hz);
+      const float *power = spectrumMonitor->getAveragePower();
+      float noise_sum = 0.0f;
+      int n_noise = 0;
+      for (int offset = EAR_DP_NOISE_MIN_BINS; offset <= EAR_DP_NOISE_MAX_BINS; offset++) {
+        for (int sign = -1; sign <= 1; sign += 2) {
+          int bin = dp_bin + sign*offset;
+          if ((bin < 1) || (bin >= SPECTRUM_NBINS-1) || (abs(bin - f1_bin) <= 1)) continue;
+          noise_sum += power[bin]; n_noise++;
+        }
+      }
+      if (ok && (dp_bin > 0)) *dp_dBFS = 10.0f*log10f(max(power[dp_bin], 1.0e-20f));
+      if (ok && (n_noise > 0)) *noise_dBFS = 10.0f*log10f(max(noise_sum / (float)n_noise, 1.0e-20f));
+      abortDPMeasurement();
+      return ok;
+    }
+    void abortDPMeasurement(void) {  //give the spectrum monitor back
+      if (!is_measuring_dp) return;
+      spectrumMonitor->setRunningMean(false);
+      spectrumMonitor->clearAverage();
+      spectrumMonitor->enable(was_spectrum_enabled);
+      is_measuring_dp = false;
+    }
+
+    //read the per-block results from the artifact monitor and log the flagged blocks
+    void serviceArtifactMonitor(void) {
+      Artifact_Block_Info info;
+      while (artifactMonitor->popBlockInfo(&info)) artifactLog.addBlock(info);
+    }
+
+    AudioCalcLeq_F32 *leq;                        //level of this ear's probe mic
+    AudioArtifactMonitor_F32 *artifactMonitor;
+    AudioSpectrumMonitor_F32 *spectrumMonitor;
+    AudioStimulusPlayer_F32 *stimPlayer;
+
+    //read the per-block measurements (in batches) and add them up
+    Block_Stats_Accum tone_stats;     //blocks with the tones on, since the current tone started
+    Block_Stats_Accum display_stats;  //every block since the caller last reset it (such as for the GUI)
+    void logBlockStats(Print *log, int ear_ind) { block_log = log; log_ear_ind = ear_ind; }  //print every record as a CSV line (NULL to stop)
+    void serviceBlockStats(void) {
+      Block_Stats batch[BLOCK_STATS_BATCH];
+      int n;
+      while ((n = blockStats->popBatch(batch, BLOCK_STATS_BATCH)) > 0) {
+        for (int i=0; i < n; i++) {
+          const Block_Stats &s = batch[i];
+          if (s.stim.isOn()) tone_stats.add(s);
+          display_stats.add(s);
+          if (block_log != NULL) printlnf(*block_log, "blk, %d, %lu, %.2f, %.2f, %.2f, %.2f, %lu, %.1f, %.1f, %d", log_ear_ind+1, (unsigned long)s.block_id,
+              10.0f*log10f(max(s.mean_sq[0], 1.0e-20f)), 20.0f*log10f(max(s.peak[0], 1.0e-10f)),
+              10.0f*log10f(max(s.mean_sq[1], 1.0e-20f)), 20.0f*log10f(max(s.peak[1], 1.0e-10f)),
+              (unsigned long)s.stim.stim_id, s.stim.freq_Hz[0], s.stim.freq_Hz[1], (int)s.stim.isOn());
+        }
+      }
+    }
+    AudioBlockStats_F32 *blockStats;
+  private:
+    Print *block_log = NULL;
+    int log_ear_ind = 0;
+    bool is_measuring_dp = false, was_spectrum_enabled = false;
+};
+
+#endif
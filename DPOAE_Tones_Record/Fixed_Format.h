@@ -0,0 +1,82 @@
+/*
+ Fixed_Format.h
+
+ Purpose: Format text into fixed-size buffers instead of building Arduino
+          String objects by concatenation.
+
+ Building Strings in the UI and reporting code allocates (and frees) heap memory
+     every time.  Over a long session, that fragments the heap and adds jitter
+     to loop().  The tools here use printf-style formatting into buffers that
+     live on the stack (or in static memory), so the heap use stays flat.
+
+ The format strings are checked by the compiler (via the "format" attribute),
+     so a mismatch between a "%d" and a float argument gives a warning at
+     compile time rather than garbage at run time.
+
+    Fixed_String<N> : a char buffer of N bytes that can be printf()'d into, and appended to
+    printlnf()      : format one line and print it to Serial (or any other Print stream)
+
+ Text that does not fit in the buffer is truncated (never overflowed).
+
+ MIT License, Use at your own risk.
+*/
+
+#ifndef _Fixed_Format_h
+#define _Fixed_Format_h
+
+#include <stdarg.h>
+#include <stdio.h>
+
+#define FIXED_FORMAT_LINE_LEN 160   //longest line that printlnf() will print (including the null terminator)
+
+template <int N>
+class Fixed_String {
+  public:
+    Fixed_String(void) { clear(); }
+    Fixed_String(const char *fmt, ...) __attribute__((format(printf, 2, 3))) {
+      va_list args; va_start(args, fmt); clear(); vappendf(fmt, args); va_end(args);
+    }
+
+    void clear(void) { len = 0; buff[0] = '\0'; }
+
+    //replace the contents with the formatted text
+    int printf(const char *fmt, ...) __attribute__((format(printf, 2, 3))) {
+      va_list args; va_start(args, fmt); clear(); int ret = vappendf(fmt, args); va_end(args); return ret;
+    }
+
+    //add the formatted text onto the end
+    int appendf(const char *fmt, ...) __attribute__((format(printf, 2, 3))) {
+      va_list args; va_start(args, fmt); int ret = vappendf(fmt, args); va_end(args); return ret;
+    }
+
+    const char *c_str(void) const { return buff; }
+    operator const char *(void) const { return buff; }
+    int length(void) const { return len; }
+    bool wasTruncated(void) const { return truncated; }
+
+  private:
+    char buff[N];
+    int len = 0;
+    bool truncated = false;
+
+    int vappendf(const char *fmt, va_list args) {
+      int n = vsnprintf(buff + len, N - len, fmt, args);
+      if (n < 0) { buff[len] = '\0'; return len; }
+      truncated = (n >= (N - len));
+      len = truncated ? (N - 1) : (len + n);
+      return len;
+    }
+};
+
+//format one line of text into a stack buffer and print it (with an end-of-line) to the given stream
+int printlnf(Print &out, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+int printlnf(Print &out, const char *fmt, ...) {
+  char buff[FIXED_FORMAT_LINE_LEN];
+  va_list args; va_start(args, fmt);
+  int n = vsnprintf(buff, sizeof(buff), fmt, args);
+  va_end(args);
+  if (n < 0) return 0;
+  return out.println(buff);
+}
+
+#endif
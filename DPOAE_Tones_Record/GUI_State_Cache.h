@@ -0,0 +1,122 @@
+/*
+ GUI_State_Cache.h
+
+ Purpose: Remember the last text or on/off state that was sent to each button
+          of the TympanRemote App so that unchanged values are never re-sent.
+
+ Values that did change are marked as pending.  They are not sent right away.
+     Instead, the owner (the SerialManager) periodically calls buildMessage(),
+     which combines all of the pending updates into a single newline-separated
+     message so that it can go out as one BLE transmission per frame.
+
+ All of the storage is fixed-size, so no heap is used when tracking the buttons.
+
+ MIT License, Use at your own risk.
+*/
+
+#ifndef _GUI_State_Cache_h
+#define _GUI_State_Cache_h
+
+#include <string.h>
+
+#define GUI_CACHE_MAX_ENTRIES  48   //how many (button ID + type) pairs can be tracked
+#define GUI_CACHE_ID_LEN       16   //max length of a button ID (including the null terminator)
+#define GUI_CACHE_TEXT_LEN     32   //max length of a button's text (including the null terminator)
+
+class GUI_State_Cache {
+  public:
+    GUI_State_Cache(void) {};
+
+    enum ENTRY_TYPE { TYPE_TEXT=0, TYPE_STATE };
+
+    //Record the desired value for a button.  Returns true if the value is new (ie, it will be sent).
+    //Returns false if the value is unchanged or if the cache is full (in which case the caller
+    //should send the value directly).  Use wasLastSetCached() to tell those two cases apart.
+    bool setText(const char *btn_id, const char *text) { return setValue(TYPE_TEXT, btn_id, text); }
+    bool setState(const char *btn_id, bool state) { return setValue(TYPE_STATE, btn_id, state ? "1" : "0"); }
+    bool wasLastSetCached(void) { return last_set_was_cached; }
+
+    //Forget everything that has been sent (such as when the App re-connects) so that the next
+    //call to setText() or setState() will always be treated as new
+    void invalidate(void) { for (int i=0; i < n_entries; i++) entries[i].is_valid = false; }
+
+    //Are there updates that still need to be sent?
+    bool hasPending(void) { return n_pending > 0; }
+
+    //Write all of the pending updates into "out" (as newline-separated messages in the format
+    //expected by the TympanRemote App) and clear them from the pending list.  If "out" fills
+    //up, the remaining updates are left pending for the next call.  Returns the number of
+    //characters written (not including the null terminator).
+    int buildMessage(char *out, const int max_len);
+
+  private:
+    struct Entry {
+      char btn_id[GUI_CACHE_ID_LEN];
+      char value[GUI_CACHE_TEXT_LEN];
+      int  type = TYPE_TEXT;
+      bool is_valid = false;    //has a value for this button been sent since the last invalidate()?
+      bool is_pending = false;  //is there a new value that has not yet been sent?
+    };
+    Entry entries[GUI_CACHE_MAX_ENTRIES];
+    int n_entries = 0;
+    int n_pending = 0;
+    bool last_set_was_cached = true;
+
+    bool setValue(const int type, const char *btn_id, const char *value);
+    int findEntry(const int type, const char *btn_id);
+};
+
+int GUI_State_Cache::findEntry(const int type, const char *btn_id) {
+  for (int i=0; i < n_entries; i++) {
+    if ((entries[i].type == type) && (strncmp(entries[i].btn_id, btn_id, GUI_CACHE_ID_LEN) == 0)) return i;
+  }
+  return -1;
+}
+
+bool GUI_State_Cache::setValue(const int type, const char *btn_id, const char *value) {
+  last_set_was_cached = true;
+  int ind = findEntry(type, btn_id);
+  if (ind < 0) {
+    //this is a button that we haven't seen before.  Is there room for it?
+    if ((n_entries >= GUI_CACHE_MAX_ENTRIES) || (strlen(btn_id) >= GUI_CACHE_ID_LEN)) {
+      last_set_was_cached = false;
+      return false;
+    }
+    ind = n_entries++;
+    strncpy(entries[ind].btn_id, btn_id, GUI_CACHE_ID_LEN);
+    entries[ind].type = type;
+    entries[ind].is_valid = false;
+    entries[ind].is_pending = false;
+  }
+  Entry &entry = entries[ind];
+
+  //has the value actually changed?  (a value that is still pending always gets overwritten)
+  if (entry.is_valid && !entry.is_pending && (strncmp(entry.value, value, GUI_CACHE_TEXT_LEN-1) == 0)) return false;
+
+  //save the new value and mark it to be sent
+  strncpy(entry.value, value, GUI_CACHE_TEXT_LEN-1); entry.value[GUI_CACHE_TEXT_LEN-1] = '\0';
+  entry.is_valid = true;
+  if (!entry.is_pending) { entry.is_pending = true; n_pending++; }
+  return true;
+}
+
+int GUI_State_Cache::buildMessage(char *out, const int max_len) {
+  int len = 0;
+  if (max_len < 1) return 0;
+  out[0] = '\0';
+  for (int i=0; (i < n_entries) && (n_pending > 0); i++) {
+    Entry &entry = entries[i];
+    if (!entry.is_pending) continue;
+
+    //format one update in the same way as SerialManagerBase::setButtonText() and setButtonState()
+    const char *prefix = (entry.type == TYPE_TEXT) ? "TEXT=BTN:" : "STATE=BTN:";
+    int needed = snprintf(out+len, max_len-len, "%s%s%s:%s", (len > 0) ? "\n" : "", prefix, entry.btn_id, entry.value);
+    if (needed >= (max_len-len)) { out[len] = '\0'; break; } //no more room.  leave the rest for next time.
+    len += needed;
+
+    entry.is_pending = false; n_pending--;
+  }
+  return len;
+}
+
+#endif
@@ -0,0 +1,256 @@
+/*
+ Probe_Check.h
+
+ Purpose: Quickly check the fit of the DPOAE probe before the stepped test starts,
+          so that a bad fit is found in about 1 second instead of after the whole test.
+
+ A repeating log chirp (AudioSynthChirp_F32) is played through both speakers of the ear
+     (each ear has its own chirp, so that one ear's check doesn't change the other's) while
+     the spectrum of the probe mic (AudioSpectrumMonitor_F32) is averaged.  The
+     averaged spectrum is summed into octave bands (250 Hz to 8 kHz) and compared
+     against the reference held in Probe_Check_Settings:
+
+       * Low-frequency level: a leaky fit loses the low frequencies first, so each of
+           the lowest PROBE_CHECK_N_LF_BANDS bands must be no more than lf_tol_dB
+           below the reference.
+       * Overall level: the mean of all bands must be within level_tol_dB of the
+           reference (this catches a probe that is out of the ear or is blocked).
+       * Shape: after removing the overall offset, the RMS difference from the
+           reference must be no more than shape_tol_dB.
+
+     If all three are OK, the result is PASS.  Otherwise, it is REFIT.
+
+ The default reference is only a rough placeholder, so the check doesn't run before
+     each test until there is a real reference.  Fit the probe well (or put it in a
+     coupler), run the check ("$probe"), and then store that measurement as the
+     reference via "$probe_ref" (see SerialManager.h).  Each ear's reference is saved to
+     the SD card (PROBE1.REF, PROBE2.REF) and loaded again at startup:
+
+     magic "TPRF", version, number of bands, the chirp (level, start and end Hz) that
+     the reference was measured with, the band levels (dBFS), the real-time clock
+     seconds, and a CRC32 of everything before it
+
+ MIT License, Use at your own risk.
+*/
+
+#ifndef _Probe_Check_h
+#define _Probe_Check_h
+
+#include "AudioSynthChirp_F32.h"
+#include "AudioSpectrumMonitor_F32.h"
+#include "Fixed_Format.h"
+#include "Crc32.h"
+
+#define PROBE_CHECK_N_BANDS     6        //octave bands
+#define PROBE_CHECK_F_LOW_HZ    250.0f   //center of the lowest octave band
+#define PROBE_CHECK_F_HIGH_HZ   8000.0f  //center of the highest octave band
+#define PROBE_CHECK_N_LF_BANDS  2        //how many of the lowest bands count as "low frequency"
+#define PROBE_REF_MAGIC         0x46525054UL   //"TPRF" as little-endian bytes
+#define PROBE_REF_VERSION       1
+
+//the reference, as saved on the SD card
+struct Probe_Ref_File {
+  uint32_t magic = PROBE_REF_MAGIC;
+  uint32_t version = PROBE_REF_VERSION;
+  uint32_t n_bands = PROBE_CHECK_N_BANDS;
+  float chirp_amp_dBFS = 0.0f, chirp_start_Hz = 0.0f, chirp_end_Hz = 0.0f;  //the chirp that it was measured with
+  float ref_band_dBFS[PROBE_CHECK_N_BANDS] = {};
+  uint32_t created_sec = 0;   //real-time clock seconds
+  uint32_t crc = 0;           //CRC32 of everything above
+};
+
+//the stimulus, timing, reference, and limits for the probe check
+class Probe_Check_Settings {
+  public:
+    //stimulus
+    float chirp_amp_dBFS = -20.0f;
+    float chirp_start_Hz = 150.0f, chirp_end_Hz = 12000.0f;
+    int chirp_samples = 4*SPECTRUM_NFFT;   //a whole number of FFT frames per sweep
+
+    //timing
+    int settle_millis = 150;    //let the speakers and the mic settle before averaging
+    int measure_millis = 850;   //how long to average the spectrum
+
+    //reference (dBFS in each octave band, for the chirp level above) and limits
+    float ref_band_dBFS[PROBE_CHECK_N_BANDS] = {-45.0f, -45.0f, -45.0f, -45.0f, -45.0f, -45.0f};
+    bool has_ref = false;        //false while ref_band_dBFS is just the placeholder above
+    float lf_tol_dB = 6.0f;      //how far below the reference the low bands may be
+    float level_tol_dB = 12.0f;  //how far the mean level may be from the reference (either direction)
+    float shape_tol_dB = 4.0f;   //largest allowed RMS difference in shape
+
+    //keep the reference on the SD card
+    bool saveReference(SdFs *sd, const char *fname);
+    bool loadReference(SdFs *sd, const char *fname);
+    static void makeRefFilename(int ear_ind, Fixed_String<16> *fname) { fname->clear(); fname->printf("PROBE%d.REF", ear_ind+1); }
+};
+
+bool Probe_Check_Settings::saveReference(SdFs *sd, const char *fname) {
+  if (!has_ref) { Serial.println("Probe_Check_Settings: saveReference: *** ERROR ***: there is no reference to save"); return false; }
+  Probe_Ref_File f;
+  f.chirp_amp_dBFS = chirp_amp_dBFS; f.chirp_start_Hz = chirp_start_Hz; f.chirp_end_Hz = chirp_end_Hz;
+  for (int i=0; i < PROBE_CHECK_N_BANDS; i++) f.ref_band_dBFS[i] = ref_band_dBFS[i];
+  f.created_sec = (uint32_t)Teensy3Clock.get();
+  f.crc = crc32(&f, sizeof(f) - sizeof(f.crc));
+
+  FsFile file = sd->open(fname, O_WRONLY | O_CREAT | O_TRUNC);
+  if (!file) { printlnf(Serial, "Probe_Check_Settings: saveReference: *** ERROR ***: could not open %s", fname); return false; }
+  size_t n_written = file.write(&f, sizeof(f));
+  file.close();
+  if (n_written != sizeof(f)) { printlnf(Serial, "Probe_Check_Settings: saveReference: *** ERROR ***: could not write all of %s", fname); return false; }
+  return true;
+}
+
+bool Probe_Check_Settings::loadReference(SdFs *sd, const char *fname) {
+  FsFile file = sd->open(fname, O_RDONLY);
+  if (!file) return false;  //no reference is fine (the check just doesn't run before each test)
+  Probe_Ref_File f;
+  bool ok = (file.read(&f, sizeof(f)) == (int)sizeof(f));
+  file.close();
+  ok = ok && (f.magic == PROBE_REF_MAGIC) && (f.version == PROBE_REF_VERSION) && (f.n_bands == PROBE_CHECK_N_BANDS) && (f.crc == crc32(&f, sizeof(f) - sizeof(f.crc)));
+  if (!ok) { printlnf(Serial, "Probe_Check_Settings: loadReference: *** ERROR ***: bad or incomplete reference in %s", fname); return false; }
+  if ((f.chirp_amp_dBFS != chirp_amp_dBFS) || (f.chirp_start_Hz != chirp_start_Hz) || (f.chirp_end_Hz != chirp_end_Hz)) {
+    printlnf(Serial, "Probe_Check_Settings: loadReference: *** ERROR ***: %s was measured with a different chirp.  Not using it.", fname);
+    return false;
+  }
+  for (int i=0; i < PROBE_CHECK_N_BANDS; i++) ref_band_dBFS[i] = f.ref_band_dBFS[i];
+  has_ref = true;
+  return true;
+}
+
+class Probe_Checker {
+  public:
+    enum RESULT { RESULT_NONE=0, RESULT_RUNNING, RESULT_PASS, RESULT_REFIT };
+
+    Probe_Checker(AudioSynthChirp_F32 *_chirp, AudioSpectrumMonitor_F32 *_spectrum, Probe_Check_Settings *_settings) :
+        chirp(_chirp), spectrum(_spectrum), settings(_settings) {};
+
+    void start(unsigned long curTime_millis);
+    int service(unsigned long curTime_millis);  //call often while running.  Returns the RESULT.
+    void abort(void);
+
+    int getResult(void) { return result; }
+    const char *getResultText(void);           //short text for the App, such as "REFIT (low freq)"
+    const float *getBandLevels_dB(void) { return band_dB; }
+    bool captureReference(void);               //store the last measurement as the reference
+    void printResult(Print *out);
+
+  private:
+    AudioSynthChirp_F32 *chirp;
+    AudioSpectrumMonitor_F32 *spectrum;
+    Probe_Check_Settings *settings;
+
+    int result = RESULT_NONE;
+    bool has_measurement = false, is_averaging = false, was_spectrum_enabled = false;
+    unsigned long start_millis = 0;
+    float band_dB[PROBE_CHECK_N_BANDS];
+    float lf_diff_dB = 0.0f, level_diff_dB = 0.0f, shape_rms_dB = 0.0f;
+    const char *reason = "";
+
+    void finish(void);
+    int evaluate(void);
+};
+
+void Probe_Checker::start(unsigned long curTime_millis) {
+  //start the chirp
+  chirp->play(false);
+  chirp->setSweep(settings->chirp_start_Hz, settings->chirp_end_Hz, settings->chirp_samples);
+  chirp->amplitude(powf(10.0f, settings->chirp_amp_dBFS / 20.0f));  //same dBFS convention as Tone_Manager::dB_to_amp()
+  chirp->play(true);
+
+  //take over the spectrum monitor (its previous state is restored when done)
+  was_spectrum_enabled = spectrum->isEnabled();
+  spectrum->enable(true);
+  spectrum->setRunningMean(true);
+  spectrum->clearAverage();
+
+  start_millis = curTime_millis;
+  is_averaging = false;
+  result = RESULT_RUNNING;
+}
+
+int Probe_Checker::service(unsigned long curTime_millis) {
+  if (result != RESULT_RUNNING) return result;
+  spectrum->processNewFrame();
+
+  unsigned long elapsed_millis = curTime_millis - start_millis;  //unsigned math handles wrap-around
+  if (!is_averaging) {
+    if (elapsed_millis >= (unsigned long)settings->settle_millis) { spectrum->clearAverage(); is_averaging = true; }  //throw away the settling time
+    return result;
+  }
+  if (elapsed_millis < (unsigned long)(settings->settle_millis + settings->measure_millis)) return result;
+
+  //done measuring
+  spectrum->getBandLevels_dB(PROBE_CHECK_N_BANDS, PROBE_CHECK_F_LOW_HZ / sqrtf(2.0f), PROBE_CHECK_F_HIGH_HZ * sqrtf(2.0f), band_dB);
+  bool enough_frames = (spectrum->getAveragedFrameCount() > 0);
+  finish();
+  if (!enough_frames) { result = RESULT_REFIT; reason = "no data"; return result; }
+  has_measurement = true;
+  return result = evaluate();
+}
+
+void Probe_Checker::abort(void) {
+  if (result != RESULT_RUNNING) return;
+  finish();
+  result = RESULT_NONE;
+}
+
+//stop the chirp and give the spectrum monitor back
+void Probe_Checker::finish(void) {
+  chirp->play(false);
+  spectrum->setRunningMean(false);
+  spectrum->clearAverage();
+  spectrum->enable(was_spectrum_enabled);
+}
+
+int Probe_Checker::evaluate(void) {
+  const float *ref = settings->ref_band_dBFS;
+
+  //low frequencies: the worst of the low bands
+  lf_diff_dB = 999.0f;
+  for (int i=0; i < PROBE_CHECK_N_LF_BANDS; i++) lf_diff_dB = min(lf_diff_dB, band_dB[i] - ref[i]);
+
+  //overall level and shape
+  level_diff_dB = 0.0f;
+  for (int i=0; i < PROBE_CHECK_N_BANDS; i++) level_diff_dB += (band_dB[i] - ref[i]);
+  level_diff_dB /= (float)PROBE_CHECK_N_BANDS;
+  shape_rms_dB = 0.0f;
+  for (int i=0; i < PROBE_CHECK_N_BANDS; i++) { float err = (band_dB[i] - ref[i]) - level_diff_dB; shape_rms_dB += err*err; }
+  shape_rms_dB = sqrtf(shape_rms_dB / (float)PROBE_CHECK_N_BANDS);
+
+  if (lf_diff_dB < -settings->lf_tol_dB) { reason = "low freq"; return RESULT_REFIT; }
+  if (fabsf(level_diff_dB) > settings->level_tol_dB) { reason = "level"; return RESULT_REFIT; }
+  if (shape_rms_dB > settings->shape_tol_dB) { reason = "shape"; return RESULT_REFIT; }
+  reason = "";
+  return RESULT_PASS;
+}
+
+bool Probe_Checker::captureReference(void) {
+  if (!has_measurement) return false;
+  for (int i=0; i < PROBE_CHECK_N_BANDS; i++) settings->ref_band_dBFS[i] = band_dB[i];
+  settings->has_ref = true;
+  return true;
+}
+
+const char* Probe_Checker::getResultText(void) {
+  static Fixed_String<32> text;
+  switch (result) {
+    case RESULT_RUNNING: text.printf("Checking..."); break;
+    case RESULT_PASS:    text.printf("Fit OK"); break;
+    case RESULT_REFIT:   text.printf("REFIT (%s)", reason); break;
+    default:             text.printf("Not checked"); break;
+  }
+  return text.c_str();
+}
+
+void Probe_Checker::printResult(Print *out) {
+  printlnf(*out, "Probe_Checker: result = %s", getResultText());
+  if (!has_measurement) return;
+  if (!settings->has_ref) out->println("    (There is no reference yet, so this is against a rough placeholder.  Fit the probe well and use \"$probe_ref\".)");
+  Fixed_String<FIXED_FORMAT_LINE_LEN> line("    Octave bands (dBFS):");
+  for (int i=0; i < PROBE_CHECK_N_BANDS; i++) line.appendf(" %.1f", band_dB[i]);
+  out->println(line);
+  printlnf(*out, "    Re reference: low freq %+.1f dB (limit -%.1f), level %+.1f dB (limit +/-%.1f), shape %.1f dB RMS (limit %.1f)",
+      lf_diff_dB, settings->lf_tol_dB, level_diff_dB, settings->level_tol_dB, shape_rms_dB, settings->shape_tol_dB);
+}
+
+#endif
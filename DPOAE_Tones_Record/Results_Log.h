@@ -0,0 +1,257 @@
+/*
+ Results_Log.h
+
+ Purpose: Keep every step's results on the SD card in one append-only binary log, so that
+          the PC can fetch just the results (rather than the WAV files, or the text that
+          scrolled past on the Serial Monitor) and can ask for just the ones that it hasn't
+          seen yet.
+
+ The log (RESULTS.LOG) is a list of fixed-size records (64 bytes), one per ear per step
+     of each test.  Each record has its own magic number and CRC32, and record n is at
+     byte n*64, so any record can be read without reading the ones before it.  Records
+     are only ever added to the end.
+
+ A small index (RESULTS.IDX) has one 16-byte entry per test (session, test, first
+     record, and number of records), so the records of one session can be found without
+     reading the whole log.  The index can always be rebuilt from the log.
+
+ Surviving a loss of power:
+     * The records of a test are written all together, after the test (and its SD
+       recording) has stopped, and the log is synced before the index is written.
+     * begin() cuts off a partly-written record at the end of the log (and any record
+       whose CRC is bad), then checks that the index ends where the log ends.  If it
+       doesn't (such as when the power went out between writing the two), the index is
+       rebuilt from the log.
+     So, at worst, the test that was running when the power went out is lost.
+
+ Export (see "$results_since" and "$results_session"): a header line, then one CSV
+     line per record.  Each line ends with the record's CRC32, so that the PC can check it.
+
+ MIT License, Use at your own risk.
+*/
+
+#ifndef _Results_Log_h
+#define _Results_Log_h
+
+#include "Crc32.h"
+#include "Fixed_Format.h"
+
+#define RESULTS_LOG_FNAME       "RESULTS.LOG"
+#define RESULTS_IDX_FNAME       "RESULTS.IDX"
+#define RESULTS_MAGIC           0x53455254UL   //"TRES" as little-endian bytes
+#define RESULTS_NO_ENTRY        0xFFFFFFFFUL   //no recording (see wav_entry)
+#define RESULTS_NOT_MEASURED    (-32768)       //for the values in hundredths of a dB
+#define RESULTS_ALL             0x7FFFFFFF     //for max_records
+#define RESULTS_COLUMNS         "record, session, test, start_sec, step_ms, wav_entry, ear, step, protocol, flags, F1 (Hz), F2 (Hz), " \
+                                "F1 (cdB SPL), F2 (cdB SPL), F1 cal (cdB), F2 cal (cdB), mic (cdBFS), peak (cdBFS), DP (cdBFS), noise (cdBFS), " \
+                                "rejected (msec), clipped blocks, crc"
+
+//flags for each record
+#define RESULTS_FLAG_CLIPPED      0x01   //the mic clipped during the tone
+#define RESULTS_FLAG_NOISY        0x02   //more audio was rejected than the tone could be extended by
+#define RESULTS_FLAG_CAL_CURVE_F1 0x04   //F1's speaker cal came from a CalibrateIO curve (see Cal_Curve.h)
+#define RESULTS_FLAG_CAL_CURVE_F2 0x08   //F2's speaker cal came from a CalibrateIO curve
+
+//the protocols (the set of F2 frequencies, see DPOAE_Protocol.h)
+#define RESULTS_PROTOCOL_STANDARD 0
+#define RESULTS_PROTOCOL_EHF      1
+
+struct Results_Record {
+  uint32_t magic = RESULTS_MAGIC;
+  uint32_t record_num = 0;                //its place in the log
+  uint32_t session_id = 0;                //the SESSnnn number (see Session_Queue.h), or zero if not part of a session
+  uint32_t test_id = 0;                   //counts up by one for each test in the log
+  uint32_t start_sec = 0;                 //real-time clock seconds when the test started
+  uint32_t step_millis = 0;               //when this step's tone ended (milliseconds since the test started)
+  uint32_t wav_entry = RESULTS_NO_ENTRY;  //the test's recording (its SD index entry, see SD_Index.h)
+  uint8_t ear = 0, step = 0, protocol = RESULTS_PROTOCOL_STANDARD, flags = 0;   //ear and step count from 0
+  float f1_Hz = 0.0f, f2_Hz = 0.0f;
+  int16_t f1_cdBSPL = 0, f2_cdBSPL = 0;   //target levels (hundredths of a dB)
+  int16_t cal1_cdB = 0, cal2_cdB = 0;     //speaker cal used (hundredths of a dB, dBFS at 94 dB SPL)
+  int16_t mic_cdBFS = RESULTS_NOT_MEASURED, peak_cdBFS = RESULTS_NOT_MEASURED;   //mic level at the end of the tone, and its peak
+  int16_t dp_cdBFS = RESULTS_NOT_MEASURED, noise_cdBFS = RESULTS_NOT_MEASURED;   //DP level and the noise floor around it (SNR is the difference)
+  uint16_t rejected_millis = 0, clipped_blocks = 0;
+  uint32_t crc = 0;                       //CRC32 of everything above
+};
+static_assert(sizeof(Results_Record) == 64, "Results_Log: the record must be 64 bytes");
+
+struct Results_Index_Entry {
+  uint32_t session_id = 0;
+  uint32_t test_id = 0;
+  uint32_t first_record = 0;
+  uint32_t n_records = 0;
+};
+
+class Results_Log {
+  public:
+    Results_Log(SdFs *_sd) : sd(_sd) {};
+
+    //check the log (and repair it after a loss of power).  Done automatically on first use.  The SD card must already be started.
+    bool begin(void);
+
+    //add one test's records (record_num and test_id are filled in here).  Returns the number added.
+    int appendTest(Results_Record *records, int n_records);
+    uint32_t getNumRecords(void) { return begin() ? n_records : 0; }
+    uint32_t getNextTestID(void) { return begin() ? next_test_id : 0; }
+
+    bool getRecord(uint32_t record_num, Results_Record *rec);
+    int printRecordsSince(Print *out, uint32_t first_record, int max_records);  //returns the number printed
+    int printSession(Print *out, uint32_t session_id);                          //every record of the session
+
+    static int16_t to_cdB(float dB) { return (dB < -327.0f) ? (int16_t)RESULTS_NOT_MEASURED : (int16_t)constrain(lroundf(100.0f * dB), -32767L, 32767L); }
+
+  private:
+    SdFs *sd;
+    FsFile log_file, idx_file;
+    bool is_open = false;
+    uint32_t n_records = 0, n_tests = 0, next_test_id = 1;
+
+    bool openFile(FsFile *file, const char *fname);
+    int rebuildIndex(void);
+    bool writeIndexEntry(uint32_t entry_ind, const Results_Index_Entry &entry);
+    static bool isGood(const Results_Record &rec) { return (rec.magic == RESULTS_MAGIC) && (rec.crc == crc32(&rec, sizeof(rec) - sizeof(rec.crc))); }
+    void printRecord(Print *out, const Results_Record &rec);
+};
+
+bool Results_Log::begin(void) {
+  if (is_open) return true;
+  if (!openFile(&log_file, RESULTS_LOG_FNAME)) return false;
+
+  //cut off a partly-written record (or a bad one) at the end
+  uint32_t size_bytes = (uint32_t)log_file.fileSize();
+  n_records = size_bytes / sizeof(Results_Record);
+  Results_Record rec;
+  while ((n_records > 0) && !(log_file.seekSet((n_records-1) * sizeof(Results_Record)) &&
+         (log_file.read(&rec, sizeof(rec)) == (int)sizeof(rec)) && isGood(rec) && (rec.record_num == n_records-1))) n_records--;
+  if (size_bytes != n_records * sizeof(Results_Record)) {
+    printlnf(Serial, "Results_Log: begin: cutting %lu bytes from the end of %s (partly written?)", (unsigned long)(size_bytes - n_records * sizeof(Results_Record)), RESULTS_LOG_FNAME);
+    log_file.truncate(n_records * sizeof(Results_Record));
+    log_file.sync();
+  }
+  next_test_id = (n_records > 0) ? (rec.test_id + 1) : 1;
+
+  //does the index end where the log ends?
+  if (!openFile(&idx_file, RESULTS_IDX_FNAME)) { log_file.close(); return false; }
+  n_tests = (uint32_t)idx_file.fileSize() / sizeof(Results_Index_Entry);
+  Results_Index_Entry entry;
+  bool ok = (n_tests == 0) ? (n_records == 0) :
+            (idx_file.seekSet((n_tests-1) * sizeof(entry)) && (idx_file.read(&entry, sizeof(entry)) == (int)sizeof(entry)) &&
+             (entry.first_record + entry.n_records == n_records) && (entry.test_id == next_test_id - 1));
+  is_open = true;
+  if (!ok) rebuildIndex();
+  return true;
+}
+
+bool Results_Log::openFile(FsFile *file, const char *fname) {
+  *file = sd->open(fname, O_RDWR | O_CREAT);
+  if (!(*file)) {
+    printlnf(Serial, "Results_Log: *** ERROR ***: could not open %s", fname);
+    return false;
+  }
+  return true;
+}
+
+//read the log once and write a fresh index
+int Results_Log::rebuildIndex(void) {
+  idx_file.truncate(0);
+  n_tests = 0;
+  Results_Index_Entry entry;
+  Results_Record rec;
+  log_file.seekSet(0);
+  for (uint32_t i=0; i < n_records; i++) {
+    if ((log_file.read(&rec, sizeof(rec)) != (int)sizeof(rec)) || !isGood(rec)) continue;
+    if ((entry.n_records > 0) && (rec.test_id == entry.test_id)) { entry.n_records++; continue; }
+    if (entry.n_records > 0) writeIndexEntry(n_tests++, entry);
+    entry.session_id = rec.session_id; entry.test_id = rec.test_id; entry.first_record = i; entry.n_records = 1;
+  }
+  if (entry.n_records > 0) writeIndexEntry(n_tests++, entry);
+  idx_file.sync();
+  printlnf(Serial, "Results_Log: rebuilt %s with %lu tests (%lu records)", RESULTS_IDX_FNAME, (unsigned long)n_tests, (unsigned long)n_records);
+  return (int)n_tests;
+}
+
+bool Results_Log::writeIndexEntry(uint32_t entry_ind, const Results_Index_Entry &entry) {
+  idx_file.seekSet(entry_ind * sizeof(entry));
+  return (idx_file.write(&entry, sizeof(entry)) == sizeof(entry));
+}
+
+int Results_Log::appendTest(Results_Record *records, int n_new) {
+  if ((n_new < 1) || !begin()) return 0;
+  for (int i=0; i < n_new; i++) {
+    records[i].magic = RESULTS_MAGIC;
+    records[i].record_num = n_records + i;
+    records[i].test_id = next_test_id;
+    records[i].crc = crc32(&records[i], sizeof(Results_Record) - sizeof(records[i].crc));
+  }
+
+  //the records first (synced), then the index.  See the notes at the top about losing power.
+  log_file.seekSet(n_records * sizeof(Results_Record));
+  size_t n_bytes = n_new * sizeof(Results_Record);
+  if (log_file.write(records, n_bytes) != n_bytes) {
+    printlnf(Serial, "Results_Log: appendTest: *** ERROR ***: could not write to %s", RESULTS_LOG_FNAME);
+    log_file.truncate(n_records * sizeof(Results_Record));  //don't leave part of the test
+    log_file.sync();
+    return 0;
+  }
+  log_file.sync();
+  n_records += n_new;
+
+  Results_Index_Entry entry;
+  entry.session_id = records[0].session_id; entry.test_id = next_test_id;
+  entry.first_record = records[0].record_num; entry.n_records = n_new;
+  if (writeIndexEntry(n_tests, entry)) n_tests++;
+  idx_file.sync();
+  next_test_id++;
+  return n_new;
+}
+
+bool Results_Log::getRecord(uint32_t record_num, Results_Record *rec) {
+  if (!begin() || (record_num >= n_records)) return false;
+  log_file.seekSet(record_num * sizeof(Results_Record));
+  if (log_file.read(rec, sizeof(Results_Record)) != (int)sizeof(Results_Record)) return false;
+  return isGood(*rec);
+}
+
+//the levels are printed as hundredths of a dB (cdB, as they are stored) and the frequencies with all 9 digits, so that
+//nothing is lost (and so that the PC can check the CRC).  The ear and step count from 1, and a missing wav_entry is -1.
+void Results_Log::printRecord(Print *out, const Results_Record &r) {
+  printlnf(*out, "%lu, %lu, %lu, %lu, %lu, %ld, %d, %d, %d, %d, %.9g, %.9g, %d, %d, %d, %d, %d, %d, %d, %d, %u, %u, %08lX",
+      (unsigned long)r.record_num, (unsigned long)r.session_id, (unsigned long)r.test_id, (unsigned long)r.start_sec, (unsigned long)r.step_millis,
+      (r.wav_entry == RESULTS_NO_ENTRY) ? -1L : (long)r.wav_entry, r.ear+1, r.step+1, r.protocol, r.flags, r.f1_Hz, r.f2_Hz,
+      r.f1_cdBSPL, r.f2_cdBSPL, r.cal1_cdB, r.cal2_cdB, r.mic_cdBFS, r.peak_cdBFS, r.dp_cdBFS, r.noise_cdBFS,
+      (unsigned)r.rejected_millis, (unsigned)r.clipped_blocks, (unsigned long)r.crc);
+}
+
+int Results_Log::printRecordsSince(Print *out, uint32_t first_record, int max_records) {
+  uint32_t n = getNumRecords(), n_max = (max_records > 0) ? (uint32_t)max_records : 0;
+  uint32_t n_to_print = (first_record >= n) ? 0 : min(n_max, n - first_record);
+  printlnf(*out, "Results_Log: records %ld to %ld of %lu: " RESULTS_COLUMNS, (long)first_record, (long)first_record + (long)n_to_print - 1, (unsigned long)n);
+  Results_Record rec;
+  int count = 0;
+  for (uint32_t i = first_record; i < first_record + n_to_print; i++) {
+    if (!getRecord(i, &rec)) { printlnf(*out, "%lu, (bad record)", (unsigned long)i); continue; }
+    printRecord(out, rec);
+    count++;
+  }
+  return count;
+}
+
+//look through the index (rather than the whole log) for the session's tests
+int Results_Log::printSession(Print *out, uint32_t session_id) {
+  if (!begin()) return 0;
+  printlnf(*out, "Results_Log: session %lu: " RESULTS_COLUMNS, (unsigned long)session_id);
+  Results_Index_Entry entry;
+  Results_Record rec;
+  int count = 0;
+  for (uint32_t i=0; i < n_tests; i++) {
+    idx_file.seekSet(i * sizeof(entry));
+    if (idx_file.read(&entry, sizeof(entry)) != (int)sizeof(entry)) break;
+    if (entry.session_id != session_id) continue;
+    for (uint32_t j = entry.first_record; j < entry.first_record + entry.n_records; j++) {
+      if (getRecord(j, &rec)) { printRecord(out, rec); count++; }
+    }
+  }
+  return count;
+}
+
+#endif
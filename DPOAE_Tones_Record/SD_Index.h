@@ -0,0 +1,317 @@
+/*
+ SD_Index.h
+
+ Purpose: Keep a small index of the files on the SD card so that listing the files
+          and choosing the next recording's name do not have to walk the whole
+          directory (which gets slow once the card holds thousands of files).
+
+ The index is one binary file (SDINDEX.BIN) in the root of the SD card:
+
+     header (32 bytes): magic "TIDX", version, number of entries, next file number, CRC32
+     entries (68 bytes each): name, size, created and closed times, hash of the name,
+                              CRC32 of the file's contents (once known) and the file's
+                              modified time when it was computed, CRC32 of the entry
+
+ Because every entry is the same size, most things are done in constant time:
+     * A new file is appended as a new entry (then the header is rewritten).  A name
+       that is written again reuses its old entry (found by searching back from the
+       newest entry), so that each name is only listed once.
+     * When the file is closed, its entry is rewritten in place with the final size.
+     * Page N of the listing (or every entry since entry N) is one seek away.
+     * The next recording's name comes from the header's file number.
+
+ Times are seconds from the Teensy's real-time clock (zero if the clock isn't set).
+ The CRC32 on each entry catches an entry that was only half written (such as when
+ the power is removed).
+
+ Files that are added or removed some other way (MTP, the 'X' transfer, or a PC
+ card reader) are not seen until the index is rebuilt ("$index_rebuild").  The
+ index is also rebuilt automatically if it is missing or its header is bad.
+
+ MIT License, Use at your own risk.
+*/
+
+#ifndef _SD_Index_h
+#define _SD_Index_h
+
+#include "Crc32.h"
+#include "Fixed_Format.h"
+
+#define SD_INDEX_FNAME        "SDINDEX.BIN"
+#define SD_INDEX_MAGIC        0x58444954UL   //"TIDX" as little-endian bytes
+#define SD_INDEX_VERSION      2              //an index from an older version is rebuilt
+#define SD_INDEX_NAME_LEN     40             //longest file name (including the null)
+#define SD_INDEX_REC_PREFIX   "AUDIO"        //recordings are named AUDIOnnn.WAV (same as AudioSDWriter)
+#define SD_INDEX_REC_SUFFIX   ".WAV"
+#define SD_INDEX_ALL          0x7FFFFFFF     //use as max_entries to list everything
+
+struct SD_Index_Header {
+  uint32_t magic = SD_INDEX_MAGIC;
+  uint32_t version = SD_INDEX_VERSION;
+  uint32_t n_entries = 0;
+  uint32_t next_file_num = 0;  //number for the next AUDIOnnn.WAV
+  uint32_t reserved[3] = {0, 0, 0};
+  uint32_t crc = 0;            //CRC32 of everything above
+};
+
+struct SD_Index_Entry {
+  char name[SD_INDEX_NAME_LEN];
+  uint32_t size_bytes = 0;
+  uint32_t created_sec = 0;    //real-time clock seconds (zero if not known)
+  uint32_t closed_sec = 0;     //zero while the file is still open (or if not known)
+  uint32_t name_hash = 0;      //FNV-1a hash of the name (for quick look-ups)
+  uint32_t content_crc = 0;    //CRC32 of the whole file (zero until computed by statFile())
+  uint32_t modified_stamp = 0; //the file's FAT modified date and time (date << 16 | time) when content_crc was computed
+  uint32_t crc = 0;            //CRC32 of everything above
+};
+
+class SD_Index {
+  public:
+    SD_Index(SdFs *_sd) : sd(_sd) {};
+
+    //open the index (rebuilding it if needed).  This is done automatically on first use.
+    //The SD card must already be started (such as by AudioSDWriter::prepareSDforRecording()).
+    bool begin(void);
+    int rebuild(void);   //walk the directory once and write a fresh index.  Returns the number of entries.
+
+    //keep the index up to date (call when creating and closing files)
+    int addFile(const char *fname, uint32_t size_bytes = 0);   //returns the entry number (reusing the name's entry, if any), or -1 on error
+    bool closeFile(int entry_ind, uint32_t size_bytes);
+    int findFile(const char *fname);                            //returns the entry number, or -1
+
+    //get the current size and the CRC32 of the file's contents (so that the PC can check its copy
+    //without reading the file over Serial).  The CRC is saved in the index, so it is only computed
+    //again if the file's size or modified time changes.  This reads the whole file, so don't call
+    //it for the file that is being recorded.
+    bool statFile(int entry_ind, SD_Index_Entry *entry);
+
+    //name for the next recording (such as "AUDIO012.WAV").  Does not create the file.
+    const char *getNextRecordingName(void);
+    int addRecording(const char *fname);  //like addFile(), but also advances the next recording number
+
+    //read the index
+    int getNumEntries(void) { return begin() ? (int)header.n_entries : 0; }
+    bool getEntry(int entry_ind, SD_Index_Entry *entry);
+    void printNames(Print *out, char separator);                        //all names on one line (same as SdFileTransfer::sendFilenames)
+    int printEntries(Print *out, int first_entry, int max_entries);     //one line per entry.  Returns the number printed.
+
+    static uint32_t hashName(const char *fname);
+
+  private:
+    SdFs *sd;
+    FsFile file;
+    SD_Index_Header header;
+    bool is_open = false;
+    Fixed_String<SD_INDEX_NAME_LEN> next_name;
+
+    bool openIndexFile(bool create_new);
+    bool writeHeader(void);
+    bool writeEntry(int entry_ind, SD_Index_Entry *entry);
+    static uint32_t position(int entry_ind) { return sizeof(SD_Index_Header) + (uint32_t)entry_ind * sizeof(SD_Index_Entry); }
+    static int32_t getRecordingNum(const char *fname);   //returns the nnn of AUDIOnnn.WAV, or -1 if it isn't a recording
+    void noteRecordingNum(const char *fname) { int32_t num = getRecordingNum(fname); if (num >= 0) header.next_file_num = max(header.next_file_num, (uint32_t)num + 1); }
+    static uint32_t getTime_sec(void) { return (uint32_t)Teensy3Clock.get(); }
+};
+
+bool SD_Index::begin(void) {
+  if (is_open) return true;
+
+  //use the existing index, if it looks good
+  if (sd->exists(SD_INDEX_FNAME) && openIndexFile(false)) {
+    file.seekSet(0);
+    bool ok = (file.read(&header, sizeof(header)) == (int)sizeof(header));
+    ok = ok && (header.magic == SD_INDEX_MAGIC) && (header.version == SD_INDEX_VERSION);
+    ok = ok && (header.crc == crc32(&header, sizeof(header) - sizeof(header.crc)));
+    ok = ok && (file.fileSize() >= position(header.n_entries));
+    if (ok) return is_open = true;
+    file.close();
+    Serial.println("SD_Index: begin: index is bad.  Rebuilding...");
+  }
+  return (rebuild() >= 0);
+}
+
+int SD_Index::rebuild(void) {
+  if (file.isOpen()) file.close();
+  is_open = false;
+  if (!openIndexFile(true)) return -1;
+  header = SD_Index_Header();
+  is_open = true;
+  writeHeader();
+
+  //walk the root directory once (the header is only written at the end, to save time)
+  FsFile root = sd->open("/"), entry_file;
+  SD_Index_Entry entry;
+  while (entry_file.openNext(&root, O_RDONLY)) {
+    memset(entry.name, 0, SD_INDEX_NAME_LEN);
+    entry_file.getName(entry.name, SD_INDEX_NAME_LEN);
+    if (!entry_file.isDir() && !entry_file.isHidden() && (strcmp(entry.name, SD_INDEX_FNAME) != 0)) {
+      entry.size_bytes = (uint32_t)entry_file.fileSize();
+      entry.created_sec = 0; entry.closed_sec = 0;  //unknown
+      entry.name_hash = hashName(entry.name);
+      if (writeEntry(header.n_entries, &entry)) header.n_entries++;
+      noteRecordingNum(entry.name);
+    }
+    entry_file.close();
+  }
+  root.close();
+  writeHeader();
+  printlnf(Serial, "SD_Index: rebuilt the index with %lu files", (unsigned long)header.n_entries);
+  return (int)header.n_entries;
+}
+
+bool SD_Index::openIndexFile(bool create_new) {
+  file = sd->open(SD_INDEX_FNAME, create_new ? (O_RDWR | O_CREAT | O_TRUNC) : O_RDWR);
+  if (!file) {
+    printlnf(Serial, "SD_Index: *** ERROR ***: could not open %s", SD_INDEX_FNAME);
+    return false;
+  }
+  return true;
+}
+
+bool SD_Index::writeHeader(void) {
+  header.crc = crc32(&header, sizeof(header) - sizeof(header.crc));
+  file.seekSet(0);
+  bool ok = (file.write(&header, sizeof(header)) == sizeof(header));
+  file.sync();  //so that the index survives losing power
+  return ok;
+}
+
+bool SD_Index::writeEntry(int entry_ind, SD_Index_Entry *entry) {
+  entry->crc = crc32(entry, sizeof(SD_Index_Entry) - sizeof(entry->crc));
+  file.seekSet(position(entry_ind));
+  return (file.write(entry, sizeof(SD_Index_Entry)) == sizeof(SD_Index_Entry));
+}
+
+bool SD_Index::getEntry(int entry_ind, SD_Index_Entry *entry) {
+  if (!begin() || (entry_ind < 0) || (entry_ind >= (int)header.n_entries)) return false;
+  file.seekSet(position(entry_ind));
+  if (file.read(entry, sizeof(SD_Index_Entry)) != (int)sizeof(SD_Index_Entry)) return false;
+  return (entry->crc == crc32(entry, sizeof(SD_Index_Entry) - sizeof(entry->crc)));
+}
+
+int SD_Index::addFile(const char *fname, uint32_t size_bytes) {
+  if (!begin()) return -1;
+  if (strlen(fname) >= SD_INDEX_NAME_LEN) {
+    printlnf(Serial, "SD_Index: addFile: *** ERROR ***: name is too long: %s", fname);
+    return -1;
+  }
+  SD_Index_Entry entry;
+  memset(entry.name, 0, SD_INDEX_NAME_LEN);
+  strcpy(entry.name, fname);
+  entry.size_bytes = size_bytes;
+  entry.created_sec = getTime_sec();
+  entry.name_hash = hashName(fname);
+  int entry_ind = findFile(fname);
+  if (entry_ind >= 0) {  //the file was written over, so start its entry again
+    if (!writeEntry(entry_ind, &entry)) return -1;
+    file.sync();
+    return entry_ind;
+  }
+  entry_ind = (int)header.n_entries;
+  if (!writeEntry(entry_ind, &entry)) return -1;
+  header.n_entries++;   //only count the entry after it has been written
+  writeHeader();
+  return entry_ind;
+}
+
+bool SD_Index::closeFile(int entry_ind, uint32_t size_bytes) {
+  SD_Index_Entry entry;
+  if (!getEntry(entry_ind, &entry)) return false;
+  entry.size_bytes = size_bytes;
+  entry.closed_sec = getTime_sec();
+  bool ok = writeEntry(entry_ind, &entry);
+  file.sync();
+  return ok;
+}
+
+bool SD_Index::statFile(int entry_ind, SD_Index_Entry *entry) {
+  if (!getEntry(entry_ind, entry)) return false;
+  FsFile data_file = sd->open(entry->name, O_RDONLY);
+  if (!data_file) {
+    printlnf(Serial, "SD_Index: statFile: *** ERROR ***: could not open %s", entry->name);
+    return false;
+  }
+  uint32_t size_bytes = (uint32_t)data_file.fileSize();
+  uint16_t mod_date = 0, mod_time = 0;
+  data_file.getModifyDateTime(&mod_date, &mod_time);
+  uint32_t stamp = ((uint32_t)mod_date << 16) | mod_time;   //catches a file that was rewritten at the same size
+  if ((entry->content_crc != 0) && (size_bytes == entry->size_bytes) && (stamp == entry->modified_stamp)) { data_file.close(); return true; }  //already known
+
+  //read the whole file (this stays on the Tympan, so it is much faster than sending it)
+  uint8_t buff[512];
+  uint32_t crc = 0;
+  int n;
+  while ((n = data_file.read(buff, sizeof(buff))) > 0) crc = crc32_update(crc, buff, n);
+  data_file.close();
+  entry->size_bytes = size_bytes;
+  entry->content_crc = crc;
+  entry->modified_stamp = stamp;
+  writeEntry(entry_ind, entry);  //remember it for next time
+  file.sync();
+  return true;
+}
+
+//look from the newest entry backwards (the file that we want is usually a recent one)
+int SD_Index::findFile(const char *fname) {
+  uint32_t hash = hashName(fname);
+  SD_Index_Entry entry;
+  for (int i = getNumEntries() - 1; i >= 0; i--) {
+    if (getEntry(i, &entry) && (entry.name_hash == hash) && (strcmp(entry.name, fname) == 0)) return i;
+  }
+  return -1;
+}
+
+const char* SD_Index::getNextRecordingName(void) {
+  if (!begin()) return NULL;
+  next_name.printf("%s%03lu%s", SD_INDEX_REC_PREFIX, (unsigned long)header.next_file_num, SD_INDEX_REC_SUFFIX);
+  return next_name.c_str();
+}
+
+int SD_Index::addRecording(const char *fname) {
+  if (!begin()) return -1;
+  noteRecordingNum(fname);
+  return addFile(fname, 0);  //this writes the header, too
+}
+
+void SD_Index::printNames(Print *out, char separator) {
+  SD_Index_Entry entry;
+  int n = getNumEntries();
+  for (int i=0; i < n; i++) {
+    if (!getEntry(i, &entry)) continue;
+    out->print(entry.name);
+    if (i < n-1) out->print(separator);
+  }
+  out->println();
+}
+
+int SD_Index::printEntries(Print *out, int first_entry, int max_entries) {
+  SD_Index_Entry entry;
+  int n = getNumEntries(), count = 0;
+  first_entry = max(0, first_entry);
+  int last_entry = (max_entries >= n - first_entry) ? (n - 1) : (first_entry + max_entries - 1);  //careful of overflow with SD_INDEX_ALL
+  printlnf(*out, "SD_Index: entries %d to %d of %d: index, name, size_bytes, created_sec, closed_sec", first_entry, last_entry, n);
+  for (int i = first_entry; i <= last_entry; i++) {
+    if (!getEntry(i, &entry)) { printlnf(*out, "%d, (bad entry)", i); continue; }
+    printlnf(*out, "%d, %s, %lu, %lu, %lu", i, entry.name, (unsigned long)entry.size_bytes,
+        (unsigned long)entry.created_sec, (unsigned long)entry.closed_sec);
+    count++;
+  }
+  return count;
+}
+
+uint32_t SD_Index::hashName(const char *fname) {
+  uint32_t hash = 2166136261UL;  //FNV-1a
+  while (*fname) { hash ^= (uint8_t)(*fname++); hash *= 16777619UL; }
+  return hash;
+}
+
+int32_t SD_Index::getRecordingNum(const char *fname) {
+  const int n_prefix = strlen(SD_INDEX_REC_PREFIX);
+  if (strncmp(fname, SD_INDEX_REC_PREFIX, n_prefix) != 0) return -1;
+  char *end = NULL;
+  unsigned long num = strtoul(fname + n_prefix, &end, 10);
+  if ((end == fname + n_prefix) || (strcmp(end, SD_INDEX_REC_SUFFIX) != 0)) return -1;
+  return (int32_t)num;
+}
+
+#endif
@@ -0,0 +1,60 @@
+/*
+ SPSC_Ring.h
+
+ Purpose: A lock-free ring buffer with a single producer (the audio interrupt) and a
+          single consumer (loop()), for passing per-block records out of the audio path.
+
+ The producer only writes n_write and the consumer only writes n_read, so neither side
+     ever has to turn off the interrupts.  The counters run freely (they wrap at 2^32)
+     and the length must be a power of 2.  When the ring is full, the new record is
+     dropped and counted (see getOverflowCount()), so a stalled loop() shows up as a gap.
+
+ This relies on the interrupt never being interrupted by loop(), which is true on our
+     single-core Teensy.
+
+ MIT License, Use at your own risk.
+*/
+
+#ifndef _SPSC_Ring_h
+#define _SPSC_Ring_h
+
+#include <atomic>
+
+template <class T, int LEN>
+class SPSC_Ring {
+  public:
+    static_assert((LEN > 0) && ((LEN & (LEN-1)) == 0), "SPSC_Ring: the length must be a power of 2");
+
+    //from the audio interrupt.  Returns false (and counts it) if the ring is full.
+    bool push(const T &item) {
+      uint32_t w = n_write;
+      if ((w - n_read) >= (uint32_t)LEN) { n_overflow++; return false; }
+      ring[w & (LEN-1)] = item;
+      std::atomic_signal_fence(std::memory_order_release);  //the copy must be finished before loop() can see it
+      n_write = w + 1;
+      return true;
+    }
+
+    //from loop(): get the oldest record.  Returns false if there is nothing new.
+    bool pop(T *item) { return (popBatch(item, 1) == 1); }
+
+    //from loop(): get up to max_items of the oldest records.  Returns the number copied.
+    int popBatch(T *items, int max_items) {
+      uint32_t r = n_read;
+      int n = min((int)(n_write - r), max_items);
+      std::atomic_signal_fence(std::memory_order_acquire);
+      for (int i=0; i < n; i++) items[i] = ring[(r + i) & (LEN-1)];
+      n_read = r + n;  //only now can the interrupt reuse those slots
+      return n;
+    }
+
+    int available(void) const { return (int)(n_write - n_read); }
+    uint32_t getOverflowCount(void) const { return n_overflow; }
+    void clear(void) { n_read = n_write; }  //from loop(): throw away everything not yet read
+
+  private:
+    T ring[LEN];
+    volatile uint32_t n_write = 0, n_read = 0, n_overflow = 0;
+};
+
+#endif
@@ -4,24 +4,68 @@
 
 #include <Tympan_Library.h>
 #include "State.h"
+#include "GUI_State_Cache.h"
+#include "TympanRemote_LayoutCache.h"
+#include "Command_Line.h"
+#include "Fixed_Format.h"
+#include "Telemetry.h"
+#include "AudioArtifactMonitor_F32.h"
+#include "Ear_Manager.h"
+#include "SD_Index.h"
+#include "Compressed_Transfer.h"
+#include "Results_Log.h"
+#include "Reply_Framer.h"
+#include "AudioSDWriter_Indexed_UI.h"
 
 //classes from the main sketch that might be used here
 extern Tympan myTympan;                    //created in the main *.ino file
 extern State myState;                      //created in the main *.ino file
 extern AudioSettings_F32 audio_settings;   //created in the main *.ino file  
-extern AudioSDWriter_F32_UI audioSDWriter; //created in AudioProcessing.h
+extern AudioSDWriter_Indexed_UI audioSDWriter; //created in AudioProcessing.h
 extern SdFileTransfer sdFileTransfer;        //created in the main *.ino file
+extern SdFileTransfer_Compressed sdFileTransfer_comp;  //created in the main *.ino file
+extern int sd_start_millis, tone_dur_millis, silence_dur_millis, max_tone_extend_millis;  //created in DPOAE_test_logic.h
+extern Telemetry telemetry;                  //created in the main *.ino file
+extern Ear_Manager earManager[N_EARS];       //created in the main *.ino file
+extern AudioParamUpdater_F32 paramUpdater;   //created in AudioProcessing.h
 
 //functions in the main sketch that I want to call from here
 extern void setConfiguration(int);
 extern float changeCal(int, float);
+extern float setCal(int, int, int, float);
+extern void setTargetLevels_dBSPL(float, float);
 extern void printGainLevels(void);
 extern int incrementFreqStep(int);
 extern int jumpToFreqStepAndPlayTones(int);
 extern bool muteOutput(bool);
 extern void start_DPOAE_test(void);
 extern void stop_DPOAE_test(void);
+extern void start_probe_check(void);
 extern bool enablePrintLevelsToGUI(bool);
+extern bool enableSpectrum(bool);
+extern void listFilesFromIndex(void);
+extern int listIndexEntries(int, int);
+extern int rebuildSDIndex(void);
+extern void statIndexEntry(int);
+extern bool enableStimulusCache(bool);
+extern int loadStimulusFromSD(int, int);
+extern int playStimulusSlot(int);
+extern void printStimulusCache(void);
+extern bool enableBlockStatsLog(bool);
+extern void printTaskStats(void);
+extern void printDSPCost(void);
+extern bool setRecordFilter(int, float);
+extern int loadCalCurves(void);
+extern int captureProbeReferences(void);
+extern bool startSession(int);
+extern void stopSession(void);
+extern void printSessionStatus(void);
+extern void resetTaskStats(void);
+extern int printResultsSince(int, int);
+extern int printSessionResults(int);
+#if (N_EARS > 1)
+extern EarpieceShield earpieceShield;        //created in the main *.ino file
+#endif
 
 
 //externals for MTP
@@ -42,36 +86,111 @@ extern void start_MTP(void);
 // you have a better idea of where to look for the code and what other code it relates to.
 //
 
+//define the named commands that can be sent as a line starting with '$' (see Command_Line.h)
+enum DPOAE_CMD { CMD_HELP=0, CMD_STEP, CMD_SPL, CMD_CAL, CMD_MUTE, CMD_TONE_MS, CMD_SILENCE_MS, CMD_SDSTART_MS, 
+                 CMD_INPUT_GAIN, CMD_LEVELS, CMD_CPU, CMD_START, CMD_STOP, CMD_TELEMETRY, CMD_SPECTRUM, 
+                 CMD_PROBE, CMD_PROBE_AUTO, CMD_PROBE_REF, CMD_PROBE_TOL, CMD_REJECT, CMD_EXTEND_MS, CMD_EAR, 
+                 CMD_LS, CMD_LS_SINCE, CMD_INDEX_REBUILD, CMD_STAT,
+                 CMD_STIM_CACHE, CMD_STIM_LOAD, CMD_STIM_PLAY, CMD_STIM_LIST, CMD_BLOCKSTATS, CMD_TASKS, CMD_DSP_COST, CMD_REC_FILTER,
+                 CMD_CAL_LOAD, CMD_SESSION, CMD_RESULTS_SINCE, CMD_RESULTS_SESSION, CMD_FRAME, N_DPOAE_CMDS };
+const Command_Def dpoae_commands[N_DPOAE_CMDS] = {   //must be in the same order as the enum above
+  { "help",       0, 0, ": Print this list of commands" },
+  { "step",       1, 1, "<n>: Jump to DPOAE test step n (1 = first step)" },
+  { "spl",        2, 2, "<f1_dB> <f2_dB>: Set the target F1 and F2 levels (dB SPL)" },
+  { "cal",        2, 4, "<chan 1|2> <dBFS> [step] [ear]: Set F1 or F2 speaker cal (dBFS at 94dB SPL) for the current (or given) step and ear" },
+  { "mute",       1, 1, "<0|1>: Unmute (0) or mute (1) the audio output" },
+  { "tone_ms",    1, 1, "<msec>: Set the duration of each tone in the stepped test" },
+  { "silence_ms", 1, 1, "<msec>: Set the duration of the silence between tones in the stepped test" },
+  { "sdstart_ms", 1, 1, "<msec>: Set the delay between starting the SD recording and starting the tones" },
+  { "input_gain", 1, 1, "<dB>: Set the analog input gain (0 to 47.5 dB)" },
+  { "levels",     1, 1, "<0|1>: Stop (0) or start (1) sending the measured mic levels" },
+  { "cpu",        1, 1, "<0|1>: Stop (0) or start (1) reporting the CPU usage" },
+  { "start",      0, 0, ": Start the stepped DPOAE test" },
+  { "stop",       0, 0, ": Stop the stepped DPOAE test" },
+  { "telemetry",  1, 2, "<0|1> [rate_Hz]: Stop (0) or start (1) the binary telemetry frames on USB (see Telemetry.h)" },
+  { "spectrum",   1, 2, "<0|1> [rate_Hz]: Stop (0) or start (1) the live mic spectrum (octave bands to App, binary frames to USB)" },
+  { "probe",      0, 0, ": Run just the probe-fit check (see Probe_Check.h)" },
+  { "probe_auto", 1, 1, "<0|1>: Skip (0) or run (1) the probe-fit check before each test (needs a reference)" },
+  { "probe_ref",  0, 0, ": Use the last probe-fit measurement as the reference and save it (do this with a good fit)" },
+  { "probe_tol",  3, 3, "<lf_dB> <level_dB> <shape_dB>: Set the probe-fit limits" },
+  { "reject",     1, 3, "<0|1> [thresh_dB] [hangover_blocks]: Stop (0) or start (1) rejecting noisy blocks (see AudioArtifactMonitor_F32.h)" },
+  { "extend_ms",  1, 1, "<msec>: Most that a tone can be extended to make up for rejected blocks" },
+  { "ear",        1, 1, "<1|2>: Choose the ear for the cal controls and the App's display (binaural only)" },
+  { "ls",         1, 2, "<page> [page_size]: List one page of the SD card's file index (page 0 is the oldest files)" },
+  { "ls_since",   1, 1, "<n>: List the SD card's files from index entry n onward (ie, the files added since)" },
+  { "index_rebuild", 0, 0, ": Rebuild the SD card's file index (after files were changed by MTP or a card reader)" },
+  { "stat",       1, 1, "<n>: Print the name, size, CRC32, and whether it is being recorded (1, with no size or CRC yet) of the file at index entry n (see $ls)" },
+  { "stim_cache", 1, 1, "<0|1>: Play the tones from the sine generators (0) or from the precomputed stimulus cache (1)" },
+  { "stim_load",  2, 2, "<slot> <n>: Load the WAV file at index entry n into a slot of the stimulus cache" },
+  { "stim_play",  1, 1, "<slot>: Play a slot of the stimulus cache on all ears (-1 stops it)" },
+  { "stim_list",  0, 0, ": List the slots of the stimulus cache" },
+  { "blockstats", 1, 1, "<0|1>: Stop (0) or start (1) printing every audio block's mic levels and peaks (see AudioBlockStats_F32.h)" },
+  { "tasks",      0, 1, "[reset]: Print each loop() task's run time and deadline misses (1 also resets them)" },
+  { "dsp_cost",   0, 0, ": Print what the analysis and recording decimators cost per audio block (see AudioDecimator_F32.h)" },
+  { "rec_filter", 1, 2, "<taps> [cutoff_Hz]: Set the anti-alias filter used before decimating the recording (not while recording)" },
+  { "cal_load",   0, 0, ": Set every step's speaker cal from the CalibrateIO curves on the SD card (CAL1.BIN to CAL4.BIN, see Cal_Curve.h)" },
+  { "session",    1, 2, "<0|1|2> [n]: Stop (0) or start (1) the queue of tests in PLAN.TXT (or PLANn.TXT), or print its status (2) (see Session_Queue.h)" },
+  { "results_since",   1, 2, "<n> [max]: Print the results log from record n onward (ie, the results added since), as CSV (see Results_Log.h)" },
+  { "results_session", 1, 1, "<n>: Print every record of the results log from session n (SESSnnn.CSV), as CSV" },
+  { "frame",      1, 1, "<0|1>: Stop (0) or start (1) marking the begin and end of each command's reply, for scripts (see Reply_Framer.h)" }
+};
+
 //now, define the Serial Manager class
 class SerialManager : public SerialManagerBase  {  // see Tympan_Library for SerialManagerBase for more functions!
   public:
-    SerialManager(BLE *_ble) : SerialManagerBase(_ble) {};
+    SerialManager(BLE *_ble) : SerialManagerBase(_ble), cmdLine(dpoae_commands, N_DPOAE_CMDS), planCmdLine(dpoae_commands, N_DPOAE_CMDS), replyFramer(&Serial) {};
       
     void printHelp(void);
     void createTympanRemoteLayout(void); 
+    void prepareTympanRemoteLayout(void);   //call from setup() to build and cache the layout ahead of time
     void printTympanRemoteLayout(void); 
+    void printTympanRemoteLayoutPage(int page_ind);
     bool processCharacter(char c);  //this is called automatically by SerialManagerBase.respondToByte(char c)
 
     int receiveFilename(String &filename,const unsigned long timeout_millis);
 
+    //methods for the named, line-based commands (see Command_Line.h)
+    int processCommandLine(void);  //returns a Reply_Framer::STATUS
+    const char *checkCommand(const Parsed_Command &cmd);  //returns NULL if the command can be executed
+    void executeCommand(const Parsed_Command &cmd);
+    bool runCommandLine(const char *line, bool execute);  //for lines that don't come from the serial link (ex: a session plan)
+    void executeBatch(const Parsed_Command *cmds, int n_cmds);  //execute them all, with their tone changes applied together
+
     //method for updating the GUI on the App
     void setFullGUIState(bool activeButtonsOnly = false);
     void updateCalDisplay(void);
     void updateDPOAEStatus(void);
+    void updateProbeCheckDisplay(void);
     void updateDPOAEDisplay(void);
     void updateCpuDisplayOnOff(void);
     void updateCpuDisplayUsage(void);
     void updateMuteDisplay(void);
     void updateLevelStartStop(void);
     void updateLevelDisplays(void);
+    void updateSpectrumStartStop(void);
+    void updateSpectrumDisplay(const float *octave_dB, const int n_octaves);
     void updateGUI_inputGain(bool activeButtonsOnly = false);
     void updateGUI_inputSelect(bool activeButtonsOnly = false);    
 
+    //methods for queueing GUI updates so that only changed values get sent (see GUI_State_Cache.h)
+    void queueButtonText(const char *btn_id, const char *text);
+    void queueButtonState(const char *btn_id, bool state);
+    void serviceGUI(unsigned long curTime_millis);  //call from loop().  Sends the queued changes as one BLE message.
+
     //factors by which to raise or lower the parameters when receiving commands from TympanRemote App
     float gainIncrement_dB = 1.0f;            //raise or lower by x dB
+    unsigned long guiUpdatePeriod_millis = 100;  //send queued GUI changes no more often than this
   private:
 
     TympanRemoteFormatter myGUI;  //Creates the GUI-writing class for interacting with TympanRemote App
+    GUI_State_Cache guiCache;     //remembers what the App is already showing
+    TympanRemote_LayoutCache layoutCache;  //pre-rendered copy of the layout defined by myGUI
+    bool waitingForLayoutPage = false;     //was the previous command a request for a layout page?
+    Command_Line cmdLine;                  //collects and parses the '$' commands
+    Command_Line planCmdLine;              //parses the lines of a session plan (see Session_Queue.h)
+    bool is_plan_line = false;             //is checkCommand() looking at a line from a session plan?
+    Reply_Framer replyFramer;              //marks the begin and end of each reply, when enabled
+    unsigned long lastGUIUpdate_millis = 0;
    
 };
 
@@ -86,11 +205,17 @@ void SerialManager::printHelp(void) {
   Serial.println("  g  : Print all gain levels.");
   Serial.println(" m/M: Mute/Unmute the audio output.");
   Serial.println(" q/Q: Start/Stop the Stepped DPOAE Test.");
+  Serial.println("  b : Check the probe fit (this also runs at the start of each test, once \"$probe_ref\" has saved a reference).");
   //Serial.println(" w/e: Switch Input to PCB Mics (w) or Line In (e)");
   Serial.println(" l/L: Start/Stop printing measured mic levels.");
-  Serial.println(" z  : SD Transfer: Get file names at root of SD.");
+  Serial.println(" v/V: Start/Stop the live mic spectrum.");
+  Serial.println(" z  : SD Transfer: Get file names at root of SD (from the SD index).");
   Serial.println(" x    : Transfer file from Tympan SD to PC via Serial ('send' interactive)");
   Serial.println(" X    : Transfer file from PC to Tympan SD via Serial ('receive' interactive)");
+  Serial.println(" k    : Transfer file from Tympan SD to PC, compressed (see Compressed_Transfer.h)");
+  Serial.println(" y<n>: Send just page n (0-9) of the App's GUI layout");
+  Serial.println(" $  : Named commands, one line, several allowed if separated by ';' (ex: \"$spl 65 55; step 3\")");
+  cmdLine.printHelp(&Serial);
   
   #if defined(USE_MTPDISK) || defined(USB_MTPDISK_SERIAL)  //detect whether "MTP Disk" or "Serial + MTP Disk" were selected in the Arduino IDEA
     Serial.println("  > : SDUtil : Start MTP mode to read SD from PC (Tympan must be freshly restarted)");
@@ -110,6 +235,23 @@ void SerialManager::printHelp(void) {
 bool SerialManager::processCharacter(char c) {  //this is called by SerialManagerBase.respondToByte(char c)
   bool ret_val = true;
 
+  //are we in the middle of receiving a named command line?
+  if (cmdLine.isCapturing()) {
+    if (cmdLine.addChar(c)) { replyFramer.startCommand(); replyFramer.endCommand(processCommandLine()); }  //execute once the whole line has arrived
+    return ret_val;
+  }
+
+  //is this character the page number that goes with a previous 'y' command?
+  if (waitingForLayoutPage) {
+    waitingForLayoutPage = false;
+    if ((c >= '0') && (c <= '9')) { replyFramer.startCommand(); printTympanRemoteLayoutPage(c - '0'); replyFramer.endCommand(Reply_Framer::REPLY_OK); return ret_val; }
+  }
+
+  //frame the reply (see Reply_Framer.h), except for the characters that only start a command and the file
+  //transfers (which have their own protocols).  The EOL after a single-character command is ignored.
+  bool is_framed = (strchr("$yxXk\r\n ", c) == NULL);
+  if (is_framed) replyFramer.startCommand();
+
   switch (c) {
     case 'h':
       printHelp(); 
@@ -117,6 +259,12 @@ bool SerialManager::processCharacter(char c) {  //this is called by SerialManage
     case 'J': case 'j':           //The TympanRemote app sends a 'J' to the Tympan when it connects
       printTympanRemoteLayout();  //in resonse, the Tympan sends the definition of the GUI that we'd like
       break;
+    case 'y':
+      waitingForLayoutPage = true;  //the next character will say which page to send
+      break;
+    case CMDLINE_START_CHAR:
+      cmdLine.begin();  //the rest of the line holds one or more named commands
+      break;
     // case 'w':
     //   Serial.println("Received: Switch input to PCB Mics");
     //   setConfiguration(State::INPUT_PCBMICS);
@@ -160,8 +308,13 @@ bool SerialManager::processCharacter(char c) {  //this is called by SerialManage
       break;
     case 'Q':
       Serial.println("Stopping DPOAE Test...");
+      stopSession();  //(if there is one)
       stop_DPOAE_test();
       break;
+    case 'b':
+      Serial.println("Checking the probe fit...");
+      start_probe_check();
+      break;
     case 'l':  //lowercase 'L'
       Serial.println("Start printing measured mic levels...");
       enablePrintLevelsToGUI(true);
@@ -172,6 +325,16 @@ bool SerialManager::processCharacter(char c) {  //this is called by SerialManage
       enablePrintLevelsToGUI(false);    
       updateLevelStartStop();
       break;
+    case 'v':
+      Serial.println("Start sending the live mic spectrum...");
+      enableSpectrum(true);
+      updateSpectrumStartStop();
+      break;
+    case 'V':
+      Serial.println("Stop sending the live mic spectrum...");
+      enableSpectrum(false);
+      updateSpectrumStartStop();
+      break;
     case 'c':
       Serial.println("Starting CPU reporting...");
       myState.printCPUtoGUI = true;
@@ -228,7 +391,7 @@ bool SerialManager::processCharacter(char c) {  //this is called by SerialManage
       break;
     case 'z':
       Serial.print("SerialMonitor: Listing Files on SD: "); //purposely don't include end-of-line
-      sdFileTransfer.sendFilenames(','); //send file names seperated by commas
+      listFilesFromIndex(); //send file names seperated by commas (from the SD index, see SD_Index.h)
       break;
     case 'x':
       if ((Serial.peek() == '\n') || (Serial.peek() == '\r')) Serial.read();  //remove any trailing EOL character
@@ -238,6 +401,10 @@ bool SerialManager::processCharacter(char c) {  //this is called by SerialManage
       if ((Serial.peek() == '\n') || (Serial.peek() == '\r')) Serial.read();  //remove any trailing EOL character
       sdFileTransfer.receiveFile_interactive();
       break;
+    case 'k':
+      if ((Serial.peek() == '\n') || (Serial.peek() == '\r')) Serial.read();  //remove any trailing EOL character
+      sdFileTransfer_comp.sendFile_interactive();
+      break;
   #if defined(USE_MTPDISK) || defined(USB_MTPDISK_SERIAL)  //detect whether "MTP Disk" or "Serial + MTP Disk" were selected in the Arduino IDEA  
     case '>':
       Serial.println("SerialMonitor: Received command to start MTP service..."); Serial.flush();delay(10);
@@ -255,6 +422,7 @@ bool SerialManager::processCharacter(char c) {  //this is called by SerialManage
       ret_val = SerialManagerBase::processCharacter(c);  //in here, it automatically loops over the different UI elements
       break;
   }
+  if (is_framed) replyFramer.endCommand(ret_val ? Reply_Framer::REPLY_OK : Reply_Framer::REPLY_UNKNOWN);
   return ret_val;
 }
 
@@ -267,6 +435,301 @@ int SerialManager::receiveFilename(String &filename,const unsigned long timeout_
   return 0;
 }
 
+// //////////////////////////////////  Methods for the named, line-based commands
+
+//parse the whole line, check every command, and only then execute them (so that a batch is all-or-nothing).  The
+//commands are checked against the state before the line, so a command that changes the test's state (such as
+//"start") must be the last one in the line.
+int SerialManager::processCommandLine(void) {
+  static Parsed_Command cmds[CMDLINE_MAX_BATCH];
+  int n_cmds = cmdLine.parse(cmds, CMDLINE_MAX_BATCH);
+  if (n_cmds < 0) {
+    Serial.print("SerialManager: *** ERROR ***: $: "); Serial.print(cmdLine.getErrorMessage()); Serial.println(". Nothing executed.");
+    return Reply_Framer::REPLY_BAD_COMMAND;
+  }
+  for (int i=0; i < n_cmds; i++) {
+    const char *err = checkCommand(cmds[i]);
+    bool changes_state = (cmds[i].def_ind == CMD_START) || (cmds[i].def_ind == CMD_PROBE) || ((cmds[i].def_ind == CMD_SESSION) && (cmds[i].args[0] == 1));
+    if ((err == NULL) && changes_state && (i < n_cmds-1)) err = "must be the last command in the line (it starts a test)";
+    if (err != NULL) {
+      Serial.print("SerialManager: *** ERROR ***: $"); Serial.print(cmdLine.getDef(cmds[i]).name); 
+      Serial.print(": "); Serial.print(err); Serial.println(". Nothing executed.");
+      return Reply_Framer::REPLY_BAD_COMMAND;
+    }
+  }
+
+  //everything is OK, so execute them all
+  executeBatch(cmds, n_cmds);
+  setFullGUIState(true);   //only the values that actually changed will be sent (see GUI_State_Cache.h)
+  Serial.print("SerialManager: $: executed "); Serial.print(n_cmds); Serial.println(" command(s)");
+  return Reply_Framer::REPLY_OK;
+}
+
+//run a line of named commands (without the '$') that came from somewhere other than the serial link, such as
+//a session plan.  It is checked in the same way, so it is all-or-nothing.  With execute = false, it is only
+//checked.  Returns false if there was an error.
+bool SerialManager::runCommandLine(const char *line, bool execute) {
+  static Parsed_Command cmds[CMDLINE_MAX_BATCH];  //not shared with processCommandLine(), which might be what called us
+  planCmdLine.begin();
+  for (const char *p = line; *p != '\0'; p++) planCmdLine.addChar(*p);
+  if (!planCmdLine.addChar('\n')) return true;  //an empty line has nothing to do
+  int n_cmds = planCmdLine.parse(cmds, CMDLINE_MAX_BATCH);
+  if (n_cmds < 0) {
+    Serial.print("SerialManager: *** ERROR ***: "); Serial.print(line); Serial.print(": "); Serial.println(planCmdLine.getErrorMessage());
+    return false;
+  }
+  is_plan_line = true;
+  for (int i=0; i < n_cmds; i++) {
+    const char *err = checkCommand(cmds[i]);
+    if (err != NULL) {
+      Serial.print("SerialManager: *** ERROR ***: "); Serial.print(planCmdLine.getDef(cmds[i]).name); Serial.print(": "); Serial.println(err);
+      is_plan_line = false;
+      return false;
+    }
+  }
+  is_plan_line = false;
+  if (!execute) return true;
+
+  executeBatch(cmds, n_cmds);
+  setFullGUIState(true);
+  return true;
+}
+
+//hold the tone changes until every command has run, so that the audio interrupt never plays a mix of the
+//settings before and after the line
+void SerialManager::executeBatch(const Parsed_Command *cmds, int n_cmds) {
+  bool was_held = paramUpdater.isHeld();
+  paramUpdater.hold(true);
+  for (int i=0; i < n_cmds; i++) executeCommand(cmds[i]);
+  paramUpdater.hold(was_held);
+}
+
+const char* SerialManager::checkCommand(const Parsed_Command &cmd) {
+  if (is_plan_line && ((cmd.def_ind == CMD_START) || (cmd.def_ind == CMD_STOP) || (cmd.def_ind == CMD_PROBE) || (cmd.def_ind == CMD_SESSION))) {
+    return "not allowed in a session plan (the session starts and stops the tests)";
+  }
+  switch (cmd.def_ind) {
+    case CMD_STEP:
+      if ((cmd.args[0] < 1) || (cmd.args[0] > myState.selEar().test_params.n_freqs)) return "step is out of range";
+      break;
+    case CMD_CAL:
+      if ((cmd.args[0] != 1) && (cmd.args[0] != 2)) return "chan must be 1 or 2";
+      if ((cmd.n_args > 2) && ((cmd.args[2] < 1) || (cmd.args[2] > myState.selEar().test_params.n_freqs))) return "step is out of range";
+      if ((cmd.n_args > 3) && ((cmd.args[3] < 1) || (cmd.args[3] > N_EARS))) return "ear is out of range";
+      break;
+    case CMD_EAR:
+      if ((cmd.args[0] < 1) || (cmd.args[0] > N_EARS)) return "ear is out of range";
+      break;
+    case CMD_LS:
+      if (cmd.args[0] < 0) return "page must not be negative";
+      if ((cmd.n_args > 1) && (cmd.args[1] < 1)) return "page_size must be at least 1";
+      break;
+    case CMD_LS_SINCE: case CMD_STAT: case CMD_RESULTS_SINCE: case CMD_RESULTS_SESSION:
+      if (cmd.args[0] < 0) return "n must not be negative";
+      if ((cmd.def_ind == CMD_RESULTS_SINCE) && (cmd.n_args > 1) && (cmd.args[1] < 1)) return "max must be at least 1";
+      break;
+    case CMD_INDEX_REBUILD:
+      if (audioSDWriter.getState() == AudioSDWriter::STATE::RECORDING) return "cannot rebuild the index while recording";
+      break;
+    case CMD_TONE_MS: case CMD_SILENCE_MS: case CMD_SDSTART_MS:
+      if (cmd.args[0] < 0) return "duration must not be negative";
+      if (myState.cur_test_state != State::TEST_OFF) return "cannot change durations while the test is running";
+      break;
+    case CMD_INPUT_GAIN:
+      if ((cmd.args[0] < 0.0f) || (cmd.args[0] > 47.5f)) return "gain must be 0 to 47.5 dB";
+      break;
+    case CMD_TELEMETRY:
+      if ((cmd.n_args > 1) && ((cmd.args[1] <= 0.0f) || (cmd.args[1] > TELEMETRY_MAX_RATE_HZ))) return "rate must be greater than 0 and no more than 50 Hz";
+      break;
+    case CMD_PROBE:
+      if (myState.cur_test_state != State::TEST_OFF) return "cannot check the probe while the test is running";
+      break;
+    case CMD_CAL_LOAD:
+      if (myState.cur_test_state != State::TEST_OFF) return "cannot change the cal while the test is running";
+      break;
+    case CMD_SESSION:
+      if ((cmd.args[0] != 0) && (cmd.args[0] != 1) && (cmd.args[0] != 2)) return "must be 0, 1, or 2";
+      if ((cmd.n_args > 1) && ((cmd.args[1] < 0) || (cmd.args[1] > 99))) return "plan number must be 0 to 99";
+      break;
+    case CMD_PROBE_REF:
+      if (myState.cur_test_state != State::TEST_OFF) return "cannot change the reference while the test is running";
+      if (audioSDWriter.getState() == AudioSDWriter::STATE::RECORDING) return "cannot save the reference while recording";
+      break;
+    case CMD_PROBE_AUTO:
+      for (int i=0; (cmd.args[0] != 0) && (i < N_EARS); i++) {
+        if (!myState.ears[i].probe_check.has_ref) return "there is no probe-fit reference yet (fit the probe, then \"$probe\" and \"$probe_ref\")";
+      }
+      break;
+    case CMD_PROBE_TOL:
+      if ((cmd.args[0] <= 0.0f) || (cmd.args[1] <= 0.0f) || (cmd.args[2] <= 0.0f)) return "limits must be greater than 0 dB";
+      break;
+    case CMD_REJECT:
+      if ((cmd.n_args > 1) && (cmd.args[1] <= 0.0f)) return "threshold must be greater than 0 dB";
+      if ((cmd.n_args > 2) && (cmd.args[2] < 0.0f)) return "hangover must not be negative";
+      break;
+    case CMD_EXTEND_MS:
+      if (cmd.args[0] < 0) return "duration must not be negative";
+      break;
+    case CMD_SPECTRUM:
+      if ((cmd.n_args > 1) && ((cmd.args[1] <= 0.0f) || (cmd.args[1] > 20.0f))) return "rate must be greater than 0 and no more than 20 Hz";
+      break;
+    case CMD_STIM_LOAD:
+      if ((cmd.args[0] < 0) || (cmd.args[0] >= STIM_CACHE_SLOTS)) return "slot is out of range";
+      if (cmd.args[1] < 0) return "n must not be negative";
+      if (myState.cur_test_state != State::TEST_OFF) return "cannot load a stimulus while the test is running";
+      break;
+    case CMD_STIM_PLAY:
+      if ((cmd.args[0] < -1) || (cmd.args[0] >= STIM_CACHE_SLOTS)) return "slot is out of range";
+      if (myState.cur_test_state != State::TEST_OFF) return "cannot play a stimulus while the test is running";
+      break;
+  }
+  return NULL;
+}
+
+void SerialManager::executeCommand(const Parsed_Command &cmd) {
+  switch (cmd.def_ind) {
+    case CMD_HELP:
+      cmdLine.printHelp(&Serial);
+      break;
+    case CMD_STEP:
+      jumpToFreqStepAndPlayTones((int)cmd.args[0] - 1);
+      break;
+    case CMD_SPL:
+      setTargetLevels_dBSPL(cmd.args[0], cmd.args[1]);
+      break;
+    case CMD_CAL:
+      setCal((cmd.n_args > 3) ? ((int)cmd.args[3] - 1) : myState.sel_ear, (int)cmd.args[0] - 1, 
+             (cmd.n_args > 2) ? ((int)cmd.args[2] - 1) : myState.selEar().cur_step_ind, cmd.args[1]);
+      break;
+    case CMD_MUTE:
+      muteOutput(cmd.args[0] != 0);
+      break;
+    case CMD_TONE_MS:
+      tone_dur_millis = (int)cmd.args[0];
+      break;
+    case CMD_SILENCE_MS:
+      silence_dur_millis = (int)cmd.args[0];
+      break;
+    case CMD_SDSTART_MS:
+      sd_start_millis = (int)cmd.args[0];
+      break;
+    case CMD_INPUT_GAIN:
+      myState.input_gain_dB = myTympan.setInputGain_dB(cmd.args[0]);
+      #if (N_EARS > 1)
+        earpieceShield.setInputGain_dB(cmd.args[0]);
+      #endif
+      break;
+    case CMD_LEVELS:
+      enablePrintLevelsToGUI(cmd.args[0] != 0);
+      break;
+    case CMD_CPU:
+      myState.printCPUtoGUI = (cmd.args[0] != 0);
+      updateCpuDisplayOnOff();
+      break;
+    case CMD_START:
+      start_DPOAE_test();
+      break;
+    case CMD_STOP:
+      stopSession();  //(if there is one)
+      stop_DPOAE_test();
+      break;
+    case CMD_TELEMETRY:
+      if (cmd.n_args > 1) telemetry.setRate_Hz(cmd.args[1]);
+      telemetry.enable(cmd.args[0] != 0);
+      break;
+    case CMD_SPECTRUM:
+      if (cmd.n_args > 1) myState.spectrum_rate_Hz = cmd.args[1];
+      enableSpectrum(cmd.args[0] != 0);
+      break;
+    case CMD_PROBE:
+      start_probe_check();
+      break;
+    case CMD_REJECT:
+      for (int i=0; i < N_EARS; i++) {
+        if (cmd.n_args > 1) earManager[i].artifactMonitor->setThreshold_dB(cmd.args[1]);
+        if (cmd.n_args > 2) earManager[i].artifactMonitor->setHangoverBlocks((int)cmd.args[2]);
+        if (myState.cur_test_state != State::TEST_PROBECHECK) earManager[i].artifactMonitor->enable(cmd.args[0] != 0);  //(otherwise, it is applied after the chirp)
+      }
+      myState.reject_noisy_blocks = (cmd.args[0] != 0);
+      break;
+    case CMD_EXTEND_MS:
+      max_tone_extend_millis = (int)cmd.args[0];
+      break;
+    case CMD_PROBE_AUTO:
+      myState.probe_check_before_test = (cmd.args[0] != 0);
+      break;
+    case CMD_PROBE_REF:
+      captureProbeReferences();
+      break;
+    case CMD_PROBE_TOL:
+      for (int i=0; i < N_EARS; i++) {
+        myState.ears[i].probe_check.lf_tol_dB = cmd.args[0];
+        myState.ears[i].probe_check.level_tol_dB = cmd.args[1];
+        myState.ears[i].probe_check.shape_tol_dB = cmd.args[2];
+      }
+      break;
+    case CMD_EAR:
+      myState.sel_ear = (int)cmd.args[0] - 1;
+      break;
+    case CMD_LS: {
+      int page_size = (cmd.n_args > 1) ? (int)cmd.args[1] : 20;
+      listIndexEntries((int)cmd.args[0] * page_size, page_size);
+      break;
+    }
+    case CMD_LS_SINCE:
+      listIndexEntries((int)cmd.args[0], SD_INDEX_ALL);
+      break;
+    case CMD_INDEX_REBUILD:
+      rebuildSDIndex();
+      break;
+    case CMD_STAT:
+      statIndexEntry((int)cmd.args[0]);
+      break;
+    case CMD_STIM_CACHE:
+      enableStimulusCache(cmd.args[0] != 0);
+      break;
+    case CMD_STIM_LOAD:
+      loadStimulusFromSD((int)cmd.args[0], (int)cmd.args[1]);
+      break;
+    case CMD_STIM_PLAY:
+      playStimulusSlot((int)cmd.args[0]);
+      break;
+    case CMD_STIM_LIST:
+      printStimulusCache();
+      break;
+    case CMD_BLOCKSTATS:
+      enableBlockStatsLog(cmd.args[0] != 0);
+      break;
+    case CMD_TASKS:
+      printTaskStats();
+      if ((cmd.n_args > 0) && (cmd.args[0] != 0)) resetTaskStats();
+      break;
+    case CMD_DSP_COST:
+      printDSPCost();
+      break;
+    case CMD_REC_FILTER:
+      if (setRecordFilter((int)cmd.args[0], (cmd.n_args > 1) ? cmd.args[1] : 0.0f)) printDSPCost();
+      break;
+    case CMD_CAL_LOAD:
+      if (loadCalCurves() > 0) printGainLevels();
+      break;
+    case CMD_SESSION:
+      if (cmd.args[0] == 0) stopSession();
+      if (cmd.args[0] == 1) startSession((cmd.n_args > 1) ? (int)cmd.args[1] : 0);
+      if (cmd.args[0] == 2) printSessionStatus();
+      break;
+    case CMD_RESULTS_SINCE:
+      printResultsSince((int)cmd.args[0], (cmd.n_args > 1) ? (int)cmd.args[1] : RESULTS_ALL);
+      break;
+    case CMD_RESULTS_SESSION:
+      printSessionResults((int)cmd.args[0]);
+      break;
+    case CMD_FRAME:
+      replyFramer.enable(cmd.args[0] != 0);
+      break;
+  }
+}
+
 // //////////////////////////////////  Methods for defining and transmitting the GUI to the App
 
 //define the GUI for the App
@@ -282,6 +745,8 @@ void SerialManager::createTympanRemoteLayout(void) {
           card_h->addButton("Start", "q" , "start",        6);
           card_h->addButton("Stop",  "Q" , "",             6);
           card_h->addButton("",      "",   "status",         12);
+          card_h->addButton("Check Probe", "b", "",        6);
+          card_h->addButton("",      "",   "probe",          6);
           
       //Add a button group for SD recording...use a button set that is built into AudioSDWriter_F32_UI for you!
       card_h = audioSDWriter.addCard_sdRecord(page_h);
@@ -357,6 +822,18 @@ void SerialManager::createTympanRemoteLayout(void) {
       card_h->addButton("LEQ2 (dBFS)", "", "",     6); //label, command, id, width (out of 12)
       card_h->addButton("",            "", "L2", 6); //label, command, id, width (out of 12)
 
+    card_h = page_h->addCard(String("Mic Spectrum (dBFS per Octave)"));
+      card_h->addButton("Start", "v", "sSpec", 6);     //label, command, id, width (out of 12)
+      card_h->addButton("Stop",  "V", "",      6);     //label, command, id, width (out of 12)
+      card_h->addButton("",      "", "spec0",  3);     //label, command, id, width (out of 12)...text is filled in by updateSpectrumDisplay()
+      card_h->addButton("",      "", "spec1",  3);
+      card_h->addButton("",      "", "spec2",  3);
+      card_h->addButton("",      "", "spec3",  3);
+      card_h->addButton("",      "", "spec4",  3);
+      card_h->addButton("",      "", "spec5",  3);
+      card_h->addButton("",      "", "spec6",  3);
+      card_h->addButton("",      "", "spec7",  3);
+
   //Add another page to the GUI
   page_h = myGUI.addPage("Globals");
 
@@ -377,19 +854,42 @@ void SerialManager::createTympanRemoteLayout(void) {
 }
 
 
+// Build the layout and render it into the layout cache so that it is ready before the App ever connects
+void SerialManager::prepareTympanRemoteLayout(void) {
+    if (myGUI.get_nPages() < 1) createTympanRemoteLayout();  //create the GUI, if it hasn't already been created
+    if (!layoutCache.isBuilt()) layoutCache.build(myGUI);     //render it once (it never changes after this)
+}
+
 // Print the layout for the Tympan Remote app, in a JSON-ish string
 void SerialManager::printTympanRemoteLayout(void) {
-    if (myGUI.get_nPages() < 1) createTympanRemoteLayout();  //create the GUI, if it hasn't already been created
-    String s = myGUI.asString();
-    Serial.println(s);
-    ble->sendMessage(s); //ble is held by SerialManagerBase
+    prepareTympanRemoteLayout();  //only does any work the first time it is called
+    if (layoutCache.isBuilt()) {
+      layoutCache.streamLayout(&Serial); Serial.println();  //stream straight from the cache, no String needed
+      ble->sendMessage(layoutCache.c_str()); //ble is held by SerialManagerBase.  The App needs the layout as one message.
+    } else {
+      String s = myGUI.asString();  //the layout was too big for the cache, so do it the old way
+      Serial.println(s);
+      ble->sendMessage(s); //ble is held by SerialManagerBase
+    }
+    guiCache.invalidate();  //the App has just (re)built its GUI, so it knows none of our values
     setFullGUIState();
 }
 
+// Print just one page of the layout (for hosts that want to fetch the layout a page at a time)
+void SerialManager::printTympanRemoteLayoutPage(int page_ind) {
+    prepareTympanRemoteLayout();
+    if ((!layoutCache.isBuilt()) || (page_ind >= layoutCache.get_nPages())) {
+      printlnf(Serial, "SerialManager: printTympanRemoteLayoutPage: *** ERROR ***: page %d is not available.", page_ind);
+      return;
+    }
+    layoutCache.streamPage(&Serial, page_ind); Serial.println();
+}
+
 // //////////////////////////////////  Methods for updating the display on the GUI
 
 void SerialManager::setFullGUIState(bool activeButtonsOnly) {
   updateDPOAEStatus();
+  updateProbeCheckDisplay();
   updateDPOAEDisplay();
   updateCalDisplay();
   updateMuteDisplay();
@@ -398,6 +898,7 @@ void SerialManager::setFullGUIState(bool activeButtonsOnly) {
   updateGUI_inputSelect(activeButtonsOnly);
   updateLevelStartStop();
   updateLevelDisplays();
+  updateSpectrumStartStop();
   
   //updateCpuDisplayOnOff();
 
@@ -408,91 +909,129 @@ void SerialManager::setFullGUIState(bool activeButtonsOnly) {
 }
 
 void SerialManager::updateCalDisplay(void) {
-  int test_ind = myState.cur_step_ind;
-  //float amp, sp1, 
-  float cal;
-
-  //amp = myState.tone_state.amp1_dBFS; 
-  //spl = myState.test_params.targ_f1_dBSPL;
-
-  cal = myState.test_params.cal_f1_dBFS_at_94dBSPL[test_ind];
-  setButtonText("cF1", String(cal,1));
-  cal = myState.test_params.cal_f2_dBFS_at_94dBSPL[test_ind];
-  setButtonText("cF2", String(cal,1));
+  Ear_State &ear = myState.selEar();
+  int test_ind = ear.cur_step_ind;
+  queueButtonText("cF1", Fixed_String<16>("%.1f", ear.test_params.cal_f1_dBFS_at_94dBSPL[test_ind]));
+  queueButtonText("cF2", Fixed_String<16>("%.1f", ear.test_params.cal_f2_dBFS_at_94dBSPL[test_ind]));
 }
 
 void SerialManager::updateDPOAEStatus(void) {
-  String text;
   if (myState.cur_test_state == State::TEST_OFF) {
-      setButtonText("status", "Stopped");
-      setButtonState("start",false);
+      queueButtonText("status", "Stopped");
+      queueButtonState("start",false);
+  } else if (myState.cur_test_state == State::TEST_PROBECHECK) {
+      queueButtonText("status", "Checking probe fit...");
+      queueButtonState("start",true);
   } else {
-      //setButtonText("status", "Step " + String(myState.cur_step_ind + 1));
-      setButtonText("status", String("Step ") + String(myState.cur_step_ind + 1) + String(" of ") + String(myState.max_step_ind));
-      setButtonState("start",true);
+      queueButtonText("status", Fixed_String<24>("Step %d of %d", myState.selEar().cur_step_ind + 1, myState.max_step_ind));
+      queueButtonState("start",true);
   }  
 }
+void SerialManager::updateProbeCheckDisplay(void) {
+  queueButtonText("probe", earManager[myState.sel_ear].probeChecker.getResultText());
+}
+
 void SerialManager::updateDPOAEDisplay(void) {
-  setButtonText("step", String("Step ") + String(myState.cur_step_ind + 1));
-  setButtonText("f1", String(myState.tone_state.freq1_Hz,0) + String(" Hz"));
-  setButtonText("f2", String(myState.tone_state.freq2_Hz,0) + String(" Hz"));
-  setButtonText("spl1", String(myState.test_params.targ_f1_dBSPL,0) + String(" dB SPL"));
-  setButtonText("spl2", String(myState.test_params.targ_f2_dBSPL,0) + String(" dB SPL"));
-  
+  Ear_State &ear = myState.selEar();
+  if (N_EARS > 1) { queueButtonText("step", Fixed_String<24>("Ear %d, Step %d", myState.sel_ear + 1, ear.cur_step_ind + 1)); }
+  else { queueButtonText("step", Fixed_String<24>("Step %d", ear.cur_step_ind + 1)); }
+  queueButtonText("f1",   Fixed_String<24>("%.0f Hz", ear.tone_state.freq1_Hz));
+  queueButtonText("f2",   Fixed_String<24>("%.0f Hz", ear.tone_state.freq2_Hz));
+  queueButtonText("spl1", Fixed_String<24>("%.0f dB SPL", ear.test_params.targ_f1_dBSPL));
+  queueButtonText("spl2", Fixed_String<24>("%.0f dB SPL", ear.test_params.targ_f2_dBSPL));
 }
 
 void SerialManager::updateCpuDisplayOnOff(void) {
-  setButtonState("cpuStart",myState.printCPUtoGUI);  //illuminate the button if we will be sending the CPU value
+  queueButtonState("cpuStart",myState.printCPUtoGUI);  //illuminate the button if we will be sending the CPU value
 }
 
 void SerialManager::updateCpuDisplayUsage(void) {
-   setButtonText("cpuValue",String(audio_settings.processorUsage(),1)); //one decimal places
+  queueButtonText("cpuValue",Fixed_String<16>("%.1f", audio_settings.processorUsage())); //one decimal places
 }
 
 void SerialManager::updateMuteDisplay(void) {
-  setButtonState("mute",myState.tone_state.is_muted);  //illuminate the button if we will be sending the CPU value
+  queueButtonState("mute",myState.selEar().tone_state.is_muted);  //illuminate the button if we will be sending the CPU value
 }
 
 
 void SerialManager::updateGUI_inputGain(bool activeButtonsOnly) {
-  setButtonText("inpGain",String(myState.input_gain_dB,1));
+  queueButtonText("inpGain",Fixed_String<16>("%.1f", myState.input_gain_dB));
 }
 
 
 void SerialManager::updateGUI_inputSelect(bool activeButtonsOnly) {
   if (!activeButtonsOnly) {
-    setButtonState("configPCB",false);
-    //setButtonState("configMIC",false);
-    setButtonState("configLINE",false);
+    queueButtonState("configPCB",false);
+    //queueButtonState("configMIC",false);
+    queueButtonState("configLINE",false);
   }
   switch (myState.input_source) {
     case (State::INPUT_PCBMICS):
-      setButtonState("configPCB",true);
+      queueButtonState("configPCB",true);
       break;
     case (State::INPUT_JACK_MIC): 
-      setButtonState("configMIC",true);
+      queueButtonState("configMIC",true);
       break;
     case (State::INPUT_JACK_LINE): 
-      setButtonState("configLINE",true);
+      queueButtonState("configLINE",true);
       break;
   }
 }
 
 void SerialManager::updateLevelStartStop(void) {
-    setButtonState("sLev",myState.printLevelsToGUI);
+    queueButtonState("sLev",myState.printLevelsToGUI);
 }
 
 void SerialManager::updateLevelDisplays(void) {
-  float val;
-  String str1,str2;
+  const char *btn_ids[2] = {"L1", "L2"};
+  Fixed_String<16> text;
+
+  for (int Ichan=0; Ichan < 2; Ichan++) {
+    float val = myState.measuredLEQ_dB[2*myState.sel_ear + Ichan];  //the selected ear's two inputs
+    bool clipped = myState.inputClipped[2*myState.sel_ear + Ichan];
+    if (val > -200.0) { text.printf("%.1f%s", val, clipped ? " CLIP" : ""); } else { text.printf("-"); }  //if a valid value, send the numbers.  If not, set a dash.
+    queueButtonText(btn_ids[Ichan], text);  //only gets transmitted if it has changed
+  }
+}
+
+void SerialManager::updateSpectrumStartStop(void) {
+    queueButtonState("sSpec",myState.showSpectrum);
+}
+
+//show each octave band as "<center freq>: <level>", such as "1k: -45"
+void SerialManager::updateSpectrumDisplay(const float *octave_dB, const int n_octaves) {
+  const char *labels[8] = {"125", "250", "500", "1k", "2k", "4k", "8k", "16k"};
+  const char *btn_ids[8] = {"spec0", "spec1", "spec2", "spec3", "spec4", "spec5", "spec6", "spec7"};
+  Fixed_String<GUI_CACHE_TEXT_LEN> text;
+  for (int i=0; i < min(n_octaves, 8); i++) {
+    text.printf("%s: %.0f", labels[i], octave_dB[i]);
+    queueButtonText(btn_ids[i], text);  //only gets transmitted if it has changed
+  }
+}
+
+// //////////////////////////////////  Methods for sending only the changed values to the GUI
+
+void SerialManager::queueButtonText(const char *btn_id, const char *text) {
+  guiCache.setText(btn_id, text);
+  if (!guiCache.wasLastSetCached()) setButtonText(String(btn_id), String(text)); //cache is full, so send it the old way
+}
+
+void SerialManager::queueButtonState(const char *btn_id, bool state) {
+  guiCache.setState(btn_id, state);
+  if (!guiCache.wasLastSetCached()) setButtonState(String(btn_id), state); //cache is full, so send it the old way
+}
+
+void SerialManager::serviceGUI(unsigned long curTime_millis) {
+  if (!guiCache.hasPending()) return;  //nothing to send
 
-  val = myState.measuredLEQ_dB[0]; str1 = String("L1");  //measurement for the first channel
-  if (val > -200.0) { str2 = String(val,1); } else { String("-"); };  //if a valid value, send the numbers.  If not, set a dash.
-  setButtonText(str1,str2);  //actually transmit the new string
+  //has enough time passed since the last transmission?
+  if (curTime_millis < lastGUIUpdate_millis) lastGUIUpdate_millis = 0; //handle wrap-around of the clock
+  if ((curTime_millis - lastGUIUpdate_millis) < guiUpdatePeriod_millis) return;
 
-  val = myState.measuredLEQ_dB[1]; str1 = String("L2");  //measurement for the second channel
-  if (val > -200.0) { str2 = String(val,1); } else { String("-"); }; //if a valid value, send the numbers.  If not, set a dash.
-  setButtonText(str1,str2);  //actually transmit the new string
+  //combine all of the changes into one message and send it
+  static char msg[512];
+  if (guiCache.buildMessage(msg, sizeof(msg)) > 0) ble->sendMessage(String(msg)); //ble is held by SerialManagerBase
+  lastGUIUpdate_millis = curTime_millis;
 }
 
 #endif
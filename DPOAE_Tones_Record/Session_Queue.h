@@ -0,0 +1,264 @@
+/*
+ Session_Queue.h
+
+ Purpose: Run several DPOAE tests back to back, unattended, from a plan file on the
+          SD card, rather than having someone change the settings and press 'q'
+          between each test.
+
+ The plan is a text file (PLAN.TXT, or PLANn.TXT).  Each line is one item of the
+     queue: the '$' commands to apply before its test (without the '$'), plus any of
+     these keywords, all separated by ';'.  Lines starting with '#' are comments.  The
+     settings carry on to the later items, just as if they had been typed in.
+
+        repeat <n>    run the item n times (default 1)
+        retry <n>     if a run fails, run it again, up to n more times (default 0)
+        on_pass <k>   after the item's last run passes, go to item k (default: the next item)
+        on_fail <k>   if a run still fails after its retries, go to item k now (default: carry on
+                      with the item's repeats, then the next item, ignoring on_pass)
+                      Items count from 1.  Going to item 0 ends the session.
+
+     Example:
+        # both levels, then a retest at a higher level if either one fails
+        spl 65 55; repeat 2; retry 1
+        spl 70 60; probe_auto 0; on_fail 4
+        spl 55 45; on_pass 0
+        spl 75 65
+
+ The whole plan is checked before anything runs (see startSession() in DPOAE_test_logic.h).
+     A run passes if the probe fit passed (when checked), every step was measured, no step
+     clipped, and no step rejected more noisy audio than the tone could be extended by.
+
+ Each run writes its own results file (SESSnnn_kk.CSV) next to its WAV file, and the
+     session writes a summary of every run (SESSnnn.CSV) at the end, or when it is stopped.
+
+ MIT License, Use at your own risk.
+*/
+
+#ifndef _Session_Queue_h
+#define _Session_Queue_h
+
+#include "Fixed_Format.h"
+
+#define SESSION_MAX_ITEMS     16
+#define SESSION_MAX_LINE_LEN  128   //longest line of the plan (including the null)
+#define SESSION_MAX_RUNS      64    //most tests in one session, so that the follow-ups can't loop forever
+#define SESSION_NAME_LEN      40
+
+class Session_Item {
+  public:
+    Session_Item(void) {};
+    char cmds[SESSION_MAX_LINE_LEN] = "";   //the '$' commands, without the keywords
+    int line_num = 0;                       //in the plan file
+    int repeats = 1, retries = 0;
+    int on_pass = -1, on_fail = -1;         //item to go to (0-based), SESSION_END, or -1 for the default
+};
+
+//one test that was run (for the summary)
+class Session_Run {
+  public:
+    Session_Run(void) {};
+    int item = 0, repeat = 0, attempt = 0;
+    bool passed = false;
+    char reason[24] = "";
+    char wav_name[SESSION_NAME_LEN] = "";
+    unsigned long start_millis = 0, dur_millis = 0;
+};
+
+class Session_Queue {
+  public:
+    enum STATE { IDLE=0, READY, RUNNING };   //not running, about to start a run, or waiting for a run to finish
+    static const int SESSION_END = -2;
+
+    Session_Queue(void) {};
+
+    int load(SdFs *sd, const char *fname);   //returns the number of items, or -1 on error
+    int getNumItems(void) const { return n_items; }
+    const Session_Item &getItem(int i) const { return items[constrain(i, 0, SESSION_MAX_ITEMS-1)]; }
+
+    //the session
+    bool begin(SdFs *sd);   //picks the session's number (the first SESSnnn.CSV that isn't taken)
+    int getState(void) const { return state; }
+    bool isActive(void) const { return state != IDLE; }
+    int getSessionNum(void) const { return isActive() ? session_num : 0; }   //the nnn of SESSnnn.CSV (zero if no session)
+    const char *getSummaryFilename(void) const { return summary_fname.c_str(); }
+    void getRunFilename(int run_ind, Fixed_String<SESSION_NAME_LEN> *fname) const { fname->printf("SESS%03d_%02d.CSV", session_num, run_ind+1); }
+
+    //the current run
+    const Session_Item &getCurrentItem(void) const { return items[cur_item]; }
+    int getCurrentItemIndex(void) const { return cur_item; }
+    int getNumRuns(void) const { return n_runs; }
+    void startRun(unsigned long curTime_millis) {
+      Session_Run &run = runs[n_runs];
+      run = Session_Run();
+      run.item = cur_item; run.repeat = cur_repeat; run.attempt = cur_attempt; run.start_millis = curTime_millis;
+      state = RUNNING;
+    }
+    const Session_Run &getCurrentRun(void) const { return runs[n_runs]; }
+    void finishRun(bool passed, const char *reason, const char *wav_name, unsigned long curTime_millis);  //then moves on to the next run
+    void stop(void) { state = IDLE; stop_requested = false; }
+    void requestStop(void) { stop_requested = true; }   //stop once the running test has wound down (see stopSession())
+    bool isStopRequested(void) const { return stop_requested; }
+
+    bool writeSummary(SdFs *sd, Print *s);   //returns false if it could not be written
+    void printStatus(Print *s) const;
+
+  private:
+    Session_Item items[SESSION_MAX_ITEMS];
+    int n_items = 0;
+    Session_Run runs[SESSION_MAX_RUNS];
+    int n_runs = 0;
+
+    int state = IDLE;
+    int cur_item = 0, cur_repeat = 1, cur_attempt = 0;
+    int session_num = 0;
+    bool stop_requested = false;
+    Fixed_String<SESSION_NAME_LEN> summary_fname;
+    Fixed_String<SESSION_NAME_LEN> plan_fname;
+
+    void goToItem(int item) {
+      cur_repeat = 1; cur_attempt = 0;
+      if ((item == SESSION_END) || (item >= n_items) || (n_runs >= SESSION_MAX_RUNS)) { state = IDLE; return; }
+      cur_item = item; state = READY;
+    }
+    bool parseLine(char *line, int line_num, Session_Item *item);
+};
+
+int Session_Queue::load(SdFs *sd, const char *fname) {
+  n_items = 0;
+  FsFile file = sd->open(fname, O_RDONLY);
+  if (!file) { printlnf(Serial, "Session_Queue: load: *** ERROR ***: could not open %s", fname); return -1; }
+  plan_fname.printf("%s", fname);
+
+  char line[SESSION_MAX_LINE_LEN];
+  int len = 0, line_num = 1;
+  bool too_long = false, ok = true;
+  while (true) {
+    int c = file.read();
+    if ((c >= 0) && (c != '\n') && (c != '\r')) {
+      if (len < (SESSION_MAX_LINE_LEN-1)) line[len++] = (char)c; else too_long = true;
+      continue;
+    }
+
+    //end of a line (for "\r\n", the '\n' just ends an empty line)
+    line[len] = '\0'; len = 0;
+    if (too_long) { printlnf(Serial, "Session_Queue: load: *** ERROR ***: %s, line %d: longer than %d characters", fname, line_num, SESSION_MAX_LINE_LEN-1); ok = false; break; }
+    char *p = line; while ((*p == ' ') || (*p == '\t')) p++;
+    if ((*p != '\0') && (*p != '#')) {
+      if (n_items >= SESSION_MAX_ITEMS) { printlnf(Serial, "Session_Queue: load: *** ERROR ***: %s: more than %d items", fname, SESSION_MAX_ITEMS); ok = false; break; }
+      if (!parseLine(p, line_num, &items[n_items])) { ok = false; break; }
+      n_items++;
+    }
+    if (c == '\n') line_num++;
+    if (c < 0) break;
+  }
+  file.close();
+
+  for (int i=0; ok && (i < n_items); i++) {  //the follow-ups must point at real items
+    if ((items[i].on_pass >= n_items) || (items[i].on_fail >= n_items)) {
+      printlnf(Serial, "Session_Queue: load: *** ERROR ***: %s, line %d: no item to go to", fname, items[i].line_num); ok = false;
+    }
+  }
+  if (ok && (n_items == 0)) { printlnf(Serial, "Session_Queue: load: *** ERROR ***: %s has no items", fname); ok = false; }
+  if (!ok) n_items = 0;
+  return ok ? n_items : -1;
+}
+
+//split off the keywords (repeat, retry, on_pass, on_fail) and keep the rest as the commands
+bool Session_Queue::parseLine(char *line, int line_num, Session_Item *item) {
+  *item = Session_Item();
+  item->line_num = line_num;
+  Fixed_String<SESSION_MAX_LINE_LEN> cmds;
+  char *p = line;
+  while (p != NULL) {
+    char *end = strchr(p, ';');
+    if (end != NULL) *end = '\0';
+    while ((*p == ' ') || (*p == '\t')) p++;
+
+    const char *keywords[4] = {"repeat", "retry", "on_pass", "on_fail"};
+    int key = -1;
+    for (int k=0; k < 4; k++) {
+      int n = strlen(keywords[k]);
+      if ((strncmp(p, keywords[k], n) == 0) && ((p[n] == ' ') || (p[n] == '\t'))) { key = k; p += n; break; }
+    }
+    if (key >= 0) {
+      char *num_end;
+      long val = strtol(p, &num_end, 10);
+      if ((num_end == p) || (val < 0) || (val > SESSION_MAX_RUNS)) { printlnf(Serial, "Session_Queue: load: *** ERROR ***: line %d: bad number for '%s'", line_num, keywords[key]); return false; }
+      if (key == 0) item->repeats = max(1, (int)val);
+      if (key == 1) item->retries = (int)val;
+      if (key == 2) item->on_pass = (val == 0) ? SESSION_END : (int)val - 1;
+      if (key == 3) item->on_fail = (val == 0) ? SESSION_END : (int)val - 1;
+    } else if (*p != '\0') {
+      cmds.appendf("%s%s", (cmds.length() > 0) ? "; " : "", p);
+    }
+    p = (end != NULL) ? end + 1 : NULL;
+  }
+  if (cmds.wasTruncated()) { printlnf(Serial, "Session_Queue: load: *** ERROR ***: line %d: too many commands", line_num); return false; }
+  strcpy(item->cmds, cmds.c_str());
+  return true;
+}
+
+bool Session_Queue::begin(SdFs *sd) {
+  if (n_items < 1) return false;
+  for (session_num = 1; session_num < 1000; session_num++) {
+    summary_fname.printf("SESS%03d.CSV", session_num);
+    if (!sd->exists(summary_fname.c_str())) break;
+  }
+  if (session_num >= 1000) { Serial.println("Session_Queue: begin: *** ERROR ***: no free session number"); return false; }
+  n_runs = 0;
+  stop_requested = false;
+  goToItem(0);
+  return true;
+}
+
+void Session_Queue::finishRun(bool passed, const char *reason, const char *wav_name, unsigned long curTime_millis) {
+  if (state != RUNNING) return;
+  Session_Run &run = runs[n_runs];
+  run.passed = passed;
+  strncpy(run.reason, reason, sizeof(run.reason)-1);
+  strncpy(run.wav_name, wav_name, sizeof(run.wav_name)-1);
+  run.dur_millis = curTime_millis - run.start_millis;
+  n_runs++;
+
+  //what next?
+  const Session_Item &item = items[cur_item];
+  if (!passed && (cur_attempt < item.retries)) {   //try it again
+    cur_attempt++;
+    state = (n_runs < SESSION_MAX_RUNS) ? READY : IDLE;
+    return;
+  }
+  cur_attempt = 0;
+  if (!passed && (item.on_fail != -1)) { goToItem(item.on_fail); return; }
+  if (cur_repeat < item.repeats) {
+    cur_repeat++;
+    state = (n_runs < SESSION_MAX_RUNS) ? READY : IDLE;
+    return;
+  }
+  goToItem((passed && (item.on_pass != -1)) ? item.on_pass : cur_item + 1);  //on_pass only follows a run that passed
+}
+
+bool Session_Queue::writeSummary(SdFs *sd, Print *s) {
+  FsFile file = sd->open(summary_fname.c_str(), O_WRONLY | O_CREAT | O_TRUNC);
+  if (!file) { printlnf(*s, "Session_Queue: writeSummary: *** ERROR ***: could not open %s", summary_fname.c_str()); return false; }
+  printlnf(file, "# plan, %s", plan_fname.c_str());
+  file.println("run, item, line, repeat, attempt, result, reason, recording, results, start (sec), duration (sec)");
+  for (int i=0; i < n_runs; i++) {
+    const Session_Run &r = runs[i];
+    Fixed_String<SESSION_NAME_LEN> results_fname; getRunFilename(i, &results_fname);
+    printlnf(file, "%d, %d, %d, %d, %d, %s, %s, %s, %s, %.1f, %.1f", i+1, r.item+1, items[r.item].line_num, r.repeat, r.attempt,
+             r.passed ? "pass" : "fail", r.reason, r.wav_name, results_fname.c_str(), 0.001f*(float)r.start_millis, 0.001f*(float)r.dur_millis);
+  }
+  file.close();
+  int n_passed = 0; for (int i=0; i < n_runs; i++) if (runs[i].passed) n_passed++;
+  printlnf(*s, "Session_Queue: %d runs (%d passed), summary in %s", n_runs, n_passed, summary_fname.c_str());
+  return true;
+}
+
+void Session_Queue::printStatus(Print *s) const {
+  const char *state_names[3] = {"idle", "ready", "running"};
+  printlnf(*s, "Session_Queue: %s, %s, %d items, %d runs so far", state_names[state], plan_fname.c_str(), n_items, n_runs);
+  if (state != IDLE) printlnf(*s, "Session_Queue: item %d (line %d), repeat %d of %d, attempt %d of %d: %s", cur_item+1, items[cur_item].line_num,
+                              cur_repeat, items[cur_item].repeats, cur_attempt+1, items[cur_item].retries+1, items[cur_item].cmds);
+}
+
+#endif
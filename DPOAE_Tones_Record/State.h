@@ -18,11 +18,49 @@
 
 #include "Tone_Manager.h"
 #include "DPOAE_Settings_Manager.h"
+#include "Probe_Check.h"
+
+#ifndef N_EARS
+#define N_EARS 1   //number of probes tested at once.  Define as 2 in the main *.ino file for binaural testing (needs 4-in/4-out)
+#endif
+
+// the states and results that are kept separately for each ear (ie, for each probe)
+class Ear_State {
+  public:
+    Tone_State tone_state;
+    Test_Parameters test_params;        //includes the speaker calibration tables for this probe
+    Probe_Check_Settings probe_check;   //includes the probe-fit reference for this probe
+    int cur_step_ind = 0;
+
+    //where this ear is in the stepped test (each ear steps on its own, so that one ear's rejected audio doesn't hold up the other)
+    enum step_states { STEP_IDLE=0, STEP_TONE, STEP_SILENCE, STEP_DONE };
+    int step_state = STEP_IDLE;
+    unsigned long lastTransition_millis = 0;
+    uint32_t toneStart_flagged = 0;     //artifact monitor's count of flagged blocks when the current tone started
+
+    //results of the most recent test, for each step
+    float step_level_dB[N_F2];          //mic level (dBFS) at the end of each tone
+    int step_rejected_millis[N_F2];     //how much audio was rejected as noisy
+    float step_peak_dBFS[N_F2];         //largest mic sample during each tone (from every block, see AudioBlockStats_F32.h)
+    int step_clipped_blocks[N_F2];      //how many of the tone's blocks clipped
+    float step_dp_dBFS[N_F2];           //level of the DP (2*F1-F2) over the tone (see Ear_Manager::finishDPMeasurement())
+    float step_noise_dBFS[N_F2];        //noise floor around the DP (per FFT bin, like the DP)
+    unsigned long step_end_millis[N_F2];  //when each tone ended
+    void clearResults(void) {
+      for (int i=0; i < N_F2; i++) {
+        step_level_dB[i] = -999.9f; step_rejected_millis[i] = 0; step_peak_dBFS[i] = -999.9f; step_clipped_blocks[i] = 0;
+        step_dp_dBFS[i] = -999.9f; step_noise_dBFS[i] = -999.9f; step_end_millis[i] = 0;
+      }
+    }
+};
 
 // define a class for tracking the state of system (primarily to help our implementation of the GUI)
 class State : public TympanStateBase_UI { // look in TympanStateBase or TympanStateBase_UI for more state variables and helpful methods!!
   public:
-    State(AudioSettings_F32 *given_settings, Print *given_serial, SerialManagerBase *given_sm) : TympanStateBase_UI(given_settings, given_serial, given_sm) {}
+    State(AudioSettings_F32 *given_settings, Print *given_serial, SerialManagerBase *given_sm) : TympanStateBase_UI(given_settings, given_serial, given_sm) {
+      for (int i=0; i < 2*N_EARS; i++) { measuredLEQ_dB[i] = -999.9; inputClipped[i] = false; }
+      for (int i=0; i < N_EARS; i++) ears[i].clearResults();
+    }
 
     //look in TympanStateBase for more state variables!  (like, bool flag_printCPUandMemory)
 
@@ -35,19 +73,27 @@ class State : public TympanStateBase_UI { // look in TympanStateBase or TympanSt
     float output_gain_dB = 0.0;  //gain of the hardware headphone amplifier in the AIC
 
     //States for the DPOAE test
-    Tone_State tone_state;
-    Test_Parameters test_params;
-    int cur_step_ind = 0;
+    Ear_State ears[N_EARS];
+    int sel_ear = 0;        //which ear the manual controls (and the App's display) act on
+    Ear_State &selEar(void) { return ears[sel_ear]; }
     int max_step_ind = 0;
-    enum test_states { TEST_OFF=0, TEST_STARTING, TEST_SDSTART, TEST_SILENCE, TEST_TONE, TEST_STOPPING }; 
+    enum test_states { TEST_OFF=0, TEST_STARTING, TEST_SDSTART, TEST_SILENCE, TEST_TONE, TEST_STOPPING, TEST_PROBECHECK }; 
     int cur_test_state = TEST_OFF;
 
+    //States for the probe-fit check (see Probe_Check.h)
+    bool probe_check_before_test = false; //run the probe check before each test?  Turned on once every ear has a reference (see Probe_Check.h)
+    bool probe_check_only = false;        //stop after the probe check (rather than going on to the test)?
+    bool reject_noisy_blocks = true;      //the "$reject" setting (the probe check turns rejection off during its chirp, then puts this back)
+
     //measurement values
-    float measuredLEQ_dB[2] = {-999.9, -999.9};
+    float measuredLEQ_dB[2*N_EARS];   //two inputs per ear
+    bool inputClipped[2*N_EARS];      //did the input clip since the last level update?
     
     //states related to the display
     bool printCPUtoGUI = false; //note that the TympanStateBase_UI has the CPU printing stuff built-in, but do it here ourselves just to illustrate
     bool printLevelsToGUI = false;
+    bool showSpectrum = false;        //send the live spectrum (octave bands to the App, finer bands to USB)
+    float spectrum_rate_Hz = 4.0f;    //how often to send the live spectrum
 
 };
 
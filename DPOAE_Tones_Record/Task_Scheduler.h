@@ -0,0 +1,154 @@
+/*
+ Task_Scheduler.h
+
+ Purpose: Run the periodic work of loop() (SD service, test sequencing, GUI updates...)
+          from one table of tasks, so that the time-critical tasks always run first and
+          so that we can see how long each task takes and how often it runs late.
+
+ Each task is a function with a period, a priority, and a deadline.  The period is how
+     often it wants to run (0 means every pass of loop()).  The deadline is how late it
+     may start, after it comes due, before we count it as a miss (0 means one period).
+
+ Each call to run() is one pass of loop():
+     * Every CRITICAL task that is due runs, every pass.  Keep these short.
+     * Then, at most one of the other tasks runs: the highest priority task that is due
+       (or, if there is a tie, the one that has been waiting the longest).  So, however
+       slow the cosmetic tasks get, the critical tasks run again between each one.
+     * A task with a period of 0 is always due, so make it CRITICAL or LOW.  Otherwise, it
+       would keep every task of a lower priority from ever running.
+
+ The times use unsigned differences, so the wrap-around of millis() and micros() is handled
+     here, once, rather than in each task.  If a task falls more than a whole period behind,
+     it skips the missed runs rather than running several times in a row to catch up.
+
+ MIT License, Use at your own risk.
+*/
+
+#ifndef _Task_Scheduler_h
+#define _Task_Scheduler_h
+
+#define TASK_SCHEDULER_MAX_TASKS 16
+
+typedef void (*Task_Func)(unsigned long curTime_millis);
+
+class Scheduled_Task {
+  public:
+    Scheduled_Task(void) {};
+    const char *name = "";
+    Task_Func func = NULL;
+    unsigned long period_millis = 0;
+    unsigned long deadline_millis = 0;
+    int priority = 0;
+    bool is_enabled = true;
+    unsigned long next_due_millis = 0;
+
+    //stats
+    uint32_t n_runs = 0, n_missed = 0;
+    uint32_t max_late_millis = 0;
+    uint64_t total_run_micros = 0;
+    uint32_t max_run_micros = 0;
+
+    void resetStats(void) { n_runs = 0; n_missed = 0; max_late_millis = 0; total_run_micros = 0; max_run_micros = 0; }
+};
+
+class Task_Scheduler {
+  public:
+    enum PRIORITY { CRITICAL=0, HIGH, NORMAL, LOW };   //lower numbers win
+
+    Task_Scheduler(void) {};
+
+    //register a task (do this in setup()).  Returns its id, or -1 if there is no room.
+    int addTask(const char *name, Task_Func func, unsigned long period_millis, int priority, unsigned long deadline_millis) {
+      if (n_tasks >= TASK_SCHEDULER_MAX_TASKS) {
+        Serial.println("Task_Scheduler: addTask: *** ERROR ***: too many tasks");
+        return -1;
+      }
+      Scheduled_Task &task = tasks[n_tasks];
+      task.name = name; task.func = func; task.priority = priority;
+      task.period_millis = period_millis; task.deadline_millis = deadline_millis;
+      task.next_due_millis = millis() + period_millis;
+      return n_tasks++;
+    }
+
+    void setEnabled(int id, bool enable) {
+      if (!isValid(id)) return;
+      if (enable && !tasks[id].is_enabled) tasks[id].next_due_millis = millis();  //run soon, but don't count the time that it was off as late
+      tasks[id].is_enabled = enable;
+    }
+    void setPeriod_millis(int id, unsigned long period_millis) {
+      if (!isValid(id)) return;
+      tasks[id].period_millis = period_millis;
+      tasks[id].next_due_millis = millis() + period_millis;
+    }
+    unsigned long getPeriod_millis(int id) const { return isValid(id) ? tasks[id].period_millis : 0; }
+
+    //one pass of loop()
+    void run(unsigned long curTime_millis) {
+      n_passes++;
+
+      //all of the critical tasks that are due
+      for (int i=0; i < n_tasks; i++) {
+        if ((tasks[i].priority == CRITICAL) && isDue(tasks[i], curTime_millis)) runTask(tasks[i], curTime_millis);
+      }
+
+      //then just the most urgent of the rest
+      int best = -1;
+      for (int i=0; i < n_tasks; i++) {
+        if ((tasks[i].priority == CRITICAL) || !isDue(tasks[i], curTime_millis)) continue;
+        if ((best < 0) || (tasks[i].priority < tasks[best].priority) ||
+            ((tasks[i].priority == tasks[best].priority) && ((long)(tasks[i].next_due_millis - tasks[best].next_due_millis) < 0))) best = i;
+      }
+      if (best >= 0) runTask(tasks[best], millis());  //the critical tasks might have taken a while
+    }
+
+    void resetStats(void) { n_passes = 0; for (int i=0; i < n_tasks; i++) tasks[i].resetStats(); }
+
+    void printStats(Print *s) const {
+      s->println("Task_Scheduler: task, priority, period (ms), runs, avg (us), max (us), late, max late (ms)");
+      for (int i=0; i < n_tasks; i++) {
+        const Scheduled_Task &t = tasks[i];
+        s->print("  "); s->print(t.name); s->print(", "); s->print(t.priority); s->print(", ");
+        s->print(t.period_millis); s->print(", "); s->print(t.n_runs); s->print(", ");
+        s->print((t.n_runs > 0) ? (uint32_t)(t.total_run_micros / t.n_runs) : 0); s->print(", ");
+        s->print(t.max_run_micros); s->print(", "); s->print(t.n_missed); s->print(", ");
+        s->print(t.max_late_millis);
+        if (!t.is_enabled) s->print(", (off)");
+        s->println();
+      }
+      s->print("Task_Scheduler: "); s->print(n_passes); s->println(" passes of loop()");
+    }
+
+  private:
+    Scheduled_Task tasks[TASK_SCHEDULER_MAX_TASKS];
+    int n_tasks = 0;
+    uint32_t n_passes = 0;
+
+    bool isValid(int id) const { return (id >= 0) && (id < n_tasks); }
+    static bool isDue(const Scheduled_Task &task, unsigned long curTime_millis) {
+      return task.is_enabled && ((long)(curTime_millis - task.next_due_millis) >= 0);
+    }
+
+    void runTask(Scheduled_Task &task, unsigned long curTime_millis) {
+      //was it late?
+      unsigned long late_millis = curTime_millis - task.next_due_millis;
+      unsigned long allowed_millis = (task.deadline_millis > 0) ? task.deadline_millis : task.period_millis;
+      if ((task.period_millis > 0) || (task.deadline_millis > 0)) {
+        if (late_millis > allowed_millis) task.n_missed++;
+        task.max_late_millis = max(task.max_late_millis, (uint32_t)late_millis);
+      }
+
+      //run it and time it
+      uint32_t start_micros = micros();
+      task.func(curTime_millis);
+      uint32_t dur_micros = micros() - start_micros;
+      task.n_runs++;
+      task.total_run_micros += dur_micros;
+      task.max_run_micros = max(task.max_run_micros, dur_micros);
+
+      //when is it next due?
+      task.next_due_millis += task.period_millis;
+      if ((long)(curTime_millis - task.next_due_millis) >= 0) task.next_due_millis = curTime_millis + task.period_millis;  //fell behind, so skip ahead
+    }
+};
+
+#endif
@@ -0,0 +1,163 @@
+/*
+ Telemetry.h
+
+ Purpose: Send compact, timestamped binary frames (levels, CPU, test state) over
+          the USB Serial link so that a host program can watch the system live.
+
+ Telemetry is opt-in.  When it is off, nothing is sent.  When it is on, frames
+     are sent at a configurable rate (up to TELEMETRY_MAX_RATE_HZ).  The frames
+     are mixed in with any normal text on the Serial link, so each frame starts
+     with two sync bytes (which never occur in the ASCII text) and ends with a
+     CRC.  That lets the host decoder skip the text and re-sync after any error.
+     See tympanTelemetry.py for the host-side decoder.
+
+ Frame layout (all multi-byte values are little-endian):
+     [0]    0xA5  sync byte 1
+     [1]    0x5A  sync byte 2
+     [2]    version (TELEMETRY_VERSION)
+     [3]    frame type (see TELEMETRY_FRAME_TYPE)
+     [4]    payload length, in bytes (N)
+     [5-6]  sequence number (uint16, increments for every frame)
+     [7-10] timestamp (uint32, millis())
+     [11..] payload (N bytes)
+     [last 2 bytes] CRC-16/CCITT-FALSE of bytes [2] through the end of the payload
+
+ Status payload (TELEMETRY_STATUS):
+     uint8  number of level channels (C)
+     uint8  stimulus state (bit 0 = tones playing, bit 1 = recording to SD)
+     uint8  test state (as in the sketch's State class)
+     int16  test step index (-1 if none)
+     uint16 CPU usage, in units of 0.01 %
+     uint16 audio memory blocks in use
+     uint16 max audio memory blocks used so far
+     int16  x C, level of each channel, in units of 0.01 dB
+
+ Spectrum payload (TELEMETRY_SPECTRUM):
+     uint8  number of bands (B)
+     uint16 lower edge of the first band (Hz)
+     uint16 upper edge of the last band (Hz)
+     int16  x B, level of each (log-spaced) band, in units of 0.01 dB
+
+ MIT License, Use at your own risk.
+*/
+
+#ifndef _Telemetry_h
+#define _Telemetry_h
+
+#define TELEMETRY_VERSION        1
+#define TELEMETRY_MAX_RATE_HZ    50.0f
+#define TELEMETRY_MAX_PAYLOAD    200
+#define TELEMETRY_MAX_LEVEL_CHAN 8
+
+#define TELEMETRY_MAX_BANDS      64
+
+enum TELEMETRY_FRAME_TYPE { TELEMETRY_STATUS=1, TELEMETRY_SPECTRUM=2 };
+
+//the values that go into a status frame
+class Telemetry_Status {
+  public:
+    int n_chan = 0;
+    float level_dB[TELEMETRY_MAX_LEVEL_CHAN];
+    bool is_stim_on = false;
+    bool is_recording = false;
+    int test_state = 0;
+    int step_ind = -1;
+    float cpu_percent = 0.0f;
+    int audio_mem_used = 0;
+    int audio_mem_max = 0;
+};
+
+class Telemetry {
+  public:
+    Telemetry(Print *_out) : out(_out) {};
+
+    //turn the telemetry on or off, and set how fast it goes
+    bool enable(bool _enable) { return is_enabled = _enable; }
+    bool isEnabled(void) { return is_enabled; }
+    float setRate_Hz(float rate_Hz) { rate_Hz = constrain(rate_Hz, 0.1f, TELEMETRY_MAX_RATE_HZ); period_millis = (unsigned long)(1000.0f / rate_Hz + 0.5f); return getRate_Hz(); }
+    float getRate_Hz(void) { return 1000.0f / (float)period_millis; }
+
+    //is telemetry enabled and has enough time passed to send the next status frame?
+    bool isTimeToSend(unsigned long curTime_millis) {
+      if (!is_enabled) return false;
+      if ((unsigned long)(curTime_millis - lastSend_millis) < period_millis) return false; //unsigned math handles wrap-around
+      lastSend_millis = curTime_millis;
+      return true;
+    }
+
+    //build and send a status frame
+    int sendStatus(const Telemetry_Status &status, unsigned long timestamp_millis);
+
+    //build and send a spectrum frame
+    int sendSpectrum(const int n_bands, const float f_min_Hz, const float f_max_Hz, const float *band_dB, unsigned long timestamp_millis);
+
+    //send a frame with any payload (used by sendStatus(), but available for other frame types, too).
+    //Nothing is sent (and it returns 0) unless telemetry is enabled, so the USB link stays text-only.
+    int sendFrame(const uint8_t frame_type, const uint8_t *payload, const int payload_len, unsigned long timestamp_millis);
+
+    //helpers for packing the payload in little-endian order
+    static int put_u8(uint8_t *buff, int ind, uint8_t val) { buff[ind] = val; return ind+1; }
+    static int put_u16(uint8_t *buff, int ind, uint16_t val) { buff[ind] = val & 0xFF; buff[ind+1] = (val >> 8) & 0xFF; return ind+2; }
+    static int put_i16(uint8_t *buff, int ind, int16_t val) { return put_u16(buff, ind, (uint16_t)val); }
+    static int put_u32(uint8_t *buff, int ind, uint32_t val) { ind = put_u16(buff, ind, val & 0xFFFF); return put_u16(buff, ind, (val >> 16) & 0xFFFF); }
+    static int16_t toCentiUnits(float val) { return (int16_t)constrain(roundf(val * 100.0f), -32768.0f, 32767.0f); }
+
+  private:
+    Print *out;
+    bool is_enabled = false;
+    unsigned long period_millis = 100;
+    unsigned long lastSend_millis = 0;
+    uint16_t seq = 0;
+
+    static uint16_t crc16(const uint8_t *data, int len, uint16_t crc = 0xFFFF) {
+      for (int i=0; i < len; i++) {
+        crc ^= ((uint16_t)data[i]) << 8;
+        for (int b=0; b < 8; b++) crc = (crc & 0x8000) ? ((crc << 1) ^ 0x1021) : (crc << 1);
+      }
+      return crc;
+    }
+};
+
+int Telemetry::sendStatus(const Telemetry_Status &status, unsigned long timestamp_millis) {
+  uint8_t payload[TELEMETRY_MAX_PAYLOAD];
+  int n_chan = constrain(status.n_chan, 0, TELEMETRY_MAX_LEVEL_CHAN);
+  int ind = 0;
+  ind = put_u8(payload, ind, n_chan);
+  ind = put_u8(payload, ind, (status.is_stim_on ? 0x01 : 0x00) | (status.is_recording ? 0x02 : 0x00));
+  ind = put_u8(payload, ind, status.test_state);
+  ind = put_i16(payload, ind, status.step_ind);
+  ind = put_u16(payload, ind, (uint16_t)constrain(roundf(status.cpu_percent * 100.0f), 0.0f, 65535.0f));
+  ind = put_u16(payload, ind, status.audio_mem_used);
+  ind = put_u16(payload, ind, status.audio_mem_max);
+  for (int i=0; i < n_chan; i++) ind = put_i16(payload, ind, toCentiUnits(status.level_dB[i]));
+  return sendFrame(TELEMETRY_STATUS, payload, ind, timestamp_millis);
+}
+
+int Telemetry::sendSpectrum(const int n_bands, const float f_min_Hz, const float f_max_Hz, const float *band_dB, unsigned long timestamp_millis) {
+  uint8_t payload[TELEMETRY_MAX_PAYLOAD];
+  int n = constrain(n_bands, 0, TELEMETRY_MAX_BANDS);
+  int ind = 0;
+  ind = put_u8(payload, ind, n);
+  ind = put_u16(payload, ind, (uint16_t)constrain(f_min_Hz + 0.5f, 0.0f, 65535.0f));
+  ind = put_u16(payload, ind, (uint16_t)constrain(f_max_Hz + 0.5f, 0.0f, 65535.0f));
+  for (int i=0; i < n; i++) ind = put_i16(payload, ind, toCentiUnits(band_dB[i]));
+  return sendFrame(TELEMETRY_SPECTRUM, payload, ind, timestamp_millis);
+}
+
+int Telemetry::sendFrame(const uint8_t frame_type, const uint8_t *payload, const int payload_len, unsigned long timestamp_millis) {
+  if (!is_enabled || (payload_len < 0) || (payload_len > TELEMETRY_MAX_PAYLOAD)) return 0;
+  uint8_t frame[TELEMETRY_MAX_PAYLOAD + 13];
+  int ind = 0;
+  ind = put_u8(frame, ind, 0xA5);
+  ind = put_u8(frame, ind, 0x5A);
+  ind = put_u8(frame, ind, TELEMETRY_VERSION);
+  ind = put_u8(frame, ind, frame_type);
+  ind = put_u8(frame, ind, payload_len);
+  ind = put_u16(frame, ind, seq++);
+  ind = put_u32(frame, ind, timestamp_millis);
+  memcpy(frame + ind, payload, payload_len); ind += payload_len;
+  ind = put_u16(frame, ind, crc16(frame + 2, ind - 2));  //CRC covers everything after the sync bytes
+  return out->write(frame, ind);  //send the whole frame in one write so that it isn't split by other text
+}
+
+#endif
@@ -4,7 +4,18 @@
  Created: Chip Audette, Jan 2023
  Purpose: Control the two sine wave tones used in the DPOAE test
  
- This class controls the frequencies and amplitudes of the two tones
+ This class controls the frequencies and amplitudes of the two tones (and the faders after them)
+
+ Nothing here touches the audio objects from loop().  setTones(), fadeIn(), and fadeOut()
+ work out the new settings (all of the math is done here, in loop()) and post them as
+ one Tone_Params to a mailbox (see Param_Mailbox.h).  The audio interrupt applies the
+ newest Tone_Params all at once at the start of the next block (see applyParams()), so
+ the tones, the mute, and the fades change together, and never in the middle of a block.
+ Register each Tone_Manager with the AudioParamUpdater_F32 in setup().
+
+ If a stimulus cache is given (see setStimulusCache()) and it holds a buffer with
+ these two tones, the tones are played from that buffer (see AudioStimulusPlayer_F32.h)
+ and the sine generators are silenced.  Otherwise the sine generators are used.
 
  MIT License, Use at your own risk.
 */
@@ -12,6 +23,11 @@
 #ifndef _Tone_Manager_h
 #define _Tone_Manager_h
 
+#include "Fixed_Format.h"
+#include "AudioStimulusPlayer_F32.h"
+#include "Param_Mailbox.h"
+#include "AudioBlockStats_F32.h"
+
 class Tone_State {
   public:
     Tone_State(void) {};
@@ -22,34 +38,121 @@ class Tone_State {
     bool is_muted = false;
 };
 
-class Tone_Manager {
+//everything that the audio interrupt needs to set for one ear's stimulus (see Tone_Manager::applyParams())
+class Tone_Params {
+  public:
+    Tone_Params(void) {};
+    float freq1_Hz = 1000.0f, freq2_Hz = 1000.0f;
+    float sine_amp1 = 0.0f, sine_amp2 = 0.0f;       //linear amplitude of each sine generator
+    const Stimulus_Buffer *buf = NULL;             //play this (from the stimulus cache) instead of the sines, or NULL
+    float buf_gain1 = 0.0f, buf_gain2 = 0.0f;       //linear gain of each channel of the buffer
+    uint32_t buf_start_count = 0;                  //incremented to (re)start the buffer at its first sample
+    uint32_t fade_count = 0;                       //incremented for each new fade
+    bool fade_in = true;
+    float fade_msec = 0.0f;
+};
+
+class Tone_Manager : public Block_Param_Client {
   public:
-    Tone_Manager(AudioSynthWaveform_F32 *_f1, AudioSynthWaveform_F32 *_f2, float fs_Hz) : 
-                f1_tone(_f1), f2_tone(_f2), sample_rate_Hz(fs_Hz) {};
+    Tone_Manager(AudioSynthWaveform_F32 *_f1, AudioSynthWaveform_F32 *_f2, AudioEffectFade_F32 *_fade1, AudioEffectFade_F32 *_fade2, float fs_Hz) : 
+                f1_tone(_f1), f2_tone(_f2), fade1(_fade1), fade2(_fade2), sample_rate_Hz(fs_Hz) {};
+
+    //play the tones from the cache whenever it has them (use_cache = false always uses the sine generators)
+    void setStimulusCache(AudioStimulusPlayer_F32 *_player, const Stimulus_Cache *_cache) { player = _player; cache = _cache; }
+    bool enableStimulusCache(bool enable) { return use_cache = enable; }
+    bool isPlayingFromCache(void) const { return mailbox.latest().buf != NULL; }
+    const Stimulus_Buffer *getBuffer(void) const { return mailbox.latest().buf; }
+    bool isUpdatePending(void) const { return mailbox.isPending(); }  //true until the audio interrupt applies the last change
+    const Block_Stim_State *getStimState(void) const { return &stim_state; }  //what the audio interrupt last applied (see AudioBlockStats_F32.h)
 
     void setTones(const Tone_State &tone_state) {
-      if (tone_state.is_muted) {
-        f1_tone->amplitude(0.0); f2_tone->amplitude(0.0);
+      Tone_Params params = mailbox.latest();
+      const Stimulus_Buffer *buf = findInCache(tone_state);
+      float amp1 = tone_state.is_muted ? 0.0f : dB_to_amp(tone_state.amp1_dBFS);
+      float amp2 = tone_state.is_muted ? 0.0f : dB_to_amp(tone_state.amp2_dBFS);
+      params.freq1_Hz = tone_state.freq1_Hz;
+      params.freq2_Hz = tone_state.freq2_Hz;
+      if (buf != NULL) {
+        if (buf != params.buf) params.buf_start_count++;  //a new step starts at the top of its buffer
+        params.buf = buf;
+        params.sine_amp1 = 0.0f; params.sine_amp2 = 0.0f;
+        params.buf_gain1 = amp1; params.buf_gain2 = amp2;
+      } else {
+        params.buf = NULL;
+        params.sine_amp1 = amp1; params.sine_amp2 = amp2;
       }
-      
-      //set the sine wave parameters                               
-      f1_tone->frequency(tone_state.freq1_Hz);   
-      f2_tone->frequency(tone_state.freq2_Hz);
-
-       if (!tone_state.is_muted) {
-          f1_tone->amplitude(dB_to_amp(tone_state.amp1_dBFS));
-          f2_tone->amplitude(dB_to_amp(tone_state.amp2_dBFS));   
-      }     
+      mailbox.post(params);
+    }
+
+    //play a buffer as-is (unity gain), instead of the tones (NULL is silence).  The next setTones() goes back to the tones.
+    void playBuffer(const Stimulus_Buffer *buf) {
+      Tone_Params params = mailbox.latest();
+      params.buf = buf; params.buf_start_count++;
+      params.sine_amp1 = 0.0f; params.sine_amp2 = 0.0f;
+      params.buf_gain1 = 1.0f; params.buf_gain2 = 1.0f;
+      mailbox.post(params);
+    }
+
+    void fadeIn(float msec) { postFade(true, msec); }
+    void fadeOut(float msec) { postFade(false, msec); }
+
+    //called from the audio interrupt (via AudioParamUpdater_F32) at the start of each block
+    virtual void applyParams(void) {
+      Tone_Params p;
+      if (!mailbox.take(&p)) return;
+      f1_tone->frequency(p.freq1_Hz); f1_tone->amplitude(p.sine_amp1);
+      f2_tone->frequency(p.freq2_Hz); f2_tone->amplitude(p.sine_amp2);
+      if (player != NULL) {
+        if (p.buf == NULL) {
+          player->stop();
+        } else {
+          if ((p.buf != applied.buf) || (p.buf_start_count != applied.buf_start_count)) player->play(p.buf);
+          player->setGain(0, p.buf_gain1); player->setGain(1, p.buf_gain2);
+        }
+      }
+      if (p.fade_count != applied.fade_count) {
+        if (p.fade_in) { fade1->fadeIn_msec(p.fade_msec); fade2->fadeIn_msec(p.fade_msec); }
+        else { fade1->fadeOut_msec(p.fade_msec); fade2->fadeOut_msec(p.fade_msec); }
+      }
+      applied = p;
+
+      //note what is now playing, for the per-block measurements (a faded-out tone counts as off)
+      stim_state.stim_id++;
+      stim_state.freq_Hz[0] = (p.buf != NULL) ? p.buf->freq_Hz[0] : p.freq1_Hz;
+      stim_state.freq_Hz[1] = (p.buf != NULL) ? p.buf->freq_Hz[1] : p.freq2_Hz;
+      stim_state.amp[0] = p.fade_in ? ((p.buf != NULL) ? p.buf_gain1 : p.sine_amp1) : 0.0f;
+      stim_state.amp[1] = p.fade_in ? ((p.buf != NULL) ? p.buf_gain2 : p.sine_amp2) : 0.0f;
     }
 
     //utility functions
     float dB_to_amp(float val_dB) { return sqrtf(powf(10.0, val_dB/10.0)); }
     void printFrequencyValues() { 
-        Serial.println("Tone_Manager: f1 = " + String(f1_tone->getFrequency_Hz()) 
-                          + "Hz, f2 = " + String(f2_tone->getFrequency_Hz()) + "Hz"); 
+      const Tone_Params &params = mailbox.latest();  //what was asked for (the interrupt might not have applied it yet)
+      if (params.buf != NULL) {
+        printlnf(Serial, "Tone_Manager: f1 = %.2fHz, f2 = %.2fHz (from the stimulus cache)", params.buf->freq_Hz[0], params.buf->freq_Hz[1]);
+        return;
+      }
+      printlnf(Serial, "Tone_Manager: f1 = %.2fHz, f2 = %.2fHz", params.freq1_Hz, params.freq2_Hz); 
     }    
   private:
     AudioSynthWaveform_F32 *f1_tone, *f2_tone;
+    AudioEffectFade_F32 *fade1, *fade2;
+    AudioStimulusPlayer_F32 *player = NULL;
+    const Stimulus_Cache *cache = NULL;
+    bool use_cache = true;
+    Param_Mailbox<Tone_Params> mailbox;
+    Tone_Params applied;   //only used by the audio interrupt
+    Block_Stim_State stim_state;  //only written by the audio interrupt
+
+    const Stimulus_Buffer *findInCache(const Tone_State &tone_state) {
+      if ((player == NULL) || (cache == NULL) || !use_cache) return NULL;
+      return cache->getSlot(cache->findTones(tone_state.freq1_Hz, tone_state.freq2_Hz));
+    }
+    void postFade(bool fade_in, float msec) {
+      Tone_Params params = mailbox.latest();
+      params.fade_in = fade_in; params.fade_msec = msec; params.fade_count++;
+      mailbox.post(params);
+    }
     float sample_rate_Hz = 48000;
 };
 
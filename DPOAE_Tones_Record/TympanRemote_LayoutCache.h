@@ -0,0 +1,122 @@
+/*
+ TympanRemote_LayoutCache.h
+
+ Purpose: Hold a pre-rendered copy of the TympanRemote App's GUI layout so that
+          it does not need to be re-generated (as a big heap String) every time
+          the App connects.
+
+ The layout is rendered once (at startup) into a fixed, statically-allocated
+     buffer.  On Teensy 4, the buffer is placed in DMAMEM (RAM2) so that it
+     stays out of the heap and out of the fast RAM1 used by the audio code.
+
+ When the layout is rendered, the location of each page within the JSON text
+     is also indexed.  That allows a single page to be sent on its own (wrapped
+     in the same JSON header as the full layout), so that a host can fetch the
+     pages lazily, one at a time, instead of receiving the whole layout at once.
+
+ MIT License, Use at your own risk.
+*/
+
+#ifndef _TympanRemote_LayoutCache_h
+#define _TympanRemote_LayoutCache_h
+
+#define LAYOUT_CACHE_MAX_BYTES   6144  //largest layout that can be cached
+#define LAYOUT_CACHE_MAX_PAGES   10    //largest number of pages that can be indexed
+#define LAYOUT_CACHE_CHUNK_BYTES 256   //how many bytes to write at a time when streaming the layout
+
+DMAMEM static char layoutCache_blob[LAYOUT_CACHE_MAX_BYTES];  //where the rendered layout is held (outside of the heap)
+
+class TympanRemote_LayoutCache {
+  public:
+    TympanRemote_LayoutCache(void) {};
+
+    //render the layout into the cache.  Returns true if it fit (if it did not fit, the caller should
+    //keep using TympanRemoteFormatter::asString() instead).
+    bool build(TympanRemoteFormatter &gui);
+    bool isBuilt(void) { return is_built; }
+    int getLength(void) { return len; }
+    int get_nPages(void) { return n_pages; }
+    const char *c_str(void) { return layoutCache_blob; }
+
+    //write the whole layout (or just one page of it) to a stream in fixed-size chunks.  No heap is used.
+    int streamLayout(Print *out) { return writeChunks(out, 0, len); }
+    int streamPage(Print *out, const int page_ind);
+
+  private:
+    bool is_built = false;
+    int len = 0;
+    int n_pages = 0;
+    int pages_start = -1;  //index of the first character after the "[" that opens the list of pages
+    int pages_end = -1;    //index of the "]" that closes the list of pages
+    int page_start[LAYOUT_CACHE_MAX_PAGES];
+    int page_end[LAYOUT_CACHE_MAX_PAGES];  //one past the last character of each page
+
+    int writeChunks(Print *out, int start_ind, const int end_ind);
+    void indexPages(void);
+};
+
+bool TympanRemote_LayoutCache::build(TympanRemoteFormatter &gui) {
+  is_built = false; len = 0; n_pages = 0;
+
+  //render the layout one last time and copy it into the static buffer
+  {
+    String s = gui.asString();  //this String only lives for the duration of this block
+    if (s.length() >= LAYOUT_CACHE_MAX_BYTES) {
+      Serial.println("TympanRemote_LayoutCache: *** WARNING ***: layout is " + String(s.length()) + " bytes, which is too big to cache.");
+      return false;
+    }
+    len = s.length();
+    memcpy(layoutCache_blob, s.c_str(), len);
+    layoutCache_blob[len] = '\0';
+  }
+
+  indexPages();
+  is_built = true;
+  return true;
+}
+
+//find where each page starts and stops so that pages can be sent individually
+void TympanRemote_LayoutCache::indexPages(void) {
+  n_pages = 0; pages_start = -1; pages_end = -1;
+  const char *pages_key = strstr(layoutCache_blob, "'pages':[");
+  if (pages_key == NULL) return;  //unexpected format.  Only the full layout can be sent.
+  pages_start = (pages_key - layoutCache_blob) + strlen("'pages':[");
+
+  //walk through the list of pages, tracking the nesting of the braces (ignoring anything in quotes)
+  int depth = 0;  bool in_quote = false;
+  for (int i = pages_start; i < len; i++) {
+    char c = layoutCache_blob[i];
+    if (c == '\'') { in_quote = !in_quote; continue; }
+    if (in_quote) continue;
+    if ((c == '{') || (c == '[')) {
+      if ((depth == 0) && (c == '{') && (n_pages < LAYOUT_CACHE_MAX_PAGES)) page_start[n_pages] = i;
+      depth++;
+    } else if ((c == '}') || (c == ']')) {
+      if (depth == 0) { pages_end = i; break; } //this is the "]" that closes the list of pages
+      depth--;
+      if ((depth == 0) && (c == '}') && (n_pages < LAYOUT_CACHE_MAX_PAGES)) page_end[n_pages++] = i+1;
+    }
+  }
+  if (pages_end < 0) n_pages = 0;  //never found the end of the pages.  Don't trust the index.
+}
+
+int TympanRemote_LayoutCache::streamPage(Print *out, const int page_ind) {
+  if ((page_ind < 0) || (page_ind >= n_pages)) return 0;
+  int count = 0;
+  count += writeChunks(out, 0, pages_start);                           //the JSON header, through the opening "["
+  count += writeChunks(out, page_start[page_ind], page_end[page_ind]); //the requested page
+  count += writeChunks(out, pages_end, len);                           //the closing "]" and whatever follows the pages
+  return count;
+}
+
+int TympanRemote_LayoutCache::writeChunks(Print *out, int start_ind, const int end_ind) {
+  int count = 0;
+  while (start_ind < end_ind) {
+    int n = min(LAYOUT_CACHE_CHUNK_BYTES, end_ind - start_ind);
+    count += out->write((const uint8_t *)(layoutCache_blob + start_ind), n);
+    start_ind += n;
+  }
+  return count;
+}
+
+#endif
@@ -0,0 +1,334 @@
+#
+# dpoaeStreamAnalyzer.py
+#
+# Purpose: Analyze a DPOAE recording while it is still being downloaded from
+#     the Tympan.  Give the analyzer the bytes of the WAV file as they arrive
+#     (any amount at a time) and it measures the levels at F1, F2, 2*F1-F2,
+#     and the noise floor for each test step.  When the last byte arrives,
+#     the results are ready.
+#
+# It does the same analysis as host_analysis/dpoae_analyze.cpp (read the
+# notes at the top of that file), so the two give the same numbers:
+#   * The steps are found from the firmware's timing plus the tone extensions in
+#     the artifact sidecar (*_flags.csv), if given.  The durations come from the
+#     sidecar's header (unless they are given to the analyzer), or else from the
+#     defaults in DPOAE_Protocol.h.  So, download the sidecar first; it is small.
+#   * The tones are planned (see planFrequencies()) at the rate that they were
+#     played: the sidecar's stimulus_rate_Hz, or stim_rate_Hz, or else the file's
+#     sample rate.  If the recording was decimated, the frames are shortened by the
+#     same factor, so that the tones still sit on the bins.
+#   * Frames of DPOAE_ASSUMED_NFFT samples (divided by any decimation) are Hann
+#     windowed (or not, with window='rect') and the power is found at the FFT bins
+#     of the tones.  Frames that overlap flagged (noisy) audio are skipped.
+#   * Only the samples that haven't been analyzed yet are kept in memory.
+#
+# To download a recording from the Tympan and analyze it at the same time, use
+# receiveAndAnalyzeFromTympan() (see getFileFromTympan.py for an example).
+#
+# To analyze a file that is already on the PC, run this file directly:
+#     python dpoaeStreamAnalyzer.py AUDIO001.WAV [AUDIO001_flags.csv]
+#
+# MIT License
+#
+
+import os
+import re
+import struct
+import sys
+import numpy as np  #pip install numpy
+
+# ####################################### The protocol (shared with the Tympan)
+
+# read the frequencies and timing from DPOAE_Protocol.h, so that they always match the firmware
+def loadProtocol(fname=None):
+    if fname is None:
+        fname = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'DPOAE_Protocol.h')
+    with open(fname, 'r') as f:
+        text = f.read()
+    text = re.sub(r'/\*.*?\*/', '', text, flags=re.DOTALL)   #remove the block comments
+    text = re.sub(r'//[^\n]*', '', text)                     #remove the line comments
+    protocol = {}
+    for name, value in re.findall(r'#define\s+(\w+)\s+([-\d.]+)', text):
+        protocol[name] = float(value) if ('.' in value) else int(value)
+    for name, values in re.findall(r'static\s+(?:const|constexpr)\s+float\s+(\w+)\s*\[[^\]]*\]\s*=\s*\{([^}]*)\}', text):
+        protocol[name] = [float(v.strip().rstrip('fF')) for v in values.split(',') if v.strip()]
+    return protocol
+
+# the FFT bins of F1, F2, and 2*F1-F2 for each step.  This is the same as dpoae_planFrequencies() in DPOAE_Protocol.h
+def planFrequencies(protocol, fs_Hz, Nfft):
+    f32 = np.float32
+    plan = []
+    targ_f2_list = protocol['dpoae_targ_freq2_Hz']
+    if fs_Hz >= protocol.get('DPOAE_EHF_MIN_FS_HZ', float('inf')):
+        targ_f2_list = protocol['dpoae_targ_freq2_ehf_Hz']   #the extended high-frequency protocol (like dpoae_targFreq2_Hz())
+    for targ_f2_Hz in targ_f2_list:
+        k2 = int(f32(targ_f2_Hz) * f32(Nfft) / f32(fs_Hz) + f32(0.5))
+        k1 = int(f32(k2) / f32(protocol['DPOAE_F2_F1_RATIO']) + f32(0.5))
+        k1 = min(k1, k2 - 1)   #keep F1 below F2
+        plan.append((k1, k2, 2*k1 - k2))
+    return plan
+
+# read the artifact sidecar written by the Tympan (see Artifact_Log.h).
+# Returns the flagged runs as (start_sample, n_samples), the tone extension of each step (msec),
+# the rate that the tones were planned for (None if not given), and the test's timing as a
+# dictionary with 'sdstart_ms', 'tone_ms', and 'silence_ms' (empty if not given)
+def loadSidecar(fname, n_steps):
+    runs, extended_ms, stim_rate_Hz, timing_ms = [], [0] * n_steps, None, {}
+    if (fname is None) or (not os.path.exists(fname)):
+        return runs, extended_ms, stim_rate_Hz, timing_ms
+    with open(fname, 'r') as f:
+        for line in f:
+            m = re.match(r'# step (\d+): rejected (\d+) msec, tone extended by (\d+) msec', line)
+            r = re.match(r'# stimulus_rate_Hz = ([\d.]+)', line)
+            t = re.match(r'# sdstart_ms = (\d+), tone_ms = (\d+), silence_ms = (\d+)', line)
+            if r:
+                stim_rate_Hz = float(r.group(1))
+            elif t:
+                timing_ms = {'sdstart_ms': int(t.group(1)), 'tone_ms': int(t.group(2)), 'silence_ms': int(t.group(3))}
+            elif m:
+                step = int(m.group(1))
+                if 1 <= step <= n_steps:
+                    extended_ms[step-1] = int(m.group(3))
+            elif not line.startswith('#'):
+                pieces = line.split(',')
+                if len(pieces) >= 2 and pieces[0].strip().isdigit():
+                    runs.append((int(pieces[0]), int(pieces[1])))
+    return runs, extended_ms, stim_rate_Hz, timing_ms
+
+# the sidecar for the given channel of the given WAV file (two channels per ear)
+def sidecarName(wav_fname, chan, n_chan):
+    base = os.path.splitext(wav_fname)[0]
+    if n_chan > 2:
+        return base + '_ear' + str(chan // 2 + 1) + '_flags.csv'
+    return base + '_flags.csv'
+
+
+# ####################################### The analyzer
+
+class DPOAEStreamAnalyzer:
+    # sidecar_fnames: one sidecar for every ear (or a function of (chan, n_chan) that gives the name), or None
+    # sdstart_ms, tone_ms, silence_ms: the test's timing (None: from the sidecar, or else the defaults)
+    # stim_rate_Hz: the rate that the tones were played at, if not in the sidecar (None: the file's sample rate)
+    def __init__(self, sidecar_fnames=None, sdstart_ms=None, tone_ms=None, silence_ms=None, settle_ms=100, noise_bins=5, window='hann', protocol=None, stim_rate_Hz=None):
+        self.p = protocol if (protocol is not None) else loadProtocol()
+        self.sidecar_fnames = sidecar_fnames
+        self.timing_ms = {'sdstart_ms': sdstart_ms, 'tone_ms': tone_ms, 'silence_ms': silence_ms}   #None: see _start()
+        self.settle_ms, self.noise_bins = settle_ms, noise_bins
+        self.stim_rate_Hz = stim_rate_Hz
+        self.rect_window = (window == 'rect')
+
+        self.header = bytearray()     #bytes of the WAV header, until we find the data chunk
+        self.is_started = False
+        self.pending = bytearray()    #bytes of a partial sample frame
+        self.buff = None              #samples that still need to be analyzed (n_samples x n_chan)
+        self.buff_start = 0           #sample index of the first row of buff
+        self.n_bytes_fed = 0
+
+    # give the analyzer more bytes of the WAV file (in order, starting at the beginning of the file)
+    def feed(self, new_bytes):
+        self.n_bytes_fed += len(new_bytes)
+        if not self.is_started:
+            self.header += new_bytes
+            if not self._parseHeader():
+                return
+            new_bytes = bytes(self.header[self.data_offset:])
+            self.header = None
+        self.pending += new_bytes
+        n_whole = (len(self.pending) // self.frame_bytes) * self.frame_bytes
+        if n_whole == 0:
+            return
+        x = np.frombuffer(bytes(self.pending[:n_whole]), dtype=self.dtype).reshape(-1, self.n_chan).astype(np.float64) * self.scale
+        del self.pending[:n_whole]
+        self.buff = x if (self.buff is None) else np.concatenate((self.buff, x))
+        self._analyzeFrames()
+
+    # after the last byte: returns the results, one dictionary per channel and step
+    def finish(self):
+        results = []
+        if not self.is_started:
+            return results
+        for chan_steps in self.steps:
+            for s in chan_steps:
+                r = {k: s[k] for k in ('channel', 'step', 'f1_Hz', 'f2_Hz', 'fdp_Hz', 'n_frames', 'n_rejected')}
+                if s['n_frames'] > 0:
+                    pow = s['power'] / s['n_frames']
+                    r['L1_dB'], r['L2_dB'], r['Ldp_dB'] = [10.0 * np.log10(max(v, 1e-20)) for v in pow[:3]]
+                    r['noise_dB'] = 10.0 * np.log10(max(np.mean(pow[3:]), 1e-20)) if len(pow) > 3 else float('nan')
+                else:
+                    r['L1_dB'] = r['L2_dB'] = r['Ldp_dB'] = r['noise_dB'] = float('nan')  #recording stopped early, or it was all rejected
+                r['snr_dB'] = r['Ldp_dB'] - r['noise_dB']
+                results.append(r)
+        return results
+
+    def _parseHeader(self):
+        h = self.header
+        if len(h) >= 12 and (h[0:4] != b'RIFF' or h[8:12] != b'WAVE'):
+            raise ValueError('DPOAEStreamAnalyzer: not a WAV file')
+        pos, fmt = 12, None
+        while pos + 8 <= len(h):
+            chunk_id, chunk_bytes = bytes(h[pos:pos+4]), struct.unpack_from('<I', h, pos+4)[0]
+            if chunk_id == b'fmt ':
+                if len(h) < pos + 24:
+                    return False
+                fmt = struct.unpack_from('<HHIIHH', h, pos+8)
+                if fmt[0] == 0xFFFE and len(h) >= pos + 34:
+                    fmt = (struct.unpack_from('<H', h, pos+32)[0],) + fmt[1:]  #WAVE_FORMAT_EXTENSIBLE: the sub-format
+            elif chunk_id == b'data':
+                if fmt is None:
+                    raise ValueError('DPOAEStreamAnalyzer: no fmt chunk before the data')
+                self._start(fmt, pos + 8)
+                return True
+            pos += 8 + chunk_bytes + (chunk_bytes & 1)
+        return False   #need more bytes
+
+    def _start(self, fmt, data_offset):
+        format, self.n_chan, sample_rate = fmt[0], fmt[1], fmt[2]
+        bits = fmt[5]
+        if (format, bits) == (1, 16):
+            self.dtype, self.scale = '<i2', 1.0 / 32768.0
+        elif (format, bits) == (3, 32):
+            self.dtype, self.scale = '<f4', 1.0
+        else:
+            raise ValueError('DPOAEStreamAnalyzer: only 16-bit PCM or 32-bit float is supported')
+        self.frame_bytes = self.n_chan * bits // 8
+        self.data_offset = data_offset
+        self.is_started = True
+
+        # each ear has its own sidecar
+        n_steps = self.p['N_F2']
+        sidecars = []
+        for chan in range(self.n_chan):
+            sidecar = self.sidecar_fnames
+            if callable(sidecar):
+                sidecar = sidecar(chan, self.n_chan)
+            elif isinstance(sidecar, (list, tuple)):
+                sidecar = sidecar[min(chan // 2, len(sidecar) - 1)]
+            sidecars.append(loadSidecar(sidecar, n_steps))
+
+        # plan the tones at the rate that they were played, then shorten the frames by the recording's
+        # decimation, so that the bins keep their width (the WAV header's rate may be rounded down)
+        stim_rate_Hz = self.stim_rate_Hz if (self.stim_rate_Hz is not None) else sidecars[0][2]
+        if stim_rate_Hz is None:
+            stim_rate_Hz = float(sample_rate)   #not decimated (or not known)
+        decimation = max(1, int(round(stim_rate_Hz / float(sample_rate))))
+        if (self.p['DPOAE_ASSUMED_NFFT'] % decimation) != 0:
+            raise ValueError("DPOAEStreamAnalyzer: the recording's decimation doesn't divide the FFT length")
+        self.Nfft = N = self.p['DPOAE_ASSUMED_NFFT'] // decimation
+        self.fs_Hz = stim_rate_Hz / decimation
+        plan = planFrequencies(self.p, stim_rate_Hz, self.p['DPOAE_ASSUMED_NFFT'])
+        if max(k2 for (k1, k2, kdp) in plan) >= N // 2:
+            raise ValueError("DPOAEStreamAnalyzer: the DPOAE frequencies are above the recording's Nyquist frequency")
+        if self.rect_window:
+            self.window = np.ones(N)  #fine for bin-aligned tones (see dpoae_planFrequencies() in DPOAE_Protocol.h)
+        else:
+            self.window = 0.5 * (1.0 - np.cos(2.0 * np.pi * np.arange(N) / N))
+
+        # plan the frames for every step of every channel
+        self.steps = []
+        for chan in range(self.n_chan):
+            runs, extended_ms, _, sidecar_timing_ms = sidecars[chan]
+            timing_ms = {}   #the timing given to the analyzer, or else the sidecar's, or else the defaults
+            for key, default_name in (('sdstart_ms', 'DPOAE_DEFAULT_SDSTART_MSEC'), ('tone_ms', 'DPOAE_DEFAULT_TONE_MSEC'), ('silence_ms', 'DPOAE_DEFAULT_SILENCE_MSEC')):
+                timing_ms[key] = self.timing_ms[key] if (self.timing_ms[key] is not None) else sidecar_timing_ms.get(key, self.p[default_name])
+            chan_steps, tone_start_ms = [], float(timing_ms['sdstart_ms'])
+            for step in range(n_steps):
+                tone_end_ms = tone_start_ms + timing_ms['tone_ms'] + extended_ms[step]
+                k1, k2, kdp = plan[step]
+                guard = 0 if self.rect_window else 1   #Hann spreads each tone into the next bin
+                noise = [k for j in range(1, self.noise_bins + 1) for k in (kdp - j, kdp + j)
+                         if (k > 0) and (abs(k - k1) > guard) and (abs(k - k2) > guard) and (abs(k - kdp) > guard)]  #not on (or next to) any tone
+                bins = np.array([k1, k2, kdp] + noise)
+                chan_steps.append({'channel': chan, 'step': step + 1,
+                    'f1_Hz': k1 * self.fs_Hz / N, 'f2_Hz': k2 * self.fs_Hz / N, 'fdp_Hz': kdp * self.fs_Hz / N,
+                    'first': int((tone_start_ms + self.p['DPOAE_FADE_MSEC'] + self.settle_ms) * 0.001 * self.fs_Hz),
+                    'last': int(tone_end_ms * 0.001 * self.fs_Hz),  #the fade out starts here
+                    'basis': self.window[None, :] * np.exp(-2j * np.pi * np.outer(bins, np.arange(N)) / N),
+                    'power': np.zeros(len(bins)), 'n_frames': 0, 'n_rejected': 0, 'runs': runs})
+                tone_start_ms = tone_end_ms + timing_ms['silence_ms']
+            self.steps.append(chan_steps)
+        self.next_frame = [chan_steps[0]['first'] for chan_steps in self.steps]  #sample index of the next frame for each channel
+        self.cur_step = [0] * self.n_chan
+
+    # analyze every frame that is now complete, then drop the samples that are no longer needed
+    def _analyzeFrames(self):
+        N = self.Nfft
+        buff_end = self.buff_start + len(self.buff)
+        for chan in range(self.n_chan):
+            while self.cur_step[chan] < len(self.steps[chan]):
+                s = self.steps[chan][self.cur_step[chan]]
+                start = max(self.next_frame[chan], s['first'])
+                n_frames = min((s['last'] - start) // N, (buff_end - start) // N) if (start >= self.buff_start) else 0
+                if n_frames > 0:
+                    starts = start + N * np.arange(n_frames)
+                    ok = np.array([not any((a < r0 + rn) and (r0 < a + N) for (r0, rn) in s['runs']) for a in starts])
+                    s['n_rejected'] += int(np.sum(~ok))
+                    if np.any(ok):
+                        rows = (starts[ok] - self.buff_start)[:, None] + np.arange(N)[None, :]
+                        X = self.buff[rows, chan] @ s['basis'].T              #frames x bins
+                        s['power'] += np.sum(0.5 * (2.0 * np.abs(X) / np.sum(self.window))**2, axis=0)  #full-scale sine is -3.0 dB
+                        s['n_frames'] += int(np.sum(ok))
+                    start += N * n_frames
+                self.next_frame[chan] = start
+                if start + N > s['last']:
+                    self.cur_step[chan] += 1   #done with this step
+                    if self.cur_step[chan] < len(self.steps[chan]):
+                        self.next_frame[chan] = self.steps[chan][self.cur_step[chan]]['first']
+                    else:
+                        self.next_frame[chan] = sys.maxsize   #this channel is finished, so it needs no more samples
+                    continue
+                break   #wait for more samples
+        keep_from = min(self.next_frame)
+        if keep_from > self.buff_start:
+            drop = min(keep_from - self.buff_start, len(self.buff))
+            self.buff = self.buff[drop:]
+            self.buff_start += drop
+
+
+# write the results as a CSV table (the same columns as host_analysis/dpoae_analyze)
+def writeResults(results, fname_or_file, wav_name=''):
+    f = open(fname_or_file, 'w') if isinstance(fname_or_file, str) else fname_or_file
+    f.write('file, channel, step, f1_Hz, f2_Hz, fdp_Hz, L1_dB, L2_dB, Ldp_dB, noise_dB, snr_dB, n_frames, n_rejected\n')
+    for r in results:
+        f.write('%s, %d, %d, %.1f, %.1f, %.1f, %.1f, %.1f, %.1f, %.1f, %.1f, %d, %d\n' % (wav_name, r['channel'], r['step'],
+                r['f1_Hz'], r['f2_Hz'], r['fdp_Hz'], r['L1_dB'], r['L2_dB'], r['Ldp_dB'], r['noise_dB'], r['snr_dB'], r['n_frames'], r['n_rejected']))
+    if isinstance(fname_or_file, str):
+        f.close()
+
+
+# download a WAV file from the Tympan and analyze it as it arrives.  The sidecars (small) are downloaded
+# first, so that their tone extensions are known before the audio arrives.  Give the sidecar names as
+# they appear on the Tympan (one per ear); any that don't exist there are just skipped.
+# Returns the results (see DPOAEStreamAnalyzer.finish()), or None if the transfer failed.
+def receiveAndAnalyzeFromTympan(serial_to_tympan, wav_fname_on_Tympan, wav_fname_locally, sidecar_fnames_on_Tympan=[], verbose=False, offset=0):
+    import tympanSdFileTransferFunctions as tympanSerial
+    local_dir = os.path.dirname(wav_fname_locally)
+    local_sidecars = []
+    for fname in sidecar_fnames_on_Tympan:
+        local_fname = os.path.join(local_dir, fname)
+        ok = tympanSerial.receiveCompressedFileFromTympan(serial_to_tympan, fname, local_fname, verbose=verbose)
+        local_sidecars.append(local_fname if ok else None)   #keep the order, so that each ear gets its own sidecar
+    analyzer = DPOAEStreamAnalyzer(local_sidecars if (len(local_sidecars) > 0) else None)
+    ok = tympanSerial.receiveCompressedFileFromTympan(serial_to_tympan, wav_fname_on_Tympan, wav_fname_locally,
+                                                      verbose=verbose, offset=offset, on_new_bytes=analyzer.feed)
+    return analyzer.finish() if ok else None
+
+
+# feed a WAV file that is already on the PC through the analyzer.  Returns the results.
+def analyzeLocalFile(wav_fname, analyzer=None, blocksize=65536):
+    if analyzer is None:
+        analyzer = DPOAEStreamAnalyzer(lambda chan, n_chan: sidecarName(wav_fname, chan, n_chan))
+    with open(wav_fname, 'rb') as f:
+        block = f.read(blocksize)
+        while block:
+            analyzer.feed(block)
+            block = f.read(blocksize)
+    return analyzer.finish()
+
+
+if __name__ == '__main__':
+    if len(sys.argv) < 2:
+        print("Usage: python dpoaeStreamAnalyzer.py <file.wav> [sidecar.csv]")
+        sys.exit(1)
+    wav_fname = sys.argv[1]
+    analyzer = DPOAEStreamAnalyzer(sys.argv[2:] if len(sys.argv) > 2 else (lambda chan, n_chan: sidecarName(wav_fname, chan, n_chan)))
+    writeResults(analyzeLocalFile(wav_fname, analyzer), sys.stdout, wav_fname)
@@ -12,6 +12,7 @@
 # https://projecthub.arduino.cc/ansh2919/serial-communication-between-python-and-arduino-663756
 #
 
+import sys
 import serial  #pip install pyserial
 import tympanSdFileTransferFunctions as tympanSerial
 
@@ -23,6 +24,9 @@ my_com_port = 'COM26'    #YOUR INPUT IS NEEDED HERE!!!
 # Do you want to learn what is happening?  Or, do you need to debug?
 verbose = False   #set to true for printing of helpful info
 
+# Do you want the DPOAE results?  If so, the recording is analyzed while it downloads (see dpoaeStreamAnalyzer.py)
+analyze_while_receiving = True
+
 
 # create a serial instance for communicating to your Tympan
 print("ACTION: Opening serial port...make sure the Serial Monitor is closed in Arduino IDE...")
@@ -67,9 +71,26 @@ else:
 
 # Transfer a file FROM THE TYMPAN
 print();print("ACTION: Receiving the file " + fname_to_read_on_Tympan + " from the Tympan...")
-command_getFileFromTypman = 'x'                     #This is set by the Tympan program
+use_compression = True                              #compressed is faster for quiet recordings (needs numpy)
 fname_to_write_locally = fname_to_read_on_Tympan    #on the local computer, what file to write to?  ...use the same as the source name
-receive_success = tympanSerial.receiveFileFromTympan(serial_to_tympan, command_getFileFromTypman, \
+if analyze_while_receiving:
+    # get the artifact sidecar(s) first, then analyze the recording as it arrives (needs numpy)
+    import dpoaeStreamAnalyzer
+    base_name = fname_to_read_on_Tympan.split('.')[0]
+    sidecars = [f for f in fnames if f.upper().startswith(base_name.upper() + '_') and f.lower().endswith('_flags.csv')]
+    results = dpoaeStreamAnalyzer.receiveAndAnalyzeFromTympan(serial_to_tympan, fname_to_read_on_Tympan, \
+                        fname_to_write_locally, sorted(sidecars), verbose=verbose)
+    receive_success = (results is not None)
+    if receive_success:
+        print("RESULT: DPOAE levels for each step:")
+        dpoaeStreamAnalyzer.writeResults(results, sys.stdout, fname_to_write_locally)
+elif use_compression:
+    # the Tympan compresses the file as it sends it (falls back to the raw transfer, if the Tympan can't)
+    receive_success = tympanSerial.receiveCompressedFileFromTympan(serial_to_tympan, \
+                        fname_to_read_on_Tympan, fname_to_write_locally, verbose=verbose)
+else:
+    command_getFileFromTypman = 'x'                     #This is set by the Tympan program
+    receive_success = tympanSerial.receiveFileFromTympan(serial_to_tympan, command_getFileFromTypman, \
                         fname_to_read_on_Tympan, fname_to_write_locally, verbose=verbose)
 
 
@@ -0,0 +1,377 @@
+/*
+ dpoae_analyze.cpp
+
+ Purpose: Offline analysis of DPOAE recordings on the PC (Linux).  Give it WAV
+          files (or directories of them) that were recorded by DPOAE_Tones_Record,
+          and it measures the level at F1, F2, 2*F1-F2, and the noise floor around
+          2*F1-F2 for every test step of every channel.  Files are analyzed in
+          parallel, one file per thread.
+
+ How it works:
+   * The WAV file is memory-mapped (no copying).  16-bit PCM and 32-bit float are supported.
+   * The test steps are found from the same timing that the Tympan used.  If the
+       artifact sidecar (AUDIOxxx_flags.csv, or AUDIOxxx_earN_flags.csv for binaural)
+       is next to the WAV, the durations in its header are used (unless they are given
+       on the command line), its "tone extended by" lines are used to find where each
+       step really ended, and its runs of flagged (noisy) audio are left out of the
+       averaging.  Without a sidecar, the defaults from DPOAE_Protocol.h are used.
+   * The tones are planned by dpoae_planFrequencies(), just like the firmware, at the
+       rate that the tones were played (the sidecar's "stimulus_rate_Hz", or --stim_rate,
+       or else the WAV file's rate).  If the recording was decimated, the frames are
+       shortened by the same factor, so that the bins are the same width and the tones
+       still sit on them.
+   * Each tone is cut into non-overlapping frames of DPOAE_ASSUMED_NFFT samples (divided
+       by any decimation), skipping the fades.  Each frame is Hann windowed and the power
+       is found at the FFT bins of F1, F2, and 2*F1-F2, using the Goertzel algorithm
+       so that the whole FFT isn't needed.  The power is averaged across the frames.
+       Since the tones sit exactly on the bins, "--window rect" can be used instead
+       of Hann for less noise in each bin (but only for recordings made with bin-aligned tones).
+   * Levels are dBFS using the same convention as the firmware (a full-scale sine is -3.0 dB).
+
+ Output is one CSV table (to stdout, or to the file given by -o), sorted by file name:
+     file, channel, step, f1_Hz, f2_Hz, fdp_Hz, L1_dB, L2_dB, Ldp_dB, noise_dB, snr_dB, n_frames, n_rejected
+
+ Build: make    (needs g++ with C++17 and pthreads)
+ Usage: ./dpoae_analyze [options] <file.wav or directory> ...
+     -o <file>          write the results to this file (default: stdout)
+     -j <n>             number of threads (default: number of CPUs)
+     --sdstart_ms <ms>  time from the start of the recording to the first tone (default: from the sidecar, or DPOAE_DEFAULT_SDSTART_MSEC)
+     --tone_ms <ms>     duration of each tone, before any extension (default: from the sidecar, or DPOAE_DEFAULT_TONE_MSEC)
+     --silence_ms <ms>  duration of the silence between tones (default: from the sidecar, or DPOAE_DEFAULT_SILENCE_MSEC)
+     --settle_ms <ms>   extra time to skip after each fade in (default: 100)
+     --noise_bins <n>   number of bins on each side of 2*F1-F2 for the noise floor (default: 5)
+     --window <name>    "hann" (default) or "rect"
+     --stim_rate <Hz>   the rate that the tones were played at (default: from the sidecar, or else the WAV file's rate)
+
+ MIT License, Use at your own risk.
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../DPOAE_Protocol.h"
+
+namespace fs = std::filesystem;
+
+struct Analysis_Settings {
+  int sdstart_ms = -1;   //negative: from the sidecar (or else the default)
+  int tone_ms = -1;
+  int silence_ms = -1;
+  int settle_ms = 100;
+  int noise_bins = 5;
+  bool rect_window = false;
+  float stim_rate_Hz = 0.0f;   //zero: from the sidecar
+};
+
+struct Step_Result {
+  int channel, step;
+  float f1_Hz, f2_Hz, fdp_Hz;
+  float L1_dB, L2_dB, Ldp_dB, noise_dB;
+  int n_frames, n_rejected;
+};
+
+struct File_Result {
+  std::string fname;
+  std::string error;   //empty if all went well
+  std::vector<Step_Result> steps;
+};
+
+// ///////////////////////////////////////////////////////////////// WAV file (memory mapped)
+
+class Wav_File {
+  public:
+    ~Wav_File(void) { close(); }
+
+    bool open(const std::string &fname, std::string &err) {
+      int fd = ::open(fname.c_str(), O_RDONLY);
+      if (fd < 0) { err = "could not open file"; return false; }
+      struct stat st;
+      if ((fstat(fd, &st) != 0) || (st.st_size < 44)) { ::close(fd); err = "file too short"; return false; }
+      map_bytes = (size_t)st.st_size;
+      void *p = mmap(NULL, map_bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+      ::close(fd);
+      if (p == MAP_FAILED) { err = "could not mmap file"; return false; }
+      map = (const uint8_t *)p;
+      madvise(p, map_bytes, MADV_SEQUENTIAL);
+      return parseHeader(err);
+    }
+    void close(void) { if (map != NULL) munmap((void *)map, map_bytes); map = NULL; }
+
+    int n_chan = 0, bits = 0, format = 0;   //format: 1 = PCM, 3 = float
+    float sample_rate_Hz = 0.0f;
+    size_t n_frames = 0;                      //samples per channel
+
+    //one sample, scaled to +/-1.0
+    inline float sample(size_t i, int chan) const {
+      size_t ind = i * n_chan + chan;
+      if (format == 3) { float x; memcpy(&x, data + 4*ind, 4); return x; }
+      int16_t x; memcpy(&x, data + 2*ind, 2); return (float)x * (1.0f/32768.0f);
+    }
+
+  private:
+    const uint8_t *map = NULL, *data = NULL;
+    size_t map_bytes = 0;
+
+    static uint32_t u32(const uint8_t *p) { return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24); }
+    static uint16_t u16(const uint8_t *p) { return (uint16_t)(p[0] | (p[1] << 8)); }
+
+    bool parseHeader(std::string &err) {
+      if ((memcmp(map, "RIFF", 4) != 0) || (memcmp(map+8, "WAVE", 4) != 0)) { err = "not a WAV file"; return false; }
+      size_t pos = 12;
+      bool have_fmt = false;
+      while (pos + 8 <= map_bytes) {
+        uint32_t chunk_bytes = u32(map+pos+4);
+        if (memcmp(map+pos, "fmt ", 4) == 0) {
+          format = u16(map+pos+8); n_chan = u16(map+pos+10);
+          sample_rate_Hz = (float)u32(map+pos+12); bits = u16(map+pos+22);
+          if (format == 0xFFFE) format = u16(map+pos+32);  //WAVE_FORMAT_EXTENSIBLE: the sub-format
+          have_fmt = true;
+        } else if (memcmp(map+pos, "data", 4) == 0) {
+          if (!have_fmt) break;
+          if (!(((format == 1) && (bits == 16)) || ((format == 3) && (bits == 32))) || (n_chan < 1)) { err = "only 16-bit PCM or 32-bit float is supported"; return false; }
+          data = map + pos + 8;
+          size_t data_bytes = std::min((size_t)chunk_bytes, map_bytes - (pos + 8));  //the Tympan may not have finished the header
+          if (chunk_bytes == 0) data_bytes = map_bytes - (pos + 8);
+          n_frames = data_bytes / (size_t)(n_chan * bits / 8);
+          return true;
+        }
+        pos += 8 + chunk_bytes + (chunk_bytes & 1);
+      }
+      err = "no fmt or data chunk";
+      return false;
+    }
+};
+
+// ///////////////////////////////////////////////////////////////// artifact sidecar (see Artifact_Log.h)
+
+struct Sidecar {
+  std::vector<std::pair<size_t, size_t>> runs;   //start_sample, n_samples
+  int extended_ms[N_F2] = {0};
+  float stim_rate_Hz = 0.0f;   //the rate that the tones were planned for (zero if not given)
+  int sdstart_ms = -1, tone_ms = -1, silence_ms = -1;   //the test's timing (negative if not given)
+  bool found = false;
+
+  void load(const std::string &fname) {
+    FILE *f = fopen(fname.c_str(), "r");
+    if (f == NULL) return;
+    found = true;
+    char line[256];
+    while (fgets(line, sizeof(line), f) != NULL) {
+      int step, rej_ms, ext_ms;
+      unsigned long start, n;
+      float rate_Hz;
+      int ms[3];
+      if (sscanf(line, "# stimulus_rate_Hz = %f", &rate_Hz) == 1) {
+        stim_rate_Hz = rate_Hz;
+      } else if (sscanf(line, "# sdstart_ms = %d, tone_ms = %d, silence_ms = %d", &ms[0], &ms[1], &ms[2]) == 3) {
+        sdstart_ms = ms[0]; tone_ms = ms[1]; silence_ms = ms[2];
+      } else if (sscanf(line, "# step %d: rejected %d msec, tone extended by %d msec", &step, &rej_ms, &ext_ms) == 3) {
+        if ((step >= 1) && (step <= N_F2)) extended_ms[step-1] = ext_ms;
+      } else if ((line[0] != '#') && (sscanf(line, "%lu, %lu", &start, &n) == 2)) {
+        runs.push_back(std::make_pair((size_t)start, (size_t)n));
+      }
+    }
+    fclose(f);
+  }
+
+  //does [start, start+n) overlap any flagged run?
+  bool isFlagged(size_t start, size_t n) const {
+    for (const auto &r : runs) if ((start < r.first + r.second) && (r.first < start + n)) return true;
+    return false;
+  }
+};
+
+//the sidecar for the given channel of the given WAV file (two channels per ear)
+static std::string sidecarName(const std::string &wav_fname, int chan, int n_chan) {
+  std::string base = wav_fname.substr(0, wav_fname.rfind('.'));
+  if (n_chan > 2) return base + "_ear" + std::to_string(chan/2 + 1) + "_flags.csv";
+  return base + "_flags.csv";
+}
+
+// ///////////////////////////////////////////////////////////////// analysis
+
+//power at bin k of a windowed frame (Goertzel), scaled so that a full-scale sine is -3.0 dB
+static double binPower(const std::vector<float> &frame, int k, double win_sum) {
+  const int N = (int)frame.size();
+  const double coeff = 2.0 * cos(2.0 * M_PI * (double)k / (double)N);
+  double s1 = 0.0, s2 = 0.0;
+  for (int i=0; i < N; i++) {
+    double s0 = (double)frame[i] + coeff * s1 - s2;
+    s2 = s1; s1 = s0;
+  }
+  double mag_sq = s1*s1 + s2*s2 - coeff*s1*s2;
+  double amp = 2.0 * sqrt(std::max(mag_sq, 0.0)) / win_sum;
+  return 0.5 * amp * amp;
+}
+static inline float todB(double pow) { return (float)(10.0 * log10(std::max(pow, 1.0e-20))); }
+
+static void analyzeFile(const std::string &fname, const Analysis_Settings &set, File_Result &result) {
+  result.fname = fname;
+  Wav_File wav;
+  if (!wav.open(fname, result.error)) return;
+  const int n_ears = std::max(1, wav.n_chan / 2);
+  std::vector<Sidecar> sidecars(n_ears);
+  for (int ear=0; ear < n_ears; ear++) sidecars[ear].load(sidecarName(fname, 2*ear, wav.n_chan));
+
+  //plan the tones at the rate that they were played (extended high frequencies if that was a high rate)...
+  float stim_rate_Hz = (set.stim_rate_Hz > 0.0f) ? set.stim_rate_Hz : sidecars[0].stim_rate_Hz;
+  if (stim_rate_Hz <= 0.0f) stim_rate_Hz = wav.sample_rate_Hz;  //not decimated (or not known)
+  const DPOAE_Freq_Plan<N_F2> plan = dpoae_planFrequencies(stim_rate_Hz, DPOAE_ASSUMED_NFFT, dpoae_targFreq2_Hz(stim_rate_Hz), DPOAE_F2_F1_RATIO);
+  if (!plan.is_valid) { result.error = "the DPOAE frequencies don't fit this sample rate"; return; }
+
+  //...then shorten the frames by the decimation, so that the bins keep their width (the WAV header's rate may be rounded down)
+  const int decimation = std::max(1, (int)lroundf(stim_rate_Hz / wav.sample_rate_Hz));
+  if ((DPOAE_ASSUMED_NFFT % decimation) != 0) { result.error = "the recording's decimation doesn't divide the FFT length"; return; }
+  const int N = DPOAE_ASSUMED_NFFT / decimation;
+  const double fs_Hz = (double)stim_rate_Hz / (double)decimation;
+  for (int step=0; step < N_F2; step++) {
+    if (plan.bin2[step] >= N/2) { result.error = "the DPOAE frequencies are above the recording's Nyquist frequency"; return; }
+  }
+
+  std::vector<float> window(N), frame(N);
+  double win_sum = 0.0;
+  for (int i=0; i < N; i++) {
+    window[i] = set.rect_window ? 1.0f : 0.5f * (1.0f - cosf(2.0f * (float)M_PI * (float)i / (float)N));
+    win_sum += window[i];
+  }
+
+  for (int chan=0; chan < wav.n_chan; chan++) {
+    const Sidecar &sidecar = sidecars[std::min(chan/2, n_ears-1)];
+
+    //walk through the steps with the firmware's timing (the command line's, or else the sidecar's, or else the defaults)
+    const int sdstart_ms = (set.sdstart_ms >= 0) ? set.sdstart_ms : ((sidecar.sdstart_ms >= 0) ? sidecar.sdstart_ms : DPOAE_DEFAULT_SDSTART_MSEC);
+    const int tone_ms = (set.tone_ms >= 0) ? set.tone_ms : ((sidecar.tone_ms >= 0) ? sidecar.tone_ms : DPOAE_DEFAULT_TONE_MSEC);
+    const int silence_ms = (set.silence_ms >= 0) ? set.silence_ms : ((sidecar.silence_ms >= 0) ? sidecar.silence_ms : DPOAE_DEFAULT_SILENCE_MSEC);
+    double tone_start_ms = (double)sdstart_ms;
+    for (int step=0; step < N_F2; step++) {
+      double tone_end_ms = tone_start_ms + (double)(tone_ms + sidecar.extended_ms[step]);
+      size_t first = (size_t)((tone_start_ms + DPOAE_FADE_MSEC + set.settle_ms) * 0.001 * fs_Hz);
+      size_t last = (size_t)(tone_end_ms * 0.001 * fs_Hz);  //the fade out starts here
+      if (last > wav.n_frames) last = wav.n_frames;
+
+      Step_Result res;
+      res.channel = chan; res.step = step + 1;
+      int k1 = plan.bin1[step], k2 = plan.bin2[step], kdp = plan.bin_dp[step];
+      res.f1_Hz = plan.freq1_Hz[step]; res.f2_Hz = plan.freq2_Hz[step]; res.fdp_Hz = plan.freq_dp_Hz[step];
+      res.n_frames = 0; res.n_rejected = 0;
+
+      //noise bins are on either side of 2*F1-F2, but not on any tone (nor next to it, for Hann, which spreads each tone into the next bin)
+      const int guard = set.rect_window ? 0 : 1;
+      std::vector<int> noise_bins;
+      for (int j=1; j <= set.noise_bins; j++) {
+        for (int k : { kdp - j, kdp + j }) {
+          if ((k > 0) && (abs(k - k1) > guard) && (abs(k - k2) > guard) && (abs(k - kdp) > guard)) noise_bins.push_back(k);
+        }
+      }
+
+      double p1 = 0.0, p2 = 0.0, pdp = 0.0, pnoise = 0.0;
+      for (size_t start = first; start + N <= last; start += N) {
+        if (sidecar.isFlagged(start, N)) { res.n_rejected++; continue; }
+        for (int i=0; i < N; i++) frame[i] = window[i] * wav.sample(start + i, chan);
+        p1 += binPower(frame, k1, win_sum); p2 += binPower(frame, k2, win_sum); pdp += binPower(frame, kdp, win_sum);
+        for (int k : noise_bins) pnoise += binPower(frame, k, win_sum);
+        res.n_frames++;
+      }
+      if (res.n_frames > 0) {
+        double scale = 1.0 / (double)res.n_frames;
+        res.L1_dB = todB(p1*scale); res.L2_dB = todB(p2*scale); res.Ldp_dB = todB(pdp*scale);
+        res.noise_dB = (noise_bins.size() > 0) ? todB(pnoise * scale / (double)noise_bins.size()) : NAN;
+      } else {
+        res.L1_dB = res.L2_dB = res.Ldp_dB = res.noise_dB = NAN;  //the recording stopped early, or it was all rejected
+      }
+      result.steps.push_back(res);
+
+      tone_start_ms = tone_end_ms + (double)silence_ms;
+    }
+  }
+}
+
+// ///////////////////////////////////////////////////////////////// main
+
+static void addPath(const std::string &path, std::vector<std::string> &fnames) {
+  std::error_code ec;
+  if (fs::is_directory(path, ec)) {
+    for (const auto &entry : fs::recursive_directory_iterator(path, ec)) {
+      if (!entry.is_regular_file()) continue;
+      std::string ext = entry.path().extension().string();
+      std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+      if (ext == ".wav") fnames.push_back(entry.path().string());
+    }
+  } else {
+    fnames.push_back(path);
+  }
+}
+
+static void printUsage(void) {
+  fprintf(stderr, "Usage: dpoae_analyze [-o out.csv] [-j threads] [--sdstart_ms ms] [--tone_ms ms] [--silence_ms ms] [--settle_ms ms] [--noise_bins n] [--window hann|rect] [--stim_rate Hz] <file.wav or dir> ...\n");
+}
+
+int main(int argc, char **argv) {
+  Analysis_Settings set;
+  std::string out_fname;
+  int n_threads = (int)std::thread::hardware_concurrency();
+  std::vector<std::string> fnames;
+
+  for (int i=1; i < argc; i++) {
+    std::string arg = argv[i];
+    bool has_val = (i+1 < argc);
+    if ((arg == "-o") && has_val) { out_fname = argv[++i]; }
+    else if ((arg == "-j") && has_val) { n_threads = atoi(argv[++i]); }
+    else if ((arg == "--sdstart_ms") && has_val) { set.sdstart_ms = atoi(argv[++i]); }
+    else if ((arg == "--tone_ms") && has_val) { set.tone_ms = atoi(argv[++i]); }
+    else if ((arg == "--silence_ms") && has_val) { set.silence_ms = atoi(argv[++i]); }
+    else if ((arg == "--settle_ms") && has_val) { set.settle_ms = atoi(argv[++i]); }
+    else if ((arg == "--noise_bins") && has_val) { set.noise_bins = atoi(argv[++i]); }
+    else if ((arg == "--window") && has_val) { set.rect_window = (std::string(argv[++i]) == "rect"); }
+    else if ((arg == "--stim_rate") && has_val) { set.stim_rate_Hz = (float)atof(argv[++i]); }
+    else if ((arg == "-h") || (arg == "--help")) { printUsage(); return 0; }
+    else if (arg[0] == '-') { fprintf(stderr, "dpoae_analyze: *** ERROR ***: unknown option %s\n", arg.c_str()); printUsage(); return 1; }
+    else { addPath(arg, fnames); }
+  }
+  if (fnames.empty()) { printUsage(); return 1; }
+  std::sort(fnames.begin(), fnames.end());
+  n_threads = std::max(1, std::min(n_threads, (int)fnames.size()));
+
+  //analyze the files in parallel.  Each thread takes the next file until there are none left.
+  std::vector<File_Result> results(fnames.size());
+  std::atomic<size_t> next_file(0);
+  auto worker = [&](void) {
+    for (size_t i = next_file++; i < fnames.size(); i = next_file++) analyzeFile(fnames[i], set, results[i]);
+  };
+  std::vector<std::thread> threads;
+  for (int i=0; i < n_threads; i++) threads.emplace_back(worker);
+  for (auto &t : threads) t.join();
+
+  //write the results, in file order
+  FILE *out = stdout;
+  if (!out_fname.empty()) {
+    out = fopen(out_fname.c_str(), "w");
+    if (out == NULL) { fprintf(stderr, "dpoae_analyze: *** ERROR ***: could not open %s\n", out_fname.c_str()); return 1; }
+  }
+  fprintf(out, "file, channel, step, f1_Hz, f2_Hz, fdp_Hz, L1_dB, L2_dB, Ldp_dB, noise_dB, snr_dB, n_frames, n_rejected\n");
+  int n_errors = 0;
+  for (const auto &r : results) {
+    if (!r.error.empty()) { fprintf(stderr, "dpoae_analyze: *** ERROR ***: %s: %s\n", r.fname.c_str(), r.error.c_str()); n_errors++; continue; }
+    for (const auto &s : r.steps) {
+      fprintf(out, "%s, %d, %d, %.1f, %.1f, %.1f, %.1f, %.1f, %.1f, %.1f, %.1f, %d, %d\n", r.fname.c_str(), s.channel, s.step,
+              s.f1_Hz, s.f2_Hz, s.fdp_Hz, s.L1_dB, s.L2_dB, s.Ldp_dB, s.noise_dB, s.Ldp_dB - s.noise_dB, s.n_frames, s.n_rejected);
+    }
+  }
+  if (out != stdout) fclose(out);
+  fprintf(stderr, "dpoae_analyze: analyzed %d files with %d threads (%d errors)\n", (int)(results.size()) - n_errors, n_threads, n_errors);
+  return (n_errors > 0) ? 2 : 0;
+}
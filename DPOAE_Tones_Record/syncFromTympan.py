@@ -0,0 +1,168 @@
+#
+# syncFromTympan.py
+#
+# MIT License
+#
+# This script communicates with the Tympan over the USB Serial link.
+# The purpose is to copy every new (or changed) file from the Tympan's
+# SD card into a folder on the PC, so that you don't have to pull the
+# recordings one at a time.
+#
+# How it works:
+#   * It asks the Tympan for its file index ("$ls_since", see SD_Index.h).
+#     For each file, it asks the Tympan for the file's size and CRC32
+#     ("$stat") and compares them against what was synced before, so a file
+#     that was rewritten is copied again.  (The Tympan keeps each file's CRC32
+#     in its index and only reads the file again if its size or modified time
+#     has changed, so even a same-size rewrite is seen.)
+#   * Each file that is new or changed is downloaded with the compressed
+#     transfer ('k'), and the CRC32 of the local copy is checked.
+#   * A file that the Tympan is still recording is skipped until next time.
+#     A recording that was never closed (such as one cut short by a power
+#     loss) is copied, as it is, once the Tympan is no longer recording it.
+#   * Files are downloaded as "<name>.part" and only renamed once they
+#     check out.  If the sync is interrupted, running it again picks up
+#     where the .part file left off.
+#   * What has been synced is remembered in "tympan_sync.json" in the
+#     local folder, so files that were already copied are not sent again.
+#   * The replies to the commands are framed ("$frame 1", see Reply_Framer.h),
+#     so each command goes on as soon as its reply is complete, rather than
+#     waiting for the link to go quiet.
+#   * With "--analyze", each WAV file is analyzed while it downloads (see
+#     dpoaeStreamAnalyzer.py) and the results are saved as "<name>_dpoae.csv".
+#     The artifact sidecars are copied before the WAV files for this.
+#
+# Usage: python syncFromTympan.py <COM port> [local folder] [--analyze]
+#
+
+import sys
+import os
+import json
+import zlib
+import serial  #pip install pyserial
+import tympanSdFileTransferFunctions as tympanSerial
+
+manifest_fname = 'tympan_sync.json'
+types_to_sync = ['wav', 'csv', 'txt']   #which files to copy (by extension)
+
+def loadManifest(local_dir):
+    fname = os.path.join(local_dir, manifest_fname)
+    if os.path.exists(fname):
+        with open(fname, 'r') as f:
+            return json.load(f)
+    return {'files': {}}
+
+def saveManifest(local_dir, manifest):
+    fname = os.path.join(local_dir, manifest_fname)
+    with open(fname + '.tmp', 'w') as f:
+        json.dump(manifest, f, indent=1)
+    os.replace(fname + '.tmp', fname)  #so that an interruption can't leave a half-written manifest
+
+def crc32OfFile(fname, blocksize=1 << 20):
+    crc = 0
+    with open(fname, 'rb') as f:
+        block = f.read(blocksize)
+        while block:
+            crc = zlib.crc32(block, crc)
+            block = f.read(blocksize)
+    return crc & 0xFFFFFFFF
+
+# is the local copy already good?  (same size and CRC32 as the file on the Tympan, per "$stat")
+def isAlreadySynced(manifest, local_dir, stat):
+    rec = manifest['files'].get(stat['name'])
+    local_fname = os.path.join(local_dir, stat['name'])
+    return (rec is not None) and (rec['size_bytes'] == stat['size_bytes']) and (rec.get('crc32') == stat['crc32']) \
+        and os.path.exists(local_fname) and (os.path.getsize(local_fname) == stat['size_bytes'])
+
+# stat is the file's size and CRC32 as computed on the Tympan (see getFileStatFromTympan())
+def syncOneFile(serial_to_tympan, local_dir, entry, stat, verbose=False, analyze=False):
+    # download (or resume downloading) into the .part file
+    local_fname = os.path.join(local_dir, entry['name'])
+    part_fname = local_fname + '.part'
+    offset = os.path.getsize(part_fname) if os.path.exists(part_fname) else 0
+    if (offset > stat['size_bytes']):
+        offset = 0  #the file on the Tympan changed, so start over
+    analyzer = None
+    if analyze and entry['name'].lower().endswith('.wav'):
+        import dpoaeStreamAnalyzer   #needs numpy
+        analyzer = dpoaeStreamAnalyzer.DPOAEStreamAnalyzer(lambda chan, n_chan: dpoaeStreamAnalyzer.sidecarName(local_fname, chan, n_chan))
+    if (offset < stat['size_bytes']):
+        if (offset > 0): print("    resuming at byte " + str(offset) + " of " + str(stat['size_bytes']))
+        ok = tympanSerial.receiveCompressedFileFromTympan(serial_to_tympan, entry['name'], part_fname, verbose=verbose, offset=offset,
+                                                          on_new_bytes=(analyzer.feed if (analyzer is not None) else None))
+        if not ok:
+            return None
+    elif analyzer is not None:
+        dpoaeStreamAnalyzer.analyzeLocalFile(part_fname, analyzer)  #it was already all here
+
+    # check it and keep it
+    local_crc = crc32OfFile(part_fname)
+    if (os.path.getsize(part_fname) != stat['size_bytes']) or (local_crc != stat['crc32']):
+        print("syncOneFile: " + entry['name'] + " failed the check (CRC32 " + format(local_crc, '08X') + \
+              " here vs " + format(stat['crc32'], '08X') + " on the Tympan).  Will download again next time.")
+        os.remove(part_fname)
+        return None
+    os.replace(part_fname, local_fname)
+    if analyzer is not None:
+        import dpoaeStreamAnalyzer
+        results_fname = os.path.splitext(local_fname)[0] + '_dpoae.csv'
+        dpoaeStreamAnalyzer.writeResults(analyzer.finish(), results_fname, entry['name'])
+        print("    analysis saved to " + results_fname)
+    return {'size_bytes': stat['size_bytes'], 'crc32': stat['crc32']}
+
+def syncFromTympan(serial_to_tympan, local_dir, verbose=False, analyze=False):
+    os.makedirs(local_dir, exist_ok=True)
+    manifest = loadManifest(local_dir)
+    if not tympanSerial.setReplyFraming(serial_to_tympan, True):
+        print("syncFromTympan: the Tympan doesn't frame its replies, so each command will wait for the link to go quiet")
+
+    # get the Tympan's file list from its index
+    entries = tympanSerial.getIndexEntriesSince(serial_to_tympan, 0)
+    entries = [e for e in entries if e['name'].split('.')[-1].lower() in types_to_sync]
+    entries = list({e['name']: e for e in entries}.values())   #if a name was indexed more than once, the newest entry is the file that is there now
+
+    # get the size and CRC of each file, as computed on the Tympan, to see which ones are new or changed
+    todo = []
+    for entry in entries:
+        stat = tympanSerial.getFileStatFromTympan(serial_to_tympan, entry['index'])
+        if (stat is None) or (stat['name'] != entry['name']):
+            print("syncFromTympan: could not stat " + entry['name'] + " on the Tympan")
+            continue
+        if stat['is_recording']:
+            print("syncFromTympan: skipping " + entry['name'] + " (still being recorded)")
+            continue
+        if not isAlreadySynced(manifest, local_dir, stat):
+            todo.append((entry, stat))
+    if analyze:
+        todo.sort(key=lambda t: not t[0]['name'].lower().endswith('_flags.csv'))  #sidecars first, so the analysis can use them
+    print("syncFromTympan: " + str(len(entries)) + " files on the Tympan, " + str(len(todo)) + " to copy")
+
+    n_ok = 0
+    for i, (entry, stat) in enumerate(todo):
+        print("  [" + str(i+1) + "/" + str(len(todo)) + "] " + entry['name'] + " (" + str(stat['size_bytes']) + " bytes)")
+        result = syncOneFile(serial_to_tympan, local_dir, entry, stat, verbose=verbose, analyze=analyze)
+        if result is not None:
+            manifest['files'][entry['name']] = result
+            saveManifest(local_dir, manifest)   #save after every file, so that an interrupted sync can resume
+            n_ok += 1
+    print("syncFromTympan: copied " + str(n_ok) + " of " + str(len(todo)) + " files")
+    tympanSerial.setReplyFraming(serial_to_tympan, False)   #leave the Serial Monitor as it was
+    return (n_ok == len(todo))
+
+
+if __name__ == '__main__':
+    analyze = ('--analyze' in sys.argv)
+    args = [a for a in sys.argv[1:] if a != '--analyze']
+    if len(args) < 1:
+        print("Usage: python syncFromTympan.py <COM port> [local folder] [--analyze]")
+        sys.exit(1)
+    my_com_port = args[0]
+    local_dir = args[1] if len(args) > 1 else 'tympan_data'
+
+    print("ACTION: Opening serial port...make sure the Serial Monitor is closed in Arduino IDE...")
+    serial_to_tympan = serial.Serial(port=my_com_port, baudrate=115200, timeout=0.5) #baudrate doesn't matter for Tympan
+    try:
+        ok = syncFromTympan(serial_to_tympan, local_dir, analyze=analyze)
+    finally:
+        serial_to_tympan.close()
+    sys.exit(0 if ok else 2)
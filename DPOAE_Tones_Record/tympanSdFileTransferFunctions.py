@@ -14,6 +14,8 @@ import serial  #pip install pyserial
 import time 
 import codecs
 import os
+import struct
+import zlib
 
 
 # ####################################### Define Low-Level Functions 
@@ -30,16 +32,42 @@ def sendTextToSerial(serial_to_tympan, text, EOL='\n'):
 def readLineFromSerial(serial_to_tympan):
     return codecs.decode(serial_to_tympan.readline(),encoding='utf-8')
 
-# keeping receiving lines of text until enough time has passed that we exceed the wait period
-def readMultipleLinesFromSerial(serial_to_tympan, wait_period_sec=0.5):
-    all_lines = readLineFromSerial(serial_to_tympan)
-    last_reply_time  = time.time()
-    while (time.time() < (last_reply_time + wait_period_sec)):
+# the lines that mark the begin and end of each reply, once framing is on ("$frame 1", see Reply_Framer.h)
+REPLY_FRAME_BEGIN = '@@begin'
+REPLY_FRAME_END = '@@end'
+REPLY_OK, REPLY_BAD_COMMAND, REPLY_UNKNOWN = 0, 1, 2
+
+# receive the reply to a command.  If the reply is framed, return as soon as its end line arrives, and return
+# just the lines inside the frame along with its status.  Otherwise (or if the end never comes), keep receiving
+# lines of text until the link has been quiet for the wait period, and return them all (with a status of None).
+def readReplyFromSerial(serial_to_tympan, wait_period_sec=0.5):
+    all_lines, framed_lines, seq = '', '', None
+    last_reply_time = time.time()
+    while True:
         new_readline = readLineFromSerial(serial_to_tympan)
-        all_lines += new_readline
         if len(new_readline) > 0:
             last_reply_time = time.time()
-    return all_lines
+            pieces = new_readline.split()
+            if (len(pieces) >= 2) and (pieces[0] == REPLY_FRAME_BEGIN):
+                seq, framed_lines = pieces[1], ''   #anything before this wasn't part of the reply
+                continue
+            if (len(pieces) >= 3) and (pieces[0] == REPLY_FRAME_END):
+                if (pieces[1] == seq): return framed_lines, int(pieces[2])
+                continue   #the end of some earlier reply
+            all_lines += new_readline
+            framed_lines += new_readline
+        elif (time.time() >= (last_reply_time + wait_period_sec)):
+            return all_lines, None
+
+# keeping receiving lines of text until the reply is complete (see readReplyFromSerial())
+def readMultipleLinesFromSerial(serial_to_tympan, wait_period_sec=0.5):
+    return readReplyFromSerial(serial_to_tympan, wait_period_sec)[0]
+
+# turn the framing of the replies on or off (see Reply_Framer.h).  With it on, the helpers here don't wait
+# for the link to go quiet after each command.  Returns True if the Tympan confirmed it.
+def setReplyFraming(serial_to_tympan, enable=True, wait_period_sec=0.5):
+    sendTextToSerial(serial_to_tympan, "$frame " + ('1' if enable else '0'))
+    return readReplyFromSerial(serial_to_tympan, wait_period_sec)[1] == REPLY_OK
 
 # receive raw btes from the serial until we have receive the number of bytes
 # specified or until the serial link times out
@@ -61,6 +89,23 @@ def readBytesFromSerial(serial_to_tympan, n_bytes_to_receive, blocksize=1024):
     #
     return all_data
 
+# like readBytesFromSerial(), but each block is written to the open file as it arrives (so memory
+# use stays small) and is also given to on_new_bytes(), if given.  Returns the number of bytes received.
+def readBytesFromSerialToFile(serial_to_tympan, n_bytes_to_receive, file, on_new_bytes=None, blocksize=4096):
+    bytes_received = 0
+    while (bytes_received < n_bytes_to_receive):
+        bytes_to_read = min(blocksize, n_bytes_to_receive - bytes_received)
+        raw_bytes = serial_to_tympan.read(bytes_to_read) #this will timeout (if needed) according to the serial port timeout parameter
+        if len(raw_bytes) > 0:
+            file.write(raw_bytes)
+            if on_new_bytes is not None: on_new_bytes(raw_bytes)
+            bytes_received += len(raw_bytes)
+        if (len(raw_bytes) < bytes_to_read):
+            # We got too few bytes.  Assume no more bytes are coming
+            print("readBytesFromSerialToFile: recieved " + str(bytes_received) + " but expected " + str(n_bytes_to_receive))
+            break
+    return bytes_received
+
 def sendFileAsBytesToSerial(local_fname, serial_to_tympan, blocksize=1024):
     with open(local_fname,'rb') as file:
         byte_count = 0
@@ -104,6 +149,151 @@ def keepFilenamesOfType(all_fnames,targ_types=['wav']):
     #
     return out_fnames
 
+# given the lines sent by the Tympan for "$ls" or "$ls_since" (see SD_Index.h),
+# parse out the entries and return them as a list of dictionaries
+def processLinesIntoIndexEntries(lines):
+    entries = []
+    for line in lines.splitlines():
+        pieces = [p.strip() for p in line.split(',')]
+        if (len(pieces) != 5) or (not pieces[0].isdigit()):
+            continue  #skip the preamble and any other text
+        entries.append({'index': int(pieces[0]), 'name': pieces[1], 'size_bytes': int(pieces[2]),
+                        'created_sec': int(pieces[3]), 'closed_sec': int(pieces[4])})
+    #
+    return entries
+
+# ask the Tympan for the files that were added to its SD card since index entry "first_entry"
+def getIndexEntriesSince(serial_to_tympan, first_entry=0, wait_period_sec=0.5):
+    sendTextToSerial(serial_to_tympan, "$ls_since " + str(first_entry))
+    return processLinesIntoIndexEntries(readMultipleLinesFromSerial(serial_to_tympan, wait_period_sec))
+
+# the columns of each record of the results log, as printed by "$results_since" and "$results_session" (see Results_Log.h)
+RESULTS_FIELDS = ['record', 'session', 'test', 'start_sec', 'step_ms', 'wav_entry', 'ear', 'step', 'protocol', 'flags',
+                  'f1_Hz', 'f2_Hz', 'f1_cdBSPL', 'f2_cdBSPL', 'cal1_cdB', 'cal2_cdB', 'mic_cdBFS', 'peak_cdBFS',
+                  'dp_cdBFS', 'noise_cdBFS', 'rejected_ms', 'clipped_blocks']
+RESULTS_MAGIC = 0x53455254
+RESULTS_NOT_MEASURED = -32768
+
+# the CRC32 of a record, as computed by the Tympan (the record is re-packed exactly as it is stored)
+def calcResultsRecordCRC(r):
+    wav_entry = 0xFFFFFFFF if (r['wav_entry'] < 0) else r['wav_entry']
+    packed = struct.pack('<7I4B2f8h2H', RESULTS_MAGIC, r['record'], r['session'], r['test'], r['start_sec'], r['step_ms'], wav_entry,
+                         r['ear']-1, r['step']-1, r['protocol'], r['flags'], r['f1_Hz'], r['f2_Hz'],
+                         r['f1_cdBSPL'], r['f2_cdBSPL'], r['cal1_cdB'], r['cal2_cdB'], r['mic_cdBFS'], r['peak_cdBFS'],
+                         r['dp_cdBFS'], r['noise_cdBFS'], r['rejected_ms'], r['clipped_blocks'])
+    return zlib.crc32(packed)
+
+# given the lines sent by the Tympan for "$results_since" or "$results_session", parse out the records
+# and return them as a list of dictionaries.  Any record whose CRC doesn't match is left out (and reported).
+def processLinesIntoResults(lines, verbose=True):
+    records = []
+    for line in lines.splitlines():
+        pieces = [p.strip() for p in line.split(',')]
+        if (len(pieces) != len(RESULTS_FIELDS)+1) or (not pieces[0].isdigit()):
+            continue  #skip the preamble and any other text
+        r = {}
+        for name, piece in zip(RESULTS_FIELDS, pieces):
+            r[name] = float(piece) if name.endswith('_Hz') else int(piece)
+        if calcResultsRecordCRC(r) != int(pieces[-1], 16):
+            if verbose: print("processLinesIntoResults: bad CRC for record " + pieces[0] + ".  Skipping.")
+            continue
+        if (r['dp_cdBFS'] != RESULTS_NOT_MEASURED) and (r['noise_cdBFS'] != RESULTS_NOT_MEASURED):
+            r['snr_dB'] = 0.01 * (r['dp_cdBFS'] - r['noise_cdBFS'])
+        records.append(r)
+    #
+    return records
+
+# ask the Tympan for the results that were added to its log since record "first_record"
+def getResultsSince(serial_to_tympan, first_record=0, wait_period_sec=0.5):
+    sendTextToSerial(serial_to_tympan, "$results_since " + str(first_record))
+    return processLinesIntoResults(readMultipleLinesFromSerial(serial_to_tympan, wait_period_sec))
+
+# ask the Tympan for every result of one session (SESSnnn.CSV, see Session_Queue.h)
+def getSessionResults(serial_to_tympan, session_id, wait_period_sec=0.5):
+    sendTextToSerial(serial_to_tympan, "$results_session " + str(session_id))
+    return processLinesIntoResults(readMultipleLinesFromSerial(serial_to_tympan, wait_period_sec))
+
+
+# Decoder for the "d16" compressed transfer (see Compressed_Transfer.h on the Tympan).
+# Give it the bytes as they arrive (any amount at a time) and it returns the decoded
+# bytes of the original file.  Anything after the last chunk is kept in "pending".
+class D16Decoder:
+    def __init__(self, stride=1, bytes_expected=None):
+        import numpy as np  #pip install numpy (only needed for the compressed transfer)
+        self.np = np
+        self.stride = max(1, stride)
+        self.history = np.zeros(self.stride, dtype=np.int64)  #last sample of each channel
+        self.phase = 0          #which channel the next sample belongs to
+        self.pending = bytearray()
+        self.bytes_left = bytes_expected  #stop decoding after this many bytes (None = no limit)
+
+    def feed(self, new_bytes):
+        self.pending += new_bytes
+        out = bytearray()
+        while (len(self.pending) >= 4) and ((self.bytes_left is None) or (self.bytes_left > 0)):
+            mode, bits = self.pending[0], self.pending[1]
+            n_bytes = self.pending[2] | (self.pending[3] << 8)
+            n_payload = n_bytes if (mode == 0) else ((n_bytes // 2) * bits + 7) // 8
+            if len(self.pending) < 4 + n_payload:
+                break  #wait for the rest of the chunk
+            payload = bytes(self.pending[4:4+n_payload])
+            del self.pending[:4+n_payload]
+            if self.bytes_left is not None:
+                self.bytes_left -= n_bytes
+            if (mode == 0):
+                out += payload
+                if (n_bytes % 2) == 0:
+                    self._updateHistory(self.np.frombuffer(payload, dtype='<i2').astype(self.np.int64))
+            else:
+                out += self._decodePacked(payload, n_bytes // 2, bits)
+        return bytes(out)
+
+    def _decodePacked(self, payload, n_samples, bits):
+        np = self.np
+        if bits == 0:
+            err = np.zeros(n_samples, dtype=np.int64)
+        else:
+            all_bits = np.unpackbits(np.frombuffer(payload, dtype=np.uint8), bitorder='little')[:n_samples*bits]
+            zz = all_bits.reshape(n_samples, bits).astype(np.int64) @ (1 << np.arange(bits, dtype=np.int64))
+            err = np.where((zz & 1) == 0, zz >> 1, -((zz + 1) >> 1))  #undo the zigzag
+        # add the errors to the prediction (the previous sample of the same channel)
+        x = np.zeros(n_samples, dtype=np.int64)
+        for c in range(self.stride):
+            first = (c - self.phase) % self.stride   #first sample in this chunk for channel c
+            x[first::self.stride] = self.history[c] + np.cumsum(err[first::self.stride])
+        self._updateHistory(x)
+        return x.astype('<i2').tobytes()
+
+    def _updateHistory(self, x):
+        for i in range(min(len(x), self.stride)):
+            j = len(x) - 1 - i                        #walk back from the last sample
+            self.history[(self.phase + j) % self.stride] = x[j]
+        self.phase = (self.phase + len(x)) % self.stride
+
+
+# ask the Tympan for the size and CRC32 of the file at index entry n (computed on the Tympan, see "$stat")
+# returns a dictionary (or None if there was an error)
+def getFileStatFromTympan(serial_to_tympan, entry_ind, wait_period_sec=15.0):  #the Tympan might need to read a big file to get its CRC
+    sendTextToSerial(serial_to_tympan, "$stat " + str(entry_ind))
+    end_time = time.time() + wait_period_sec
+    is_framed, stat = False, None
+    while (time.time() < end_time):
+        line = readLineFromSerial(serial_to_tympan)
+        if line.startswith(REPLY_FRAME_BEGIN):
+            is_framed = True
+        if line.startswith(REPLY_FRAME_END) and is_framed:
+            return stat  #the whole reply has been read, so nothing is left over for the next command
+        if ("SD_Index: stat:" not in line):
+            continue
+        if ("*** ERROR ***" not in line):
+            pieces = [p.strip() for p in line.split('stat:')[-1].split(',')]
+            stat = {'index': int(pieces[0]), 'name': pieces[1], 'size_bytes': int(pieces[2]), 'crc32': int(pieces[3], 16),
+                    'is_recording': (len(pieces) > 4) and (pieces[4] == '1')}   #is the Tympan still recording it?
+        if not is_framed:
+            return stat
+    return stat
+
+
 # ##################################### Define High-Level Functions
 
 # Here is the script for working with the Tympan to send a file to be saved on its SD card
@@ -153,8 +343,10 @@ def sendFileToTypman(serial_to_tympan, command_char, fname_to_read_locally, fnam
         return False
 
 
-# Here is the script for working with the Tympan to have it send a file from its SD card
-def receiveFileFromTympan(serial_to_tympan, command_char, fname_to_read_on_Tympan, fname_to_write_locally, verbose=False):
+# Here is the script for working with the Tympan to have it send a file from its SD card.
+# If on_new_bytes is given, the file is written to disk as it arrives (rather than all at the end) and
+# each block of the file is also given to on_new_bytes() (such as for DPOAEStreamAnalyzer.feed()).
+def receiveFileFromTympan(serial_to_tympan, command_char, fname_to_read_on_Tympan, fname_to_write_locally, verbose=False, on_new_bytes=None):
     try:
         # Step 1: Initiate the file transfer process (PC to Tympan)
         if (verbose):print("ACTION: Initiating process of file transfer from Tympan")
@@ -188,6 +380,17 @@ def receiveFileFromTympan(serial_to_tympan, command_char, fname_to_read_on_Tympa
             raise HaltException()   
         
         #Step 5: Read the in-coming bytes
+        if on_new_bytes is not None:
+            #streaming: write each block to the local file as it arrives (a failed transfer leaves a partial file)
+            with open(fname_to_write_locally,'wb') as file:
+                n_received = readBytesFromSerialToFile(serial_to_tympan, bytes_to_receive, file, on_new_bytes)
+            if (verbose): print("RESULTS: ",n_received,"bytes were received and written to",fname_to_write_locally)
+            reply = readLineFromSerial(serial_to_tympan)        #the confirmation message sent by the Tympan
+            if (verbose):print("REPLY:",reply.strip())
+            if ("*** ERROR ***" in reply) or (n_received != bytes_to_receive):
+                raise HaltException()
+            if (verbose):print("SUCCESS: File was successfully transfererd from the Tympan")
+            return True
         received_bytes = readBytesFromSerial(serial_to_tympan,bytes_to_receive) #get the one-line reply from the Tympan
         if (len(received_bytes)<300):
             if (verbose):print("RESULT: The",len(received_bytes),"received bytes are:", received_bytes)
@@ -215,3 +418,84 @@ def receiveFileFromTympan(serial_to_tympan, command_char, fname_to_read_on_Tympa
         print("FAIL: File was NOT successfully transferred from the Tympan")
         return False
 
+
+# Here is the script for having the Tympan send a file from its SD card with compression (see Compressed_Transfer.h).
+# The file is decoded as it arrives.  If the Tympan doesn't know the compressed transfer, this falls back to the raw 'x' transfer.
+# To resume an interrupted transfer, give the offset (such as the size of the partial local file).  The new bytes are appended.
+# If on_new_bytes is given, each block of the decoded file is also given to on_new_bytes() as soon as it is written.
+# on_new_bytes() always sees the whole file from its first byte: when resuming, the part already on disk is given first.
+def receiveCompressedFileFromTympan(serial_to_tympan, fname_to_read_on_Tympan, fname_to_write_locally, codec='d16', command_char='k', verbose=False, offset=0, on_new_bytes=None):
+    try:
+        # Step 1: Initiate the file transfer process and check that the Tympan knows the compressed transfer
+        if (verbose):print("ACTION: Initiating process of compressed file transfer from Tympan")
+        sendTextToSerial(serial_to_tympan, command_char)
+        reply = readLineFromSerial(serial_to_tympan)
+        if (verbose):print("REPLY:",reply.strip())
+        if ("SdFileTransfer_Compressed" not in reply):
+            if (verbose):print("RESULT: Tympan does not support the compressed transfer.  Using the raw transfer.")
+            readMultipleLinesFromSerial(serial_to_tympan)  #clear out whatever it did send
+            if (offset > 0):
+                print("receiveCompressedFileFromTympan: the raw transfer cannot resume, so starting from the beginning")
+            return receiveFileFromTympan(serial_to_tympan, 'x', fname_to_read_on_Tympan, fname_to_write_locally, verbose=verbose, on_new_bytes=on_new_bytes)
+
+        # Step 2: Send the filename and the codec that we'd like
+        offset = offset - (offset % 2)  #the Tympan only starts on an even byte
+        sendTextToSerial(serial_to_tympan, fname_to_read_on_Tympan + ',' + codec + ',' + str(offset))
+        reply = readLineFromSerial(serial_to_tympan)
+        if (verbose):print("REPLY:",reply.strip())
+        if ("*** ERROR ***" in reply):
+            raise HaltException()
+
+        # Step 3: Read the file size, the codec that the Tympan chose, and the predictor's stride
+        reply = readLineFromSerial(serial_to_tympan)
+        if (verbose):print("REPLY:",reply.strip())
+        pieces = reply.strip().split(',')
+        bytes_to_receive, used_codec, stride = int(pieces[0]), pieces[1], int(pieces[2])
+
+        # Step 4: Read the start prompt
+        reply = readLineFromSerial(serial_to_tympan)
+        if (verbose):print("REPLY:",reply.strip())
+        if ("*** ERROR ***" in reply):
+            raise HaltException()
+
+        # Step 5: Read and decode the in-coming bytes, writing them to the local file as we go
+        decoder = D16Decoder(stride, bytes_to_receive) if (used_codec == 'd16') else None
+        bytes_received, bytes_written = 0, 0
+        with open(fname_to_write_locally,'r+b' if (offset > 0) else 'wb') as file:
+            if (on_new_bytes is not None) and (offset > 0):
+                file.seek(0)
+                block = file.read(min(65536, offset))
+                while (len(block) > 0) and (file.tell() <= offset):
+                    on_new_bytes(block)
+                    block = file.read(min(65536, offset - file.tell()))
+            file.seek(offset); file.truncate()
+            while (bytes_written < bytes_to_receive):
+                n_wanted = 4096 if (decoder is not None) else min(4096, bytes_to_receive - bytes_written)
+                raw_bytes = serial_to_tympan.read(n_wanted) if (decoder is None) else serial_to_tympan.read(max(1, serial_to_tympan.in_waiting))
+                if len(raw_bytes) == 0:
+                    print("receiveCompressedFileFromTympan: timed out after " + str(bytes_written) + " of " + str(bytes_to_receive) + " bytes")
+                    if (decoder is not None):
+                        # the last chunk might have been decoded from whatever text followed the cut-off data, so
+                        # drop it (512 bytes, see COMP_XFER_CHUNK_BYTES) to leave only good bytes for resuming
+                        file.truncate(offset + max(0, bytes_written - 512))
+                    raise HaltException()
+                bytes_received += len(raw_bytes)
+                new_bytes = decoder.feed(raw_bytes) if (decoder is not None) else raw_bytes
+                file.write(new_bytes)
+                if (on_new_bytes is not None) and (len(new_bytes) > 0): on_new_bytes(new_bytes)
+                bytes_written += len(new_bytes)
+        if (verbose):print("RESULT:",bytes_received,"bytes were received for",bytes_written,"bytes of file (codec " + used_codec + ")")
+
+        # Step 6: Read the final reply
+        leftover = codecs.decode(bytes(decoder.pending), encoding='utf-8', errors='replace') if (decoder is not None) else ''
+        reply = leftover + readMultipleLinesFromSerial(serial_to_tympan, wait_period_sec=0.1)
+        if (verbose):print("REPLY:",reply.strip())
+        if ("*** ERROR ***" in reply) or (bytes_written != bytes_to_receive):
+            raise HaltException()
+        if (verbose):print("SUCCESS: File was successfully transfererd from the Tympan")
+        return True
+
+    except HaltException as h:
+        print("FAIL: File was NOT successfully transferred from the Tympan")
+        return False
+